@@ -51,6 +51,7 @@
 #include "render.h"
 #include "game.h"
 #include "enemygen.h"
+#include "network.h" // threads only
 
 char base_path[1024] = "./";
 Sprite* enemygen_sprite = 0;
@@ -111,6 +112,7 @@ char ini_path[4096];
 
 Terrain* terrain = 0;
 World* world = 0;
+WorldQuery world_stats = { 0 }; // of last rendered frame
 Mesh* active_mesh = 0;
 Sprite* active_sprite = 0;
 Sprite* item_preview_sprite = 0; 
@@ -4039,6 +4041,49 @@ void TranslateMap(int delta_z, bool water_limit)
 	RebuildWorld(world, true);
 }
 
+// bsp subtrees are built on all cores, it dominates loading of dense maps
+struct WorldBuildRun
+{
+	WorldBuild* wb;
+	int jobs;
+	volatile unsigned int next; // interlocked
+};
+
+void* WorldBuildWorker(void* arg)
+{
+	WorldBuildRun* run = (WorldBuildRun*)arg;
+	while (1)
+	{
+		int j = (int)INTERLOCKED_INC(&run->next) - 1;
+		if (j >= run->jobs)
+			break;
+		BuildWorldJobs(run->wb, j, j + 1);
+	}
+	return 0;
+}
+
+void RebuildWorldThreaded(World* w, bool boxes)
+{
+	WorldBuildRun run;
+	run.wb = CreateWorldBuild(w, boxes);
+	run.jobs = GetWorldBuildJobs(run.wb);
+	run.next = 0;
+
+	static const int max_workers = 64;
+	THREAD_HANDLE* worker[max_workers];
+	int workers = std::min(std::min(THREAD_CORES(), max_workers), run.jobs) - 1; // we're the last one
+	for (int i = 0; i < workers; i++)
+		worker[i] = THREAD_CREATE(WorldBuildWorker, &run);
+	WorldBuildWorker(&run);
+	for (int i = 0; i < workers; i++)
+	{
+		if (worker[i])
+			THREAD_JOIN(worker[i]);
+	}
+
+	DeleteWorldBuild(run.wb);
+}
+
 void Load(const char* path)
 {
 	// load
@@ -4126,7 +4171,7 @@ void Load(const char* path)
 	// as meshes weren't present during their creation
 	// now meshes are loaded ...
 	// so we need to update instance boxes with (,true)
-	RebuildWorld(world, true);
+	RebuildWorldThreaded(world, true);
 
 	active_mesh = GetFirstMesh(world);	
 
@@ -4134,6 +4179,145 @@ void Load(const char* path)
 	//TranslateMap(-100, false);
 }
 
+#ifdef DARK_TERRAIN
+// shadow casting runs on all cores in slices, one slice per frame
+// so the ui can show progress and cancel it, nothing is edited meanwhile
+// (editor is blocked by modal popup and the main thread waits for slice to finish)
+// live mode rebakes edited regions as soon as there are any, in place if they fit in a slice
+// workers are kept in a pool (while baking or live) and poll for next slice when idle
+struct DarkBakeRun
+{
+	DarkBake* db;
+	bool live;
+	int jobs;
+	int done;
+	int slice; // jobs per frame, adapted to keep frame around 40ms
+	volatile unsigned int next; // next job in slice (interlocked)
+	int end; // slice end
+
+	static const int max_workers = 64;
+	THREAD_HANDLE* worker[max_workers];
+	int workers;
+	SEMAPHORE_HANDLE* go; // posted once per worker to let them into next slice (or quit)
+	SEMAPHORE_HANDLE* acks; // posted by every worker done with current slice
+	bool quit;
+};
+
+DarkBakeRun dark_bake = { 0 };
+
+void* DarkBakeWorker(void* arg)
+{
+	while (1)
+	{
+		int j = (int)INTERLOCKED_INC(&dark_bake.next) - 1;
+		if (j >= dark_bake.end)
+			break;
+		BakeTerrainDark(dark_bake.db, j, j + 1);
+	}
+	return 0;
+}
+
+// workers sleep on semaphore between slices (and while LIVE waits for edits)
+// main thread waits for all acks before next slice, so each go is for next one
+void* DarkBakePool(void* arg)
+{
+	while (1)
+	{
+		SEMAPHORE_WAIT(dark_bake.go);
+		if (dark_bake.quit)
+			break;
+
+		DarkBakeWorker(0);
+		SEMAPHORE_POST(dark_bake.acks, 1);
+	}
+	return 0;
+}
+
+void StartDarkBakePool()
+{
+	dark_bake.quit = false;
+	dark_bake.workers = 0;
+	dark_bake.go = SEMAPHORE_CREATE(0);
+	dark_bake.acks = SEMAPHORE_CREATE(0);
+	int workers = std::min(THREAD_CORES(), DarkBakeRun::max_workers) - 1; // we're the last one
+	for (int w = 0; w < workers; w++)
+	{
+		THREAD_HANDLE* th = THREAD_CREATE(DarkBakePool, 0);
+		if (th)
+			dark_bake.worker[dark_bake.workers++] = th;
+	}
+}
+
+void StopDarkBakePool()
+{
+	if (!dark_bake.go)
+		return;
+
+	dark_bake.quit = true;
+	SEMAPHORE_POST(dark_bake.go, dark_bake.workers);
+	for (int w = 0; w < dark_bake.workers; w++)
+		THREAD_JOIN(dark_bake.worker[w]);
+	dark_bake.workers = 0;
+
+	SEMAPHORE_DELETE(dark_bake.go);
+	SEMAPHORE_DELETE(dark_bake.acks);
+	dark_bake.go = 0;
+	dark_bake.acks = 0;
+}
+
+void StartDarkBake(bool dirty_only)
+{
+	// pool traces rays concurrently, nothing may be built lazily meanwhile
+	PrepareTerrainQueries(terrain);
+	dark_bake.db = CreateDarkBake(terrain, world, global_lt, true, dirty_only);
+	dark_bake.jobs = GetDarkBakeJobs(dark_bake.db);
+	dark_bake.done = 0;
+	if (!dark_bake.slice)
+		dark_bake.slice = THREAD_CORES();
+}
+
+void StopDarkBake()
+{
+	// cancelled bake leaves remaining patches with old shadows
+	if (dark_bake.db)
+		DeleteDarkBake(dark_bake.db);
+	dark_bake.db = 0;
+}
+
+void StepDarkBake()
+{
+	if (!dark_bake.db)
+		return;
+
+	uint64_t t0 = a3dGetTime();
+
+	if (!dark_bake.go)
+		StartDarkBakePool();
+
+	dark_bake.next = dark_bake.done;
+	dark_bake.end = std::min(dark_bake.done + dark_bake.slice, dark_bake.jobs);
+	SEMAPHORE_POST(dark_bake.go, dark_bake.workers);
+
+	DarkBakeWorker(0);
+	for (int w = 0; w < dark_bake.workers; w++)
+		SEMAPHORE_WAIT(dark_bake.acks);
+
+	int baked = dark_bake.end - dark_bake.done;
+	dark_bake.done = dark_bake.end;
+
+	uint64_t dt = a3dGetTime() - t0 + 1;
+	int fit = (int)(baked * 40000 / dt);
+	dark_bake.slice = std::max(1, (dark_bake.slice + fit) / 2);
+
+	if (dark_bake.done == dark_bake.jobs)
+	{
+		StopDarkBake();
+		if (!dark_bake.live)
+			StopDarkBakePool();
+	}
+}
+#endif
+
 void my_render(A3D_WND* wnd)
 {
 
@@ -4863,11 +5047,51 @@ void my_render(A3D_WND* wnd)
 		   possibly in linear (max 127) or exponential form (max base^127)
 		*/
 
-		if (ImGui::Button("CAST SHADOWS"))
+		if (ImGui::Button("CAST SHADOWS") && !dark_bake.db)
 		{
-			UpdateTerrainDark(terrain, world, global_lt, true);
+			StartDarkBake(false);
+			ImGui::OpenPopup("CASTING SHADOWS");
 			//UpdateWorldDark(world, terrain, global_lt)
 		}
+
+		ImGui::SameLine();
+		ImGui::Checkbox("LIVE", &dark_bake.live);
+
+		if (!dark_bake.live && !dark_bake.db && dark_bake.go)
+			StopDarkBakePool();
+
+		if (dark_bake.live && !dark_bake.db && GetTerrainDarkDirty(terrain, world))
+		{
+			StartDarkBake(true);
+			if (!dark_bake.jobs)
+				StopDarkBake();
+			else
+			if (dark_bake.jobs > dark_bake.slice)
+				ImGui::OpenPopup("CASTING SHADOWS");
+			else
+				StepDarkBake();
+		}
+
+		if (ImGui::BeginPopupModal("CASTING SHADOWS", 0, ImGuiWindowFlags_AlwaysAutoResize))
+		{
+			StepDarkBake();
+
+			int jobs = dark_bake.jobs ? dark_bake.jobs : 1;
+			ImGui::ProgressBar((float)dark_bake.done / jobs, ImVec2(200, 0));
+			ImGui::Text("%d / %d patches", dark_bake.done, dark_bake.jobs);
+
+			if (ImGui::Button("Cancel"))
+			{
+				StopDarkBake();
+				if (!dark_bake.live)
+					StopDarkBakePool();
+			}
+
+			if (!dark_bake.db)
+				ImGui::CloseCurrentPopup();
+
+			ImGui::EndPopup();
+		}
 #endif
 
 		if (!save)
@@ -5570,8 +5794,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
-					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
+					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", world_stats.insts, world_stats.nodes, world_stats.tests);
 
 					const char* mode = "";
 
@@ -5632,8 +5855,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
-					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
+					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", world_stats.insts, world_stats.nodes, world_stats.tests);
 
 					const char* mode = "";
 
@@ -5693,8 +5915,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
-					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
+					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", world_stats.insts, world_stats.nodes, world_stats.tests);
 
 					const char* mode = "";
 
@@ -7592,7 +7813,7 @@ void my_render(A3D_WND* wnd)
 	rc->BeginMeshes(tm, lt);
 
 	QueryWorldCB cb = { RenderContext::RenderMesh , RenderContext::RenderSprite };
-	QueryWorld(world, planes, clip_world, &cb, rc);
+	QueryWorld(world, planes, clip_world, &cb, rc, &world_stats);
 
 	if (merge._world)
 		QueryWorld(merge._world, 0,0/*planes, clip_world*/, &cb, rc);
@@ -8021,6 +8242,11 @@ void my_close(A3D_WND* wnd)
 {
 	TermCloseAll();
 
+#ifdef DARK_TERRAIN
+	StopDarkBake();
+	StopDarkBakePool();
+#endif
+
 	if (pal_tex)
 		glDeleteTextures(1, &pal_tex);
 	pal_tex = 0;
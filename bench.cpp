@@ -0,0 +1,651 @@
+// benchmarks of terrain / world queries on shipped maps, loaded as server does
+// build with: make -f makefile_bench
+// run from repo root: .run/bench <test> [map.a3d ...] (y7 and y8 maps by default)
+//   hit - HitTerrainPacket() vs scalar HitTerrain() on shadow baking rays
+//   sah - bsp build time (serial & jobs on all cores), tree area and query / ray results,
+//         on map as is and with mesh insts cloned 16x (compare output of two builds)
+//   stress - world & terrain queries and hits from many threads at once must give the
+//            same results as serial ones (build with -fsanitize=thread, see makefile_bench)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+#include "terrain.h"
+#include "world.h"
+#include "render.h"
+#include "game.h"
+#include "startup.h"
+#include "network.h"
+
+// game.cpp externs, as in game_svr.cpp
+char base_path[1024] = "./";
+Server* server = 0;
+
+void exit_handler(int)
+{
+}
+
+void Buzz()
+{
+}
+
+void SyncConf()
+{
+}
+
+const char* GetConfPath()
+{
+	return "asciicker.cfg";
+}
+
+bool Server::Send(const uint8_t* data, int size)
+{
+	return false;
+}
+
+void Server::Proc()
+{
+}
+
+void Server::Log(const char* str)
+{
+}
+
+Terrain* terrain = 0;
+World* world = 0;
+Material mat[256];
+void* GetMaterialArr()
+{
+	return mat;
+}
+
+static uint64_t GetTime() // us
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Map
+{
+	Terrain* terrain;
+	World* world;
+};
+
+static bool LoadMap(Map* map, const char* path)
+{
+	map->terrain = 0;
+	map->world = 0;
+	if (!LoadStartup(path, &map->terrain, &map->world, mat, false, 0, 0) || !map->terrain || !map->world)
+	{
+		printf("can't load %s\n", path);
+		return false;
+	}
+
+	// whole world, not only insts around some player
+	LoadWorldChunks(map->world);
+	return true;
+}
+
+static void FreeMap(Map* map)
+{
+	if (map->world)
+		DeleteWorld(map->world);
+	if (map->terrain)
+		DeleteTerrain(map->terrain);
+	map->world = 0;
+	map->terrain = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hit
+
+struct HitSamples
+{
+	int num;
+	int cap;
+	double(*pos)[3];
+};
+
+// visual cell centers as in shadow baking
+static void HitSamplePatch(Patch* p, int x, int y, int view_flags, void* cookie)
+{
+	HitSamples* hs = (HitSamples*)cookie;
+	if (hs->num + VISUAL_CELLS * VISUAL_CELLS > hs->cap)
+	{
+		hs->cap = 2 * hs->cap + VISUAL_CELLS * VISUAL_CELLS;
+		hs->pos = (double(*)[3])realloc(hs->pos, sizeof(double[3]) * hs->cap);
+	}
+
+	for (int v = 0; v < VISUAL_CELLS; v++)
+	{
+		for (int u = 0; u < VISUAL_CELLS; u++)
+		{
+			double* s = hs->pos[hs->num++];
+			s[0] = x + u + 0.5;
+			s[1] = y + v + 0.5;
+			s[2] = HitTerrain(p, (u + 0.5) / VISUAL_CELLS, (v + 0.5) / VISUAL_CELLS);
+		}
+	}
+}
+
+static int BenchHit(Map* map)
+{
+	HitSamples hs = { 0 };
+	QueryTerrain(map->terrain, 0, 0, 1e9, 0xAA, HitSamplePatch, &hs);
+	// packets must be full
+	hs.num -= hs.num % TERRAIN_PACKET;
+
+	double(*ret)[3] = (double(*)[3])malloc(sizeof(double[3]) * 2 * hs.num);
+	Patch** hit = (Patch**)malloc(sizeof(Patch*) * 2 * hs.num);
+
+	// light from: low side, low front, zenith (as lightpos goes to CreateDarkBake)
+	static const double light[3][3] = { { 0.7,0.4,0.6 }, { -1.0,-0.2,0.3 }, { 0,0,1 } };
+
+	int mismatches = 0;
+	for (int l = 0; l < 3; l++)
+	{
+		double dir[TERRAIN_PACKET][3];
+		for (int i = 0; i < TERRAIN_PACKET; i++)
+		{
+			dir[i][0] = -light[l][0];
+			dir[i][1] = -light[l][1];
+			dir[i][2] = -light[l][2] * HEIGHT_SCALE;
+		}
+
+		uint64_t t0 = GetTime();
+		for (int s = 0; s < hs.num; s++)
+			hit[s] = HitTerrain(map->terrain, hs.pos[s], dir[0], ret[s]);
+
+		uint64_t t1 = GetTime();
+		for (int s = 0; s < hs.num; s += TERRAIN_PACKET)
+			HitTerrainPacket(map->terrain, TERRAIN_PACKET, hs.pos + s, dir, ret + hs.num + s, hit + hs.num + s);
+
+		uint64_t t2 = GetTime();
+
+		int hits = 0, diff = 0;
+		for (int s = 0; s < hs.num; s++)
+		{
+			Patch* a = hit[s];
+			Patch* b = hit[hs.num + s];
+			if (a)
+				hits++;
+			if (!a != !b)
+				diff++;
+			else
+			if (a)
+			{
+				// rays hitting patch edges may report either patch, rounding may differ too
+				for (int i = 0; i < 3; i++)
+				{
+					if (fabs(ret[s][i] - ret[hs.num + s][i]) > 1e-6)
+					{
+						diff++;
+						break;
+					}
+				}
+			}
+		}
+
+		printf("  light %d: %d rays, %d hits, scalar %d ms, packet %d ms, mismatches %d\n",
+			l, hs.num, hits, (int)((t1 - t0) / 1000), (int)((t2 - t1) / 1000), diff);
+
+		mismatches += diff;
+	}
+
+	free(hit);
+	free(ret);
+	free(hs.pos);
+
+	return mismatches ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// sah
+
+struct SahClones
+{
+	int num;
+	int cap;
+	Mesh** mesh;
+	double(*tm)[16];
+};
+
+static void SahCloneMesh(Mesh* m, double tm[16], void* cookie)
+{
+	SahClones* sc = (SahClones*)cookie;
+	if (sc->num == sc->cap)
+	{
+		sc->cap = 2 * sc->cap + 64;
+		sc->mesh = (Mesh**)realloc(sc->mesh, sizeof(Mesh*) * sc->cap);
+		sc->tm = (double(*)[16])realloc(sc->tm, sizeof(double[16]) * sc->cap);
+	}
+
+	sc->mesh[sc->num] = m;
+	memcpy(sc->tm[sc->num], tm, sizeof(double[16]));
+	sc->num++;
+}
+
+static void SahCloneSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie)
+{
+}
+
+struct SahQuery
+{
+	int hits;
+	double sum; // of positions, so different sets likely differ
+};
+
+static void SahQueryMesh(Mesh* m, double tm[16], void* cookie)
+{
+	SahQuery* sq = (SahQuery*)cookie;
+	sq->hits++;
+	sq->sum += tm[12] * 3 + tm[13];
+}
+
+static void SahQuerySprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie)
+{
+	SahQuery* sq = (SahQuery*)cookie;
+	sq->hits++;
+	sq->sum += pos[0] * 3 + pos[1];
+}
+
+struct SahTree
+{
+	int nodes;
+	double area; // sum of node surfaces (in visual cells)
+	float root[6];
+};
+
+static void SahNode(int level, const float bbox[6], void* cookie)
+{
+	SahTree* st = (SahTree*)cookie;
+	if (!st->nodes++)
+		memcpy(st->root, bbox, sizeof(float[6]));
+
+	double dx = bbox[1] - bbox[0], dy = bbox[3] - bbox[2], dz = (bbox[5] - bbox[4]) / HEIGHT_SCALE;
+	st->area += 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+struct SahBuild
+{
+	WorldBuild* wb;
+	int jobs;
+	volatile unsigned int next;
+};
+
+static void* SahWorker(void* cookie)
+{
+	SahBuild* sb = (SahBuild*)cookie;
+	while (1)
+	{
+		int j = (int)INTERLOCKED_INC(&sb->next) - 1;
+		if (j >= sb->jobs)
+			break;
+		BuildWorldJobs(sb->wb, j, j + 1);
+	}
+	return 0;
+}
+
+static void SahBuildJobs(World* w)
+{
+	SahBuild sb;
+	sb.wb = CreateWorldBuild(w, false);
+	sb.jobs = GetWorldBuildJobs(sb.wb);
+	sb.next = 0;
+
+	static const int max_workers = 64;
+	THREAD_HANDLE* worker[max_workers];
+	int workers = (THREAD_CORES() < max_workers ? THREAD_CORES() : max_workers) - 1;
+	for (int i = 0; i < workers; i++)
+		worker[i] = THREAD_CREATE(SahWorker, &sb);
+	SahWorker(&sb);
+	for (int i = 0; i < workers; i++)
+	{
+		if (worker[i])
+			THREAD_JOIN(worker[i]);
+	}
+
+	DeleteWorldBuild(sb.wb);
+}
+
+static void BenchSahWorld(World* w, int copies)
+{
+	uint64_t serial = ~0ull, jobs = ~0ull;
+	for (int r = 0; r < 5; r++)
+	{
+		uint64_t t0 = GetTime();
+		RebuildWorld(w, false);
+		uint64_t t1 = GetTime();
+		SahBuildJobs(w);
+		uint64_t t2 = GetTime();
+
+		serial = t1 - t0 < serial ? t1 - t0 : serial;
+		jobs = t2 - t1 < jobs ? t2 - t1 : jobs;
+	}
+
+	// whole tree, 4 planes far away
+	double all[4][4] = { { 1,0,0,1e9 }, { -1,0,0,1e9 }, { 0,1,0,1e9 }, { 0,-1,0,1e9 } };
+	SahTree st = { 0 };
+	QueryWorldBSP(w, 4, all, SahNode, &st);
+
+	QueryWorldCB cb = { SahQueryMesh, SahQuerySprite };
+	SahQuery insts = { 0 };
+	QueryWorld(w, 0, 0, &cb, &insts);
+
+	// same boxes and rays for every build
+	srand(7);
+	double x0 = st.root[0], y0 = st.root[2];
+	int w_x = (int)(st.root[1] - st.root[0]) + 1, w_y = (int)(st.root[3] - st.root[2]) + 1;
+
+	SahQuery boxes = { 0 };
+	uint64_t t0 = GetTime();
+	for (int i = 0; i < 2000; i++)
+	{
+		double x = x0 + rand() % w_x, y = y0 + rand() % w_y, r = 60;
+		double plane[4][4] = { { 1,0,0,-(x - r) }, { -1,0,0,x + r }, { 0,1,0,-(y - r) }, { 0,-1,0,y + r } };
+		QueryWorld(w, 4, plane, &cb, &boxes);
+	}
+	uint64_t t1 = GetTime();
+
+	SahQuery rays = { 0 };
+	for (int i = 0; i < 4000; i++)
+	{
+		double p[3] = { x0 + rand() % w_x, y0 + rand() % w_y, st.root[5] + HEIGHT_SCALE };
+		double v[3] = { (rand() % 100 - 50) * 0.01, (rand() % 100 - 50) * 0.01, -1 };
+		double ret[3], nrm[3];
+		if (HitWorld(w, p, v, ret, nrm, false, false, false, false))
+		{
+			rays.hits++;
+			rays.sum += ret[2];
+		}
+	}
+	uint64_t t2 = GetTime();
+
+	printf("  x%d %d insts: build %d us serial, %d us jobs, %d nodes, area %.4g\n",
+		copies, insts.hits, (int)serial, (int)jobs, st.nodes, st.area);
+	printf("    2000 boxes: %d us, %d hits (sum %.0f), 4000 rays: %d us, %d hits (z sum %.1f)\n",
+		(int)(t1 - t0), boxes.hits, boxes.sum, (int)(t2 - t1), rays.hits, rays.sum);
+}
+
+static int BenchSah(Map* map)
+{
+	BenchSahWorld(map->world, 1);
+
+	// denser world, mesh insts get 15 shifted copies
+	static const int copies = 16;
+	SahClones sc = { 0 };
+	QueryWorldCB cb = { SahCloneMesh, SahCloneSprite };
+	QueryWorld(map->world, 0, 0, &cb, &sc);
+
+	for (int i = 0; i < sc.num; i++)
+	{
+		for (int k = 1; k < copies; k++)
+		{
+			double tm[16];
+			memcpy(tm, sc.tm[i], sizeof(double[16]));
+			tm[12] += (k % 4) * 37.0 - 60;
+			tm[13] += (k / 4) * 41.0 - 60;
+			CreateInst(sc.mesh[i], INST_VISIBLE | INST_USE_TREE, tm, 0, -1);
+		}
+	}
+
+	free(sc.mesh);
+	free(sc.tm);
+
+	BenchSahWorld(map->world, copies);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// stress
+
+struct StressMap
+{
+	Map* map;
+	int spots;
+	double (*spot)[3]; // mesh inst positions
+	Inst* skip;
+	int rounds;
+	uint64_t* ref;
+	volatile unsigned int mismatches;
+};
+
+static void StressHash(uint64_t* h, uint64_t v)
+{
+	*h = (*h ^ v) * 1099511628211ull;
+}
+
+static void StressSpotMesh(Mesh* m, double tm[16], void* cookie)
+{
+	StressMap* sm = (StressMap*)cookie;
+	sm->spot = (double(*)[3])realloc(sm->spot, sizeof(double[3]) * (sm->spots + 1));
+	sm->spot[sm->spots][0] = tm[12];
+	sm->spot[sm->spots][1] = tm[13];
+	sm->spot[sm->spots][2] = tm[14];
+	sm->spots++;
+}
+
+static void StressSpotSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie)
+{
+}
+
+static void StressMesh(Mesh* m, double tm[16], void* cookie)
+{
+	StressHash((uint64_t*)cookie, (uintptr_t)m);
+	StressHash((uint64_t*)cookie, (int64_t)(tm[12] * 16));
+}
+
+static void StressSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie)
+{
+	StressHash((uint64_t*)cookie, (uintptr_t)inst);
+}
+
+static void StressPatch(Patch* p, int x, int y, int view_flags, void* cookie)
+{
+	StressHash((uint64_t*)cookie, (uint64_t)x * 7919 + y);
+}
+
+static bool StressLOD(int x, int y, int range, void* cookie)
+{
+	return range >= 64;
+}
+
+static void StressLODPatch(Patch* p, int x, int y, int range, int view_flags, void* cookie)
+{
+	StressHash((uint64_t*)cookie, (uintptr_t)p);
+	StressHash((uint64_t*)cookie, range);
+}
+
+// boxes around one spot, each queried and hit every possible way, deterministic per round
+static uint64_t StressRound(StressMap* sm, int round)
+{
+	uint64_t h = 1469598103934665603ull;
+	const double* c = sm->spot[round % sm->spots];
+	for (int q = 0; q < 8; q++)
+	{
+		double x = c[0] + q * 13 % 40 - 20, y = c[1] + q * 29 % 40 - 20, r = 30 + q * 5;
+		double plane[4][4] = { { 1,0,0,-(x - r) }, { -1,0,0,x + r }, { 0,1,0,-(y - r) }, { 0,-1,0,y + r } };
+
+		WorldQuery wq = { 0 };
+		wq.skip = q & 1 ? sm->skip : 0;
+		QueryWorldCB cb = { StressMesh, StressSprite };
+		QueryWorld(sm->map->world, 4, plane, &cb, &h, &wq);
+		StressHash(&h, wq.insts);
+		StressHash(&h, wq.nodes);
+		StressHash(&h, wq.tests);
+
+		QueryTerrain(sm->map->terrain, 4, plane, 0xAA, StressPatch, &h);
+		QueryTerrainLOD lod = { StressLOD, StressLODPatch };
+		QueryTerrain(sm->map->terrain, 4, plane, 0xAA, &lod, &h);
+
+		for (int k = 0; k < 16; k++)
+		{
+			double p[3] = { x + k % 4 * 3 - 6, y + k / 4 * 3 - 6, c[2] + 200 };
+			double v[3] = { (k & 1) * 0.3, (k & 2) * 0.2, -1 };
+			double ret[3] = { 0,0,0 }, nrm[3];
+
+			Inst* i = HitWorld(sm->map->world, p, v, ret, nrm, false, false, true, true, &wq);
+			StressHash(&h, (uintptr_t)i);
+			StressHash(&h, (int64_t)(ret[2] * 1024));
+
+			// editor view, volatile insts ignored
+			i = HitWorld(sm->map->world, p, v, ret, nrm, false, true, false, true, &wq);
+			StressHash(&h, (uintptr_t)i);
+
+			Patch* t = HitTerrain(sm->map->terrain, p, v, ret);
+			StressHash(&h, (uintptr_t)t);
+			StressHash(&h, (int64_t)(ret[2] * 1024));
+		}
+	}
+	return h;
+}
+
+struct StressWorker
+{
+	StressMap* sm;
+	int index;
+};
+
+static void* StressThread(void* cookie)
+{
+	StressWorker* sw = (StressWorker*)cookie;
+	StressMap* sm = sw->sm;
+	for (int k = 0; k < sm->rounds; k++)
+	{
+		// every thread walks all rounds from a different start
+		int round = (k * 7 + sw->index * 31) % sm->rounds;
+		if (StressRound(sm, round) != sm->ref[round])
+			INTERLOCKED_INC(&sm->mismatches);
+	}
+	return 0;
+}
+
+static int BenchStress(Map* map)
+{
+	StressMap sm = { 0 };
+	sm.map = map;
+
+	QueryWorldCB cb = { StressSpotMesh, StressSpotSprite };
+	QueryWorld(map->world, 0, 0, &cb, &sm);
+	if (!sm.spots)
+	{
+		printf("  no mesh insts\n");
+		return 1;
+	}
+
+	// volatile sprites among meshes, to be hit and skipped
+	extern Sprite* player_nude;
+	for (int k = 0; player_nude && k < 64; k++)
+	{
+		const double* s = sm.spot[k * 37 % sm.spots];
+		float pos[3] = { (float)s[0], (float)s[1], (float)s[2] };
+		int reps[4] = { -1,-1,-1,-1 };
+		Inst* i = CreateInst(map->world, player_nude, INST_VOLATILE | INST_VISIBLE, pos, 0, 0, 0, reps, 0, -1);
+		if (!sm.skip)
+			sm.skip = i;
+	}
+
+	// everything built on demand gets built here, see PrepareTerrainQueries()
+	PrepareTerrainQueries(map->terrain);
+
+	sm.rounds = 64;
+	sm.ref = (uint64_t*)malloc(sizeof(uint64_t) * sm.rounds);
+	uint64_t t0 = GetTime();
+	for (int r = 0; r < sm.rounds; r++)
+		sm.ref[r] = StressRound(&sm, r);
+	uint64_t t1 = GetTime();
+
+	// more threads than cores too, so they get preempted in the middle of queries
+	static const int max_threads = 64;
+	int threads = THREAD_CORES() > 8 ? THREAD_CORES() : 8;
+	if (threads > max_threads)
+		threads = max_threads;
+
+	StressWorker sw[max_threads];
+	THREAD_HANDLE* worker[max_threads];
+	for (int i = 0; i < threads; i++)
+	{
+		sw[i].sm = &sm;
+		sw[i].index = i;
+		worker[i] = THREAD_CREATE(StressThread, sw + i);
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		if (worker[i])
+			THREAD_JOIN(worker[i]);
+		else
+			StressThread(sw + i);
+	}
+	uint64_t t2 = GetTime();
+
+	printf("  %d rounds serial: %d ms, %d threads x %d rounds: %d ms, mismatches %d\n",
+		sm.rounds, (int)((t1 - t0) / 1000), threads, sm.rounds, (int)((t2 - t1) / 1000), (int)sm.mismatches);
+
+	free(sm.ref);
+	free(sm.spot);
+
+	return sm.mismatches ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct Bench
+{
+	const char* name;
+	int (*run)(Map* map); // non zero on failure
+};
+
+static const Bench bench[] =
+{
+	{ "hit", BenchHit },
+	{ "sah", BenchSah },
+	{ "stress", BenchStress },
+};
+
+int main(int argc, char* argv[])
+{
+	static const char* maps[] = { "a3d/game_map_y7.a3d", "a3d/game_map_y8.a3d" };
+	static const int benches = sizeof(bench) / sizeof(Bench);
+
+	const Bench* b = 0;
+	for (int i = 0; argc > 1 && i < benches; i++)
+	{
+		if (strcmp(argv[1], bench[i].name) == 0)
+			b = bench + i;
+	}
+
+	if (!b)
+	{
+		printf("usage: %s <test> [map.a3d ...]\ntests:", argv[0]);
+		for (int i = 0; i < benches; i++)
+			printf(" %s", bench[i].name);
+		printf("\n");
+		return 1;
+	}
+
+	int num = argc > 2 ? argc - 2 : sizeof(maps) / sizeof(maps[0]);
+	const char** path = argc > 2 ? (const char**)argv + 2 : maps;
+
+	int ret = 0;
+	for (int m = 0; m < num; m++)
+	{
+		Map map;
+		if (!LoadMap(&map, path[m]))
+		{
+			ret = 1;
+			continue;
+		}
+
+		printf("%s %s:\n", b->name, path[m]);
+		ret |= b->run(&map);
+
+		FreeMap(&map);
+	}
+
+	return ret;
+}
@@ -11,6 +11,7 @@
 
 #include "font1.h"
 #include "gamepad.h"
+#include "startup.h"
 
 uint8_t ConvertToCP437(uint32_t uc)
 {
@@ -1487,18 +1488,67 @@ bool Server::Proc(const uint8_t* ptr, int size)
 
 			h->sprite = GetSprite(&h->req, h->clr);
 
-			h->anim = pose->anim;
-			h->frame = pose->frame;
+			// clock offset is lower envelope of (local - server) samples
+			int64_t ofs = (int64_t)(stamp / 1000) - pose->stamp;
+			if (!clock_valid || ofs < clock_ofs || ofs > clock_ofs + 1000 /*server clock has changed*/)
+			{
+				clock_ofs = ofs;
+				clock_valid = true;
+			}
 
-			h->dir = pose->dir;
-			h->pos[0] = pose->pos[0];
-			h->pos[1] = pose->pos[1];
-			h->pos[2] = pose->pos[2];
+			Human::Snapshot* last = h->snap_num ? h->snap + (h->snap_num - 1) % Human::snapshots : 0;
+			if (last)
+			{
+				int gap = (int)(pose->stamp - last->stamp);
+				if (gap < 0 || gap > 5000)
+				{
+					// clock jump (shard handoff?) or long silence, restart buffering
+					h->snap_num = 0;
+					last = 0;
+				}
+				else
+				{
+					if (gap < 1000)
+						snap_interval += (gap - snap_interval) / 8;
 
-			if (h->inst)
+					if (gap > 2 * snap_interval + 50)
+					{
+						// player was standing still, hold last pose till just before this one
+						// otherwise it would slowly glide during whole silence
+						Human::Snapshot* hold = h->snap + h->snap_num % Human::snapshots;
+						*hold = *last;
+						hold->stamp = pose->stamp - snap_interval;
+						h->snap_num++;
+					}
+				}
+			}
+
+			Human::Snapshot* snap = h->snap + h->snap_num % Human::snapshots;
+			snap->stamp = pose->stamp;
+			snap->pos[0] = pose->pos[0];
+			snap->pos[1] = pose->pos[1];
+			snap->pos[2] = pose->pos[2];
+			snap->dir = pose->dir;
+			snap->anim = pose->anim;
+			snap->frame = pose->frame;
+			h->snap_num++;
+
+			if (h->snap_num == 1)
 			{
-				int reps[4];
-				UpdateSpriteInst(world, h->inst, h->sprite, h->pos, h->dir, h->anim, h->frame, reps);
+				// nothing to interpolate yet
+				h->anim = pose->anim;
+				h->frame = pose->frame;
+
+				h->dir = pose->dir;
+				h->pos[0] = pose->pos[0];
+				h->pos[1] = pose->pos[1];
+				h->pos[2] = pose->pos[2];
+
+				if (h->inst)
+				{
+					int reps[4];
+					UpdateSpriteInst(world, h->inst, h->sprite, h->pos, h->dir, h->anim, h->frame, reps);
+				}
 			}
 
 			break;
@@ -1552,6 +1602,15 @@ bool Server::Proc(const uint8_t* ptr, int size)
 			break;
 		}
 
+		case 'c': // slow down!
+		{
+			STRUCT_RSP_TUNE* tune = (STRUCT_RSP_TUNE*)ptr;
+			pose_interval = tune->pose_hz ? 1000000 / tune->pose_hz : 0;
+			pose_quant = tune->pose_quant / 16.0f;
+			dir_quant = tune->dir_quant;
+			break;
+		}
+
 		case 'l':
 		{
 			STRUCT_RSP_LAG* lag = (STRUCT_RSP_LAG*)ptr;
@@ -1573,6 +1632,11 @@ bool Server::Proc(const uint8_t* ptr, int size)
 			lag_ms = (latency + 500) / 1000;
 			lag_wait = false;
 
+			// jitter buffer depth follows lag probe variance
+			int dev = latency - lag_prev;
+			lag_jitter += ((dev < 0 ? -dev : dev) - lag_jitter) / 8;
+			lag_prev = latency;
+
 			// store it in server
 			break;
 		}
@@ -1585,6 +1649,155 @@ bool Server::Proc(const uint8_t* ptr, int size)
 	return true;
 }
 
+void Server::ResetInterpolation()
+{
+	interp_stamp = stamp;
+	clock_ofs = 0;
+	clock_valid = false;
+	lag_prev = 0;
+	lag_jitter = 0;
+	snap_interval = 50;
+	delay = 100;
+}
+
+void Server::ResetPoseSender()
+{
+	pose_interval = 1000000 / 20;
+	pose_quant = 0.25f;
+	dir_quant = 2.0f;
+	pose_stamp = 0;
+	pose_valid = false;
+}
+
+void Server::SendPose(const STRUCT_REQ_POSE* pose)
+{
+	static const int settle_intervals = 4;
+
+	if (pose_valid)
+	{
+		const STRUCT_REQ_POSE* last = &pose_sent;
+
+		// action, mount and equipment changes go immediately
+		bool discrete = pose->am != last->am || pose->sprite != last->sprite;
+
+		if (!discrete)
+		{
+			if (memcmp(pose, last, sizeof(STRUCT_REQ_POSE)) == 0)
+				return;
+
+			uint64_t elapsed = stamp - pose_stamp;
+			if (elapsed < (uint64_t)pose_interval)
+				return; // coalesced into next one
+
+			float dd = pose->dir - last->dir;
+			dd -= 360 * floorf((dd + 180) / 360);
+
+			bool minor =
+				fabsf(pose->pos[0] - last->pos[0]) < pose_quant &&
+				fabsf(pose->pos[1] - last->pos[1]) < pose_quant &&
+				fabsf(pose->pos[2] - last->pos[2]) < pose_quant &&
+				fabsf(dd) < dir_quant &&
+				pose->anim == last->anim;
+
+			// minor changes are skipped for a while, then sent anyway
+			// so others see exactly where we've stopped
+			if (minor && elapsed < (uint64_t)pose_interval * settle_intervals)
+				return;
+		}
+	}
+
+	if (!Send((const uint8_t*)pose, sizeof(STRUCT_REQ_POSE)))
+		return; // careful, this (server) is gone
+
+	pose_sent = *pose;
+	pose_stamp = stamp;
+	pose_valid = true;
+}
+
+void Server::Interpolate()
+{
+	static const int max_extrapolation = 250; // ms
+	static const int min_delay = 20, max_delay = 300; // ms
+
+	int dt = (int)((stamp - interp_stamp) / 1000);
+	interp_stamp = stamp;
+
+	// 1 interval for regular snapshots + 2 deviations for late ones
+	int target = snap_interval + 2 * lag_jitter / 1000;
+	if (target < min_delay)
+		target = min_delay;
+	if (target > max_delay)
+		target = max_delay;
+
+	// time-scale rather than jump: adjust delay by at most 10% of elapsed time
+	int adj = dt / 10 + 1;
+	if (target > delay)
+		delay += target - delay < adj ? target - delay : adj;
+	else
+		delay -= delay - target < adj ? delay - target : adj;
+
+	if (!clock_valid)
+		return;
+
+	uint32_t t = (uint32_t)((int64_t)(stamp / 1000) - clock_ofs - delay); // in server time
+
+	for (Human* h = head; h; h = (Human*)h->next)
+	{
+		if (h->snap_num < 2)
+			continue;
+
+		int num = h->snap_num < Human::snapshots ? h->snap_num : Human::snapshots;
+		const Human::Snapshot* b = h->snap + (h->snap_num - 1) % Human::snapshots; // newest
+		const Human::Snapshot* a = 0;
+
+		// find a <= t < b
+		for (int i = 2; i <= num; i++)
+		{
+			a = h->snap + (h->snap_num - i) % Human::snapshots;
+			if ((int)(t - a->stamp) >= 0)
+				break;
+			b = a;
+		}
+
+		int span = (int)(b->stamp - a->stamp);
+		float w;
+
+		if ((int)(t - a->stamp) < 0 || span <= 0)
+			w = 0; // older than whole buffer
+		else
+		if ((int)(t - b->stamp) <= 0)
+			w = (float)(int)(t - a->stamp) / span;
+		else
+		{
+			// late, dead-reckon from last 2 snapshots,
+			// then ease back to newest so we never keep overshoot
+			int late = (int)(t - b->stamp);
+			int ext = late < max_extrapolation ? late : 2 * max_extrapolation - late;
+			if (ext < 0)
+				ext = 0;
+			w = 1.0f + (float)ext / span;
+		}
+
+		float dd = b->dir - a->dir;
+		dd -= 360 * floorf((dd + 180) / 360); // shortest arc
+
+		h->pos[0] = a->pos[0] + w * (b->pos[0] - a->pos[0]);
+		h->pos[1] = a->pos[1] + w * (b->pos[1] - a->pos[1]);
+		h->pos[2] = a->pos[2] + w * (b->pos[2] - a->pos[2]);
+		h->dir = a->dir + w * dd;
+
+		const Human::Snapshot* s = w < 0.5f ? a : b; // nearer one
+		h->anim = s->anim;
+		h->frame = s->frame;
+
+		if (h->inst)
+		{
+			int reps[4];
+			UpdateSpriteInst(world, h->inst, h->sprite, h->pos, h->dir, h->anim, h->frame, reps);
+		}
+	}
+}
+
 #if 0
 struct KeyCap
 {
@@ -2754,7 +2967,7 @@ Sprite* character_button = 0;
 Sprite* inventory_sprite = 0;
 Sprite* fire_sprite = 0;
 
-Sprite* LoadSpriteBP(const char* name, const uint8_t* recolor, bool detached)
+void QueueSpriteBP(SpriteBatch* sb, Sprite** dst, const char* name, const uint8_t* recolor, bool detached)
 {
 	char path[1024];
 	sprintf(path,"%ssprites/%s", base_path, name);
@@ -2762,12 +2975,12 @@ Sprite* LoadSpriteBP(const char* name, const uint8_t* recolor, bool detached)
 #ifdef EDITOR
 	recolor = 0;
 #endif
-	return LoadSprite(path,name,recolor,detached);
+	QueueSprite(sb,dst,path,name,recolor,detached);
 }
 
-#define LOAD_SPRITE(n) LoadSpriteBP(n, 0, false);
+#define QUEUE_SPRITE(s,n) QueueSpriteBP(sb, &s, n, 0, false)
 
-void LoadSprites()
+void LoadSprites(void (*run)(SpriteBatch* sb, void* cookie), void* cookie)
 {
 #ifdef _WIN32
 	_set_printf_count_output(1);
@@ -2777,29 +2990,32 @@ void LoadSprites()
 	LoadFont1();
 	LoadGamePad();
 
+	// sprite files are decoded as batch jobs, pointers are stored once it's done
+	SpriteBatch* sb = CreateSpriteBatch();
+
 	// main buts
-	character_button = LoadSpriteBP("character.xp", 0, false);
-	inventory_sprite = LoadSpriteBP("inventory.xp", 0, false);
+	QueueSpriteBP(sb, &character_button, "character.xp", 0, false);
+	QueueSpriteBP(sb, &inventory_sprite, "inventory.xp", 0, false);
 
-	keyb_sprite[0] = LoadSpriteBP("keyb-07.xp", 0, false);
-	keyb_sprite[1] = LoadSpriteBP("keyb-09.xp", 0, false);
-	keyb_sprite[2] = LoadSpriteBP("keyb-11.xp", 0, false);
-	keyb_sprite[3] = LoadSpriteBP("keyb-13.xp", 0, false);
-	keyb_sprite[4] = LoadSpriteBP("keyb-15.xp", 0, false);
+	QueueSpriteBP(sb, &keyb_sprite[0], "keyb-07.xp", 0, false);
+	QueueSpriteBP(sb, &keyb_sprite[1], "keyb-09.xp", 0, false);
+	QueueSpriteBP(sb, &keyb_sprite[2], "keyb-11.xp", 0, false);
+	QueueSpriteBP(sb, &keyb_sprite[3], "keyb-13.xp", 0, false);
+	QueueSpriteBP(sb, &keyb_sprite[4], "keyb-15.xp", 0, false);
 
-	caps_sprite[0] = LoadSpriteBP("keyb-caps-a.xp", 0, false);
-	caps_sprite[1] = LoadSpriteBP("keyb-caps-b.xp", 0, false);
-	caps_sprite[2] = LoadSpriteBP("keyb-caps-c.xp", 0, false);
+	QueueSpriteBP(sb, &caps_sprite[0], "keyb-caps-a.xp", 0, false);
+	QueueSpriteBP(sb, &caps_sprite[1], "keyb-caps-b.xp", 0, false);
+	QueueSpriteBP(sb, &caps_sprite[2], "keyb-caps-c.xp", 0, false);
 
-	fire_sprite = LoadSpriteBP("fire.xp", 0, false);
+	QueueSpriteBP(sb, &fire_sprite, "fire.xp", 0, false);
 
-	player_nude = LoadSpriteBP("player-nude.xp", 0, false);
+	QueueSpriteBP(sb, &player_nude, "player-nude.xp", 0, false);
 
 	uint8_t wolf_recolor[] = { 2, 85,85,85, 51,51,51, 170,170,170, 102,102,102, 0,0 };
-	wolf[0] = LoadSpriteBP("wolfie.xp", 0, false);
-	wolf[1] = LoadSpriteBP("wolfie.xp", wolf_recolor, false);
+	QueueSpriteBP(sb, &wolf[0], "wolfie.xp", 0, false);
+	QueueSpriteBP(sb, &wolf[1], "wolfie.xp", wolf_recolor, false);
 
-	bee[0] = LoadSpriteBP("bigbee.xp", 0, false);
+	QueueSpriteBP(sb, &bee[0], "bigbee.xp", 0, false);
 	bee[1] = 0;
 
 
@@ -2822,17 +3038,17 @@ void LoadSprites()
 					for (int w = 0; w < WEAPON::SIZE; w++)
 					{
 						sprintf(name, "player-%x%x%x%x.xp", a, h, s, w);
-						player[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &player[c][a][h][s][w], name, recolor[c], false);
 
 						sprintf(name, "plydie-%x%x%x%x.xp", a, h, s, w);
-						player_fall[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &player_fall[c][a][h][s][w], name, recolor[c], false);
 
 						sprintf(name, "wolfie-%x%x%x%x.xp", a, h, s, w);
-						wolfie[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &wolfie[c][a][h][s][w], name, recolor[c], false);
 						wolfie_fall[c][a][h][s][w] = 0;
 
 						sprintf(name, "bigbee-%x%x%x%x.xp", a, h, s, w);
-						bigbee[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &bigbee[c][a][h][s][w], name, recolor[c], false);
 						bigbee_fall[c][a][h][s][w] = 0;
 					}
 
@@ -2841,13 +3057,13 @@ void LoadSprites()
 					for (int w = 1; w < WEAPON::SIZE; w++)
 					{
 						sprintf(name, "attack-%x%x%x%x.xp", a, h, s, w);
-						player_attack[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &player_attack[c][a][h][s][w], name, recolor[c], false);
 
 						sprintf(name, "wolack-%x%x%x%x.xp", a, h, s, w);
-						wolfie_attack[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						QueueSpriteBP(sb, &wolfie_attack[c][a][h][s][w], name, recolor[c], false);
 
 						//sprintf(name, "beeack-%x%x%x%x.xp", a, h, s, w);
-						//bigbee_attack[c][a][h][s][w] = LoadSpriteBP(name, recolor[c], false);
+						//QueueSpriteBP(sb, &bigbee_attack[c][a][h][s][w], name, recolor[c], false);
 						bigbee_attack[c][a][h][s][w] = 0;
 					}
 				}
@@ -2856,101 +3072,108 @@ void LoadSprites()
 	}
 
 	// world sprites
-	Sprite* item_sword =  LOAD_SPRITE("item-sword.xp");
-	Sprite* item_shield = LOAD_SPRITE("item-shield.xp");
-	Sprite* item_hammer = LOAD_SPRITE("item-hammer.xp");
-	Sprite* item_helmet = LOAD_SPRITE("item-helmet.xp");
-	Sprite* item_mace =   LOAD_SPRITE("item-mace.xp");
-	Sprite* item_axe =    LOAD_SPRITE("item-axe.xp");
-	Sprite* item_armor =  LOAD_SPRITE("item-armor.xp");
-	Sprite* item_crossbow  = LOAD_SPRITE("item-crossbow.xp");
-	Sprite* item_flail =  LOAD_SPRITE("item-flail.xp");
-
-	Sprite* item_white_ring = LOAD_SPRITE("item-white-ring.xp");
-	Sprite* item_cyan_ring = LOAD_SPRITE("item-cyan-ring.xp");
-	Sprite* item_gold_ring = LOAD_SPRITE("item-gold-ring.xp");
-	Sprite* item_pink_ring = LOAD_SPRITE("item-pink-ring.xp");
-
-	Sprite* item_meat =   LOAD_SPRITE("item-meat.xp");
-	Sprite* item_egg =    LOAD_SPRITE("item-egg.xp");
-	Sprite* item_cheese = LOAD_SPRITE("item-cheese.xp");
-	Sprite* item_bread =  LOAD_SPRITE("item-bread.xp");
-	Sprite* item_beet =   LOAD_SPRITE("item-beet.xp");
-	Sprite* item_cucumber = LOAD_SPRITE("item-cucumber.xp");
-	Sprite* item_carrot = LOAD_SPRITE("item-carrot.xp");
-	Sprite* item_apple =  LOAD_SPRITE("item-apple.xp");
-	Sprite* item_cherry = LOAD_SPRITE("item-cherry.xp");
-	Sprite* item_plum =   LOAD_SPRITE("item-plum.xp");
-	Sprite* item_milk =   LOAD_SPRITE("item-milk.xp");
-	Sprite* item_water =  LOAD_SPRITE("item-water.xp");
-	Sprite* item_wine =   LOAD_SPRITE("item-wine.xp");
-	Sprite* item_red_potion = LOAD_SPRITE("item-red-potion.xp");
-	Sprite* item_blue_potion = LOAD_SPRITE("item-blue-potion.xp");
-	Sprite* item_green_potion = LOAD_SPRITE("item-green-potion.xp");
-	Sprite* item_pink_potion = LOAD_SPRITE("item-pink-potion.xp");
-	Sprite* item_cyan_potion = LOAD_SPRITE("item-cyan-potion.xp");
-	Sprite* item_gold_potion = LOAD_SPRITE("item-gold-potion.xp");
-	Sprite* item_grey_potion = LOAD_SPRITE("item-grey-potion.xp");
+	Sprite* item_sword;  QUEUE_SPRITE(item_sword, "item-sword.xp");
+	Sprite* item_shield; QUEUE_SPRITE(item_shield, "item-shield.xp");
+	Sprite* item_hammer; QUEUE_SPRITE(item_hammer, "item-hammer.xp");
+	Sprite* item_helmet; QUEUE_SPRITE(item_helmet, "item-helmet.xp");
+	Sprite* item_mace;   QUEUE_SPRITE(item_mace, "item-mace.xp");
+	Sprite* item_axe;    QUEUE_SPRITE(item_axe, "item-axe.xp");
+	Sprite* item_armor;  QUEUE_SPRITE(item_armor, "item-armor.xp");
+	Sprite* item_crossbow; QUEUE_SPRITE(item_crossbow, "item-crossbow.xp");
+	Sprite* item_flail;  QUEUE_SPRITE(item_flail, "item-flail.xp");
+
+	Sprite* item_white_ring; QUEUE_SPRITE(item_white_ring, "item-white-ring.xp");
+	Sprite* item_cyan_ring; QUEUE_SPRITE(item_cyan_ring, "item-cyan-ring.xp");
+	Sprite* item_gold_ring; QUEUE_SPRITE(item_gold_ring, "item-gold-ring.xp");
+	Sprite* item_pink_ring; QUEUE_SPRITE(item_pink_ring, "item-pink-ring.xp");
+
+	Sprite* item_meat;   QUEUE_SPRITE(item_meat, "item-meat.xp");
+	Sprite* item_egg;    QUEUE_SPRITE(item_egg, "item-egg.xp");
+	Sprite* item_cheese; QUEUE_SPRITE(item_cheese, "item-cheese.xp");
+	Sprite* item_bread;  QUEUE_SPRITE(item_bread, "item-bread.xp");
+	Sprite* item_beet;   QUEUE_SPRITE(item_beet, "item-beet.xp");
+	Sprite* item_cucumber; QUEUE_SPRITE(item_cucumber, "item-cucumber.xp");
+	Sprite* item_carrot; QUEUE_SPRITE(item_carrot, "item-carrot.xp");
+	Sprite* item_apple;  QUEUE_SPRITE(item_apple, "item-apple.xp");
+	Sprite* item_cherry; QUEUE_SPRITE(item_cherry, "item-cherry.xp");
+	Sprite* item_plum;   QUEUE_SPRITE(item_plum, "item-plum.xp");
+	Sprite* item_milk;   QUEUE_SPRITE(item_milk, "item-milk.xp");
+	Sprite* item_water;  QUEUE_SPRITE(item_water, "item-water.xp");
+	Sprite* item_wine;   QUEUE_SPRITE(item_wine, "item-wine.xp");
+	Sprite* item_red_potion; QUEUE_SPRITE(item_red_potion, "item-red-potion.xp");
+	Sprite* item_blue_potion; QUEUE_SPRITE(item_blue_potion, "item-blue-potion.xp");
+	Sprite* item_green_potion; QUEUE_SPRITE(item_green_potion, "item-green-potion.xp");
+	Sprite* item_pink_potion; QUEUE_SPRITE(item_pink_potion, "item-pink-potion.xp");
+	Sprite* item_cyan_potion; QUEUE_SPRITE(item_cyan_potion, "item-cyan-potion.xp");
+	Sprite* item_gold_potion; QUEUE_SPRITE(item_gold_potion, "item-gold-potion.xp");
+	Sprite* item_grey_potion; QUEUE_SPRITE(item_grey_potion, "item-grey-potion.xp");
 
 	// inventory sprites
 	// weapons_2x3
-	Sprite* grid_big_mace = LOAD_SPRITE("grid-big-mace.xp");
-	Sprite* grid_big_hammer = LOAD_SPRITE("grid-big-hammer.xp");
-	Sprite* grid_big_axe = LOAD_SPRITE("grid-big-axe.xp");
+	Sprite* grid_big_mace; QUEUE_SPRITE(grid_big_mace, "grid-big-mace.xp");
+	Sprite* grid_big_hammer; QUEUE_SPRITE(grid_big_hammer, "grid-big-hammer.xp");
+	Sprite* grid_big_axe; QUEUE_SPRITE(grid_big_axe, "grid-big-axe.xp");
 
 	// weapons_1x3
-	Sprite* grid_alpha_sword = LOAD_SPRITE("grid-alpha-sword.xp");
-	Sprite* grid_plus_sword = LOAD_SPRITE("grid-plus-sword.xp");
-	Sprite* grid_small_mace = LOAD_SPRITE("grid-small-mace.xp");
+	Sprite* grid_alpha_sword; QUEUE_SPRITE(grid_alpha_sword, "grid-alpha-sword.xp");
+	Sprite* grid_plus_sword; QUEUE_SPRITE(grid_plus_sword, "grid-plus-sword.xp");
+	Sprite* grid_small_mace; QUEUE_SPRITE(grid_small_mace, "grid-small-mace.xp");
 
 	// weapons_1x2
-	Sprite* grid_small_sword = LOAD_SPRITE("grid-small-sword.xp");
-	Sprite* grid_small_saber = LOAD_SPRITE("grid-small-saber.xp");
-	Sprite* grid_lumber_axe = LOAD_SPRITE("grid-lumber-axe.xp");
+	Sprite* grid_small_sword; QUEUE_SPRITE(grid_small_sword, "grid-small-sword.xp");
+	Sprite* grid_small_saber; QUEUE_SPRITE(grid_small_saber, "grid-small-saber.xp");
+	Sprite* grid_lumber_axe; QUEUE_SPRITE(grid_lumber_axe, "grid-lumber-axe.xp");
 
 	// armory_2x2
-	Sprite* grid_light_helmet = LOAD_SPRITE("grid-light-helmet.xp");
-	Sprite* grid_heavy_helmet = LOAD_SPRITE("grid-heavy-helmet.xp");
-	Sprite* grid_light_shield = LOAD_SPRITE("grid-light-shield.xp");
-	Sprite* grid_heavy_shield = LOAD_SPRITE("grid-heavy-shield.xp");
-	Sprite* grid_light_armor = LOAD_SPRITE("grid-light-armor.xp");
-	Sprite* grid_heavy_armor = LOAD_SPRITE("grid-heavy-armor.xp");
+	Sprite* grid_light_helmet; QUEUE_SPRITE(grid_light_helmet, "grid-light-helmet.xp");
+	Sprite* grid_heavy_helmet; QUEUE_SPRITE(grid_heavy_helmet, "grid-heavy-helmet.xp");
+	Sprite* grid_light_shield; QUEUE_SPRITE(grid_light_shield, "grid-light-shield.xp");
+	Sprite* grid_heavy_shield; QUEUE_SPRITE(grid_heavy_shield, "grid-heavy-shield.xp");
+	Sprite* grid_light_armor; QUEUE_SPRITE(grid_light_armor, "grid-light-armor.xp");
+	Sprite* grid_heavy_armor; QUEUE_SPRITE(grid_heavy_armor, "grid-heavy-armor.xp");
 
 	// weapons_2x2
-	Sprite* grid_crossbow = LOAD_SPRITE("grid-crossbow.xp");
-	Sprite* grid_flail = LOAD_SPRITE("grid-flail.xp");
+	Sprite* grid_crossbow; QUEUE_SPRITE(grid_crossbow, "grid-crossbow.xp");
+	Sprite* grid_flail; QUEUE_SPRITE(grid_flail, "grid-flail.xp");
 
 	// rings_1x1
-	Sprite* grid_white_ring = LOAD_SPRITE("grid-white-ring.xp");
-	Sprite* grid_cyan_ring = LOAD_SPRITE("grid-cyan-ring.xp");
-	Sprite* grid_gold_ring = LOAD_SPRITE("grid-gold-ring.xp");
-	Sprite* grid_pink_ring = LOAD_SPRITE("grid-pink-ring.xp");
+	Sprite* grid_white_ring; QUEUE_SPRITE(grid_white_ring, "grid-white-ring.xp");
+	Sprite* grid_cyan_ring; QUEUE_SPRITE(grid_cyan_ring, "grid-cyan-ring.xp");
+	Sprite* grid_gold_ring; QUEUE_SPRITE(grid_gold_ring, "grid-gold-ring.xp");
+	Sprite* grid_pink_ring; QUEUE_SPRITE(grid_pink_ring, "grid-pink-ring.xp");
 
 	// food_2x2
-	Sprite* grid_meat = LOAD_SPRITE("grid-meat.xp");
-	Sprite* grid_egg = LOAD_SPRITE("grid-egg.xp");
-	Sprite* grid_cheese = LOAD_SPRITE("grid-cheese.xp");
-	Sprite* grid_bread = LOAD_SPRITE("grid-bread.xp");
-	Sprite* grid_beet = LOAD_SPRITE("grid-beet.xp");
-	Sprite* grid_cucumber = LOAD_SPRITE("grid-cucumber.xp");
-	Sprite* grid_carrot = LOAD_SPRITE("grid-carrot.xp");
-	Sprite* grid_apple = LOAD_SPRITE("grid-apple.xp");
-	Sprite* grid_cherry = LOAD_SPRITE("grid-cherry.xp");
-	Sprite* grid_plum = LOAD_SPRITE("grid-plum.xp");
+	Sprite* grid_meat; QUEUE_SPRITE(grid_meat, "grid-meat.xp");
+	Sprite* grid_egg; QUEUE_SPRITE(grid_egg, "grid-egg.xp");
+	Sprite* grid_cheese; QUEUE_SPRITE(grid_cheese, "grid-cheese.xp");
+	Sprite* grid_bread; QUEUE_SPRITE(grid_bread, "grid-bread.xp");
+	Sprite* grid_beet; QUEUE_SPRITE(grid_beet, "grid-beet.xp");
+	Sprite* grid_cucumber; QUEUE_SPRITE(grid_cucumber, "grid-cucumber.xp");
+	Sprite* grid_carrot; QUEUE_SPRITE(grid_carrot, "grid-carrot.xp");
+	Sprite* grid_apple; QUEUE_SPRITE(grid_apple, "grid-apple.xp");
+	Sprite* grid_cherry; QUEUE_SPRITE(grid_cherry, "grid-cherry.xp");
+	Sprite* grid_plum; QUEUE_SPRITE(grid_plum, "grid-plum.xp");
 
 	// drinks_2x2
-	Sprite* grid_milk = LOAD_SPRITE("grid-milk.xp");
-	Sprite* grid_water = LOAD_SPRITE("grid-water.xp");
-	Sprite* grid_wine = LOAD_SPRITE("grid-wine.xp");
+	Sprite* grid_milk; QUEUE_SPRITE(grid_milk, "grid-milk.xp");
+	Sprite* grid_water; QUEUE_SPRITE(grid_water, "grid-water.xp");
+	Sprite* grid_wine; QUEUE_SPRITE(grid_wine, "grid-wine.xp");
 
 	// potions_2x2
-	Sprite* grid_red_potion = LOAD_SPRITE("grid-red-potion.xp");
-	Sprite* grid_blue_potion = LOAD_SPRITE("grid-blue-potion.xp");
-	Sprite* grid_green_potion = LOAD_SPRITE("grid-green-potion.xp");
-	Sprite* grid_pink_potion = LOAD_SPRITE("grid-pink-potion.xp");
-	Sprite* grid_cyan_potion = LOAD_SPRITE("grid-cyan-potion.xp");
-	Sprite* grid_gold_potion = LOAD_SPRITE("grid-gold-potion.xp");
-	Sprite* grid_grey_potion = LOAD_SPRITE("grid-grey-potion.xp");
+	Sprite* grid_red_potion; QUEUE_SPRITE(grid_red_potion, "grid-red-potion.xp");
+	Sprite* grid_blue_potion; QUEUE_SPRITE(grid_blue_potion, "grid-blue-potion.xp");
+	Sprite* grid_green_potion; QUEUE_SPRITE(grid_green_potion, "grid-green-potion.xp");
+	Sprite* grid_pink_potion; QUEUE_SPRITE(grid_pink_potion, "grid-pink-potion.xp");
+	Sprite* grid_cyan_potion; QUEUE_SPRITE(grid_cyan_potion, "grid-cyan-potion.xp");
+	Sprite* grid_gold_potion; QUEUE_SPRITE(grid_gold_potion, "grid-gold-potion.xp");
+	Sprite* grid_grey_potion; QUEUE_SPRITE(grid_grey_potion, "grid-grey-potion.xp");
+
+	// decode queued files (caller can run jobs on many threads), then link & store
+	if (run)
+		run(sb, cookie);
+	else
+		LoadSpriteJobs(sb, 0, GetSpriteBatchJobs(sb));
+	DeleteSpriteBatch(sb);
 
 	static const ItemProto item_proto[] = 
 	{
@@ -3138,6 +3361,60 @@ void FreeSprites()
 		FreeSprite(s);
 }
 
+#ifdef DARK_TERRAIN
+// shadows of what last paging brought in, baked few jobs a frame
+// (about 0.3 ms each) so walking over chunk borders doesn't stall
+#define PAGE_BAKE_STEP 32
+static DarkBake* page_bake = 0;
+static int page_bake_done = 0;
+
+// true when there's nothing left to bake
+static bool StepPageBake(bool finish)
+{
+	if (!page_bake)
+		return true;
+
+	int jobs = GetDarkBakeJobs(page_bake);
+	int to = finish || jobs - page_bake_done <= PAGE_BAKE_STEP ? jobs : page_bake_done + PAGE_BAKE_STEP;
+	BakeTerrainDark(page_bake, page_bake_done, to);
+	page_bake_done = to;
+	if (to < jobs)
+		return false;
+
+	DeleteDarkBake(page_bake);
+	page_bake = 0;
+	return true;
+}
+#endif
+
+// pages terrain chunks and mesh insts around x,y in, far ones go away over budgets,
+// dirty boxes of both are rebaked with startup bake light, so paged in patches get
+// their shadows and ones they cast, and paged in insts cast theirs on terrain
+// finish==false spreads the bake over next calls, no paging happens till it's done
+// as bake jobs refer to patches, radius has enough margin for that
+static void TouchGameWorld(double x, double y, bool finish)
+{
+	#ifdef DARK_TERRAIN
+	if (!StepPageBake(finish))
+		return;
+	#endif
+
+	double xyr[3] = { x, y, WORLD_TOUCH_RADIUS };
+	bool paged = TouchTerrain(terrain, xyr);
+	paged = TouchWorld(world, xyr) || paged;
+
+	#ifdef DARK_TERRAIN
+	float lt[3];
+	if (paged && GetTerrainDarkLight(terrain, lt))
+	{
+		page_bake = CreateDarkBake(terrain, world, lt, false, true, true);
+		page_bake_done = 0;
+		if (finish)
+			StepPageBake(true);
+	}
+	#endif
+}
+
 Game* CreateGame(int water, float pos[3], float yaw, float dir, uint64_t stamp)
 {
 	// load defaults
@@ -3560,6 +3837,8 @@ Game* CreateGame(int water, float pos[3], float yaw, float dir, uint64_t stamp)
 		server->last_lag = stamp;
 		server->lag_ms = 0;
 		server->lag_wait = false;
+		server->ResetInterpolation();
+		server->ResetPoseSender();
 	}
 
 	ReadConf(g); 
@@ -3580,6 +3859,9 @@ Game* CreateGame(int water, float pos[3], float yaw, float dir, uint64_t stamp)
 	int width = 112, height = 63;
 	g->keyb_hide = 1000;// keyb.Height(width, height);
 
+	// physics settles player on what's around
+	TouchGameWorld(pos[0], pos[1], true);
+
 	g->renderer = CreateRenderer(stamp);
 	g->physics = CreatePhysics(terrain, world, pos, dir, yaw, stamp);
 	g->stamp = stamp;
@@ -3648,6 +3930,14 @@ void DeleteGame(Game* g)
 		if (g->physics)
 			DeletePhysics(g->physics);
 
+		#ifdef DARK_TERRAIN
+		if (page_bake)
+		{
+			DeleteDarkBake(page_bake);
+			page_bake = 0;
+		}
+		#endif
+
 		if (g->player.prev)
 			g->player.prev->next = g->player.next;
 		else
@@ -4679,6 +4969,9 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 
 	int steps = Animate(physics, _stamp, &io, player.req.mount);
 
+	if (server)
+		server->Interpolate();
+
 	if (io.grounded && blood)
 		BloodLeak(&player, steps);
 
@@ -5221,6 +5514,9 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 	player.pos[1] = io.pos[1];
 	player.pos[2] = io.pos[2];
 
+	// terrain and mesh insts around us paged in before anything queries them
+	TouchGameWorld(player.pos[0], player.pos[1], false);
+
 	switch (player.req.action)
 	{
 		case ACTION::ATTACK:
@@ -5552,8 +5848,9 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 				v[1] *= 1.0 / HEIGHT_CELLS;
 				*/
 
-				HideInst(player_inst);
-				Inst* inst = HitWorld(world, p, v, r1, 0, true, false, true, false);
+				WorldQuery wq = { 0 };
+				wq.skip = player_inst;
+				Inst* inst = HitWorld(world, p, v, r1, 0, true, false, true, false, &wq);
 				bool ground = HitTerrain(terrain, p, v, inst ? r2 : r1, 0, true);
 
 				if (inst && ground)
@@ -5589,8 +5886,6 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 					}
 				}
 
-				ShowInst(player_inst);
-
 				// set shoot params in human
 				player.shoot_stamp = stamp;
 				player.shooting = true;
@@ -5671,8 +5966,9 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 				v[1] *= 1000.0 / HEIGHT_CELLS;
 				v[2] *= 1000.0;
 
-				HideInst(player_inst);
-				Inst* inst = HitWorld(world, p, v, r1, 0, true, false, true);
+				WorldQuery wq = { 0 };
+				wq.skip = player_inst;
+				Inst* inst = HitWorld(world, p, v, r1, 0, true, false, true, true, &wq);
 				bool ground = HitTerrain(terrain, p, v, inst ? r2 : r1, 0, true);
 
 				if (inst && ground)
@@ -5700,8 +5996,6 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 					player.shoot_to[2] = (p[2] + v[2]);
 				}
 
-				ShowInst(player_inst);
-
 				// set shoot params in human
 				player.shoot_stamp = stamp;
 				player.shooting = true;
@@ -5720,7 +6014,7 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 		char status_text[80];
 		int len_left = 4;
 		int len_right = 4;
-		if (server)
+		if (server && !server->offline)
 		{
 			int len = sprintf(status_text,"ON LINE %4d | %d.%d fps", server->lag_ms, FPSx10/10, FPSx10%10);
 			len_left = len/2;
@@ -5733,7 +6027,7 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 		}
 		else
 		{
-			int len = sprintf(status_text,"OFF LINE | %d.%d fps", FPSx10/10, FPSx10%10);
+			int len = sprintf(status_text,"%s | %d.%d fps", server ? "RECONNECTING" : "OFF LINE", FPSx10/10, FPSx10%10);
 			len_left = len/2;
 			len_right = len - len_left;
 
@@ -6492,8 +6786,9 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 			server->Send((const uint8_t*)&req_lag, sizeof(STRUCT_REQ_LAG));
 		}
 
-		if (steps)
+		if (server) // lag probe could drop the connection
 		{
+			// every frame, SendPose decides if and when it goes out
 			STRUCT_REQ_POSE req_pose = { 0 };
 			req_pose.token = 'P';
 			req_pose.am = (player.req.action<<4) | player.req.mount;
@@ -6509,7 +6804,7 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 				(player.req.shield << 4) |
 				player.req.weapon; // 0xAHSW
 
-			server->Send((const uint8_t*)&req_pose, sizeof(STRUCT_REQ_POSE));
+			server->SendPose(&req_pose);
 		}
 	}
 
@@ -9112,59 +9407,9 @@ void Game::OnPadAxis(int a, int16_t pos)
 	}
 }
 
-struct MatIDStamp
-{
-	static void SetMatCB(Patch* p, int x, int y, int view_flags, void* cookie)
-	{
-		MatIDStamp* t = (MatIDStamp*)cookie;
-
-		double r2 = t->r * t->r;
-		double* hit = t->hit;
-		int matid = t->matid;
-
-		uint16_t* visual = GetTerrainVisualMap(p);
-
-		bool diff = false;
-		diff = true;
-
-		for (int v = 0, i = 0; v < VISUAL_CELLS; v++)
-		{
-			for (int u = 0; u < VISUAL_CELLS; u++, i++)
-			{
-				double dx = u + x - hit[0];
-				double dy = v + y - hit[1];
-				if (dx*dx + dy * dy < r2)
-				{
-					int old = visual[i] & 0xFF;
-					if (old != matid)
-					{
-						diff = true;
-						visual[i] = (visual[i] & ~0x00FF) | matid;
-					}
-				}
-			}
-		}
-
-		if (diff)
-			UpdateTerrainVisualMap(p);
-	}
-
-	int matid;
-	double hit[2];
-	double r;
-};
-
 void PaintTerrain(float* xy, float r, int matid)
 {
-#ifndef EDITOR
-	MatIDStamp stamp;
-	stamp.hit[0] = xy[0];
-	stamp.hit[1] = xy[1];
-	stamp.r = r;
-	stamp.matid = matid;
-
-	QueryTerrain(terrain, xy[0], xy[1], r * 0.501, 0x00, MatIDStamp::SetMatCB, &stamp);
-#endif
+	AddTerrainDecal(xy, r, matid);
 }
 
 void BloodLeak(Character* c, int steps)
@@ -207,6 +207,20 @@ struct Human : Character
 	float shoot_from[3];
 	float shoot_to[3];
 	bool shooting;
+
+	// server players only, poses buffered for interpolation
+	struct Snapshot
+	{
+		uint32_t stamp; // server ms
+		float pos[3];
+		float dir;
+		int anim;
+		int frame;
+	};
+
+	static const int snapshots = 8;
+	int snap_num; // total pushed, ring index is snap_num % snapshots
+	Snapshot snap[snapshots];
 };
 
 struct NPC_Creature : Character, ItemOwner {};
@@ -231,6 +245,31 @@ struct Server
 	uint64_t last_lag;
 	int lag_ms;
 	bool lag_wait;
+	bool offline; // native client lost connection and tries to get back
+
+	// others are rendered 'delay' ms behind server time (jitter buffer)
+	// interpolating between snapshots, or extrapolating if they are late
+	void Interpolate();
+	void ResetInterpolation();
+
+	// pose upload is rate capped and coalesced, discrete changes go immediately
+	void SendPose(const STRUCT_REQ_POSE* pose);
+	void ResetPoseSender();
+
+	int pose_interval; // us, from STRUCT_RSP_TUNE
+	float pose_quant; // visual cells
+	float dir_quant; // degrees
+	uint64_t pose_stamp; // last sent
+	STRUCT_REQ_POSE pose_sent;
+	bool pose_valid;
+
+	uint64_t interp_stamp; // last Interpolate() call
+	int64_t clock_ofs; // local ms - server ms, lower envelope of samples
+	bool clock_valid;
+	int lag_prev; // us, previous lag probe result
+	int lag_jitter; // us, smoothed lag probe deviation
+	int snap_interval; // ms, smoothed interval between snapshots
+	int delay; // ms
 
 	// pose->pad with hold new/del/upd flags
 };
@@ -477,7 +516,8 @@ struct Game
 Game* CreateGame(int water, float pos[3], float yaw, float dir, uint64_t stamp);
 void DeleteGame(Game* g);
 
-void LoadSprites();
+// if run is given it must load all batch jobs (see LoadSpriteJobs) before returning
+void LoadSprites(void (*run)(SpriteBatch* sb, void* cookie) = 0, void* cookie = 0);
 void FreeSprites();
 
 void PaintTerrain(float* xy, float r, int matid);
@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #ifdef __linux__
 # include <linux/limits.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 #include <linux/joystick.h>
 #else
@@ -42,6 +43,7 @@
 #include "matrix.h"
 
 #include "network.h"
+#include "startup.h"
 
 // FOR GL 
 #include "term.h"
@@ -719,45 +721,161 @@ bool NextGLFont()
 
 Server* server = 0;
 
-struct GameServer : Server
+// wakeup primitive, on posix it is pollable: eventfd on linux, pipe elsewhere
+struct NetEvent
 {
-	TCP_SOCKET server_socket;
+#ifdef _WIN32
+	HANDLE ev;
+#else
+	int fd[2]; // read end, write end (both the same eventfd on linux)
+#endif
+
+	bool Create(bool nonblock)
+	{
+		#ifdef _WIN32
+		ev = CreateEvent(0, FALSE, FALSE, 0);
+		return ev != 0;
+		#elif defined(__linux__)
+		fd[0] = fd[1] = eventfd(0, EFD_CLOEXEC | (nonblock ? EFD_NONBLOCK : 0));
+		return fd[0] >= 0;
+		#else
+		if (pipe(fd) != 0)
+			return false;
+		fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK); // full pipe is signalled enough
+		if (nonblock)
+			fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+		return true;
+		#endif
+	}
 
-	static const int buf_size = 1<<16;
-	uint8_t buf[buf_size];
-	int buf_ofs;
+	void Destroy()
+	{
+		#ifdef _WIN32
+		CloseHandle(ev);
+		#else
+		close(fd[0]);
+		if (fd[1] != fd[0])
+			close(fd[1]);
+		#endif
+	}
 
-	struct MSG_FIFO
+	void Signal()
 	{
-		uint8_t* ptr;
-		int size;
-	};
+		#ifdef _WIN32
+		SetEvent(ev);
+		#else
+		uint64_t one = 1;
+		if (write(fd[1], &one, fd[1] == fd[0] ? sizeof(uint64_t) : 1) < 0)
+			return; // pipe is full, so wakeup is pending anyway
+		#endif
+	}
 
-	static const int max_msg_size = 1 << 8;
-	static const int msg_size = buf_size / max_msg_size;
-	MSG_FIFO msg[msg_size];
+	void Wait(int timeout_ms = -1) // blocking
+	{
+		#ifdef _WIN32
+		WaitForSingleObject(ev, timeout_ms < 0 ? INFINITE : timeout_ms);
+		#else
+		if (timeout_ms >= 0)
+		{
+			pollfd pfd = { fd[0], POLLIN, 0 };
+			if (poll(&pfd, 1, timeout_ms) <= 0)
+				return;
+		}
+		uint64_t cnt;
+		if (read(fd[0], &cnt, fd[1] == fd[0] ? sizeof(uint64_t) : 1) < 0)
+			return; // interrupted, caller checks its state and waits again
+		#endif
+	}
 
-	int msg_read; // r/w only by main-thread wrapped at 256 to 0
-	int msg_write; // r/w only by net-thread wrapped at 256 to 0
+	void Clear() // non-blocking
+	{
+		#ifdef _WIN32
+		ResetEvent(ev);
+		#else
+		uint8_t cnt[64];
+		while (read(fd[0], cnt, fd[1] == fd[0] ? sizeof(uint64_t) : 64) > 0);
+		#endif
+	}
+};
 
-	volatile unsigned int msg_num; // inter_inc by net-thread, inter_and(0) by main-thread
+struct GameServer : Server
+{
+	// connection parameters, net-thread redials with them whenever connection is lost
+	char addr[256];
+	char port[32];
+	char path[256];
+	char user[32];
+
+	// session to resume after reconnection (from STRUCT_RSP_JOIN)
+	bool has_session;
+	uint16_t session_id;
+	uint64_t session_resume;
+
+	// ids are below it, main-thread sizes others[] by it at fresh_mark
+	volatile unsigned int maxcli;
+
+	TCP_SOCKET server_socket; // INVALID_TCP_SOCKET while disconnected
+	MUTEX_HANDLE* socket_lock; // guards server_socket between Send() and net-thread
+
+	// single producer (net-thread) single consumer (main-thread) ring of records:
+	// int32 size followed by message, padded to 4 bytes, records never wrap around,
+	// size == wrap_mark tells to continue from ring start, size <= 0 are connection marks
+	static const int ring_size = 1<<16;
+	static const int max_msg_size = 2048;
+	static const int max_rec_size = 4 + max_msg_size;
+	static const int wrap_mark = 0x7FFFFFFF;
+	static const int lost_mark = 0; // connection is gone, reconnecting
+	static const int fresh_mark = -1; // (re)connected, new session, forget everyone
+	static const int resumed_mark = -2; // reconnected, server delivers what we've missed
+	uint8_t ring[ring_size];
+
+	volatile unsigned int ring_write; // bytes produced, stored only by net-thread (release)
+	volatile unsigned int ring_read; // bytes consumed, stored only by main-thread (release)
+	unsigned int rec_pos; // net-thread only, record being written
+
+	volatile unsigned int ring_full; // non zero while net-thread waits for space
+	volatile unsigned int quit; // main-thread abandoned us, net-thread must leave
+	volatile unsigned int refs; // net-thread and main-thread, last one frees
+
+	NetEvent wake; // net -> main: records available (main loop polls it)
+	NetEvent space; // main -> net: records consumed while ring was full (or quit)
 
 	bool Start()
 	{
 		head = 0;
 		tail = 0;
 
-		others = (Human*)malloc(sizeof(Human) * max_clients);
-		
-		buf_ofs = 0;
-		msg_read = 0;
-		msg_write = 0;
-		msg_num = 0;
+		others = 0; // sized by maxcli of first session
+		max_clients = 0;
+
+		offline = true; // till net-thread connects
+		has_session = false;
+		server_socket = INVALID_TCP_SOCKET;
+
+		ring_write = 0;
+		ring_read = 0;
+		ring_full = 0;
+		quit = 0;
+		refs = 2;
+
+		if (!wake.Create(true))
+			return false;
+
+		if (!space.Create(false))
+		{
+			wake.Destroy();
+			return false;
+		}
+
+		socket_lock = MUTEX_CREATE();
 
 		bool ok = THREAD_CREATE_DETACHED(Entry, this);
 
 		if (!ok)
 		{
+			MUTEX_DELETE(socket_lock);
+			wake.Destroy();
+			space.Destroy();
 			return false;
 		}
 
@@ -766,30 +884,302 @@ struct GameServer : Server
 		return true;
 	}
 
+	unsigned int Room()
+	{
+		return ring_size - (ring_write - ATOMIC_LOAD_ACQUIRE(&ring_read));
+	}
+
+	// blocks till consumer makes enough room, false if we should quit
+	bool Reserve(unsigned int size)
+	{
+		while (Room() < size)
+		{
+			// announce we're waiting then re-check, consumer checks ring_full after moving ring_read
+			INTERLOCKED_INC(&ring_full);
+			if (Room() < size && !ATOMIC_LOAD_ACQUIRE(&quit))
+				space.Wait();
+			INTERLOCKED_DEC(&ring_full);
+
+			if (ATOMIC_LOAD_ACQUIRE(&quit))
+				return false;
+		}
+		return true;
+	}
+
+	// room for one record's payload, 0 if we should quit
+	uint8_t* Begin()
+	{
+		rec_pos = ring_write;
+		int ofs = rec_pos & (ring_size - 1);
+		int tail_room = ring_size - ofs;
+
+		if (tail_room < max_rec_size)
+		{
+			// not enough contiguous space till the end, skip it
+			if (!Reserve(tail_room + max_rec_size))
+				return 0;
+
+			*(int32_t*)(ring + ofs) = wrap_mark;
+			rec_pos += tail_room;
+			ofs = 0;
+		}
+		else
+		if (!Reserve(max_rec_size))
+			return 0;
+
+		return ring + ofs + 4;
+	}
+
+	// publishes record started by Begin(), marks (size <= 0) have no payload
+	void Commit(int size)
+	{
+		*(int32_t*)(ring + (rec_pos & (ring_size - 1))) = size;
+		int rec = size > 0 ? (4 + size + 3) & ~3 : 4;
+		ATOMIC_STORE_RELEASE(&ring_write, rec_pos + rec);
+		wake.Signal();
+	}
+
+	// resolve, connect, upgrade to ws and join or resume, blocking
+	TCP_SOCKET Dial(bool* resumed)
+	{
+		const char* hostname = addr;
+		const char* portname = port;
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		hints.ai_flags = AI_PASSIVE;
+		struct addrinfo* result = 0;
+		int iResult = getaddrinfo(hostname, portname, &hints, &result);
+		if (iResult != 0)
+		{
+			printf("getaddrinfo failed: %d\n", iResult);
+			return INVALID_TCP_SOCKET;
+		}
+
+		// socket create and varification 
+		TCP_SOCKET s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		if (s == INVALID_TCP_SOCKET)
+		{
+			printf("socket creation failed...\n");
+			freeaddrinfo(result);
+			return INVALID_TCP_SOCKET;
+		}
+
+		// connect the client socket to server socket 
+		if (connect(s, result->ai_addr, (int)result->ai_addrlen) != 0)
+		{
+			printf("connection with the server failed...\n");
+			freeaddrinfo(result);
+			TCP_CLOSE(s);
+			return INVALID_TCP_SOCKET;
+		}
+		else
+			printf("connected to the server..\n");
+
+		freeaddrinfo(result);
+
+		int optval = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char*)&optval, sizeof(optval)) != 0)
+		{
+			// ok we can live without it
+		}
+
+		optval = 1;
+		if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&optval, sizeof(optval)) != 0)
+		{
+			// ok we can live without it
+		}
+
+		// first, send HTTP->WS upgrade request (over http)
+		const char* request_fmt =
+			"GET /%s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+	#ifdef _WIN32
+			"User-Agent: native-asciicker-windows\r\n"
+	#else
+			"User-Agent: native-asciicker-linux\r\n"
+	#endif
+			"Accept: */*\r\n"
+			"Accept-Language: en-US,en;q=0.5\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"Sec-WebSocket-Key: btsPdKGunHdaTPnSSDlfow==\r\n"
+			"Pragma: no-cache\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Upgrade: WebSocket\r\n"
+			"Connection: Upgrade\r\n\r\n";
+
+		char request[2048];
+		sprintf(request, request_fmt, path, addr);
+
+		int w = TCP_WRITE(s, (uint8_t*)request, (int)strlen(request));
+		if (w < 0)
+		{
+			TCP_CLOSE(s);
+			return INVALID_TCP_SOCKET;
+		}
+
+		// wait for response (check HTTP status / headers)
+		struct Headers
+		{
+			static int cb(const char* header, const char* value, void* param)
+			{
+				Headers* h = (Headers*)param;
+
+				if (header)
+				{
+					if (strcmp("Content-Length", header) == 0)
+						h->content_len = atoi(value);
+				}
+
+				return 0;
+			}
+
+			int content_len;
+		} headers;
+
+		headers.content_len = 0;
+
+		char buf[2048];
+		int over_read = HTTP_READ(s, Headers::cb, &headers, buf);
+
+		if (over_read < 0 || over_read > headers.content_len || headers.content_len > 2048)
+		{
+			TCP_CLOSE(s);
+			return INVALID_TCP_SOCKET;
+		}
+
+		while (headers.content_len > over_read)
+		{
+			int r = TCP_READ(s, (uint8_t*)buf + over_read, headers.content_len - over_read);
+			if (r <= 0)
+			{
+				TCP_CLOSE(s);
+				return INVALID_TCP_SOCKET;
+			}
+			over_read += r;
+		}
+
+		// server should stay silent till we join the game
+		// send JOIN (or RESUME if we were here before) along with user name (over ws)
+		// name stays zero terminated (structs are zeroed)
+		size_t user_len = strlen(user);
+		if (user_len > 30)
+			user_len = 30;
+
+		int ws;
+		if (has_session)
+		{
+			STRUCT_REQ_RESUME req_resume = { 0 };
+			req_resume.token = 'R';
+			memcpy(req_resume.name, user, user_len);
+			req_resume.id = session_id;
+			req_resume.resume = session_resume;
+			ws = WS_WRITE(s, (uint8_t*)&req_resume, sizeof(STRUCT_REQ_RESUME), 0, 0x2);
+		}
+		else
+		{
+			STRUCT_REQ_JOIN req_join = { 0 };
+			req_join.token = 'J';
+			memcpy(req_join.name, user, user_len);
+			ws = WS_WRITE(s, (uint8_t*)&req_join, sizeof(STRUCT_REQ_JOIN), 0, 0x2);
+		}
+
+		if (ws <= 0)
+		{
+			TCP_CLOSE(s);
+			return INVALID_TCP_SOCKET;
+		}
+
+		// Recv for ID (over ws), old servers send just first 4 bytes of it
+		STRUCT_RSP_JOIN rsp_join = { 0 };
+		ws = WS_READ(s, (uint8_t*)&rsp_join, sizeof(STRUCT_RSP_JOIN), 0);
+		if (ws < 4 || rsp_join.token != 'j')
+		{
+			TCP_CLOSE(s);
+			return INVALID_TCP_SOCKET;
+		}
+
+		*resumed = has_session && ws == sizeof(STRUCT_RSP_JOIN) && rsp_join.resumed;
+
+		has_session = ws == sizeof(STRUCT_RSP_JOIN);
+		session_id = rsp_join.id;
+		session_resume = rsp_join.resume;
+		ATOMIC_STORE_RELEASE(&maxcli, rsp_join.maxcli); // before connection mark
+
+		printf("%s with ID:%d/%d\n", *resumed ? "resumed" : "connected", rsp_join.id, rsp_join.maxcli);
+
+		return s;
+	}
+
 	void Recv()
 	{
-		while (1)
+		int backoff = 0; // ms, doubles with every failed attempt
+
+		while (!ATOMIC_LOAD_ACQUIRE(&quit))
 		{
-			while (msg_num == msg_size)
-				THREAD_SLEEP(15);
+			if (backoff)
+				space.Wait(backoff); // Abandon() cuts it short
+
+			if (ATOMIC_LOAD_ACQUIRE(&quit))
+				break;
+
+			bool resumed = false;
+			TCP_SOCKET s = Dial(&resumed);
+			if (s == INVALID_TCP_SOCKET)
+			{
+				backoff = backoff ? backoff * 2 : 1000;
+				if (backoff > 30000)
+					backoff = 30000;
+				continue;
+			}
+
+			backoff = 0;
+
+			if (!Begin())
+			{
+				TCP_CLOSE(s);
+				break;
+			}
+			Commit(resumed ? resumed_mark : fresh_mark);
 
-			int r = WS_READ(server_socket, buf + buf_ofs, 2048, 0);
+			MUTEX_LOCK(socket_lock);
+			server_socket = s;
+			MUTEX_UNLOCK(socket_lock);
 
-			MSG_FIFO* m = msg + msg_write;
-			m->size = r;
-			m->ptr = buf + buf_ofs;
+			while (1)
+			{
+				uint8_t* rec = Begin();
+				if (!rec)
+					break;
+
+				int r = WS_READ(s, rec, max_msg_size, 0);
+				if (r <= 0)
+				{
+					Commit(lost_mark);
+					break;
+				}
 
-			INTERLOCKED_INC(&msg_num);
+				// handed off to other shard, resume goes there from now on
+				if (r == sizeof(STRUCT_RSP_SESSION) && rec[0] == 's')
+				{
+					session_id = ((STRUCT_RSP_SESSION*)rec)->id;
+					session_resume = ((STRUCT_RSP_SESSION*)rec)->resume;
+					continue;
+				}
 
-            if (r<=0)
-                break;
+				Commit(r);
+			}
 
-			msg_write = (msg_write + 1)&(msg_size - 1);
+			MUTEX_LOCK(socket_lock);
+			server_socket = INVALID_TCP_SOCKET;
+			MUTEX_UNLOCK(socket_lock);
 
-			buf_ofs += r;
-			if (buf_size - buf_ofs < max_msg_size)
-				buf_ofs = 0;
+			TCP_CLOSE(s);
 		}
+
+		Release();
 	}
 
 	static void* Entry(void* arg)
@@ -799,233 +1189,162 @@ struct GameServer : Server
 		return 0;
 	}
 
-	void Stop()
+	// breaks current connection (if any), net-thread closes it and redials
+	void Drop()
 	{
-		// finish thread
-		// close socket
+		MUTEX_LOCK(socket_lock);
 		if (server_socket != INVALID_TCP_SOCKET)
-		{
-			TCP_CLOSE(server_socket);
-			TCP_CLEANUP();
-		}
+			shutdown(server_socket, 2 /*both ways*/);
+		MUTEX_UNLOCK(socket_lock);
+	}
 
-		server_socket = INVALID_TCP_SOCKET;
+	// main-thread gives up, net-thread may still be running
+	void Abandon()
+	{
+		ATOMIC_STORE_RELEASE(&quit, 1);
+		Drop();
+		space.Signal();
 
 		if (others)
 			free(others);
 		others = 0;
+
+		Release();
 	}
-};
 
-bool Server::Send(const uint8_t* data, int size)
-{
-	GameServer* gs = (GameServer*)this;
-	int w = WS_WRITE(gs->server_socket, (const uint8_t*)data, size, 0, 0x2);
-	if (w <= 0)
+	void Release()
 	{
-        gs->Stop();
-        free(others);
-        free(server);
-        server=0;
-		return false;
+		if (INTERLOCKED_DEC(&refs) == 0)
+		{
+			MUTEX_DELETE(socket_lock);
+			wake.Destroy();
+			space.Destroy();
+			free(this);
+			TCP_CLEANUP();
+		}
 	}
-	return true;
-}
+};
 
-void Server::Proc()
+bool Server::Send(const uint8_t* data, int size)
 {
 	GameServer* gs = (GameServer*)this;
-	int num = gs->msg_num;
-	for (int i = 0; i < num; i++)
+	bool ok = false;
+
+	MUTEX_LOCK(gs->socket_lock);
+	if (gs->server_socket != INVALID_TCP_SOCKET)
 	{
-		GameServer::MSG_FIFO* m = gs->msg + gs->msg_read;
-        if (m->size<=0)
-        {
-            free(others);
-            free(server);
-            server = 0;
-            return;
-        }
-		Server::Proc(m->ptr, m->size); // this would be called directly by JS
-		gs->msg_read = (gs->msg_read + 1)&(GameServer::msg_size - 1);
+		ok = WS_WRITE(gs->server_socket, (const uint8_t*)data, size, 0, 0x2) > 0;
+		if (!ok)
+			shutdown(gs->server_socket, 2); // net-thread notices and reconnects
 	}
+	MUTEX_UNLOCK(gs->socket_lock);
 
-	INTERLOCKED_SUB(&gs->msg_num, num);
+	return ok;
 }
 
-void Server::Log(const char* str)
-{
-    //printf("%s",str);
-}
-
-GameServer* Connect(const char* addr, const char* port, const char* path, const char* user)
+void Server::Proc()
 {
-	int iResult;
-
-	// Initialize Winsock
-	iResult = TCP_INIT();
-	if (iResult != 0)
-	{
-		printf("WSAStartup failed: %d\n", iResult);
-		return 0;
-	}
-
-	TCP_SOCKET server_socket = INVALID_TCP_SOCKET;
-
-	const char* hostname = addr;
-	const char* portname = port;
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = AI_PASSIVE;
-	struct addrinfo* result = 0;
-	iResult = getaddrinfo(hostname, portname, &hints, &result);
-	if (iResult != 0)
-	{
-		printf("getaddrinfo failed: %d\n", iResult);
-		TCP_CLEANUP();
-		return 0;
-	}
-
-	// socket create and varification 
-	server_socket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-	if (server_socket == INVALID_TCP_SOCKET)
-	{
-		printf("socket creation failed...\n");
-		TCP_CLEANUP();
-		return 0;
-	}
-	else
-		printf("Socket successfully created..\n");
-
-	// connect the client socket to server socket 
-	if (connect(server_socket, result->ai_addr, (int)result->ai_addrlen) != 0)
-	{
-		printf("connection with the server failed...\n");
-		TCP_CLOSE(server_socket);
-		TCP_CLEANUP();
-		return 0;
-	}
-	else
-		printf("connected to the server..\n");
+	GameServer* gs = (GameServer*)this;
 
-    int optval = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_KEEPALIVE, (const char*)&optval, sizeof(optval)) != 0)
-    {
-        // ok we can live without it
-    }
+	// message handlers may Abandon() us, keep gs alive till we're done with the ring
+	INTERLOCKED_INC(&gs->refs);
 
-	optval = 1;
-	if (setsockopt(server_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&optval, sizeof(optval)) != 0)
-	{
-		// ok we can live without it
-	}
+	gs->wake.Clear();
 
-	freeaddrinfo(result);
+	unsigned int r = gs->ring_read;
+	unsigned int w = ATOMIC_LOAD_ACQUIRE(&gs->ring_write);
 
-	// first, send HTTP->WS upgrade request (over http)
-	const char* request_fmt =
-		"GET /%s HTTP/1.1\r\n"
-        "Host: %s\r\n"
-#ifdef _WIN32
-		"User-Agent: native-asciicker-windows\r\n"
-#else
-		"User-Agent: native-asciicker-linux\r\n"
-#endif
-		"Accept: */*\r\n"
-		"Accept-Language: en-US,en;q=0.5\r\n"
-		"Sec-WebSocket-Version: 13\r\n"
-		"Sec-WebSocket-Key: btsPdKGunHdaTPnSSDlfow==\r\n"
-		"Pragma: no-cache\r\n"
-		"Cache-Control: no-cache\r\n"
-		"Upgrade: WebSocket\r\n"
-		"Connection: Upgrade\r\n\r\n";
-
-    char request[2048];
-    sprintf(request, request_fmt, path, addr);
-
-	int w = TCP_WRITE(server_socket, (uint8_t*)request, (int)strlen(request));
-	if (w < 0)
+	while (r != w)
 	{
-		TCP_CLOSE(server_socket);
-		TCP_CLEANUP();
-		return 0;
-	}
+		int ofs = r & (GameServer::ring_size - 1);
+		int size = *(int32_t*)(gs->ring + ofs);
 
-	// wait for response (check HTTP status / headers)
-	struct Headers
-	{
-		static int cb(const char* header, const char* value, void* param)
+		if (size == GameServer::wrap_mark)
 		{
-			Headers* h = (Headers*)param;
+			r += GameServer::ring_size - ofs;
+			continue;
+		}
 
-			if (header)
+		if (size <= 0)
+		{
+			if (size == GameServer::fresh_mark)
 			{
-				if (strcmp("Content-Length", header) == 0)
-					h->content_len = atoi(value);
+				// server doesn't know us anymore, neither we know anyone there
+				STRUCT_BRC_EXIT brc_exit = { 0 };
+				brc_exit.token = 'e';
+				while (head && !ATOMIC_LOAD_ACQUIRE(&gs->quit))
+				{
+					brc_exit.id = (uint16_t)(head - others);
+					Server::Proc((const uint8_t*)&brc_exit, sizeof(STRUCT_BRC_EXIT));
+				}
+
+				// nobody's left to point into others, size it for this server
+				// (grows only, maxcli may be already of next session)
+				int cli = (int)ATOMIC_LOAD_ACQUIRE(&gs->maxcli);
+				if (!head && cli > max_clients)
+				{
+					if (others)
+						free(others);
+					others = (Human*)malloc(sizeof(Human) * cli);
+					max_clients = cli;
+				}
 			}
 
-			return 0;
+			// others keep extrapolating (then stop) till we're back
+			offline = size == GameServer::lost_mark;
+			lag_wait = false; // probe in flight is lost
+			ResetPoseSender(); // server sends STRUCT_RSP_TUNE again
+			r += 4;
+			continue;
 		}
 
-		int content_len;
-	} headers;
+		Server::Proc(gs->ring + ofs + 4, size); // this would be called directly by JS
+		r += (4 + size + 3) & ~3;
 
-	headers.content_len = 0;
+		if (ATOMIC_LOAD_ACQUIRE(&gs->quit))
+			break; // abandoned by handler, others are gone
+	}
 
-	char buf[2048];
-	int over_read = HTTP_READ(server_socket, Headers::cb, &headers, buf);
+	ATOMIC_STORE_RELEASE(&gs->ring_read, r);
 
-	if (over_read < 0 || over_read > headers.content_len || headers.content_len > 2048)
-	{
-		TCP_CLOSE(server_socket);
-		TCP_CLEANUP();
-		return 0;
-	}
+	// full barrier (interlocked) between storing ring_read and checking ring_full
+	if (INTERLOCKED_ADD(&gs->ring_full, 0))
+		gs->space.Signal();
 
-	while (headers.content_len > over_read)
-	{
-		int r = TCP_READ(server_socket, (uint8_t*)buf + over_read, headers.content_len - over_read);
-		if (r <= 0)
-		{
-			TCP_CLOSE(server_socket);
-			TCP_CLEANUP();
-			return 0;
-		}
-		over_read += r;
-	}
+	gs->Release();
+}
 
-	// server should stay silent till we join the game
-	// send JOIN command along with user name (over ws)
-	STRUCT_REQ_JOIN req_join = { 0 };
-	req_join.token = 'J';
-	strncpy(req_join.name, user, 30);
-	int ws = WS_WRITE(server_socket, (uint8_t*)&req_join, sizeof(STRUCT_REQ_JOIN), 0, 0x2);
-	if (ws <= 0)
-	{
-		TCP_CLOSE(server_socket);
-		TCP_CLEANUP();
-		return 0;
-	}
+void Server::Log(const char* str)
+{
+    //printf("%s",str);
+}
 
-	// Recv for ID (over ws) (it can send us some content to display!)
-	STRUCT_RSP_JOIN rsp_join = { 0 };
-	ws = WS_READ(server_socket, (uint8_t*)&rsp_join, sizeof(STRUCT_RSP_JOIN), 0);
-	if (ws <= 0 || rsp_join.token != 'j')
+// connection is made by net-thread (started by GameServer::Start),
+// it keeps reconnecting with backoff and resumes session if server still keeps it
+GameServer* Connect(const char* addr, const char* port, const char* path, const char* user)
+{
+	// Initialize Winsock
+	int iResult = TCP_INIT();
+	if (iResult != 0)
 	{
-		TCP_CLOSE(server_socket);
-		TCP_CLEANUP();
+		printf("WSAStartup failed: %d\n", iResult);
 		return 0;
 	}
 
-	int ID = rsp_join.id;
-	printf("connected with ID:%d/%d\n", ID, rsp_join.maxcli);
-
 	GameServer* gs = (GameServer*)malloc(sizeof(GameServer));
-	gs->server_socket = server_socket;
-	gs->max_clients = rsp_join.maxcli;
+	memset(gs, 0, sizeof(GameServer));
+
+	strncpy(gs->addr, addr, sizeof(gs->addr) - 1);
+	gs->addr[sizeof(gs->addr) - 1] = 0;
+	strncpy(gs->port, port, sizeof(gs->port) - 1);
+	gs->port[sizeof(gs->port) - 1] = 0;
+	strncpy(gs->path, path, sizeof(gs->path) - 1);
+	gs->path[sizeof(gs->path) - 1] = 0;
+	strncpy(gs->user, user, 30);
+	gs->user[30] = 0;
+
+	// others[] is allocated when rsp_join.maxcli is known (fresh_mark in Server::Proc)
+	gs->max_clients = 0;
 
 	return gs;
 }
@@ -1435,11 +1754,15 @@ int main(int argc, char* argv[])
 	*/
 
     bool term = false;
+    bool trace = false; // print startup timeline
     for (int p=1; p<argc; p++)
     {
         if (strcmp(argv[p],"-term")==0)
             term = true;
 		else
+        if (strcmp(argv[p],"-trace")==0)
+            trace = true;
+		else
 		if (p+1<argc)
 		{
 			if (strcmp(argv[p], "-url") == 0)
@@ -1491,10 +1814,11 @@ int main(int argc, char* argv[])
 
         if (addr && addr[0])
         {
+            // doesn't wait for the server, game starts right away and goes online when it's up
             gs = Connect(addr, port, path, user);
             if (!gs)
             {
-                printf("Couldn't connect to server %S, starting solo ...\n", addr);
+                printf("Couldn't connect to server %s, starting solo ...\n", addr);
             }
         }
 
@@ -1521,78 +1845,34 @@ int main(int argc, char* argv[])
 
 	float last_yaw = yaw;
 
-	LoadSprites();
-
 	{
         char a3d_path[1024];
         sprintf(a3d_path,"%sa3d/game_map_y8.a3d", base_path);
-		FILE* f = fopen(a3d_path, "rb");
 
 		// TODO:
 		// if GameServer* gs != 0
 		// DO NOT LOAD ITEMS!
 		// we will receive them from server
 
-		if (f)
-		{
-			terrain = LoadTerrain(f);
-
-			if (terrain)
-			{
-				for (int i = 0; i < 256; i++)
-				{
-					if (fread(mat[i].shade, 1, sizeof(MatCell) * 4 * 16, f) != sizeof(MatCell) * 4 * 16)
-						break;
-				}
-
-				world = LoadWorld(f, false);
-				if (world)
-				{
-					// reload meshes too
-					Mesh* m = GetFirstMesh(world);
-
-					while (m)
-					{
-						char mesh_name[256];
-						GetMeshName(m, mesh_name, 256);
-						char obj_path[4096];
-						sprintf(obj_path, "%smeshes/%s", base_path, mesh_name);
-						if (!UpdateMesh(m, obj_path))
-						{
-							// what now?
-							// missing mesh file!
-						}
-
-						m = GetNextMesh(m);
-					}
-
-					LoadEnemyGens(f);
-				}
-			}
-
-			fclose(f);
-		}
+		// sprites, terrain, meshes, bsp and dark bake run on all cores
+        #ifdef DARK_TERRAIN
+		LoadStartup(a3d_path, &terrain, &world, mat, true, lt, trace ? stdout : 0);
+        #else
+		LoadStartup(a3d_path, &terrain, &world, mat, true, 0, trace ? stdout : 0);
+        #endif
 
 		// if (!terrain || !world)
 		//    return -1;
 
+		// far chunks go away as we walk, game's TouchTerrain() / TouchWorld() page them in
+		// (and shadow them) again when needed, queries only see what's there
+		SetTerrainBudget(terrain, TERRAIN_BUDGET);
+		SetWorldBudget(world, WORLD_BUDGET);
+
 		// add meshes from library that aren't present in scene file
 		char mesh_dirname[4096];
 		sprintf(mesh_dirname, "%smeshes", base_path);
 		//a3dListDir(mesh_dirname, MeshScan, mesh_dirname);
-
-		// this is the only case when instances has no valid bboxes yet
-		// as meshes weren't present during their creation
-		// now meshes are loaded ...
-		// so we need to update instance boxes with (,true)
-
-		if (world)
-        {
-			RebuildWorld(world, true);
-            #ifdef DARK_TERRAIN
-            UpdateTerrainDark(terrain, world, lt, false);
-            #endif
-        }
 	}
 
 	if (gs)
@@ -1909,7 +2189,13 @@ int main(int argc, char* argv[])
             }
         }
 
-        struct pollfd pfds[3]={0};
+        // last slot is network thread's wakeup, poll ignores slots with fd<0
+        struct pollfd pfds[4]={0};
+        for (int i=0; i<4; i++)
+            pfds[i].fd = -1;
+        pfds[3].fd = server ? ((GameServer*)server)->wake.fd[0] : -1;
+        pfds[3].events = POLLIN;
+
         if (gpm>=0)
         {
             pfds[0].fd = STDIN_FILENO;
@@ -1925,7 +2211,7 @@ int main(int argc, char* argv[])
                 pfds[2].fd = jsfd;
                 pfds[2].events = POLLIN|POLL_HUP|POLL_ERR; 
                 pfds[2].revents = 0;
-                poll(pfds, 3, 0); // 0 no timeout, -1 block
+                poll(pfds, 4, 0); // 0 no timeout, -1 block
 
                 if (pfds[2].revents & (POLLHUP|POLLERR))
                 {
@@ -1945,7 +2231,7 @@ int main(int argc, char* argv[])
                 }
             }
             else
-                poll(pfds, 2, 0); // 0 no timeout, -1 block
+                poll(pfds, 4, 0); // 0 no timeout, -1 block
 
 #ifdef USE_GPM
             if (pfds[1].revents & POLLIN)
@@ -2065,7 +2351,7 @@ int main(int argc, char* argv[])
                 pfds[1].fd = jsfd;
                 pfds[1].events = POLLIN|POLLHUP|POLLERR; 
                 pfds[1].revents = 0;
-                poll(pfds, 2, 0); // 0 no timeout, -1 block
+                poll(pfds, 4, 0); // 0 no timeout, -1 block
 
                 if (pfds[1].revents & (POLLHUP|POLLERR))
                 {
@@ -2085,7 +2371,7 @@ int main(int argc, char* argv[])
                 }
             }
             else
-                poll(pfds, 1, 0); // 0 no timeout, -1 block
+                poll(pfds, 4, 0); // 0 no timeout, -1 block
         }
 
         if (pfds[0].revents & POLLIN) 
@@ -2641,7 +2927,7 @@ int main(int argc, char* argv[])
 		// 2. reverse order
 		// 3. dispatch every message with term->game->OnMessage()
 
-		if (server)
+		if (server && (pfds[3].revents & POLLIN))
 			server->Proc();
 
 		// render
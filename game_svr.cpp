@@ -1,12 +1,14 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include "terrain.h"
 #include "world.h"
 #include "render.h"
 #include "game.h"
 #include "network.h"
+#include "startup.h"
 
 #if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
 #ifdef __linux__
@@ -21,6 +23,11 @@
 #define TCP_NODELAY 1
 #endif
 
+// shards talk to each other over unix domain sockets
+#include <sys/un.h>
+#include <errno.h>
+#define SHARDING
+
 #else
 #define PATH_MAX 1024
 #endif
@@ -30,6 +37,173 @@ char base_path[1024] = "./";
 #define MAX_CLIENTS 50
 Server* server = 0; // this is to fullfil game.cpp externs!
 
+//////////////////////////////////////////////////////
+// SHARDING
+//
+// every server process owns a rectangle of the patch grid,
+// players crossing its edge are handed off (with their socket) to the owner
+// of the region they've entered, players walking near the edge are mirrored
+// to neighbours as 'ghosts' so clients can see across it.
+// player ids sent to clients are global: shard_self * MAX_CLIENTS + slot
+
+#define MAX_SHARDS 5 // MAX_SHARDS * MAX_CLIENTS must fit in rsp_join.maxcli
+#define MAX_GLOBAL (MAX_SHARDS * MAX_CLIENTS)
+#define SHARD_MARGIN (2 * VISUAL_CELLS) // width of boundary zone mirrored to neighbours
+#define SHARD_HYSTERESIS (VISUAL_CELLS / 2) // prevents ping-pong handoffs on the edge
+
+struct Shard
+{
+	int region[4]; // x0,y0,x1,y1 in patches (x1,y1 excluded)
+	char ipc_path[100];
+};
+
+// client pose upload tuning, sent to every joining client (STRUCT_RSP_TUNE)
+// lower rate / coarser quantization trades fidelity for capacity
+int pose_hz = 20;
+int pose_quant = 4; // 1/16 of visual cell
+int dir_quant = 2; // degrees
+
+// how long slot of a player who lost connection waits for STRUCT_REQ_RESUME
+// queued broadcasts are delivered on resume, so client sees no gap
+int resume_grace = 10000; // ms
+
+Shard shard[MAX_SHARDS];
+int shards = 1; // 1 means no sharding at all
+int shard_self = 0;
+int ipc_socket = -1;
+
+struct PlayerState
+{
+	float pos[3];
+	float dir;
+	int32_t am; // action / mount
+	int32_t sprite;
+	int32_t anim;
+	int32_t frame;
+	int32_t flags; // unspecified
+};
+
+#pragma pack(push,1)
+
+struct IPC_HANDOFF // socket fd is attached as SCM_RIGHTS
+{
+	uint8_t token; // 'H'
+	uint8_t pad;
+	uint16_t gid; // id at sender
+	char name[32];
+	PlayerState state;
+};
+
+struct IPC_GHOST
+{
+	uint8_t token; // 'G'
+	uint8_t pad;
+	uint16_t gid;
+	char name[32];
+	PlayerState state;
+};
+
+struct IPC_GHOST_EXIT
+{
+	uint8_t token; // 'g'
+	uint8_t pad;
+	uint16_t gid;
+};
+
+struct IPC_RESUME // socket fd is attached as SCM_RIGHTS
+{
+	uint8_t token; // 'R'
+	STRUCT_REQ_RESUME req; // came to wrong shard (all share listening port)
+};
+
+#pragma pack(pop)
+
+struct Ghost // neighbour's player near our edge
+{
+	bool present;
+	char name[32];
+	PlayerState state;
+};
+
+Ghost ghost[MAX_GLOBAL];
+RWLOCK_HANDLE* ghost_lock = 0;
+
+bool ShardContains(int s, const float pos[3], float margin)
+{
+	const int* r = shard[s].region;
+	return
+		pos[0] >= r[0] * VISUAL_CELLS - margin && pos[0] < r[2] * VISUAL_CELLS + margin &&
+		pos[1] >= r[1] * VISUAL_CELLS - margin && pos[1] < r[3] * VISUAL_CELLS + margin;
+}
+
+// returns shard which should take the player over or -1 if we keep it
+int ShardOwner(const float pos[3])
+{
+	if (shards < 2 || ShardContains(shard_self, pos, SHARD_HYSTERESIS))
+		return -1;
+
+	for (int s = 0; s < shards; s++)
+	{
+		if (s != shard_self && ShardContains(s, pos, 0))
+			return s;
+	}
+
+	return -1; // nobody's land, keep it
+}
+
+// must not be called with any lock held, it may block till neighbour drains its queue
+bool IPC_SEND(int to, const void* data, int size, int fd = -1)
+{
+#ifdef SHARDING
+	if (ipc_socket < 0)
+		return false;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, shard[to].ipc_path);
+
+	struct iovec iov;
+	iov.iov_base = (void*)data;
+	iov.iov_len = size;
+
+	union
+	{
+		struct cmsghdr hdr;
+		char space[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0)
+	{
+		memset(&ctrl, 0, sizeof(ctrl));
+		msg.msg_control = ctrl.space;
+		msg.msg_controllen = sizeof(ctrl.space);
+		struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	}
+
+	int w;
+	do w = (int)sendmsg(ipc_socket, &msg, 0);
+	while (w < 0 && errno == EINTR);
+
+	return w == size;
+#else
+	return false;
+#endif
+}
+
+//////////////////////////////////////////////////////
+
 void exit_handler(int)
 {
 }
@@ -60,6 +234,38 @@ void Server::Log(const char* str)
 {
 }
 
+uint32_t ServerStamp() // ms, for client side interpolation
+{
+	#ifdef _WIN32
+	return GetTickCount();
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	#endif
+}
+
+uint64_t ResumeToken() // unguessable, so nobody else can take a session over
+{
+	uint64_t t = 0;
+	#ifndef _WIN32
+	FILE* f = fopen("/dev/urandom", "rb");
+	if (f)
+	{
+		if (fread(&t, sizeof(t), 1, f) != 1)
+			t = 0;
+		fclose(f);
+	}
+	#endif
+	if (!t)
+	{
+		for (int i = 0; i < 4; i++)
+			t = (t << 16) ^ (uint64_t)rand();
+		t ^= (uint64_t)ServerStamp() << 24;
+	}
+	return t;
+}
+
 extern "C" void SHA1(void* data, int len, unsigned char digest[20]);
 
 int Base64Encode(unsigned char* data, int len, char* base64)
@@ -147,17 +353,26 @@ struct PlayerCon
 		TCP_CLOSE(s);
 	}
 
-	struct PlayerState
+	bool StartHandoff(TCP_SOCKET socket)
+	{
+		handoff_in = true;
+		return Start(socket);
+	}
+
+	bool StartForward(TCP_SOCKET socket, const STRUCT_REQ_RESUME* req)
 	{
-		float pos[3];
-		float dir;
-		int32_t am; // action / mount
-		int32_t sprite;
-		int32_t anim;
-		int32_t frame;
-		int32_t flags; // unspecified
-	};
+		forward_in = true;
+		forward_req = *req;
+		return Start(socket);
+	}
 
+	bool StartResume(TCP_SOCKET socket)
+	{
+		// rwlock and queued broadcasts survived detaching
+		resume_in = true;
+		client_socket = socket;
+		return THREAD_CREATE_DETACHED(Recv, this);
+	}
 
 	PlayerState player_state; // this player
 
@@ -171,12 +386,22 @@ struct PlayerCon
 
 	int broadcasts; // fuse
 
-	void Recv()
+	// sharding
+	bool handoff_in; // connection came from neighbour shard, already joined
+	int ghost_mask; // shards we're mirroring this player to
+	uint8_t known[(MAX_GLOBAL + 7) / 8]; // ids client has received 'j' for
+
+	// reconnection
+	uint64_t resume_token; // client must present it in STRUCT_REQ_RESUME
+	bool resume_in; // connection took this detached slot over
+	bool forward_in; // resume request forwarded by shard which accepted connection
+	STRUCT_REQ_RESUME forward_req;
+	bool detached; // socket lost, slot waits resume_grace ms for the client
+	bool overflow; // broadcasts were dropped, session can't be resumed
+	uint32_t detach_stamp;
+
+	bool Handshake()
 	{
-		int ID = (int)(this - players);
-		printf("CONNECTED ID: %d\n", ID);
-		uint8_t buf[2048]; // should be enough for any message size including talkboxes
-
 		// read /GET request with some headers, but ensure these: "Upgrade: WebSocket" and "Connection: Upgrade"
 		#if 0
 		"GET / HTTP/1.1"
@@ -318,8 +543,7 @@ struct PlayerCon
 		int ok = HTTP_READ(client_socket, Headers::cb, &headers, 0);
 		if (ok != 0 || (headers.parsed & 31) != 31)
 		{
-			Release();
-			return;
+			return false;
 		}
 
 		strcpy(headers.key + headers.keylen, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
@@ -344,12 +568,64 @@ struct PlayerCon
 		int w = TCP_WRITE(client_socket, (const uint8_t*)response_buf, response_len);
 		if (w <= 0)
 		{
-			Release();
-			return;
+			return false;
 		}
 
 		printf("------------- AFTER-SHAKE ----------------\n");
-		
+		return true;
+	}
+
+	void Recv()
+	{
+		int ID = (int)(this - players);
+		uint8_t buf[2048]; // should be enough for any message size including talkboxes
+
+		if (resume_in)
+		{
+			printf("RESUMED ID: %d\n", ID);
+			resume_in = false;
+
+			if (!Resume())
+			{
+				Lost();
+				return;
+			}
+		}
+		else
+		if (forward_in)
+		{
+			printf("FORWARDED ID: %d\n", ID);
+			forward_in = false;
+
+			STRUCT_REQ_RESUME req = forward_req;
+			if (!ResumeSession(&req))
+				return;
+		}
+		else
+		if (handoff_in)
+		{
+			printf("HANDED-IN ID: %d\n", ID);
+
+			char name[32];
+			strcpy(name, player_name);
+			PlayerState state = player_state;
+
+			if (!Join(name, &state))
+			{
+				Lost();
+				return;
+			}
+		}
+		else
+		{
+			printf("CONNECTED ID: %d\n", ID);
+			if (!Handshake())
+			{
+				Release();
+				return;
+			}
+		}
+
 		while (1)
 		{
 			int type = 0;
@@ -386,13 +662,24 @@ struct PlayerCon
 						return;
 					}
 
+					// clients throttle poses (and skip them when idle),
+					// lag probes keep broadcasts flowing
+					RWLOCK_WRITE_LOCK(rwlock);
+					if (!Flush())
+					{
+						RWLOCK_WRITE_UNLOCK(rwlock);
+						Lost();
+						return;
+					}
+					RWLOCK_WRITE_UNLOCK(rwlock);
+
 					STRUCT_RSP_LAG rsp_lag = *(STRUCT_RSP_LAG*)buf;
 					rsp_lag.token = 'l';
 
 					size = WS_WRITE(client_socket, (uint8_t*)&rsp_lag, sizeof(STRUCT_RSP_LAG), 0, 0x2);
 					if (size <= 0)
 					{
-						Release();
+						Lost();
 						return;
 					}					
 
@@ -404,35 +691,13 @@ struct PlayerCon
 					RWLOCK_WRITE_LOCK(rwlock);
 
 					// handle broadcasts first !
-					int num = 0;
-					while (head)
+					if (!Flush())
 					{
-						BroadCast* n = head->next[ID];
-
-						int w = WS_WRITE(client_socket, (uint8_t*)(head + 1), head->size, 0, 0x2);
-						if (w <= 0)
-						{
-							RWLOCK_WRITE_UNLOCK(rwlock);
-							Release();
-							return;
-						}
-
-						head->next[ID] = 0;
-						if (INTERLOCKED_DEC(&head->refs) == 0)
-							free(head);
-
-						head = n;
-						num++;
+						RWLOCK_WRITE_UNLOCK(rwlock);
+						Lost();
+						return;
 					}
 
-					assert(num == broadcasts);
-
-					tail = 0;
-					broadcasts = 0;
-					
-					//if (num)
-					//	printf("ID:%d processed %d broadcasts\n", ID, num);
-
 					STRUCT_REQ_POSE* req_pose = (STRUCT_REQ_POSE*)buf;
 					if (size != sizeof(STRUCT_REQ_POSE))
 					{
@@ -470,7 +735,7 @@ struct PlayerCon
 
 						broadcast->size = sizeof(STRUCT_BRC_POSE);
 						broadcast->token = 'p';
-						broadcast->id = ID;
+						broadcast->id = GlobalID();
 						broadcast->pos[0] = player_state.pos[0];
 						broadcast->pos[1] = player_state.pos[1];
 						broadcast->pos[2] = player_state.pos[2];
@@ -479,8 +744,19 @@ struct PlayerCon
 						broadcast->sprite = player_state.sprite;
 						broadcast->anim = player_state.anim;
 						broadcast->frame = player_state.frame;
+						broadcast->stamp = ServerStamp();
 
 						broadcast->Send(ID);
+
+						Mirror();
+
+						// walked into neighbour's region?
+						int owner = ShardOwner(player_state.pos);
+						if (owner >= 0)
+						{
+							Handoff(owner);
+							return;
+						}
 					}
 					else
 						RWLOCK_WRITE_UNLOCK(rwlock);
@@ -502,103 +778,26 @@ struct PlayerCon
 						return;
 					}
 
-					RWLOCK_READ_LOCK(cs);
-
-					RWLOCK_WRITE_LOCK(rwlock);
-					strcpy(player_name, req_join->name);
-					joined = true;
-					has_state = false;
-					player_state.am = 0;
-					player_state.anim = 0;
-					player_state.dir = 0;
-					player_state.flags = 0;
-					player_state.sprite = 0;
-					player_state.pos[0] = 0;
-					player_state.pos[1] = 0;
-					player_state.pos[2] = -1000;
-					RWLOCK_WRITE_UNLOCK(rwlock);
-
-					STRUCT_RSP_JOIN rsp_join = { 0 };
-					rsp_join.token = 'j';
-					rsp_join.maxcli = MAX_CLIENTS;
-					rsp_join.id = ID;
-
-					size = WS_WRITE(client_socket, (uint8_t*)&rsp_join, sizeof(STRUCT_RSP_JOIN), 0, 0x2);
-					if (size <= 0)
+					if (!Join(req_join->name, 0))
 					{
-						RWLOCK_READ_UNLOCK(cs);
-						Release();
+						Lost();
 						return;
 					}
 
-					// for all clients emu join
-					STRUCT_BRC_JOIN brc_join = { 0 };
-					brc_join.token = 'j';
-					for (int i = 0; i < clients; i++)
-					{
-						int id = client_id[i];
-						if (id == ID)
-							continue;
-
-						PlayerCon* con = players + id;
+					break;
+				}
 
-						// newly created client (not joined yet)
-						// must be excluded !!!
-						if (!con->joined)
-						{
-							printf("!con->joined in Recv()\n");
-							continue;
-						}
-							
-						RWLOCK_READ_LOCK(con->rwlock);
-						brc_join.anim = con->player_state.anim;
-						brc_join.frame = con->player_state.frame;
-						brc_join.am = con->player_state.am;
-						brc_join.pos[0] = con->player_state.pos[0];
-						brc_join.pos[1] = con->player_state.pos[1];
-						brc_join.pos[2] = con->player_state.pos[2];
-						brc_join.dir = con->player_state.dir;
-						brc_join.sprite = con->player_state.sprite;
-						strcpy(brc_join.name, con->player_name);
-						RWLOCK_READ_UNLOCK(con->rwlock);
-						brc_join.id = id;
-						brc_join.name[30] = 0;
-						brc_join.name[31] = 0;
-
-						size = WS_WRITE(client_socket, (uint8_t*)&brc_join, sizeof(STRUCT_BRC_JOIN), 0, 0x2);
-						if (size <= 0)
-						{
-							RWLOCK_READ_UNLOCK(cs);
-							Release();
-							return;
-						}
+				case 'R':
+				{
+					STRUCT_REQ_RESUME* req_resume = (STRUCT_REQ_RESUME*)buf;
+					if (joined || size != sizeof(STRUCT_REQ_RESUME) || req_resume->name[30] != 0)
+					{
+						Release();
+						return;
 					}
 
-					RWLOCK_READ_UNLOCK(cs);
-
-
-					printf("%s joined with ID:%d\n", player_name, ID);
-
-					// notify others (our socket can be broken but that's fine
-					struct ExitBroadCast : BroadCast, STRUCT_BRC_JOIN {} *broadcast =
-						(ExitBroadCast*)malloc(sizeof(ExitBroadCast));
-					broadcast->size = sizeof(STRUCT_BRC_JOIN);
-					broadcast->token = 'j';
-
-					broadcast->anim = 0;
-					broadcast->frame = 0;
-					broadcast->am = 0;
-					broadcast->pos[0] = 0;
-					broadcast->pos[1] = 0;
-					broadcast->pos[2] = -1000; // hide under water :)
-					broadcast->dir = 0;
-					broadcast->sprite = 0;
-
-					broadcast->id = ID;
-					strcpy(broadcast->name, player_name);
-					broadcast->name[30] = 0;
-					broadcast->name[31] = 0;
-					broadcast->Send(ID);
+					if (!ResumeSession(req_resume))
+						return;
 
 					break;
 				}
@@ -618,7 +817,7 @@ struct PlayerCon
 					broadcast->token = 't';
 
 					broadcast->len = req_talk->len;
-					broadcast->id = ID;
+					broadcast->id = GlobalID();
 					memcpy(broadcast->str, req_talk->str, req_talk->len);
 					broadcast->Send(ID);
 
@@ -637,6 +836,474 @@ struct PlayerCon
 			}
 		}
 
+		Lost();
+	}
+
+	int GlobalID()
+	{
+		return shard_self * MAX_CLIENTS + (int)(this - players);
+	}
+
+	void SetKnown(int gid, bool known_flag)
+	{
+		if (known_flag)
+			known[gid >> 3] |= 1 << (gid & 7);
+		else
+			known[gid >> 3] &= ~(1 << (gid & 7));
+	}
+
+	// sends all queued broadcasts, rwlock must be held
+	bool Flush()
+	{
+		int ID = (int)(this - players);
+		int num = 0;
+		while (head)
+		{
+			BroadCast* n = head->next[ID];
+
+			int w = WS_WRITE(client_socket, (uint8_t*)(head + 1), head->size, 0, 0x2);
+			if (w <= 0)
+				return false;
+
+			// track what client knows about, needed for handoff
+			uint8_t token = *(uint8_t*)(head + 1);
+			if (token == 'j')
+				SetKnown(((STRUCT_BRC_JOIN*)(head + 1))->id, true);
+			else
+			if (token == 'e')
+				SetKnown(((STRUCT_BRC_EXIT*)(head + 1))->id, false);
+
+			head->next[ID] = 0;
+			if (INTERLOCKED_DEC(&head->refs) == 0)
+				free(head);
+
+			head = n;
+			num++;
+		}
+
+		assert(num == broadcasts);
+
+		tail = 0;
+		broadcasts = 0;
+
+		//if (num)
+		//	printf("ID:%d processed %d broadcasts\n", ID, num);
+
+		return true;
+	}
+
+	// rsp_join followed by rsp_tune
+	bool Greet(bool resumed)
+	{
+		STRUCT_RSP_JOIN rsp_join = { 0 };
+		rsp_join.token = 'j';
+		rsp_join.maxcli = shards * MAX_CLIENTS;
+		rsp_join.id = GlobalID();
+		rsp_join.resumed = resumed ? 1 : 0;
+		rsp_join.resume = resume_token;
+
+		int size = WS_WRITE(client_socket, (uint8_t*)&rsp_join, sizeof(STRUCT_RSP_JOIN), 0, 0x2);
+		if (size <= 0)
+			return false;
+
+		STRUCT_RSP_TUNE rsp_tune = { 0 };
+		rsp_tune.token = 'c';
+		rsp_tune.pose_hz = pose_hz;
+		rsp_tune.pose_quant = pose_quant;
+		rsp_tune.dir_quant = dir_quant;
+
+		size = WS_WRITE(client_socket, (uint8_t*)&rsp_tune, sizeof(STRUCT_RSP_TUNE), 0, 0x2);
+		return size > 0;
+	}
+
+	// handed in client carries on, it only learns its id and resume token here
+	bool Rehome()
+	{
+		STRUCT_RSP_SESSION rsp_session = { 0 };
+		rsp_session.token = 's';
+		rsp_session.maxcli = shards * MAX_CLIENTS;
+		rsp_session.id = GlobalID();
+		rsp_session.resume = resume_token;
+
+		int size = WS_WRITE(client_socket, (uint8_t*)&rsp_session, sizeof(STRUCT_RSP_SESSION), 0, 0x2);
+		return size > 0;
+	}
+
+	// client came back, deliver everything it has missed
+	bool Resume()
+	{
+		if (!Greet(true))
+			return false;
+
+		RWLOCK_WRITE_LOCK(rwlock);
+		bool ok = Flush();
+		RWLOCK_WRITE_UNLOCK(rwlock);
+		return ok;
+	}
+
+	// socket error, joined player keeps its slot and broadcasts queue up
+	// till it resumes or Reaper() expires it
+	void Lost()
+	{
+		if (!joined)
+		{
+			Release();
+			return;
+		}
+
+		RWLOCK_WRITE_LOCK(cs);
+		if (client_socket != INVALID_TCP_SOCKET)
+		{
+			TCP_CLOSE(client_socket);
+			client_socket = INVALID_TCP_SOCKET;
+		}
+		detach_stamp = ServerStamp();
+		detached = true;
+		RWLOCK_WRITE_UNLOCK(cs);
+
+		printf("DETACHED ID: %d\n", GlobalID());
+	}
+
+	// 'R' from not joined connection, false if this one is done (socket went elsewhere or lost)
+	bool ResumeSession(const STRUCT_REQ_RESUME* req)
+	{
+		// listening port is shared, pass socket to shard keeping the session
+		// otherwise its detached slot would linger there as frozen duplicate
+		int owner = req->id / MAX_CLIENTS;
+		if (owner != shard_self && owner < shards)
+		{
+			IPC_RESUME msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.token = 'R';
+			msg.req = *req;
+
+			if (IPC_SEND(owner, &msg, sizeof(msg), client_socket))
+			{
+				printf("RESUME ID: %d -> SHARD: %d\n", (int)req->id, owner);
+
+				// closing our descriptor doesn't affect one passed to owner
+				Release();
+				return false;
+			}
+
+			// owner is unreachable, its session too, join here
+			printf("RESUME ID: %d -> SHARD: %d FAILED\n", (int)req->id, owner);
+		}
+
+		// old connection may be still alive for us (half-open), give it a moment
+		PlayerCon* con = 0;
+		for (int retry = 0; retry < 20 && Reattach(req, &con) < 0; retry++)
+			THREAD_SLEEP(50);
+
+		if (con)
+		{
+			// our socket goes to resumed slot, this one is done
+			TCP_SOCKET s = client_socket;
+			client_socket = INVALID_TCP_SOCKET;
+			Release();
+
+			if (!con->StartResume(s))
+			{
+				con->client_socket = INVALID_TCP_SOCKET;
+				TCP_CLOSE(s);
+				con->Release();
+			}
+			return false;
+		}
+
+		// session is gone, start over
+		if (!Join(req->name, 0))
+		{
+			Lost();
+			return false;
+		}
+
+		return true;
+	}
+
+	// returns 1 and detached slot in *ret if client can continue its session
+	// 0 if there's nothing to resume, -1 if old connection is still alive (it gets kicked)
+	static int Reattach(const STRUCT_REQ_RESUME* req, PlayerCon** ret)
+	{
+		*ret = 0;
+		int id = req->id - shard_self * MAX_CLIENTS;
+		if (id < 0 || id >= MAX_CLIENTS)
+			return 0; // other shard's or garbage
+
+		PlayerCon* con = players + id;
+		int result = 0;
+		bool expire = false;
+
+		RWLOCK_WRITE_LOCK(cs);
+		if (con->joined && con->resume_token == req->resume && strcmp(con->player_name, req->name) == 0)
+		{
+			if (!con->detached)
+			{
+				// client noticed connection loss before we did
+				if (con->client_socket != INVALID_TCP_SOCKET)
+					shutdown(con->client_socket, 2 /*both ways*/);
+				result = -1;
+			}
+			else
+			{
+				con->detached = false; // Reaper won't touch it anymore
+				if (con->overflow)
+					expire = true;
+				else
+				{
+					*ret = con;
+					result = 1;
+				}
+			}
+		}
+		RWLOCK_WRITE_UNLOCK(cs);
+
+		// others must get 'e' before 'j' of fresh session
+		if (expire)
+			con->Release();
+
+		return result;
+	}
+
+	// state==0: fresh client, respond with id, hide player till first pose
+	// state!=0: handed off by neighbour shard, client is already connected
+	bool Join(const char* name, const PlayerState* state)
+	{
+		int ID = (int)(this - players);
+		int size;
+
+		// ghost_lock first, IPC thread broadcasts ghosts with ghost_lock held
+		RWLOCK_READ_LOCK(ghost_lock);
+		RWLOCK_READ_LOCK(cs);
+
+		RWLOCK_WRITE_LOCK(rwlock);
+		strcpy(player_name, name);
+		joined = true;
+		resume_token = ResumeToken();
+		memset(known, 0, sizeof(known));
+		ghost_mask = 0;
+		if (state)
+		{
+			has_state = true;
+			player_state = *state;
+		}
+		else
+		{
+			has_state = false;
+			player_state.am = 0;
+			player_state.anim = 0;
+			player_state.dir = 0;
+			player_state.flags = 0;
+			player_state.sprite = 0;
+			player_state.pos[0] = 0;
+			player_state.pos[1] = 0;
+			player_state.pos[2] = -1000;
+		}
+		RWLOCK_WRITE_UNLOCK(rwlock);
+
+		if (state ? !Rehome() : !Greet(false))
+		{
+			RWLOCK_READ_UNLOCK(cs);
+			RWLOCK_READ_UNLOCK(ghost_lock);
+			return false;
+		}
+
+		// for all clients emu join
+		STRUCT_BRC_JOIN brc_join = { 0 };
+		brc_join.token = 'j';
+		for (int i = 0; i < clients; i++)
+		{
+			int id = client_id[i];
+			if (id == ID)
+				continue;
+
+			PlayerCon* con = players + id;
+
+			// newly created client (not joined yet)
+			// must be excluded !!!
+			if (!con->joined)
+			{
+				printf("!con->joined in Recv()\n");
+				continue;
+			}
+
+			RWLOCK_READ_LOCK(con->rwlock);
+			brc_join.anim = con->player_state.anim;
+			brc_join.frame = con->player_state.frame;
+			brc_join.am = con->player_state.am;
+			brc_join.pos[0] = con->player_state.pos[0];
+			brc_join.pos[1] = con->player_state.pos[1];
+			brc_join.pos[2] = con->player_state.pos[2];
+			brc_join.dir = con->player_state.dir;
+			brc_join.sprite = con->player_state.sprite;
+			strcpy(brc_join.name, con->player_name);
+			RWLOCK_READ_UNLOCK(con->rwlock);
+			brc_join.id = con->GlobalID();
+			brc_join.name[30] = 0;
+			brc_join.name[31] = 0;
+
+			size = WS_WRITE(client_socket, (uint8_t*)&brc_join, sizeof(STRUCT_BRC_JOIN), 0, 0x2);
+			if (size <= 0)
+			{
+				RWLOCK_READ_UNLOCK(cs);
+				RWLOCK_READ_UNLOCK(ghost_lock);
+				return false;
+			}
+
+			SetKnown(brc_join.id, true);
+		}
+
+		// and for all neighbours' players near our edges
+		for (int id = 0; id < shards * MAX_CLIENTS; id++)
+		{
+			Ghost* g = ghost + id;
+			if (!g->present)
+				continue;
+
+			brc_join.anim = g->state.anim;
+			brc_join.frame = g->state.frame;
+			brc_join.am = g->state.am;
+			brc_join.pos[0] = g->state.pos[0];
+			brc_join.pos[1] = g->state.pos[1];
+			brc_join.pos[2] = g->state.pos[2];
+			brc_join.dir = g->state.dir;
+			brc_join.sprite = g->state.sprite;
+			strcpy(brc_join.name, g->name);
+			brc_join.id = id;
+			brc_join.name[30] = 0;
+			brc_join.name[31] = 0;
+
+			size = WS_WRITE(client_socket, (uint8_t*)&brc_join, sizeof(STRUCT_BRC_JOIN), 0, 0x2);
+			if (size <= 0)
+			{
+				RWLOCK_READ_UNLOCK(cs);
+				RWLOCK_READ_UNLOCK(ghost_lock);
+				return false;
+			}
+
+			SetKnown(id, true);
+		}
+
+		RWLOCK_READ_UNLOCK(cs);
+		RWLOCK_READ_UNLOCK(ghost_lock);
+
+		printf("%s joined with ID:%d\n", player_name, GlobalID());
+
+		// notify others (our socket can be broken but that's fine
+		struct JoinBroadCast : BroadCast, STRUCT_BRC_JOIN {} *broadcast =
+			(JoinBroadCast*)malloc(sizeof(JoinBroadCast));
+		broadcast->size = sizeof(STRUCT_BRC_JOIN);
+		broadcast->token = 'j';
+
+		broadcast->anim = player_state.anim;
+		broadcast->frame = player_state.frame;
+		broadcast->am = player_state.am;
+		broadcast->pos[0] = player_state.pos[0];
+		broadcast->pos[1] = player_state.pos[1];
+		broadcast->pos[2] = player_state.pos[2]; // -1000 hides fresh ones under water :)
+		broadcast->dir = player_state.dir;
+		broadcast->sprite = player_state.sprite;
+
+		broadcast->id = GlobalID();
+		strcpy(broadcast->name, player_name);
+		broadcast->name[30] = 0;
+		broadcast->name[31] = 0;
+		broadcast->Send(ID);
+
+		if (state)
+			Mirror();
+
+		return true;
+	}
+
+	// update ghosts of this player on neighbour shards
+	void Mirror()
+	{
+		if (shards < 2)
+			return;
+
+		for (int s = 0; s < shards; s++)
+		{
+			if (s == shard_self)
+				continue;
+
+			int bit = 1 << s;
+			if (ShardContains(s, player_state.pos, SHARD_MARGIN))
+			{
+				IPC_GHOST msg = { 0 };
+				msg.token = 'G';
+				msg.gid = GlobalID();
+				strcpy(msg.name, player_name);
+				msg.state = player_state;
+				if (IPC_SEND(s, &msg, sizeof(msg)))
+					ghost_mask |= bit;
+			}
+			else
+			if (ghost_mask & bit)
+			{
+				IPC_GHOST_EXIT msg = { 0 };
+				msg.token = 'g';
+				msg.gid = GlobalID();
+				IPC_SEND(s, &msg, sizeof(msg));
+				ghost_mask &= ~bit;
+			}
+		}
+	}
+
+	void Unmirror()
+	{
+		for (int s = 0; s < shards; s++)
+		{
+			if (ghost_mask & (1 << s))
+			{
+				IPC_GHOST_EXIT msg = { 0 };
+				msg.token = 'g';
+				msg.gid = GlobalID();
+				IPC_SEND(s, &msg, sizeof(msg));
+			}
+		}
+		ghost_mask = 0;
+	}
+
+	// passes client socket to shard 'owner', always ends with Release()
+	void Handoff(int owner)
+	{
+		// deliver everything queued, so we know exactly what client knows about
+		RWLOCK_WRITE_LOCK(rwlock);
+		bool ok = Flush();
+		RWLOCK_WRITE_UNLOCK(rwlock);
+
+		// make client forget everyone from here, owner will flood it with its own
+		STRUCT_BRC_EXIT brc_exit = { 0 };
+		brc_exit.token = 'e';
+		for (int id = 0; ok && id < MAX_GLOBAL; id++)
+		{
+			if (known[id >> 3] & (1 << (id & 7)))
+			{
+				brc_exit.id = id;
+				ok = WS_WRITE(client_socket, (uint8_t*)&brc_exit, sizeof(STRUCT_BRC_EXIT), 0, 0x2) > 0;
+				SetKnown(id, false);
+			}
+		}
+
+		// owner drops its ghost of us before getting real one
+		Unmirror();
+
+		if (ok)
+		{
+			IPC_HANDOFF msg = { 0 };
+			msg.token = 'H';
+			msg.gid = GlobalID();
+			strcpy(msg.name, player_name);
+			msg.state = player_state;
+
+			if (IPC_SEND(owner, &msg, sizeof(msg), client_socket))
+				printf("HANDOFF ID: %d -> SHARD: %d\n", GlobalID(), owner);
+			else
+				printf("HANDOFF ID: %d -> SHARD: %d FAILED\n", GlobalID(), owner);
+		}
+
+		// closing our descriptor doesn't affect one passed to owner
 		Release();
 	}
 
@@ -675,6 +1342,9 @@ struct PlayerCon
 
 	void Release()
 	{
+		// neighbours must drop our ghosts, do it before locking (may block)
+		Unmirror();
+
 		// remove as soon as possible
 		RWLOCK_WRITE_LOCK(cs); 
 
@@ -693,7 +1363,7 @@ struct PlayerCon
 				(ExitBroadCast*)malloc(sizeof(ExitBroadCast));
 			broadcast->size = sizeof(STRUCT_BRC_EXIT);
 			broadcast->token = 'e';
-			broadcast->id = ID;
+			broadcast->id = GlobalID();
 			broadcast->Send(ID, true /* cs_already_locked */);
 		}
 
@@ -707,6 +1377,11 @@ struct PlayerCon
 
 		joined = false;
 		has_state = false;
+		handoff_in = false;
+		resume_in = false;
+		forward_in = false;
+		detached = false;
+		overflow = false;
 		// remove broadcasts
 		while (head)
 		{
@@ -764,7 +1439,8 @@ void BroadCast::Send(int id_from, bool cs_already_locked)
 		{
 			if (con->broadcasts >= 100 * MAX_CLIENTS) // 5000 broadcasts awaiting (looks like client can't handle it)
 			{
-				if (con->client_socket)
+				con->overflow = true; // it'd miss something, no resume
+				if (con->client_socket != INVALID_TCP_SOCKET)
 				{
 					// nasty!
 					TCP_CLOSE(con->client_socket);
@@ -802,6 +1478,252 @@ PlayerCon PlayerCon::players[MAX_CLIENTS];
 
 volatile bool isRunning = true;
 
+#ifdef SHARDING
+void* IPC_Recv(void*)
+{
+	uint8_t buf[256];
+
+	while (isRunning)
+	{
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+
+		union
+		{
+			struct cmsghdr hdr;
+			char space[CMSG_SPACE(sizeof(int))];
+		} ctrl;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl.space;
+		msg.msg_controllen = sizeof(ctrl.space);
+
+		int size = (int)recvmsg(ipc_socket, &msg, 0);
+		if (size <= 0)
+		{
+			if (size < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		int fd = -1;
+		struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+		if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(c), sizeof(int));
+
+		switch (buf[0])
+		{
+			case 'H':
+			{
+				IPC_HANDOFF* handoff = (IPC_HANDOFF*)buf;
+				if (size != sizeof(IPC_HANDOFF) || fd < 0)
+					break;
+
+				handoff->name[31] = 0;
+
+				PlayerCon* con = PlayerCon::Aquire();
+				if (!con)
+				{
+					// we're full, sorry
+					TCP_CLOSE(fd);
+					fd = -1;
+					break;
+				}
+
+				strcpy(con->player_name, handoff->name);
+				con->player_state = handoff->state;
+
+				if (!con->StartHandoff(fd))
+				{
+					TCP_CLOSE(fd);
+					con->client_socket = INVALID_TCP_SOCKET;
+					con->Release();
+				}
+
+				fd = -1;
+				break;
+			}
+
+			case 'R':
+			{
+				IPC_RESUME* resume = (IPC_RESUME*)buf;
+				if (size != sizeof(IPC_RESUME) || fd < 0)
+					break;
+
+				resume->req.name[30] = 0;
+
+				// temporary slot, it resumes session (or joins if session is gone)
+				PlayerCon* con = PlayerCon::Aquire();
+				if (!con)
+				{
+					TCP_CLOSE(fd);
+					fd = -1;
+					break;
+				}
+
+				if (!con->StartForward(fd, &resume->req))
+				{
+					TCP_CLOSE(fd);
+					con->client_socket = INVALID_TCP_SOCKET;
+					con->Release();
+				}
+
+				fd = -1;
+				break;
+			}
+
+			case 'G':
+			{
+				IPC_GHOST* pose = (IPC_GHOST*)buf;
+				if (size != sizeof(IPC_GHOST) || pose->gid >= shards * MAX_CLIENTS ||
+					pose->gid / MAX_CLIENTS == shard_self)
+					break;
+
+				pose->name[31] = 0;
+
+				RWLOCK_WRITE_LOCK(ghost_lock);
+				Ghost* g = ghost + pose->gid;
+				g->state = pose->state;
+
+				if (!g->present)
+				{
+					g->present = true;
+					strcpy(g->name, pose->name);
+
+					struct JoinBroadCast : BroadCast, STRUCT_BRC_JOIN {} *broadcast =
+						(JoinBroadCast*)malloc(sizeof(JoinBroadCast));
+					broadcast->size = sizeof(STRUCT_BRC_JOIN);
+					broadcast->token = 'j';
+					broadcast->anim = g->state.anim;
+					broadcast->frame = g->state.frame;
+					broadcast->am = g->state.am;
+					broadcast->pos[0] = g->state.pos[0];
+					broadcast->pos[1] = g->state.pos[1];
+					broadcast->pos[2] = g->state.pos[2];
+					broadcast->dir = g->state.dir;
+					broadcast->sprite = g->state.sprite;
+					broadcast->id = pose->gid;
+					strcpy(broadcast->name, g->name);
+					broadcast->name[30] = 0;
+					broadcast->name[31] = 0;
+					broadcast->Send(-1);
+				}
+				else
+				{
+					struct PoseBroadCast : BroadCast, STRUCT_BRC_POSE {} *broadcast =
+						(PoseBroadCast*)malloc(sizeof(PoseBroadCast));
+					broadcast->size = sizeof(STRUCT_BRC_POSE);
+					broadcast->token = 'p';
+					broadcast->id = pose->gid;
+					broadcast->pos[0] = g->state.pos[0];
+					broadcast->pos[1] = g->state.pos[1];
+					broadcast->pos[2] = g->state.pos[2];
+					broadcast->dir = g->state.dir;
+					broadcast->am = g->state.am;
+					broadcast->sprite = g->state.sprite;
+					broadcast->anim = g->state.anim;
+					broadcast->frame = g->state.frame;
+					broadcast->stamp = ServerStamp();
+					broadcast->Send(-1);
+				}
+				RWLOCK_WRITE_UNLOCK(ghost_lock);
+				break;
+			}
+
+			case 'g':
+			{
+				IPC_GHOST_EXIT* leave = (IPC_GHOST_EXIT*)buf;
+				if (size != sizeof(IPC_GHOST_EXIT) || leave->gid >= shards * MAX_CLIENTS)
+					break;
+
+				RWLOCK_WRITE_LOCK(ghost_lock);
+				Ghost* g = ghost + leave->gid;
+				if (g->present)
+				{
+					g->present = false;
+
+					struct ExitBroadCast : BroadCast, STRUCT_BRC_EXIT {} *broadcast =
+						(ExitBroadCast*)malloc(sizeof(ExitBroadCast));
+					broadcast->size = sizeof(STRUCT_BRC_EXIT);
+					broadcast->token = 'e';
+					broadcast->id = leave->gid;
+					broadcast->Send(-1);
+				}
+				RWLOCK_WRITE_UNLOCK(ghost_lock);
+				break;
+			}
+		}
+
+		// unexpected descriptor
+		if (fd >= 0)
+			TCP_CLOSE(fd);
+	}
+
+	return 0;
+}
+
+bool IPC_Start()
+{
+	ipc_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ipc_socket < 0)
+		return false;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, shard[shard_self].ipc_path);
+	unlink(addr.sun_path);
+
+	if (bind(ipc_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(ipc_socket);
+		ipc_socket = -1;
+		return false;
+	}
+
+	return THREAD_CREATE_DETACHED(IPC_Recv, 0);
+}
+#endif
+
+// expires detached players who didn't come back in time
+void* Reaper(void*)
+{
+	while (isRunning)
+	{
+		THREAD_SLEEP(500);
+		uint32_t now = ServerStamp();
+
+		while (1)
+		{
+			PlayerCon* expired = 0;
+
+			RWLOCK_WRITE_LOCK(PlayerCon::cs);
+			for (int i = 0; i < PlayerCon::clients && !expired; i++)
+			{
+				PlayerCon* con = PlayerCon::players + PlayerCon::client_id[i];
+				if (con->detached && (con->overflow || (int)(now - con->detach_stamp) > resume_grace))
+				{
+					con->detached = false; // ours now
+					expired = con;
+				}
+			}
+			RWLOCK_WRITE_UNLOCK(PlayerCon::cs);
+
+			if (!expired)
+				break;
+
+			printf("EXPIRED ID: %d\n", expired->GlobalID());
+			expired->Release();
+		}
+	}
+
+	return 0;
+}
+
 int ServerLoop(const char* port)
 {
 	int iResult;
@@ -880,6 +1802,29 @@ int ServerLoop(const char* port)
 
 	PlayerCon::cs = RWLOCK_CREATE();
 
+	memset(ghost, 0, sizeof(ghost));
+	ghost_lock = RWLOCK_CREATE();
+
+	#ifdef SHARDING
+	if (shards > 1)
+	{
+		if (!IPC_Start())
+		{
+			printf("can't bind shard socket: %s\n", shard[shard_self].ipc_path);
+			TCP_CLOSE(ListenSocket);
+			RWLOCK_DELETE(PlayerCon::cs);
+			RWLOCK_DELETE(ghost_lock);
+			TCP_CLEANUP();
+			return 1;
+		}
+
+		const int* r = shard[shard_self].region;
+		printf("SHARD %d/%d owns patches [%d,%d]-[%d,%d)\n", shard_self, shards, r[0], r[1], r[2], r[3]);
+	}
+	#endif
+
+	THREAD_HANDLE* reaper = THREAD_CREATE(Reaper, 0);
+
 	printf("SERVER awaits connections on port: %s\n", port);
 
 	while (isRunning)
@@ -928,6 +1873,10 @@ int ServerLoop(const char* port)
 
 	TCP_CLOSE(ListenSocket);
 
+	isRunning = false;
+	if (reaper)
+		THREAD_JOIN(reaper);
+
 	for (int i = 0; i < PlayerCon::clients; i++)
 	{
 		int id = PlayerCon::client_id[i];
@@ -937,6 +1886,16 @@ int ServerLoop(const char* port)
 
 	RWLOCK_DELETE(PlayerCon::cs);
 
+	#ifdef SHARDING
+	if (ipc_socket >= 0)
+	{
+		// IPC thread leaves on socket error, ghost_lock stays alive for it
+		shutdown(ipc_socket, SHUT_RDWR);
+		close(ipc_socket);
+		unlink(shard[shard_self].ipc_path);
+	}
+	#endif
+
 	TCP_CLEANUP();
 
 	return 0;
@@ -1013,67 +1972,72 @@ int main(int argc, char* argv[])
     printf("exec path: %s\n", argv[0]);
     printf("BASE PATH: %s\n", base_path);
 
-	
-	LoadSprites();
-
-	char a3d_path[1024];
-	sprintf(a3d_path,"%sa3d/game_map_y8.a3d", base_path);
-	FILE* f = fopen(a3d_path, "rb");
-
-	if (f)
+	// pose tuning: server --pose <hz>,<quant>,<dir_quant>
+	for (int a = 1; a + 1 < argc; a++)
 	{
-		terrain = LoadTerrain(f);
-
-		if (terrain)
+		if (strcmp(argv[a], "--pose") == 0)
 		{
-			for (int i = 0; i < 256; i++)
-			{
-				if (fread(mat[i].shade, 1, sizeof(MatCell) * 4 * 16, f) != sizeof(MatCell) * 4 * 16)
-					break;
-			}
+			sscanf(argv[a + 1], "%d,%d,%d", &pose_hz, &pose_quant, &dir_quant);
+			if (pose_hz < 1) pose_hz = 1;
+			if (pose_hz > 255) pose_hz = 255;
+			if (pose_quant < 0) pose_quant = 0;
+			if (pose_quant > 255) pose_quant = 255;
+			if (dir_quant < 0) dir_quant = 0;
+			if (dir_quant > 255) dir_quant = 255;
+		}
+	}
 
-			world = LoadWorld(f, false);
-			if (world)
-			{
-				// reload meshes too
-				Mesh* m = GetFirstMesh(world);
+	// sharding: server --shard <self> <x0,y0,x1,y1> <x0,y0,x1,y1> ...
+	// regions of all shards (in patches) listed in shard index order,
+	// all shards share listening port (SO_REUSEPORT) and hand players off
+	for (int a = 1; a < argc; a++)
+	{
+		if (strcmp(argv[a], "--shard") != 0 || a + 1 >= argc)
+			continue;
 
-				while (m)
-				{
-					char mesh_name[256];
-					GetMeshName(m, mesh_name, 256);
-					char obj_path[4096];
-					sprintf(obj_path, "%smeshes/%s", base_path, mesh_name);
-					if (!UpdateMesh(m, obj_path))
-					{
-						// what now?
-						// missing mesh file!
-					}
+		shard_self = atoi(argv[++a]);
+		shards = 0;
+		while (a + 1 < argc && shards < MAX_SHARDS)
+		{
+			int* r = shard[shards].region;
+			if (sscanf(argv[a + 1], "%d,%d,%d,%d", r + 0, r + 1, r + 2, r + 3) != 4)
+				break;
+			sprintf(shard[shards].ipc_path, "/tmp/asciicker_shard_%d.sock", shards);
+			shards++;
+			a++;
+		}
 
-					m = GetNextMesh(m);
-				}
-			}
+		if (shard_self < 0 || shard_self >= shards)
+		{
+			printf("invalid shard configuration\n");
+			return -1;
 		}
+	}
 
-		fclose(f);
+	// print startup timeline: server --trace
+	bool trace = false;
+	for (int a = 1; a < argc; a++)
+	{
+		if (strcmp(argv[a], "--trace") == 0)
+			trace = true;
 	}
 
+	// sprites, terrain, meshes and bsp run on all cores
+	char a3d_path[1024];
+	sprintf(a3d_path,"%sa3d/game_map_y8.a3d", base_path);
+	LoadStartup(a3d_path, &terrain, &world, mat, false, 0, trace ? stdout : 0);
+
 	// if (!terrain || !world)
 	//    return -1;
 
+	// nothing here queries terrain or world, so nothing of chunked maps is paged in
+	// (only game calls TouchTerrain() / TouchWorld()), chunks stay in the file
+
 	// add meshes from library that aren't present in scene file
 	char mesh_dirname[4096];
 	sprintf(mesh_dirname, "%smeshes", base_path);
 	//a3dListDir(mesh_dirname, MeshScan, mesh_dirname);
 
-	// this is the only case when instances has no valid bboxes yet
-	// as meshes weren't present during their creation
-	// now meshes are loaded ...
-	// so we need to update instance boxes with (,true)
-
-	if (world)
-		RebuildWorld(world, true);
-
 	ServerLoop("8080");
 
 	DeleteWorld(world);
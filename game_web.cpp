@@ -203,7 +203,7 @@ int Main()
 
         if (f)
         {
-            terrain = LoadTerrain(f);
+            terrain = LoadTerrain(f, true);
             
             if (terrain)
             {
@@ -431,6 +431,8 @@ extern "C"
         memset(gs,0,sizeof(GameServer));
         server = gs;
         server->others = (Human*)malloc(sizeof(Human)*max_cli);
+        server->ResetInterpolation();
+        server->ResetPoseSender();
         return gs->send_buf;
     }
 
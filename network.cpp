@@ -99,6 +99,13 @@ void THREAD_SLEEP(int ms)
 	Sleep(ms);
 }
 
+int THREAD_CORES()
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
 struct RWLOCK_HANDLE
 {
 	SRWLOCK rw;
@@ -156,6 +163,19 @@ unsigned int INTERLOCKED_ADD(volatile unsigned int* ptr, unsigned int add)
 	return (unsigned int)InterlockedAdd((volatile LONG*)ptr, (LONG)add);
 }
 
+unsigned int ATOMIC_LOAD_ACQUIRE(volatile unsigned int* ptr)
+{
+	unsigned int val = *ptr; // msvc volatile read has acquire semantics
+	_ReadWriteBarrier();
+	return val;
+}
+
+void ATOMIC_STORE_RELEASE(volatile unsigned int* ptr, unsigned int val)
+{
+	_ReadWriteBarrier();
+	*ptr = val; // msvc volatile write has release semantics
+}
+
 
 struct MUTEX_HANDLE
 {
@@ -185,6 +205,34 @@ void MUTEX_UNLOCK(MUTEX_HANDLE* mutex)
 	LeaveCriticalSection(&mutex->mu);
 }
 
+struct SEMAPHORE_HANDLE
+{
+	HANDLE sem;
+};
+
+SEMAPHORE_HANDLE* SEMAPHORE_CREATE(int count)
+{
+	SEMAPHORE_HANDLE* s = (SEMAPHORE_HANDLE*)malloc(sizeof(SEMAPHORE_HANDLE));
+	s->sem = CreateSemaphore(0, count, 0x7FFFFFFF, 0);
+	return s;
+}
+
+void SEMAPHORE_DELETE(SEMAPHORE_HANDLE* sem)
+{
+	CloseHandle(sem->sem);
+	free(sem);
+}
+
+void SEMAPHORE_WAIT(SEMAPHORE_HANDLE* sem)
+{
+	WaitForSingleObject(sem->sem, INFINITE);
+}
+
+void SEMAPHORE_POST(SEMAPHORE_HANDLE* sem, int n)
+{
+	ReleaseSemaphore(sem->sem, n, 0);
+}
+
 #else
 
 typedef int TCP_SOCKET;
@@ -245,6 +293,12 @@ void THREAD_SLEEP(int ms)
 	usleep(ms*1000);
 }
 
+int THREAD_CORES()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
 struct RWLOCK_HANDLE
 {
 	pthread_rwlock_t rw;
@@ -311,6 +365,50 @@ void MUTEX_UNLOCK(MUTEX_HANDLE* mutex)
 	pthread_mutex_unlock(&mutex->mu);
 }
 
+// no unnamed sem_t on macos
+struct SEMAPHORE_HANDLE
+{
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+	int count;
+};
+
+SEMAPHORE_HANDLE* SEMAPHORE_CREATE(int count)
+{
+	SEMAPHORE_HANDLE* s = (SEMAPHORE_HANDLE*)malloc(sizeof(SEMAPHORE_HANDLE));
+	pthread_mutex_init(&s->mu, 0);
+	pthread_cond_init(&s->cv, 0);
+	s->count = count;
+	return s;
+}
+
+void SEMAPHORE_DELETE(SEMAPHORE_HANDLE* sem)
+{
+	pthread_cond_destroy(&sem->cv);
+	pthread_mutex_destroy(&sem->mu);
+	free(sem);
+}
+
+void SEMAPHORE_WAIT(SEMAPHORE_HANDLE* sem)
+{
+	pthread_mutex_lock(&sem->mu);
+	while (!sem->count)
+		pthread_cond_wait(&sem->cv, &sem->mu);
+	sem->count--;
+	pthread_mutex_unlock(&sem->mu);
+}
+
+void SEMAPHORE_POST(SEMAPHORE_HANDLE* sem, int n)
+{
+	pthread_mutex_lock(&sem->mu);
+	sem->count += n;
+	if (n > 1)
+		pthread_cond_broadcast(&sem->cv);
+	else
+		pthread_cond_signal(&sem->cv);
+	pthread_mutex_unlock(&sem->mu);
+}
+
 unsigned int INTERLOCKED_DEC(volatile unsigned int* ptr)
 {
 	return __sync_fetch_and_sub(ptr, 1) - 1;
@@ -331,6 +429,16 @@ unsigned int INTERLOCKED_ADD(volatile unsigned int* ptr, unsigned int add)
 	return __sync_fetch_and_add(ptr, add) + add;
 }
 
+unsigned int ATOMIC_LOAD_ACQUIRE(volatile unsigned int* ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+void ATOMIC_STORE_RELEASE(volatile unsigned int* ptr, unsigned int val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
 #endif
 
 int TCP_WRITE(TCP_SOCKET s, const uint8_t* buf, int size)
@@ -27,6 +27,7 @@ typedef int TCP_SOCKET;
 struct THREAD_HANDLE;
 struct RWLOCK_HANDLE;
 struct MUTEX_HANDLE;
+struct SEMAPHORE_HANDLE;
 
 int TCP_INIT();
 int TCP_CLOSE(TCP_SOCKET s);
@@ -47,12 +48,19 @@ void* THREAD_JOIN(THREAD_HANDLE* thread);
 bool THREAD_CREATE_DETACHED(void* (*entry)(void*), void* arg);
 
 void THREAD_SLEEP(int ms);
+int THREAD_CORES(); // hardware threads available
 
 MUTEX_HANDLE* MUTEX_CREATE();
 void MUTEX_DELETE(MUTEX_HANDLE* mutex);
 void MUTEX_LOCK(MUTEX_HANDLE* mutex);
 void MUTEX_UNLOCK(MUTEX_HANDLE* mutex);
 
+// counting, WAIT blocks till count > 0 then decrements it, POST adds n
+SEMAPHORE_HANDLE* SEMAPHORE_CREATE(int count);
+void SEMAPHORE_DELETE(SEMAPHORE_HANDLE* sem);
+void SEMAPHORE_WAIT(SEMAPHORE_HANDLE* sem);
+void SEMAPHORE_POST(SEMAPHORE_HANDLE* sem, int n);
+
 RWLOCK_HANDLE* RWLOCK_CREATE();
 void RWLOCK_DELETE(RWLOCK_HANDLE* rwl);
 void RWLOCK_READ_LOCK(RWLOCK_HANDLE* rwl);
@@ -65,6 +73,10 @@ unsigned int INTERLOCKED_INC(volatile unsigned int* ptr);
 unsigned int INTERLOCKED_SUB(volatile unsigned int* ptr, unsigned int sub);
 unsigned int INTERLOCKED_ADD(volatile unsigned int* ptr, unsigned int add);
 
+// plain loads / stores ordering memory around them (for lock-free queues)
+unsigned int ATOMIC_LOAD_ACQUIRE(volatile unsigned int* ptr);
+void ATOMIC_STORE_RELEASE(volatile unsigned int* ptr, unsigned int val);
+
 ////////////////////////////////////////////////////////////
 
 #pragma pack(push,1)
@@ -75,11 +87,39 @@ struct STRUCT_REQ_JOIN
 	char name[31];
 };
 
+struct STRUCT_REQ_RESUME
+{
+	uint8_t token; // 'R' -- sent instead of 'J' after reconnecting
+	char name[31];
+	uint16_t id; // from previous STRUCT_RSP_JOIN
+	uint64_t resume; // from previous STRUCT_RSP_JOIN
+};
+
 struct STRUCT_RSP_JOIN
 {
 	uint8_t token; // 'j'
 	uint8_t maxcli;	
 	uint16_t id;
+	uint8_t resumed; // 1: old session continues (missed broadcasts follow), 0: fresh one
+	uint8_t pad[3];
+	uint64_t resume; // token for STRUCT_REQ_RESUME
+};
+
+struct STRUCT_RSP_TUNE
+{
+	uint8_t token; // 'c' -- sent right after STRUCT_RSP_JOIN, may be resent anytime
+	uint8_t pose_hz; // max rate of STRUCT_REQ_POSE
+	uint8_t pose_quant; // min position change worth sending (1/16 of visual cell)
+	uint8_t dir_quant; // min direction change worth sending (degrees)
+};
+
+struct STRUCT_RSP_SESSION
+{
+	uint8_t token; // 's' -- handed off to other shard, our session there (old one is gone)
+	uint8_t maxcli;
+	uint16_t id;
+	uint8_t pad[4];
+	uint64_t resume; // token for STRUCT_REQ_RESUME
 };
 
 struct STRUCT_BRC_JOIN
@@ -123,6 +163,7 @@ struct STRUCT_BRC_POSE
 	float dir;
 	uint16_t sprite;
 	uint16_t id;
+	uint32_t stamp; // server time (ms) pose was received, for client side interpolation
 };
 
 struct STRUCT_REQ_TALK
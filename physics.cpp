@@ -472,6 +472,8 @@ struct Physics
 	int soup_items;
 
 	double* collect_tm;
+	int collect_alloc;
+	float (*collect_vtx)[4]; // transformed verts of collected mesh
 	float collect_mul_xy;
 	float collect_mul_z;
 
@@ -493,66 +495,61 @@ struct Physics
     Terrain* terrain;
     World* world;
 
-	static void FaceCollect(float coords[9], uint8_t* colors, uint32_t visual, void* cookie)
+	static void FacesCollect(int verts, const float* xyz, const uint8_t* rgba, int faces, const int* abc, const uint32_t* visual, void* cookie)
 	{
-		if (visual&(1 << 31)) // skip lines (but could be worked out to collide lines too!)
-			return;
-		if (colors[3] > 128 || colors[7] > 128 || colors[11] > 128) // skip leafs
-			return;
-
 		Physics* phys = (Physics*)cookie;
-		SoupItem* item = phys->soup + phys->soup_items;
 
-		// multiply coords by collect_tm
+		// multiply coords by collect_tm, once per vert
 		// then multiply x & y by collect_mul_xy and z by collect_mul_z
-		// ...
 
-		float v[3][4]=
+		if (phys->collect_alloc < verts)
 		{
-			{coords[0],coords[1],coords[2],1},
-			{coords[3],coords[4],coords[5],1},
-			{coords[6],coords[7],coords[8],1},
-		};
-
-		float tmv[4];
+			phys->collect_alloc = verts;
+			phys->collect_vtx = (float(*)[4])realloc(phys->collect_vtx, sizeof(float[4]) * verts);
+		}
 
-		Product(phys->collect_tm, v[0], tmv);
-		phys->max_height = fmaxf(tmv[2], phys->max_height);
+		for (int i = 0; i < verts; i++)
+		{
+			float v[4] = { xyz[3 * i + 0], xyz[3 * i + 1], xyz[3 * i + 2], 1 };
+			Product(phys->collect_tm, v, phys->collect_vtx[i]);
+		}
 
-		item->tri[0][0] = tmv[0] * phys->collect_mul_xy;
-		item->tri[0][1] = tmv[1] * phys->collect_mul_xy;
-		item->tri[0][2] = tmv[2] * phys->collect_mul_z;
+		for (int f = 0; f < faces; f++, abc += 3)
+		{
+			if (visual[f]&(1 << 31)) // skip lines (but could be worked out to collide lines too!)
+				continue;
+			if (rgba[4 * abc[0] + 3] > 128 || rgba[4 * abc[1] + 3] > 128 || rgba[4 * abc[2] + 3] > 128) // skip leafs
+				continue;
 
-		Product(phys->collect_tm, v[1], tmv);
-		phys->max_height = fmaxf(tmv[2], phys->max_height);
+			SoupItem* item = phys->soup + phys->soup_items;
 
-		item->tri[1][0] = tmv[0] * phys->collect_mul_xy;
-		item->tri[1][1] = tmv[1] * phys->collect_mul_xy;
-		item->tri[1][2] = tmv[2] * phys->collect_mul_z;
+			for (int i = 0; i < 3; i++)
+			{
+				const float* tmv = phys->collect_vtx[abc[i]];
+				phys->max_height = fmaxf(tmv[2], phys->max_height);
 
-		Product(phys->collect_tm, v[2], tmv);
-		phys->max_height = fmaxf(tmv[2], phys->max_height);
+				item->tri[i][0] = tmv[0] * phys->collect_mul_xy;
+				item->tri[i][1] = tmv[1] * phys->collect_mul_xy;
+				item->tri[i][2] = tmv[2] * phys->collect_mul_z;
+			}
 
-		item->tri[2][0] = tmv[0] * phys->collect_mul_xy;
-		item->tri[2][1] = tmv[1] * phys->collect_mul_xy;
-		item->tri[2][2] = tmv[2] * phys->collect_mul_z;
+			{
+				float* v[3] = { item->tri[0], item->tri[1], item->tri[2] };
+				float e1[3] = { v[0][0] - v[2][0],v[0][1] - v[2][1],v[0][2] - v[2][2] };
+				float e2[3] = { v[1][0] - v[2][0],v[1][1] - v[2][1],v[1][2] - v[2][2] };
+				CrossProduct(e1, e2, item->nrm);
+				float nrm = 1.0f / sqrtf(
+					item->nrm[0] * item->nrm[0] +
+					item->nrm[1] * item->nrm[1] +
+					item->nrm[2] * item->nrm[2]);
+				item->nrm[0] *= nrm;
+				item->nrm[1] *= nrm;
+				item->nrm[2] *= nrm;
+				item->nrm[3] = -(v[2][0] * item->nrm[0] + v[2][1] * item->nrm[1] + v[2][2] * item->nrm[2]);
+			}
 
-		{
-			float* v[3] = { item->tri[0], item->tri[1], item->tri[2] };
-			float e1[3] = { v[0][0] - v[2][0],v[0][1] - v[2][1],v[0][2] - v[2][2] };
-			float e2[3] = { v[1][0] - v[2][0],v[1][1] - v[2][1],v[1][2] - v[2][2] };
-			CrossProduct(e1, e2, item->nrm);
-			float nrm = 1.0f / sqrtf(
-				item->nrm[0] * item->nrm[0] +
-				item->nrm[1] * item->nrm[1] +
-				item->nrm[2] * item->nrm[2]);
-			item->nrm[0] *= nrm;
-			item->nrm[1] *= nrm;
-			item->nrm[2] *= nrm;
-			item->nrm[3] = -(v[2][0] * item->nrm[0] + v[2][1] * item->nrm[1] + v[2][2] * item->nrm[2]);
+			phys->soup_items ++;
 		}
-
-		phys->soup_items ++;
 	}
 
 	static void SpriteCollect(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie)
@@ -573,7 +570,7 @@ struct Physics
 
 		phys->collect_tm = tm;
 
-		QueryMesh(m, FaceCollect, cookie);
+		QueryMesh(m, FacesCollect, cookie);
 	}
 	
 	static void PatchCollect(Patch* p, int x, int y, int view_flags, void* cookie)
@@ -1454,6 +1451,9 @@ Physics* CreatePhysics(Terrain* t, World* w, float pos[3], float dir, float yaw,
 	phys->soup_alloc = 0;
 	phys->soup_items = 0;
 
+	phys->collect_alloc = 0;
+	phys->collect_vtx = 0;
+
 	phys->yaw = yaw;
 	phys->yaw_vel = 0;
 
@@ -1490,6 +1490,8 @@ void DeletePhysics(Physics* phys)
 {
     if (phys->soup)
         free(phys->soup);
+    if (phys->collect_vtx)
+        free(phys->collect_vtx);
     free(phys);
 }
 
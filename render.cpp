@@ -21,6 +21,7 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <string.h>
 
 #ifdef min // thanks windows
@@ -36,7 +37,6 @@
 extern Character* player_head;
 extern Character* player_tail;
 
-static bool global_refl_mode = false;
 extern Sprite* player_sprite;
 extern Sprite* attack_sprite;
 extern Sprite* inventory_sprite;
@@ -504,6 +504,11 @@ struct SpriteRenderBuf
 	}
 };
 
+#define HIZ_TILE 4 // samples per level 0 tile side
+#define HIZ_LEVELS 8
+
+#define MESH_CACHE_VERTS (1 << 18) // whole cache is dropped rather than going over
+
 struct Renderer
 {
 	void Init()
@@ -518,6 +523,14 @@ struct Renderer
 			free(sample_buffer.ptr);
 		if (sprites_alloc)
 			free(sprites_alloc);
+		if (mesh_vert)
+			free(mesh_vert);
+		if (hiz_buf)
+			free(hiz_buf);
+		if (mesh_cache)
+			free(mesh_cache);
+		if (mesh_cache_pool)
+			free(mesh_cache_pool);
 	}
 
 	uint64_t stamp;
@@ -543,10 +556,64 @@ struct Renderer
 	uint8_t* buffer;
 	int buffer_size; // ansi_buffer allocation size in cells (minimize reallocs)
 
-	static void RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/);
+	static bool PatchLOD(int x, int y, int range, void* cookie /*Renderer*/);
+	static void RenderPatch(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/);
 	static void RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie /*Renderer*/);
 	static void RenderMesh(Mesh* m, double* tm, void* cookie /*Renderer*/);
 	static void RenderFace(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie /*Renderer*/);
+	static void RenderFaces(int verts, const float* xyz, const uint8_t* rgba, int faces, const int* abc, const uint32_t* visual, void* cookie /*Renderer*/);
+	bool ProjectVert(const float xyz[3], int v[4]);
+	void RasterFace(int* v[3], const float* xyz[3], const uint8_t* rgb[3], uint32_t visual);
+
+	// verts of currently rendered mesh inst, projected once for all its faces
+	struct MeshVert
+	{
+		int v[4]; // x,y,z,clip flags
+		bool behind; // perspective only
+	};
+	int mesh_vert_alloc;
+	MeshVert* mesh_vert;
+
+	// orthographic projections of mesh verts relative to inst origin (3 doubles per vert)
+	// keyed by mesh and rotation/scale part of inst tm, so insts differing only in
+	// translation (and same inst in following frames) share them, adding projected inst
+	// origin before rounding gives exactly what ProjectVert() does, (rounding whole mesh
+	// at once would move its verts by up to a sample against terrain & other meshes)
+	// whole cache is dropped when view rotation or zoom changes
+	struct MeshCache
+	{
+		Mesh* mesh; // 0 if slot is free
+		double lin[9];
+		bool refl;
+		const float* xyz; // mesh data it was made of
+		int verts;
+		int pool; // offset in mesh_cache_pool
+	};
+	int mesh_cache_size; // slots, power of 2
+	int mesh_caches;
+	MeshCache* mesh_cache;
+	int mesh_cache_pool_alloc;
+	int mesh_cache_pool_used;
+	double* mesh_cache_pool;
+	double mesh_cache_mul[6];
+	Mesh* inst_mesh;
+	void DropMeshCache();
+	const double* GetMeshCache(int verts, const float* xyz);
+
+	// coarse occlusion: min sample height of HIZ_TILE^2 sample tiles and their 2x2 pyramid
+	// built after terrain pass, kept up to date by meshes, (sample heights only grow then)
+	// mesh insts with projected bbox entirely below it are skipped
+	bool hiz; // valid (not in reflection pass)
+	int hiz_levels;
+	int hiz_w[HIZ_LEVELS];
+	int hiz_h[HIZ_LEVELS];
+	float* hiz_level[HIZ_LEVELS];
+	int hiz_alloc;
+	float* hiz_buf;
+	void BuildHiZ();
+	void UpdateHiZ(const int rect[4]);
+	bool HiZTest(int level, int tx, int ty, const int rect[4], float z) const;
+	bool Occluded(const int rect[4], float z) const;
 	
 	// unstatic -> needs R/W access to sample_buffer.ptr[].height for depth testing!
 	void RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, bool refl, int anim, int frame, int angle, int pos[3]);
@@ -559,8 +626,14 @@ struct Renderer
 	float light[4];
 	bool int_flag;
 	bool perspective;
+	bool refl_mode; // reflection pass, mirrored heights
 	double inv_tm[16]; // for unproject
 
+#ifdef DARK_TERRAIN
+	bool horizon; // light differs from baked one, terrain shadows come from horizons
+	uint32_t horizon_light;
+#endif
+
 	// perspective test
 	float view_dir[3];
 	float view_pos[3];
@@ -709,6 +782,258 @@ static int create_auto_mat(uint8_t mat[])
 }
 
 void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie)
+{
+	Renderer* r = (Renderer*)cookie;
+
+	int v[3][4];
+	int n = visual & (1 << 31) ? 2 : 3;
+	for (int i = 0; i < n; i++)
+	{
+		if (!r->ProjectVert(coords + 3 * i, v[i]))
+			return;
+	}
+
+	int* pv[3] = { v[0],v[1],v[2] };
+	const float* xyz[3] = { coords + 0, coords + 3, coords + 6 };
+	const uint8_t* rgb[3] = { colors + 0, colors + 4, colors + 8 };
+	r->RasterFace(pv, xyz, rgb, visual);
+}
+
+// (int)floor(f + 0.5f) without libm call
+static inline int RoundVert(float f)
+{
+	float h = f + 0.5f;
+	int i = (int)h;
+	return i - (h < i);
+}
+
+void Renderer::RenderFaces(int verts, const float* xyz, const uint8_t* rgba, int faces, const int* abc, const uint32_t* visual, void* cookie)
+{
+	Renderer* r = (Renderer*)cookie;
+
+	if (r->mesh_vert_alloc < verts)
+	{
+		r->mesh_vert_alloc = verts;
+		r->mesh_vert = (MeshVert*)realloc(r->mesh_vert, sizeof(MeshVert) * verts);
+	}
+
+	// each vert is shared by few faces, project it once
+	MeshVert* mv = r->mesh_vert;
+	const double* cv = r->perspective ? 0 : r->GetMeshCache(verts, xyz);
+	if (cv)
+	{
+		const double* o = r->viewinst_tm + 12;
+		for (int i = 0; i < verts; i++, cv += 3)
+		{
+			mv[i].v[0] = RoundVert((float)(cv[0] + o[0]));
+			mv[i].v[1] = RoundVert((float)(cv[1] + o[1]));
+			mv[i].v[2] = RoundVert((float)(cv[2] + o[2]));
+			mv[i].v[3] = 0;
+			mv[i].behind = false;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < verts; i++)
+			mv[i].behind = !r->ProjectVert(xyz + 3 * i, mv[i].v);
+	}
+
+	int w = r->sample_buffer.w;
+	int h = r->sample_buffer.h;
+
+	for (int f = 0; f < faces; f++, abc += 3)
+	{
+		if (mv[abc[0]].behind || mv[abc[1]].behind || mv[abc[2]].behind)
+			continue;
+
+		int* pv[3] = { mv[abc[0]].v, mv[abc[1]].v, mv[abc[2]].v };
+
+		if (!(visual[f] & (1 << 31)))
+		{
+			// skip faces Rasterize() would produce no samples for before shading them:
+			// off screen or thinner than sample, back facing (winding flips in reflection)
+			int left = std::max(0, std::min(pv[0][0], std::min(pv[1][0], pv[2][0])));
+			int right = std::min(w, std::max(pv[0][0], std::max(pv[1][0], pv[2][0])));
+			int bottom = std::max(0, std::min(pv[0][1], std::min(pv[1][1], pv[2][1])));
+			int top = std::min(h, std::max(pv[0][1], std::max(pv[1][1], pv[2][1])));
+			if (left >= right || bottom >= top)
+				continue;
+
+			int area = (pv[1][0] - pv[0][0]) * (pv[2][1] - pv[0][1]) - (pv[1][1] - pv[0][1]) * (pv[2][0] - pv[0][0]);
+			if (r->refl_mode)
+				area = -area;
+			if (area == 0 || area < 0 && !(visual[f] & (1 << 30)))
+				continue;
+		}
+
+		const float* p[3] = { xyz + 3 * abc[0], xyz + 3 * abc[1], xyz + 3 * abc[2] };
+		const uint8_t* rgb[3] = { rgba + 4 * abc[0], rgba + 4 * abc[1], rgba + 4 * abc[2] };
+		r->RasterFace(pv, p, rgb, visual[f]);
+	}
+}
+
+bool Renderer::ProjectVert(const float xyz[3], int v[4])
+{
+	float tmp0[4];
+	float xyzw[] = { xyz[0], xyz[1], xyz[2], 1.0f };
+	Product(viewinst_tm, xyzw, tmp0);
+
+	if (perspective) // #if PERSPECTIVE_TEST 
+	{
+		float ws[4];
+		Product(inst_tm, xyzw, ws);
+		float viewer_dist; // {vx,vy,vz}  pos
+		float eye_to_vtx[3] =
+		{
+			ws[0] * HEIGHT_CELLS - view_pos[0],
+			ws[1] * HEIGHT_CELLS - view_pos[1],
+			ws[2] - view_pos[2],
+		};
+
+		viewer_dist = DotProduct(eye_to_vtx, view_dir);
+		if (viewer_dist > 0)
+		{
+			viewer_dist = 1.0/viewer_dist;
+
+			float fx = tmp0[0];
+			float fy = tmp0[1];
+
+			fx = (fx - view_ofs[0]) * viewer_dist + view_ofs[0];
+			fy = (fy - view_ofs[1]) * viewer_dist + view_ofs[1];
+
+			int tx = (int)floorf(fx + 0.5f);
+			int ty = (int)floorf(fy + 0.5f);
+
+			v[0] = tx;
+			v[1] = ty;
+			v[2] = (int)floor(tmp0[2] + 0.5f);
+			v[3] = 0; // clip flags
+		}
+		else
+			return false;
+	}
+	else //#else
+	{
+		v[0] = (int)floor(tmp0[0] + 0.5f);
+		v[1] = (int)floor(tmp0[1] + 0.5f);
+		v[2] = (int)floor(tmp0[2] + 0.5f);
+		v[3] = 0; // clip flags
+	} //#endif
+
+	return true;
+}
+
+void Renderer::DropMeshCache()
+{
+	if (mesh_cache)
+		memset(mesh_cache, 0, sizeof(MeshCache) * mesh_cache_size);
+	mesh_caches = 0;
+	mesh_cache_pool_used = 0;
+}
+
+static inline uint32_t MeshCacheHash(const Mesh* m, const double lin[9], bool refl)
+{
+	uint32_t h = 2166136261u;
+	const uint8_t* p = (const uint8_t*)&m;
+	for (int i = 0; i < (int)sizeof(m); i++)
+		h = (h ^ p[i]) * 16777619u;
+	p = (const uint8_t*)lin;
+	for (int i = 0; i < (int)sizeof(double[9]); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h ^ (refl ? 1 : 0);
+}
+
+// uses inst_mesh, inst_tm and viewinst_tm set by RenderMesh(), 0 if verts don't fit at all
+const double* Renderer::GetMeshCache(int verts, const float* xyz)
+{
+	if (verts > MESH_CACHE_VERTS)
+		return 0;
+
+	// reflection pass flips z part of the same view
+	double view[6] = { mul[0], mul[1], mul[2], mul[3], mul[4], refl_mode ? -mul[5] : mul[5] };
+	if (memcmp(mesh_cache_mul, view, sizeof(double[6])))
+	{
+		memcpy(mesh_cache_mul, view, sizeof(double[6]));
+		DropMeshCache();
+	}
+
+	double lin[9];
+	for (int c = 0; c < 3; c++)
+	{
+		for (int i = 0; i < 3; i++)
+			lin[3 * c + i] = inst_tm[4 * c + i];
+	}
+
+	if (2 * (mesh_caches + 1) > mesh_cache_size)
+	{
+		// grow & rehash
+		int old_size = mesh_cache_size;
+		MeshCache* old = mesh_cache;
+		mesh_cache_size = old_size ? 2 * old_size : 256;
+		mesh_cache = (MeshCache*)calloc(mesh_cache_size, sizeof(MeshCache));
+		for (int i = 0; i < old_size; i++)
+		{
+			if (!old[i].mesh)
+				continue;
+			int s = MeshCacheHash(old[i].mesh, old[i].lin, old[i].refl) & (mesh_cache_size - 1);
+			while (mesh_cache[s].mesh)
+				s = (s + 1) & (mesh_cache_size - 1);
+			mesh_cache[s] = old[i];
+		}
+		if (old)
+			free(old);
+	}
+
+	int s = MeshCacheHash(inst_mesh, lin, refl_mode) & (mesh_cache_size - 1);
+	while (mesh_cache[s].mesh)
+	{
+		MeshCache* mc = mesh_cache + s;
+		if (mc->mesh == inst_mesh && mc->refl == refl_mode && !memcmp(mc->lin, lin, sizeof(lin)))
+		{
+			if (mc->xyz == xyz && mc->verts == verts)
+				return mesh_cache_pool + mc->pool;
+			break; // mesh changed, reproject into new space
+		}
+		s = (s + 1) & (mesh_cache_size - 1);
+	}
+
+	if (mesh_cache_pool_used + 3 * verts > 3 * MESH_CACHE_VERTS)
+	{
+		DropMeshCache();
+		s = MeshCacheHash(inst_mesh, lin, refl_mode) & (mesh_cache_size - 1);
+	}
+
+	if (mesh_cache_pool_alloc < mesh_cache_pool_used + 3 * verts)
+	{
+		mesh_cache_pool_alloc = std::min(3 * MESH_CACHE_VERTS, std::max(2 * mesh_cache_pool_alloc, mesh_cache_pool_used + 3 * verts));
+		mesh_cache_pool = (double*)realloc(mesh_cache_pool, sizeof(double) * mesh_cache_pool_alloc);
+	}
+
+	MeshCache* mc = mesh_cache + s;
+	if (!mc->mesh)
+		mesh_caches++;
+	mc->mesh = inst_mesh;
+	memcpy(mc->lin, lin, sizeof(lin));
+	mc->refl = refl_mode;
+	mc->xyz = xyz;
+	mc->verts = verts;
+	mc->pool = mesh_cache_pool_used;
+	mesh_cache_pool_used += 3 * verts;
+
+	// ProjectVert() sums without inst translation (its last term), same order
+	const double* m = viewinst_tm;
+	double* v = mesh_cache_pool + mc->pool;
+	for (int i = 0; i < verts; i++, v += 3, xyz += 3)
+	{
+		v[0] = m[0] * xyz[0] + m[4] * xyz[1] + m[8] * xyz[2];
+		v[1] = m[1] * xyz[0] + m[5] * xyz[1] + m[9] * xyz[2];
+		v[2] = m[2] * xyz[0] + m[6] * xyz[1] + m[10] * xyz[2];
+	}
+
+	return mesh_cache_pool + mc->pool;
+}
+
+void Renderer::RasterFace(int* v[3], const float* xyz[3], const uint8_t* rgb[3], uint32_t visual)
 {
 	struct Shader
 	{
@@ -716,7 +1041,7 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 		{
 			if (s->height < z)
 			{
-				if (global_refl_mode)
+				if (refl)
 				{
 					if (z < water + HEIGHT_SCALE / 8)
 					{
@@ -810,175 +1135,29 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 		}
 		*/
 
-		uint8_t* rgb[3]; // per vertex colors
+		const uint8_t* rgb[3]; // per vertex colors
 		float water;
+		bool refl; // reflection pass
 		float light[4];
 		uint8_t diffuse; // shading experiment
 	} shader;
 
-	Renderer* r = (Renderer*)cookie;
-	shader.water = r->water;
-
-	// temporarily, let's transform verts for each face separately
-
-	int v[3][4];
-
-	float tmp0[4], tmp1[4], tmp2[4];
-
-	{
-		float xyzw[] = { coords[0], coords[1], coords[2], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp0);
-
-		if (r->perspective) // #if PERSPECTIVE_TEST 
-		{
-			float ws[4];
-			Product(r->inst_tm, xyzw, ws);
-			float viewer_dist; // {vx,vy,vz}  r->pos
-			float eye_to_vtx[3] =
-			{
-				ws[0] * HEIGHT_CELLS - r->view_pos[0],
-				ws[1] * HEIGHT_CELLS - r->view_pos[1],
-				ws[2] - r->view_pos[2],
-			};
-
-			viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
-			if (viewer_dist > 0)
-			{
-				viewer_dist = 1.0/viewer_dist;
-
-				float fx = tmp0[0];
-				float fy = tmp0[1];
-
-				fx = (fx - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
-				fy = (fy - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
-
-				int tx = (int)floorf(fx + 0.5f);
-				int ty = (int)floorf(fy + 0.5f);
-
-				v[0][0] = tx;
-				v[0][1] = ty;
-				v[0][2] = (int)floor(tmp0[2] + 0.5f);
-				v[0][3] = 0; // clip flags
-			}
-			else
-				return;
-		}
-		else //#else
-		{
-			v[0][0] = (int)floor(tmp0[0] + 0.5f);
-			v[0][1] = (int)floor(tmp0[1] + 0.5f);
-			v[0][2] = (int)floor(tmp0[2] + 0.5f);
-			v[0][3] = 0; // clip flags
-		} //#endif
-	}
-
-	{
-		float xyzw[] = { coords[3], coords[4], coords[5], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp1);
-
-		if (r->perspective) // #if PERSPECTIVE_TEST
-		{
-			float ws[4];
-			Product(r->inst_tm, xyzw, ws);
-			float viewer_dist; // {vx,vy,vz}  r->pos
-			float eye_to_vtx[3] =
-			{
-				ws[0] * HEIGHT_CELLS - r->view_pos[0],
-				ws[1] * HEIGHT_CELLS - r->view_pos[1],
-				ws[2] - r->view_pos[2],
-			};
-
-			viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
-			if (viewer_dist > 0)
-			{
-				viewer_dist = 1.0/viewer_dist;
-
-				float fx = tmp1[0];
-				float fy = tmp1[1];
-
-				fx = (fx - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
-				fy = (fy - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
-
-				int tx = (int)floorf(fx + 0.5f);
-				int ty = (int)floorf(fy + 0.5f);
-
-				v[1][0] = tx;
-				v[1][1] = ty;
-				v[1][2] = (int)floor(tmp1[2] + 0.5f);
-				v[1][3] = 0; // clip flags
-			}
-			else
-				return;
-		}
-		else // #else
-		{
-			v[1][0] = (int)floor(tmp1[0] + 0.5f);
-			v[1][1] = (int)floor(tmp1[1] + 0.5f);
-			v[1][2] = (int)floor(tmp1[2] + 0.5f);
-			v[1][3] = 0; // clip flags
-		} //#endif
-	}
+	shader.water = water;
+	shader.refl = refl_mode;
 
 	if (visual & (1<<31))
 	{
-		Bresenham(r->sample_buffer.ptr,r->sample_buffer.w,r->sample_buffer.h, v[0], v[1], 0x40);
+		Bresenham(sample_buffer.ptr,sample_buffer.w,sample_buffer.h, v[0], v[1], 0x40);
 		return;
 	}
 
-	{
-		float xyzw[] = { coords[6], coords[7], coords[8], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp2);
-
-		if (r->perspective) // #if PERSPECTIVE_TEST
-		{
-			float ws[4];
-			Product(r->inst_tm, xyzw, ws);
-			float viewer_dist; // {vx,vy,vz}  r->pos
-			float eye_to_vtx[3] =
-			{
-				ws[0] * HEIGHT_CELLS - r->view_pos[0],
-				ws[1] * HEIGHT_CELLS - r->view_pos[1],
-				ws[2] - r->view_pos[2],
-			};
-
-			viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
-			if (viewer_dist > 0)
-			{
-				viewer_dist = 1.0/viewer_dist;
-
-				float fx = tmp2[0];
-				float fy = tmp2[1];
-
-				fx = (fx - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
-				fy = (fy - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
-
-				int tx = (int)floorf(fx + 0.5f);
-				int ty = (int)floorf(fy + 0.5f);
-
-				v[2][0] = tx;
-				v[2][1] = ty;
-				v[2][2] = (int)floor(tmp2[2] + 0.5f);
-				v[2][3] = 0; // clip flags
-			}
-			else
-				return;
-		}
-		else // #else
-		{
-			v[2][0] = (int)floor(tmp2[0] + 0.5f);
-			v[2][1] = (int)floor(tmp2[1] + 0.5f);
-			v[2][2] = (int)floor(tmp2[2] + 0.5f);
-			v[2][3] = 0; // clip flags
-		} // #endif
-	}
-
-	int w = r->sample_buffer.w;
-	int h = r->sample_buffer.h;
-	Sample* ptr = r->sample_buffer.ptr;
+	int w = sample_buffer.w;
+	int h = sample_buffer.h;
+	Sample* ptr = sample_buffer.ptr;
 
 	// normal is const, could be baked into mesh
-	float e1[] = { coords[3] - coords[0], coords[4] - coords[1], coords[5] - coords[2] };
-	float e2[] = { coords[6] - coords[0], coords[7] - coords[1], coords[8] - coords[2] };
+	float e1[] = { xyz[1][0] - xyz[0][0], xyz[1][1] - xyz[0][1], xyz[1][2] - xyz[0][2] };
+	float e2[] = { xyz[2][0] - xyz[0][0], xyz[2][1] - xyz[0][1], xyz[2][2] - xyz[0][2] };
 
 	float n[4] =
 	{
@@ -989,17 +1168,17 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 	};
 
 	float inst_n[4];
-	Product(r->inst_tm, n, inst_n);
+	Product(inst_tm, n, inst_n);
 
 	inst_n[2] /= HEIGHT_SCALE;
 
 	float nn = 1.0f / sqrtf(inst_n[0] * inst_n[0] + inst_n[1] * inst_n[1] + inst_n[2] * inst_n[2]);
 
-	float df = nn * (inst_n[0] * r->light[0] + inst_n[1] * r->light[1] + inst_n[2] * r->light[2]);
+	float df = nn * (inst_n[0] * light[0] + inst_n[1] * light[1] + inst_n[2] * light[2]);
 
 	//diffuse = 1.0;
 
-	df = df * (1.0f - 0.5f*r->light[3]) + 0.5f*r->light[3];
+	df = df * (1.0f - 0.5f*light[3]) + 0.5f*light[3];
 	df += 0.5;
 
 	if (df > 1)
@@ -1009,25 +1188,25 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 
 	shader.diffuse = (int)(df * 0xFF);
 
-	if (global_refl_mode)
+	if (refl_mode)
 	{
 		const int* pv[3] = { v[2],v[1],v[0] };
-		shader.rgb[0] = colors + 8;
-		shader.rgb[1] = colors + 4;
-		shader.rgb[2] = colors + 0;
+		shader.rgb[0] = rgb[2];
+		shader.rgb[1] = rgb[1];
+		shader.rgb[2] = rgb[0];
 
 		//for (int i = 0; i < 12; i++)
 		//	colors[i] = colors[i] * 3 / 4;
 
-		Rasterize(r->sample_buffer.ptr, r->sample_buffer.w, r->sample_buffer.h, &shader, pv, visual&(1<<30));
+		Rasterize(sample_buffer.ptr, sample_buffer.w, sample_buffer.h, &shader, pv, visual&(1<<30));
 	}
 	else
 	{
 		const int* pv[3] = { v[0],v[1],v[2] };
-		shader.rgb[0] = colors + 0;
-		shader.rgb[1] = colors + 4;
-		shader.rgb[2] = colors + 8;
-		Rasterize(r->sample_buffer.ptr, r->sample_buffer.w, r->sample_buffer.h, &shader, pv, visual&(1<<30));
+		shader.rgb[0] = rgb[0];
+		shader.rgb[1] = rgb[1];
+		shader.rgb[2] = rgb[2];
+		Rasterize(sample_buffer.ptr, sample_buffer.w, sample_buffer.h, &shader, pv, visual&(1<<30));
 	}
 }
 
@@ -1042,7 +1221,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 	if (h && h->req.action == ACTION::DEAD)
 	{
 		// we need to list his items if nearby
-		if (!global_refl_mode)
+		if (!r->refl_mode)
 		{
 			float dx = r->pos[0] - pos[0];
 			float dy = r->pos[1] - pos[1];
@@ -1100,7 +1279,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 
 		// calc distance to player
 		// and choose upto 3 closest items
-		if (!global_refl_mode)
+		if (!r->refl_mode)
 		{
 			float dx = r->pos[0] - pos[0];
 			float dy = r->pos[1] - pos[1];
@@ -1170,7 +1349,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 		}
 	}
 
-	if (global_refl_mode && s->projs == 1)
+	if (r->refl_mode && s->projs == 1)
 		return;
 
 	// transform and append to sprite render list
@@ -1195,7 +1374,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 
 	viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
 
-	if (global_refl_mode)
+	if (r->refl_mode)
 	{
 		if (r->perspective) // #if PERSPECTIVE_TEST
 		{
@@ -1352,7 +1531,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 	buf->reps[1] = reps[1];
 	buf->reps[2] = reps[2];
 	buf->reps[3] = reps[3];
-	buf->refl = global_refl_mode;
+	buf->refl = r->refl_mode;
 
 	buf->character = h;
 
@@ -1361,6 +1540,157 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 	r->sprites++;
 }
 
+void Renderer::BuildHiZ()
+{
+	int w = sample_buffer.w;
+	int h = sample_buffer.h;
+
+	int size = 0;
+	int lw = (w + HIZ_TILE - 1) / HIZ_TILE;
+	int lh = (h + HIZ_TILE - 1) / HIZ_TILE;
+	hiz_levels = 0;
+	while (1)
+	{
+		hiz_w[hiz_levels] = lw;
+		hiz_h[hiz_levels] = lh;
+		hiz_levels++;
+		size += lw * lh;
+		if (lw == 1 && lh == 1 || hiz_levels == HIZ_LEVELS)
+			break;
+		lw = (lw + 1) / 2;
+		lh = (lh + 1) / 2;
+	}
+
+	if (hiz_alloc < size)
+	{
+		hiz_alloc = size;
+		hiz_buf = (float*)realloc(hiz_buf, sizeof(float) * size);
+	}
+
+	float* ptr = hiz_buf;
+	for (int l = 0; l < hiz_levels; l++)
+	{
+		hiz_level[l] = ptr;
+		ptr += hiz_w[l] * hiz_h[l];
+	}
+
+	int all[4] = { 0, 0, w - 1, h - 1 };
+	UpdateHiZ(all);
+	hiz = true;
+}
+
+void Renderer::UpdateHiZ(const int rect[4])
+{
+	int w = sample_buffer.w;
+	int h = sample_buffer.h;
+
+	int tx0 = rect[0] / HIZ_TILE, tx1 = rect[2] / HIZ_TILE;
+	int ty0 = rect[1] / HIZ_TILE, ty1 = rect[3] / HIZ_TILE;
+
+	float* lev = hiz_level[0];
+	int lw = hiz_w[0];
+	for (int ty = ty0; ty <= ty1; ty++)
+	{
+		int y1 = std::min(h, (ty + 1) * HIZ_TILE);
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			int x1 = std::min(w, (tx + 1) * HIZ_TILE);
+			float z = FLT_MAX;
+			for (int y = ty * HIZ_TILE; y < y1; y++)
+			{
+				const Sample* row = sample_buffer.ptr + y * w;
+				for (int x = tx * HIZ_TILE; x < x1; x++)
+					z = std::min(z, row[x].height);
+			}
+			lev[tx + ty * lw] = z;
+		}
+	}
+
+	for (int l = 1; l < hiz_levels; l++)
+	{
+		const float* sub = hiz_level[l - 1];
+		int sw = hiz_w[l - 1];
+		int sh = hiz_h[l - 1];
+		lev = hiz_level[l];
+		lw = hiz_w[l];
+
+		tx0 >>= 1; tx1 >>= 1;
+		ty0 >>= 1; ty1 >>= 1;
+		for (int ty = ty0; ty <= ty1; ty++)
+		{
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				int sx = 2 * tx, sy = 2 * ty;
+				float z = sub[sx + sy * sw];
+				if (sx + 1 < sw)
+					z = std::min(z, sub[sx + 1 + sy * sw]);
+				if (sy + 1 < sh)
+				{
+					z = std::min(z, sub[sx + (sy + 1) * sw]);
+					if (sx + 1 < sw)
+						z = std::min(z, sub[sx + 1 + (sy + 1) * sw]);
+				}
+				lev[tx + ty * lw] = z;
+			}
+		}
+	}
+}
+
+// true if all samples of tile inside rect are above z
+bool Renderer::HiZTest(int level, int tx, int ty, const int rect[4], float z) const
+{
+	if (hiz_level[level][tx + ty * hiz_w[level]] > z)
+		return true;
+
+	if (!level)
+	{
+		// finest tile failed, look at its samples
+		int x0 = std::max(rect[0], tx * HIZ_TILE), x1 = std::min(rect[2], (tx + 1) * HIZ_TILE - 1);
+		int y0 = std::max(rect[1], ty * HIZ_TILE), y1 = std::min(rect[3], (ty + 1) * HIZ_TILE - 1);
+		for (int y = y0; y <= y1; y++)
+		{
+			const Sample* row = sample_buffer.ptr + y * sample_buffer.w;
+			for (int x = x0; x <= x1; x++)
+			{
+				if (row[x].height <= z)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	level--;
+	int size = HIZ_TILE << level;
+	for (int cy = 2 * ty; cy <= 2 * ty + 1 && cy < hiz_h[level]; cy++)
+	{
+		if ((cy + 1) * size <= rect[1] || cy * size > rect[3])
+			continue;
+		for (int cx = 2 * tx; cx <= 2 * tx + 1 && cx < hiz_w[level]; cx++)
+		{
+			if ((cx + 1) * size <= rect[0] || cx * size > rect[2])
+				continue;
+			if (!HiZTest(level, cx, cy, rect, z))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool Renderer::Occluded(const int rect[4], float z) const
+{
+	int top = hiz_levels - 1;
+	int size = HIZ_TILE << top;
+	for (int ty = rect[1] / size; ty <= rect[3] / size; ty++)
+	{
+		for (int tx = rect[0] / size; tx <= rect[2] / size; tx++)
+		{
+			if (!HiZTest(top, tx, ty, rect, z))
+				return false;
+		}
+	}
+	return true;
+}
+
 void Renderer::RenderMesh(Mesh* m, double* tm, void* cookie)
 {
 	Renderer* r = (Renderer*)cookie;
@@ -1368,13 +1698,54 @@ void Renderer::RenderMesh(Mesh* m, double* tm, void* cookie)
 	{
 		r->mul[0] * HEIGHT_CELLS, r->mul[1] * HEIGHT_CELLS, 0.0, 0.0,
 		r->mul[2] * HEIGHT_CELLS, r->mul[3] * HEIGHT_CELLS, 0.0, 0.0,
-		r->mul[4], r->mul[5], global_refl_mode ? -1.0 : 1.0, 0.0,
+		r->mul[4], r->mul[5], r->refl_mode ? -1.0 : 1.0, 0.0,
 		r->add[0], r->add[1], r->add[2], 1.0
 	};
 
+	r->inst_mesh = m;
 	r->inst_tm = tm;
 	MatProduct(view_tm, tm, r->viewinst_tm);
-	QueryMesh(m, Renderer::RenderFace, r);
+
+	// screen rect & max depth of projected bbox bound all verts projections
+	float bbox[6];
+	GetMeshBBox(m, bbox);
+	int rect[4] = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+	int z = INT_MIN;
+	bool behind = false;
+	for (int c = 0; c < 8; c++)
+	{
+		float xyz[3] = { bbox[c & 1], bbox[2 + ((c >> 1) & 1)], bbox[4 + (c >> 2)] };
+		int v[4];
+		if (!r->ProjectVert(xyz, v))
+		{
+			behind = true;
+			break;
+		}
+		rect[0] = std::min(rect[0], v[0]);
+		rect[1] = std::min(rect[1], v[1]);
+		rect[2] = std::max(rect[2], v[0]);
+		rect[3] = std::max(rect[3], v[1]);
+		z = std::max(z, v[2]);
+	}
+
+	if (!behind)
+	{
+		rect[0] = std::max(rect[0], 0);
+		rect[1] = std::max(rect[1], 0);
+		rect[2] = std::min(rect[2], r->sample_buffer.w - 1);
+		rect[3] = std::min(rect[3], r->sample_buffer.h - 1);
+		if (rect[0] > rect[2] || rect[1] > rect[3])
+			return;
+
+		// lines pass depth test half cell deeper than faces
+		if (r->hiz && r->Occluded(rect, z + HEIGHT_SCALE / 2.0f))
+			return;
+	}
+
+	QueryMesh(m, Renderer::RenderFaces, r);
+
+	if (r->hiz && !behind)
+		r->UpdateHiZ(rect);
 
 	// transform verts int integer coords
 	// ...
@@ -1392,8 +1763,204 @@ void Renderer::RenderMesh(Mesh* m, double* tm, void* cookie)
 	// else apply gridlines etc.
 }
 
+// decal layer, ring of stamps linked into hash of patches they cover
+#define DECAL_CAPACITY 4096 // oldest get overwritten
+#define DECAL_BUCKETS 1024
+#define DECAL_REFS 4 // patches per decal, radius is clamped so it fits
+#define DECAL_LIFE 120000000 // us
+#define DECAL_FADE 30000000 // us, dithered out at the end of life
+
+struct Decal
+{
+	float x, y, r; // visual cells
+	uint64_t birth;
+	uint32_t seq; // dither seed
+	int matid;
+	int refs;
+	int linked; // bit per ref still in its bucket
+	int patch[DECAL_REFS][2];
+};
+
+struct DecalRef
+{
+	int next; // ref index + 1, 0 ends
+};
+
+static Decal decal[DECAL_CAPACITY];
+static DecalRef decal_ref[DECAL_CAPACITY * DECAL_REFS]; // ref k of decal i at i * DECAL_REFS + k
+static int decal_bucket[DECAL_BUCKETS]; // first ref index + 1
+static int decal_head = 0;
+static int decal_num = 0;
+static uint32_t decal_seq = 0;
+static uint64_t decal_clock = 0; // last render stamp
+
+static inline int DecalBucket(int px, int py)
+{
+	return ((px * 73856093) ^ (py * 19349663)) & (DECAL_BUCKETS - 1);
+}
+
+static void UnlinkDecal(int i)
+{
+	Decal* d = decal + i;
+	for (int k = 0; k < d->refs; k++)
+	{
+		if (!(d->linked & (1 << k)))
+			continue;
+
+		int ref = i * DECAL_REFS + k + 1;
+		int* link = decal_bucket + DecalBucket(d->patch[k][0], d->patch[k][1]);
+		while (*link && *link != ref)
+			link = &decal_ref[*link - 1].next;
+		if (*link)
+			*link = decal_ref[ref - 1].next;
+	}
+	d->linked = 0;
+}
+
+void AddTerrainDecal(const float xy[2], float r, int matid)
+{
+	if (r <= 0)
+		return;
+	if (r > VISUAL_CELLS / 2)
+		r = VISUAL_CELLS / 2;
+
+	int i = decal_head;
+	decal_head = (decal_head + 1) % DECAL_CAPACITY;
+	if (decal_num < DECAL_CAPACITY)
+		decal_num++;
+	else
+		UnlinkDecal(i);
+
+	Decal* d = decal + i;
+	d->x = xy[0];
+	d->y = xy[1];
+	d->r = r;
+	d->birth = decal_clock;
+	d->seq = decal_seq++;
+	d->matid = matid;
+	d->refs = 0;
+	d->linked = 0;
+
+	int px0 = (int)floorf((xy[0] - r) / VISUAL_CELLS), px1 = (int)floorf((xy[0] + r) / VISUAL_CELLS);
+	int py0 = (int)floorf((xy[1] - r) / VISUAL_CELLS), py1 = (int)floorf((xy[1] + r) / VISUAL_CELLS);
+
+	for (int py = py0; py <= py1; py++)
+	{
+		for (int px = px0; px <= px1; px++)
+		{
+			int k = d->refs++;
+			d->patch[k][0] = px;
+			d->patch[k][1] = py;
+			d->linked |= 1 << k;
+
+			int ref = i * DECAL_REFS + k;
+			int* bucket = decal_bucket + DecalBucket(px, py);
+			decal_ref[ref].next = *bucket;
+			*bucket = ref + 1;
+		}
+	}
+}
+
+// composites live decals of patch at visual x,y over its visual map into out
+// newest decal wins, returns false (out untouched) if there are none
+static bool CompositeDecals(int x, int y, const uint16_t* map, uint16_t out[VISUAL_CELLS * VISUAL_CELLS], uint64_t now)
+{
+	int px = x / VISUAL_CELLS, py = y / VISUAL_CELLS;
+
+	uint64_t painted = 0;
+	bool any = false;
+
+	int* link = decal_bucket + DecalBucket(px, py);
+	while (*link)
+	{
+		int ref = *link - 1;
+		int i = ref / DECAL_REFS, k = ref % DECAL_REFS;
+		Decal* d = decal + i;
+
+		if (d->patch[k][0] != px || d->patch[k][1] != py)
+		{
+			link = &decal_ref[ref].next;
+			continue;
+		}
+
+		uint64_t age = now - d->birth;
+		if (age >= DECAL_LIFE)
+		{
+			// expired, drop it from bucket
+			*link = decal_ref[ref].next;
+			d->linked &= ~(1 << k);
+			continue;
+		}
+
+		if (!any)
+		{
+			memcpy(out, map, sizeof(uint16_t) * VISUAL_CELLS * VISUAL_CELLS);
+			any = true;
+		}
+
+		// cells survive fade while their hash is under remaining life
+		uint32_t keep = age > DECAL_LIFE - DECAL_FADE ? (uint32_t)((DECAL_LIFE - age) * 256 / DECAL_FADE) : 256;
+		float rr = d->r * d->r;
+
+		for (int v = 0, c = 0; v < VISUAL_CELLS; v++)
+		{
+			for (int u = 0; u < VISUAL_CELLS; u++, c++)
+			{
+				float dx = u + x - d->x;
+				float dy = v + y - d->y;
+				if (dx*dx + dy*dy >= rr || (painted >> c) & 1)
+					continue;
+
+				if (keep < 256)
+				{
+					uint32_t h = (d->seq * 0x9E3779B1u) ^ ((u + x) * 73856093u) ^ ((v + y) * 19349663u);
+					h ^= h >> 15; h *= 0x2C1B3C6Du; h ^= h >> 12;
+					if ((h & 0xFF) >= keep)
+						continue;
+				}
+
+				out[c] = (out[c] & ~0x00FF) | d->matid;
+				painted |= ((uint64_t)1) << c;
+			}
+		}
+
+		link = &decal_ref[ref].next;
+	}
+
+	return any;
+}
+
+// coarse patch is used if its visual cells shrink to at most this many samples
+// (finer cells than a sample are only point sampled anyway)
+#define PATCH_LOD_SAMPLES 2.0f
+
+bool Renderer::PatchLOD(int x, int y, int range, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+
+	float viewer_dist = 1;
+	if (r->perspective)
+	{
+		// view_dir is horizontal so nearest corner gives min distance of whole node
+		float span = (float)(range * HEIGHT_CELLS);
+		viewer_dist =
+			(x * HEIGHT_CELLS - r->view_pos[0]) * r->view_dir[0] + fminf(0, span * r->view_dir[0]) +
+			(y * HEIGHT_CELLS - r->view_pos[1]) * r->view_dir[1] + fminf(0, span * r->view_dir[1]);
+
+		if (viewer_dist <= 0)
+			return false;
+	}
+
+	// samples per visual cell at viewer_dist == 1 (zoom included)
+	double* mul = r->mul;
+	float cell = HEIGHT_CELLS * sqrtf((float)fmax(mul[0] * mul[0] + mul[2] * mul[2], mul[1] * mul[1] + mul[3] * mul[3]));
+
+	return cell * range / VISUAL_CELLS <= PATCH_LOD_SAMPLES * viewer_dist;
+}
+
 // we could easily make it template of <Sample,Shader>
-void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/)
+// range > VISUAL_CELLS for coarse patches of far nodes, see QueryTerrainLOD
+void Renderer::RenderPatch(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/)
 {
 	struct Shader
 	{
@@ -1401,7 +1968,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 		{
 			if (s->height < z)
 			{
-				if (global_refl_mode)
+				if (refl)
 				{
 					if (z < water + HEIGHT_SCALE / 8)
 					{
@@ -1532,8 +2099,8 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 
 		inline void Diffuse(int dzdx, int dzdy)
 		{
-			float nl = (float)sqrt(dzdx * dzdx + dzdy * dzdy + HEIGHT_SCALE * HEIGHT_SCALE);
-			float df = (dzdx * light[0] + dzdy * light[1] + HEIGHT_SCALE * light[2]) / nl;
+			float nl = (float)sqrt(dzdx * dzdx + dzdy * dzdy + run * run);
+			float df = (dzdx * light[0] + dzdy * light[1] + run * light[2]) / nl;
 			df = df * (1.0f - 0.5f*light[3]) + 0.5f*light[3];
 			diffuse = df <= 0 ? 0 : (int)(df * 0xFF);
 		}
@@ -1541,6 +2108,8 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 		int* uv; // points to array of 6 ints (u0,v0,u1,v1,u2,v2) each is equal to 0 or VISUAL_CELLS
 		uint16_t* map; // points to array of VISUAL_CELLS x VISUAL_CELLS ushorts
 		float water;
+		bool refl; // reflection pass
+		float run; // horizontal z-steps per height cell, HEIGHT_SCALE for patches
 		float light[4];
 		uint8_t diffuse; // shading experiment
 		uint8_t parity;
@@ -1569,14 +2138,14 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 
 	for (int dy = 0; dy <= HEIGHT_CELLS; dy++)
 	{
-		int vy = y * HEIGHT_CELLS + dy * VISUAL_CELLS;
+		int vy = y * HEIGHT_CELLS + dy * range; // range/HEIGHT_CELLS visual cells per height cell
 
 		for (int dx = 0; dx <= HEIGHT_CELLS; dx++)
 		{
-			int vx = x * HEIGHT_CELLS + dx * VISUAL_CELLS;
+			int vx = x * HEIGHT_CELLS + dx * range;
 			int vz = *(hm++);
 
-			if (global_refl_mode)
+			if (r->refl_mode)
 			{
 				if (r->perspective) // #if PERSPECTIVE_TEST
 				{
@@ -1741,12 +2310,19 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 	// 3 - under water
 
 #ifdef DARK_TERRAIN
-	shader.dark = GetTerrainDark(p);
+	shader.dark = r->horizon ? GetTerrainHorizonDark(p, r->horizon_light) : GetTerrainDark(p);
 #endif
 
-	shader.parity = (((x^y)/VISUAL_CELLS) & 1) + 1; 
+	shader.parity = (((x^y)/range) & 1) + 1; 
 	shader.water = r->water;
+	shader.refl = r->refl_mode;
 	shader.map = GetTerrainVisualMap(p);
+	shader.run = (float)(HEIGHT_SCALE * range / VISUAL_CELLS);
+
+	// decals are too small to show on coarse patches
+	uint16_t decal_map[VISUAL_CELLS * VISUAL_CELLS];
+	if (range == VISUAL_CELLS && CompositeDecals(x, y, shader.map, decal_map, r->stamp))
+		shader.map = decal_map;
 
 	shader.light[0] = r->light[0];
 	shader.light[1] = r->light[1];
@@ -1783,7 +2359,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				// then if current light timestamp is different than in terrain we need to update diffuse (into terrain)
 				// now we should simply use diffuse from terrain
 				// note: if terrain is being modified, we should clear its timestamp or immediately update diffuse
-				if (global_refl_mode)
+				if (r->refl_mode)
 				{
 					//done
 					int lo_uv[] = { uv[dx][0],uv[dy][1], uv[dx][1],uv[dy][0], uv[dx][0],uv[dy][0] };
@@ -1806,7 +2382,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				//   \|
 				//    '
 				// upper triangle
-				if (global_refl_mode)
+				if (r->refl_mode)
 				{
 					//done
 					int up_uv[] = { uv[dx][1],uv[dy][0], uv[dx][0],uv[dy][1], uv[dx][1],uv[dy][1] };
@@ -1831,7 +2407,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				//   /|
 				//  /_|
 				// '  '
-				if (global_refl_mode)
+				if (r->refl_mode)
 				{
 					// done
 					int lo_uv[] = { uv[dx][0],uv[dy][0], uv[dx][1],uv[dy][1], uv[dx][1],uv[dy][0] };
@@ -1855,7 +2431,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				// | / 
 				// |/  
 				// '
-				if (global_refl_mode)
+				if (r->refl_mode)
 				{
 					//done
 					int up_uv[] = { uv[dx][1],uv[dy][1], uv[dx][0],uv[dy][0], uv[dx][0],uv[dy][1] };
@@ -1877,7 +2453,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 	}
 
 
-	if (!global_refl_mode) // disabled on reflections
+	if (!r->refl_mode) // disabled on reflections
 	{
 		// grid lines thru middle of patch?
 		int mid = (HEIGHT_CELLS + 1) / 2;
@@ -2662,13 +3238,15 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 {
 	r->perspective = perspective;
 
-	if (inst)
-		HideInst(inst);
+	// world is only read, inst is skipped by queries rather than hidden
+	WorldQuery wq = { 0 };
+	wq.skip = inst;
 
 	AnsiCell* out_ptr = ptr;
 
 	double dt = stamp - r->stamp;
 	r->stamp = stamp;
+	decal_clock = stamp;
 	r->pn_time += 0.02 * dt / 16666.0; // dt is in microsecs
 	if (r->pn_time >= 1000000000000.0)
 		r->pn_time = 0.0;
@@ -2759,6 +3337,21 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	r->light[2] = lt[2];
 	r->light[3] = lt[3];
 
+#ifdef DARK_TERRAIN
+	// only direction matters, bake may have got light of other length (game normalizes it)
+	float baked[3];
+	r->horizon = false;
+	if (t && GetTerrainDarkLight(t, baked))
+	{
+		float bb = baked[0] * baked[0] + baked[1] * baked[1] + baked[2] * baked[2];
+		float ll = lt[0] * lt[0] + lt[1] * lt[1] + lt[2] * lt[2];
+		float bl = baked[0] * lt[0] + baked[1] * lt[1] + baked[2] * lt[2];
+		r->horizon = bl <= 0 || bl * bl < 0.9999f * bb * ll; // off by more than ~0.6 deg
+	}
+	if (r->horizon)
+		r->horizon_light = GetTerrainHorizonLight(lt);
+#endif
+
 	// memset(r->sample_buffer.ptr, 0x00, dw*dh * sizeof(Sample));
 	memcpy(r->sample_buffer.ptr, r->sample_buffer.ptr + dw * dh, dw*dh * sizeof(Sample));
 
@@ -2988,9 +3581,12 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 
 	r->sprites = 0;
 
-	QueryTerrain(t, planes, clip_world, view_flags, Renderer::RenderPatch, r);
+	QueryTerrainLOD lod = { Renderer::PatchLOD, Renderer::RenderPatch };
+	QueryTerrain(t, planes, clip_world, view_flags, &lod, r);
+	r->BuildHiZ();
 	QueryWorldCB cb = { Renderer::RenderMesh , Renderer::RenderSprite };
-	QueryWorld(w, planes, clip_world, &cb, r);
+	QueryWorld(w, planes, clip_world, &cb, r, &wq);
+	r->hiz = false; // reflection pass can lower heights to water level
 
 	// player shadow
 	// double inv_tm[16];
@@ -3169,11 +3765,11 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	}
 	// #endif
 
-	global_refl_mode = true;
-	QueryTerrain(t, planes, clip_world, view_flags, Renderer::RenderPatch, r);
-	QueryWorld(w, planes, clip_world, &cb, r);
+	r->refl_mode = true;
+	QueryTerrain(t, planes, clip_world, view_flags, &lod, r);
+	QueryWorld(w, planes, clip_world, &cb, r, &wq);
 
-	global_refl_mode = false;
+	r->refl_mode = false;
 
 	// clear and write new water ripples from player history position
 	// do not emit wave if given z is greater than water level!
@@ -4194,9 +4790,6 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	// now we should send request to server for changing exclusive item list
 	// and return only those that are already confirmed as exclusive and still visible now
 	// (maybe we should introduce few frames window until we request de-exclusivity?)
-
-	if (inst)
-		ShowInst(inst);
 }
 
 bool ProjectCoords(Renderer* r, const float pos[3], int view[3])
@@ -59,6 +59,11 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, 		//
 	const int scene_shift[2],
 	bool perspective);
 
+// runtime terrain decals (blood etc), composited over patch visuals while rendering
+// terrain data isn't touched, decals fade out and expire, oldest are overwritten when full
+// radius is in visual cells, clamped to half of patch
+void AddTerrainDecal(const float xy[2], float r, int matid);
+
 bool ProjectCoords(Renderer* r, const float pos[3], int view[3]); // like a sprite!
 bool UnprojectCoords2D(Renderer* r, const int xy[2], float pos[3]); // reads height from buffer first!
 bool UnprojectCoords3D(Renderer* r, const int xy[3], float pos[3]); // reads height from buffer first!
@@ -181,23 +181,10 @@ int AverageGlyphTransp(const AnsiCell* ptr, int mask);
 
 extern "C" void *tinfl_decompress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags);
 
-Sprite* LoadSprite(const char* path, const char* name, /*bool has_refl,*/ const uint8_t* recolor, bool detached)
+// reads, inflates and converts xp file, touches no globals so it can run on any thread
+// returned sprite is neither linked nor named yet
+static Sprite* DecodeSprite(const char* path, const uint8_t* recolor)
 {
-	if (!detached && !recolor)
-	{
-		// first, lookup linked sprites, return pointer to already loaded one if found
-		Sprite* s = GetFirstSprite();
-		while (s)
-		{
-			if (strcmp(s->name, name) == 0)
-			{
-				s->refs++;
-				return s;
-			}
-			s = s->next;
-		}
-	}
-
 	FILE* f = fopen(path, "rb");
 	if (!f)
 		return 0;
@@ -842,6 +829,11 @@ Sprite* LoadSprite(const char* path, const char* name, /*bool has_refl,*/ const
 	// u_inflate_free(out);
 	free(out);
 
+	return sprite;
+}
+
+static void LinkSprite(Sprite* sprite, const char* name, bool detached)
+{
 	if (detached)
 	{
 		sprite->prev = 0;
@@ -862,10 +854,163 @@ Sprite* LoadSprite(const char* path, const char* name, /*bool has_refl,*/ const
 		sprite->name = strdup(name);
 	else
 		sprite->name = 0;
+}
+
+static Sprite* FindSprite(const char* name)
+{
+	// lookup linked sprites, return pointer to already loaded one if found
+	Sprite* s = GetFirstSprite();
+	while (s)
+	{
+		if (s->name && strcmp(s->name, name) == 0)
+			return s;
+		s = s->next;
+	}
+	return 0;
+}
 
+Sprite* LoadSprite(const char* path, const char* name, /*bool has_refl,*/ const uint8_t* recolor, bool detached)
+{
+	if (!detached && !recolor)
+	{
+		Sprite* s = FindSprite(name);
+		if (s)
+		{
+			s->refs++;
+			return s;
+		}
+	}
+
+	Sprite* sprite = DecodeSprite(path, recolor);
+	if (sprite)
+		LinkSprite(sprite, name, detached);
 	return sprite;
 }
 
+struct SpriteBatch
+{
+	struct Job
+	{
+		Sprite** dst;
+		char* path;
+		char* name;
+		uint8_t* recolor;
+		bool detached;
+		int share; // index of earlier job loading same sprite or -1
+		Sprite* sprite; // decoded by job
+	};
+
+	int jobs;
+	int job_cap;
+	Job* job;
+};
+
+SpriteBatch* CreateSpriteBatch()
+{
+	SpriteBatch* sb = (SpriteBatch*)malloc(sizeof(SpriteBatch));
+	sb->jobs = 0;
+	sb->job_cap = 0;
+	sb->job = 0;
+	return sb;
+}
+
+void QueueSprite(SpriteBatch* sb, Sprite** dst, const char* path, const char* name, const uint8_t* recolor, bool detached)
+{
+	*dst = 0;
+
+	int share = -1;
+	if (!detached && !recolor && name)
+	{
+		Sprite* s = FindSprite(name);
+		if (s)
+		{
+			s->refs++;
+			*dst = s;
+			return;
+		}
+
+		for (int i = 0; i < sb->jobs; i++)
+		{
+			SpriteBatch::Job* j = sb->job + i;
+			if (!j->detached && !j->recolor && j->share < 0 && j->name && strcmp(j->name, name) == 0)
+			{
+				share = i;
+				break;
+			}
+		}
+	}
+
+	if (sb->jobs == sb->job_cap)
+	{
+		sb->job_cap = sb->job_cap ? 2 * sb->job_cap : 64;
+		sb->job = (SpriteBatch::Job*)realloc(sb->job, sizeof(SpriteBatch::Job) * sb->job_cap);
+	}
+
+	SpriteBatch::Job* j = sb->job + sb->jobs++;
+	j->dst = dst;
+	j->path = strdup(path);
+	j->name = name ? strdup(name) : 0;
+	j->recolor = 0;
+	j->detached = detached;
+	j->share = share;
+	j->sprite = 0;
+
+	if (recolor)
+	{
+		// rgb pairs followed by zero terminated glyph pairs
+		int len = 1 + 6 * recolor[0];
+		while (recolor[len])
+			len += 2;
+		len++;
+		j->recolor = (uint8_t*)malloc(len);
+		memcpy(j->recolor, recolor, len);
+	}
+}
+
+int GetSpriteBatchJobs(SpriteBatch* sb)
+{
+	return sb->jobs;
+}
+
+void LoadSpriteJobs(SpriteBatch* sb, int from, int to)
+{
+	for (int i = from; i < to; i++)
+	{
+		SpriteBatch::Job* j = sb->job + i;
+		if (j->share < 0)
+			j->sprite = DecodeSprite(j->path, j->recolor);
+	}
+}
+
+void DeleteSpriteBatch(SpriteBatch* sb)
+{
+	// link in queue order, so sprite list is same as with LoadSprite() calls
+	for (int i = 0; i < sb->jobs; i++)
+	{
+		SpriteBatch::Job* j = sb->job + i;
+		if (j->share >= 0)
+		{
+			j->sprite = sb->job[j->share].sprite;
+			if (j->sprite)
+				j->sprite->refs++;
+		}
+		else
+		if (j->sprite)
+			LinkSprite(j->sprite, j->name, j->detached);
+
+		*j->dst = j->sprite;
+
+		free(j->path);
+		if (j->name)
+			free(j->name);
+		if (j->recolor)
+			free(j->recolor);
+	}
+
+	free(sb->job);
+	free(sb);
+}
+
 void FillRect(AnsiCell* ptr, int width, int height, int x, int y, int w, int h, AnsiCell ac)
 {
 	if (x < 0)
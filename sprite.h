@@ -39,6 +39,18 @@ struct Sprite
 };
 
 Sprite* LoadSprite(const char* path, const char* name, /*bool has_refl = true,*/ const uint8_t* recolor = 0, bool detached = false);
+
+// same as LoadSprite() but deferred, *dst is set by DeleteSpriteBatch() (to 0 if file fails)
+// LoadSpriteJobs() can be called from many threads at once on disjoint job ranges,
+// it only reads & decodes files, all jobs must be loaded before DeleteSpriteBatch()
+// which links sprites in queue order (no other sprites should be loaded meanwhile)
+struct SpriteBatch;
+SpriteBatch* CreateSpriteBatch();
+void QueueSprite(SpriteBatch* sb, Sprite** dst, const char* path, const char* name, const uint8_t* recolor = 0, bool detached = false);
+int GetSpriteBatchJobs(SpriteBatch* sb);
+void LoadSpriteJobs(SpriteBatch* sb, int from, int to);
+void DeleteSpriteBatch(SpriteBatch* sb);
+
 Sprite* GetFirstSprite();
 Sprite* GetPrevSprite(Sprite* s);
 Sprite* GetNextSprite(Sprite* s);
@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "startup.h"
+#include "terrain.h"
+#include "world.h"
+#include "render.h"
+#include "sprite.h"
+#include "game.h"
+#include "enemygen.h"
+#include "network.h"
+
+extern char base_path[];
+
+// timeline, every thread records tasks it has run
+struct StartupTask
+{
+	const char* name;
+	int lane;
+	int jobs; // 0 for single task
+	uint64_t begin, end; // us
+
+	static int Order(const void* a, const void* b)
+	{
+		const StartupTask* p = (const StartupTask*)a;
+		const StartupTask* q = (const StartupTask*)b;
+		if (p->begin != q->begin)
+			return p->begin < q->begin ? -1 : 1;
+		return p->lane - q->lane;
+	}
+};
+
+#define STARTUP_TASKS 1024
+static StartupTask startup_task[STARTUP_TASKS];
+static volatile unsigned int startup_tasks = 0; // interlocked
+
+static uint64_t StartupTime()
+{
+	#ifdef _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return (uint64_t)(c.QuadPart / f.QuadPart * 1000000 + c.QuadPart % f.QuadPart * 1000000 / f.QuadPart);
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	#endif
+}
+
+static void TraceTask(const char* name, int lane, int jobs, uint64_t begin, uint64_t end)
+{
+	unsigned int t = INTERLOCKED_INC(&startup_tasks) - 1;
+	if (t >= STARTUP_TASKS)
+		return;
+	StartupTask* st = startup_task + t;
+	st->name = name;
+	st->lane = lane;
+	st->jobs = jobs;
+	st->begin = begin;
+	st->end = end;
+}
+
+static void PrintTrace(FILE* f, uint64_t zero)
+{
+	int tasks = std::min((int)startup_tasks, STARTUP_TASKS);
+
+	// sorted by begin, lane 0 tasks are critical path (others are waited for)
+	qsort(startup_task, tasks, sizeof(StartupTask), StartupTask::Order);
+
+	uint64_t end = zero;
+	fprintf(f, "startup timeline (ms), lane 0 is main thread:\n");
+	for (int t = 0; t < tasks; t++)
+	{
+		StartupTask* st = startup_task + t;
+		if (st->jobs)
+			fprintf(f, "  lane %2d %8.2f .. %8.2f  %-12s (%d jobs)\n", st->lane, (st->begin - zero) * 0.001, (st->end - zero) * 0.001, st->name, st->jobs);
+		else
+			fprintf(f, "  lane %2d %8.2f .. %8.2f  %s\n", st->lane, (st->begin - zero) * 0.001, (st->end - zero) * 0.001, st->name);
+		end = std::max(end, st->end);
+	}
+	fprintf(f, "startup total %.2f ms on %d cores\n", (end - zero) * 0.001, THREAD_CORES());
+}
+
+// one stage of independent jobs, run on all cores
+// caller thread can do single task first (it is joined together with jobs)
+struct StartupStage
+{
+	const char* name;
+	int jobs;
+	volatile unsigned int next; // interlocked
+	void (*job)(int j, void* cookie);
+	void* cookie;
+};
+
+struct StartupLane
+{
+	StartupStage* stage;
+	int lane;
+};
+
+static void* StartupWorker(void* arg)
+{
+	StartupLane* sl = (StartupLane*)arg;
+	StartupStage* st = sl->stage;
+
+	int jobs = 0;
+	uint64_t begin = StartupTime();
+	while (1)
+	{
+		int j = (int)INTERLOCKED_INC(&st->next) - 1;
+		if (j >= st->jobs)
+			break;
+		st->job(j, st->cookie);
+		jobs++;
+	}
+
+	if (jobs)
+		TraceTask(st->name, sl->lane, jobs, begin, StartupTime());
+	return 0;
+}
+
+static void RunStage(StartupStage* st, const char* task_name = 0, void (*task)(void* cookie) = 0, void* task_cookie = 0)
+{
+	st->next = 0;
+
+	static const int max_workers = 64;
+	THREAD_HANDLE* worker[max_workers];
+	StartupLane lane[max_workers + 1];
+	int workers = std::min(std::min(THREAD_CORES(), max_workers), st->jobs) - 1; // we're the last one
+	for (int i = 0; i < workers; i++)
+	{
+		lane[i + 1].stage = st;
+		lane[i + 1].lane = i + 1;
+		worker[i] = THREAD_CREATE(StartupWorker, lane + i + 1);
+	}
+
+	if (task)
+	{
+		uint64_t begin = StartupTime();
+		task(task_cookie);
+		TraceTask(task_name, 0, 0, begin, StartupTime());
+	}
+
+	lane[0].stage = st;
+	lane[0].lane = 0;
+	StartupWorker(lane + 0);
+
+	for (int i = 0; i < workers; i++)
+	{
+		if (worker[i])
+			THREAD_JOIN(worker[i]);
+	}
+}
+
+struct StartupLoad
+{
+	const char* a3d_path;
+	FILE* f;
+	Terrain* terrain;
+	World* world;
+	Material* mat;
+
+	Mesh** mesh;
+	WorldBuild* wb;
+	DarkBake* db;
+};
+
+// overlaps sprite jobs, stream is left at world
+static void LoadTerrainTask(void* cookie)
+{
+	StartupLoad* sl = (StartupLoad*)cookie;
+	sl->f = fopen(sl->a3d_path, "rb");
+	if (!sl->f)
+		return;
+
+	sl->terrain = LoadTerrain(sl->f, true);
+	if (!sl->terrain)
+		return;
+
+	for (int i = 0; i < 256; i++)
+	{
+		if (fread(sl->mat[i].shade, 1, sizeof(MatCell) * 4 * 16, sl->f) != sizeof(MatCell) * 4 * 16)
+			break;
+	}
+}
+
+static void SpriteJob(int j, void* cookie)
+{
+	LoadSpriteJobs((SpriteBatch*)cookie, j, j + 1);
+}
+
+static void RunSpriteJobs(SpriteBatch* sb, void* cookie)
+{
+	StartupStage st;
+	st.name = "sprites";
+	st.jobs = GetSpriteBatchJobs(sb);
+	st.job = SpriteJob;
+	st.cookie = sb;
+	RunStage(&st, "terrain", LoadTerrainTask, cookie);
+}
+
+static void MeshJob(int j, void* cookie)
+{
+	StartupLoad* sl = (StartupLoad*)cookie;
+	Mesh* m = sl->mesh[j];
+
+	char mesh_name[256];
+	GetMeshName(m, mesh_name, 256);
+	char obj_path[4096];
+	sprintf(obj_path, "%smeshes/%s", base_path, mesh_name);
+	if (!UpdateMesh(m, obj_path))
+	{
+		// what now?
+		// missing mesh file!
+	}
+}
+
+static void BuildJob(int j, void* cookie)
+{
+	StartupLoad* sl = (StartupLoad*)cookie;
+	BuildWorldJobs(sl->wb, j, j + 1);
+}
+
+#ifdef DARK_TERRAIN
+static void DarkJob(int j, void* cookie)
+{
+	StartupLoad* sl = (StartupLoad*)cookie;
+	BakeTerrainDark(sl->db, j, j + 1);
+}
+#endif
+
+bool LoadStartup(const char* a3d_path, Terrain** terrain, World** world, Material mat[256], bool enemy_gens, float dark_lightpos[3], FILE* trace)
+{
+	uint64_t zero = StartupTime();
+	uint64_t begin;
+	startup_tasks = 0;
+
+	StartupLoad sl;
+	memset(&sl, 0, sizeof(StartupLoad));
+	sl.a3d_path = a3d_path;
+	sl.mat = mat;
+
+	begin = StartupTime();
+	LoadSprites(RunSpriteJobs, &sl);
+	TraceTask("load sprites", 0, 0, begin, StartupTime());
+
+	if (sl.terrain)
+	{
+		// chunks not paged in stay mapped (or read to memory), file is closed below
+		char mesh_dir[4096];
+		sprintf(mesh_dir, "%smeshes/", base_path);
+
+		begin = StartupTime();
+		sl.world = LoadWorld(sl.f, false, mesh_dir);
+		TraceTask("world", 0, 0, begin, StartupTime());
+
+		if (sl.world && enemy_gens)
+		{
+			begin = StartupTime();
+			LoadEnemyGens(sl.f);
+			TraceTask("enemy gens", 0, 0, begin, StartupTime());
+		}
+	}
+
+	if (sl.f)
+		fclose(sl.f);
+
+	if (sl.world)
+	{
+		StartupStage st;
+
+		// reload meshes too
+		int meshes = 0;
+		for (Mesh* m = GetFirstMesh(sl.world); m; m = GetNextMesh(m))
+			meshes++;
+		sl.mesh = (Mesh**)malloc(sizeof(Mesh*) * (meshes + 1));
+		meshes = 0;
+		for (Mesh* m = GetFirstMesh(sl.world); m; m = GetNextMesh(m))
+			sl.mesh[meshes++] = m;
+
+		st.name = "meshes";
+		st.jobs = meshes;
+		st.job = MeshJob;
+		st.cookie = &sl;
+		RunStage(&st);
+		free(sl.mesh);
+
+		// this is the only case when instances has no valid bboxes yet
+		// as meshes weren't present during their creation
+		// now meshes are loaded ...
+		// so we need to update instance boxes with (,true)
+		sl.wb = CreateWorldBuild(sl.world, true);
+		st.name = "bsp";
+		st.jobs = GetWorldBuildJobs(sl.wb);
+		st.job = BuildJob;
+		RunStage(&st);
+		begin = StartupTime();
+		DeleteWorldBuild(sl.wb);
+		TraceTask("bsp flatten", 0, 0, begin, StartupTime());
+
+		#ifdef DARK_TERRAIN
+		if (dark_lightpos)
+		{
+			// only chunks loaded so far, game bakes others as it pages them in
+			// dark jobs trace rays on all lanes, mips must be there before
+			PrepareTerrainQueries(sl.terrain, true);
+			sl.db = CreateDarkBake(sl.terrain, sl.world, dark_lightpos, false, false, true);
+			st.name = "dark";
+			st.jobs = GetDarkBakeJobs(sl.db);
+			st.job = DarkJob;
+			RunStage(&st);
+			DeleteDarkBake(sl.db);
+		}
+		#endif
+	}
+
+	*terrain = sl.terrain;
+	*world = sl.world;
+
+	if (trace)
+		PrintTrace(trace, zero);
+
+	return sl.f != 0;
+}
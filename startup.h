@@ -0,0 +1,33 @@
+#pragma once
+
+struct Terrain;
+struct World;
+struct Material;
+
+// patches game keeps loaded (16 file chunks, enough for a view with margin)
+// passed to SetTerrainBudget() after LoadStartup(), shipped maps fit in whole
+#define TERRAIN_BUDGET 4096
+
+// mesh insts game keeps paged in and radius around player TouchTerrain() and
+// TouchWorld() page them in (covers a view with margin), WORLD_BUDGET is passed to
+// SetWorldBudget() after LoadStartup()
+#define WORLD_BUDGET 4096
+#define WORLD_TOUCH_RADIUS 256.0
+
+// threaded startup loading shared by game and server (web build loads sequentially)
+// tasks wait only where there is real dependency:
+//
+//   sprite files: decode jobs ----------+
+//   terrain & materials: main thread ---+--> world --> meshes: job per mesh --> bsp: subtree jobs --> dark: patch jobs
+//
+// world needs sprites (sprite & item insts) and stream position after materials
+// bsp needs all meshes loaded as it refreshes inst bboxes, dark bake needs bsp
+// enemy_gens==true reads enemy generators right after world (same stream)
+// world is loaded lazily too, mesh insts of chunked world (and their meshes) come in
+// with TouchWorld(), till then only loose insts and their meshes are there
+// dark_lightpos==0 skips dark bake, otherwise only chunks loaded so far are baked
+// (terrain is loaded lazily), others need dirty_only bake after TouchTerrain()
+// trace!=0 prints startup timeline there, one lane per thread (lane 0 is caller)
+//
+// returns false if a3d file can't be opened, terrain & world are left 0 then
+bool LoadStartup(const char* a3d_path, Terrain** terrain, World** world, Material mat[256], bool enemy_gens, float dark_lightpos[3], FILE* trace);
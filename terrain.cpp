@@ -10,6 +10,11 @@
 #include <assert.h>
 #include <float.h>
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef EDITOR
 #include "texheap.h"
 #endif
@@ -81,12 +86,15 @@ struct QuadItem
 struct Node : QuadItem
 {
 	QuadItem* quad[4]; // all 4 are same, either Nodes or Patches, at least 1 must not be NULL
+	Patch* mip; // coarse patch for far views, built on demand, see GetNodeMip()
 };
 
-struct Patch : QuadItem // 564 bytes (512x512 'raster' map would require 564KB)
+struct Patch : QuadItem // 280 bytes on 64 bit with DARK_TERRAIN and no TEXHEAP (4096 of them for 512x512 map)
 {
 #ifdef DARK_TERRAIN
 	uint64_t dark; // (8x8)
+	uint16_t dark_lo, dark_hi; // height range edited since last bake, none if lo > hi
+	uint32_t horizon[HEIGHT_CELLS * HEIGHT_CELLS]; // per height cell, 4 bit elevation per azimuth sector, see HorizonBits()
 #endif
 
 	// visual contains:                grass, sand, rock,
@@ -94,12 +102,46 @@ struct Patch : QuadItem // 564 bytes (512x512 'raster' map would require 564KB)
 	uint16_t visual[VISUAL_CELLS][VISUAL_CELLS];
 	uint16_t height[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1];
 	uint16_t diag; // (4x4)
+	uint8_t slot; // index + 1 in its PatchSlab, 0 if malloc'ed
 
 #ifdef TEXHEAP
 	TexAlloc* ta; // MUST BE AT THE TAIL OF STRUCT !!!
 #endif
 };
 
+#define GRID_SHIFT 4 // 16x16 patches per grid page
+#define GRID_MASK ((1 << GRID_SHIFT) - 1)
+#define SLAB_SHIFT 3 // 8x8 patches per slab
+#define SLAB_MASK ((1 << SLAB_SHIFT) - 1)
+#define NODE_CHUNK 256
+
+// patches are pooled in slabs by their coords (morton order inside),
+// so neighbors share cache lines / pages, pointers never move
+struct PatchSlab
+{
+	Patch patch[1 << (2 * SLAB_SHIFT)]; // MUST BE AT THE HEAD, see FreePatch()
+	uint64_t used; // bit per slot
+};
+
+struct GridPage
+{
+	Patch* patch[1 << (2 * GRID_SHIFT)];
+	PatchSlab* slab[1 << (2 * (GRID_SHIFT - SLAB_SHIFT))];
+};
+
+// nodes are pooled in chunks in order of creation (tree order when loading)
+struct NodeChunk
+{
+	NodeChunk* next;
+	Node node[NODE_CHUNK];
+};
+
+// lazy loading from chunked file, see LoadTerrain() and TouchTerrain()
+// pinning materializes file chunk of patch being added / deleted and keeps it
+struct TerrainFile;
+static void PinTerrainChunk(Terrain* t, int x, int y);
+static void DeleteTerrainFile(TerrainFile* tf);
+
 struct Terrain
 {
 	int x, y; // worldspace origin from tree origin
@@ -108,6 +150,27 @@ struct Terrain
 	int nodes;
 	int patches;
 
+	// sparse paged 2d array of patches for point lookups, tree is for culling
+	// keys are worldspace coords + grid_x,y (so they survive SetTerrainBase)
+	// and start at 0,0 in first page
+	int grid_x, grid_y;
+	int grid_w, grid_h; // in pages
+	GridPage** grid; // [grid_h][grid_w] pages, NULL until used
+
+	NodeChunk* node_chunk;
+	Node* node_free; // linked by parent
+
+	TerrainFile* lazy; // chunks not materialized yet, NULL if all are
+
+#ifdef DARK_TERRAIN
+	double dark_dirty[6]; // bbox of patches detached since last bake, none if [0] > [1]
+	float dark_light[3]; // lightpos of last bake
+	bool dark_baked;
+	bool dark_editor;
+	World* dark_world; // of last bake, chunks loaded after lazy one are baked with it
+	unsigned int dark_edits; // dark_edits_all at last bake
+#endif
+
 #ifdef TEXHEAP
 	TexHeap th; // MUST BE AT THE TAIL OF STRUCT !!!
 #endif
@@ -121,10 +184,210 @@ void GetTerrainBase(Terrain* t, int b[2])
 
 void SetTerrainBase(Terrain* t, const int b[2])
 {
+	t->grid_x += b[0] - t->x;
+	t->grid_y += b[1] - t->y;
 	t->x = b[0];
 	t->y = b[1];
 }
 
+// page holding worldspace patch x,y and x,y inside of it
+static GridPage* GridPageAt(Terrain* t, int x, int y, int* kx, int* ky, bool alloc)
+{
+	int gx = x + t->grid_x, gy = y + t->grid_y;
+	int px = gx >> GRID_SHIFT, py = gy >> GRID_SHIFT;
+
+	if (px < 0 || py < 0 || px >= t->grid_w || py >= t->grid_h)
+	{
+		if (!alloc)
+			return 0;
+
+		// grow page directory towards px,py with some slack
+		int x0 = px < 0 ? px - 1 - t->grid_w / 2 : 0;
+		int y0 = py < 0 ? py - 1 - t->grid_h / 2 : 0;
+		int x1 = px >= t->grid_w ? px + 2 + t->grid_w / 2 : t->grid_w;
+		int y1 = py >= t->grid_h ? py + 2 + t->grid_h / 2 : t->grid_h;
+
+		int w = x1 - x0, h = y1 - y0;
+		GridPage** grid = (GridPage**)calloc(w * h, sizeof(GridPage*));
+		for (int j = 0; j < t->grid_h; j++)
+			for (int i = 0; i < t->grid_w; i++)
+				grid[(j - y0) * w + i - x0] = t->grid[j * t->grid_w + i];
+
+		if (t->grid)
+			free(t->grid);
+		t->grid = grid;
+		t->grid_w = w;
+		t->grid_h = h;
+
+		t->grid_x -= x0 * (1 << GRID_SHIFT);
+		t->grid_y -= y0 * (1 << GRID_SHIFT);
+		px -= x0;
+		py -= y0;
+	}
+
+	*kx = gx & GRID_MASK;
+	*ky = gy & GRID_MASK;
+
+	GridPage** page = t->grid + py * t->grid_w + px;
+	if (!*page && alloc)
+		*page = (GridPage*)calloc(1, sizeof(GridPage));
+	return *page;
+}
+
+static void GridSet(Terrain* t, int x, int y, Patch* p)
+{
+	int kx, ky;
+	GridPage* page = GridPageAt(t, x, y, &kx, &ky, p != 0);
+	if (page)
+		page->patch[(ky << GRID_SHIFT) + kx] = p;
+}
+
+static Patch* AllocPatch(Terrain* t, int x, int y)
+{
+	int kx, ky;
+	GridPage* page = GridPageAt(t, x, y, &kx, &ky, true);
+
+	PatchSlab** slab = page->slab + ((ky >> SLAB_SHIFT) << (GRID_SHIFT - SLAB_SHIFT)) + (kx >> SLAB_SHIFT);
+	if (!*slab)
+	{
+		*slab = (PatchSlab*)malloc(sizeof(PatchSlab));
+		(*slab)->used = 0;
+	}
+
+	int i = 0;
+	for (int b = 0; b < SLAB_SHIFT; b++)
+		i |= (((kx >> b) & 1) << (2 * b)) | (((ky >> b) & 1) << (2 * b + 1));
+
+	uint64_t bit = ((uint64_t)1) << i;
+	if ((*slab)->used & bit)
+	{
+		// slot is still held by detached patch (undo)
+		Patch* p = (Patch*)malloc(sizeof(Patch));
+		p->slot = 0;
+		return p;
+	}
+
+	(*slab)->used |= bit;
+	Patch* p = (*slab)->patch + i;
+	p->slot = i + 1;
+	return p;
+}
+
+static void FreePatch(Patch* p)
+{
+	if (!p->slot)
+	{
+		free(p);
+		return;
+	}
+
+	int i = p->slot - 1;
+	PatchSlab* slab = (PatchSlab*)(p - i);
+	slab->used &= ~(((uint64_t)1) << i);
+}
+
+// releases slabs emptied by deletions in worldspace patch range
+static void TrimSlabs(Terrain* t, int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y <= y1; y++)
+	{
+		for (int x = x0; x <= x1; x++)
+		{
+			int kx, ky;
+			GridPage* page = GridPageAt(t, x, y, &kx, &ky, false);
+			if (!page)
+				continue;
+
+			PatchSlab** slab = page->slab + ((ky >> SLAB_SHIFT) << (GRID_SHIFT - SLAB_SHIFT)) + (kx >> SLAB_SHIFT);
+			if (*slab && !(*slab)->used)
+			{
+				free(*slab);
+				*slab = 0;
+			}
+		}
+	}
+}
+
+static Node* AllocNode(Terrain* t)
+{
+	if (!t->node_free)
+	{
+		NodeChunk* c = (NodeChunk*)malloc(sizeof(NodeChunk));
+		c->next = t->node_chunk;
+		t->node_chunk = c;
+
+		for (int i = NODE_CHUNK - 1; i >= 0; i--)
+		{
+			c->node[i].parent = (Node*)t->node_free;
+			t->node_free = c->node + i;
+		}
+	}
+
+	Node* n = t->node_free;
+	t->node_free = n->parent;
+	n->mip = 0;
+	return n;
+}
+
+static void FreeNode(Terrain* t, Node* n)
+{
+	if (n->mip)
+		free(n->mip);
+	n->parent = t->node_free;
+	t->node_free = n;
+}
+
+// node mips are built bottom-up so if a node has none, none of its parents has one either
+static void DropMips(QuadItem* q)
+{
+	for (Node* n = q->parent; n && n->mip; n = n->parent)
+	{
+		free(n->mip);
+		n->mip = 0;
+	}
+}
+
+#ifdef DARK_TERRAIN
+// shadow casters edited since last bake, see CreateDarkBake()
+static void ExtendDarkDirty(double box[6], const double add[6])
+{
+	if (box[0] > box[1])
+	{
+		memcpy(box, add, sizeof(double[6]));
+		return;
+	}
+
+	for (int a = 0; a < 6; a += 2)
+	{
+		box[a] = add[a] < box[a] ? add[a] : box[a];
+		box[a + 1] = add[a + 1] > box[a + 1] ? add[a + 1] : box[a + 1];
+	}
+}
+
+// bumped by every edit marking patches dark dirty (patches don't know their terrain)
+// so polling for dirty_only bake doesn't need to walk all patches
+static unsigned int dark_edits_all = 0;
+
+static void MarkDarkDirty(Patch* p)
+{
+	dark_edits_all++;
+	p->dark_lo = p->lo < p->dark_lo ? p->lo : p->dark_lo;
+	p->dark_hi = p->hi > p->dark_hi ? p->hi : p->dark_hi;
+}
+
+static void MarkDarkDirty(Terrain* t, Patch* p, int x, int y)
+{
+	double box[6] =
+	{
+		(double)(x * VISUAL_CELLS), (double)((x + 1) * VISUAL_CELLS),
+		(double)(y * VISUAL_CELLS), (double)((y + 1) * VISUAL_CELLS),
+		(double)p->lo, (double)p->hi
+	};
+	ExtendDarkDirty(t->dark_dirty, box);
+	dark_edits_all++;
+}
+#endif
+
 Terrain* CreateTerrain(int z)
 {
 	Terrain* t = (Terrain*)malloc(sizeof(Terrain));
@@ -132,6 +395,26 @@ Terrain* CreateTerrain(int z)
 	t->y = 0;
 	t->nodes = 0;
 
+	t->grid_x = 0;
+	t->grid_y = 0;
+	t->grid_w = 0;
+	t->grid_h = 0;
+	t->grid = 0;
+
+	t->node_chunk = 0;
+	t->node_free = 0;
+
+	t->lazy = 0;
+
+#ifdef DARK_TERRAIN
+	t->dark_dirty[0] = 1;
+	t->dark_dirty[1] = 0;
+	t->dark_baked = false;
+	t->dark_editor = false;
+	t->dark_world = 0;
+	t->dark_edits = dark_edits_all;
+#endif
+
 #ifdef TEXHEAP
 
 	int cap = TERRAIN_TEXHEAP_CAPACITY;
@@ -149,7 +432,7 @@ Terrain* CreateTerrain(int z)
 	{
 		t->level = 0;
 
-		Patch* p = (Patch*)malloc(sizeof(Patch));
+		Patch* p = AllocPatch(t, 0, 0);
 		p->parent = 0;
 		p->lo = z;
 		p->hi = z;
@@ -157,6 +440,10 @@ Terrain* CreateTerrain(int z)
 
 #ifdef DARK_TERRAIN
 		p->dark = 0;
+		p->dark_lo = z;
+		p->dark_hi = z;
+		memset(p->horizon, 0, sizeof(p->horizon));
+		dark_edits_all++;
 #endif
 
 		for (int y = 0; y <= HEIGHT_CELLS; y++)
@@ -173,6 +460,7 @@ Terrain* CreateTerrain(int z)
 
 		t->root = p;
 		t->patches = 1;
+		GridSet(t, 0, 0, p);
 
 #ifdef TEXHEAP
 		TexData data[2]=
@@ -194,6 +482,7 @@ Terrain* CreateTerrain(int z)
 	return t;
 }
 
+// only patches which didn't fit in their slabs are freed here
 static void DeleteTerrain(Node* n, int lev)
 {
 	if (lev == 1)
@@ -202,7 +491,7 @@ static void DeleteTerrain(Node* n, int lev)
 		{
 			Patch* p = (Patch*)n->quad[i];
 			if (p)
-				free(p);
+				FreePatch(p);
 		}
 	}
 	else
@@ -215,7 +504,8 @@ static void DeleteTerrain(Node* n, int lev)
 		}
 	}
 
-	free(n);
+	if (n->mip)
+		free(n->mip);
 }
 
 void DeleteTerrain(Terrain* t)
@@ -223,30 +513,46 @@ void DeleteTerrain(Terrain* t)
 	if (!t)
 		return;
 
+	if (t->lazy)
+		DeleteTerrainFile(t->lazy);
+
 #ifdef TEXHEAP
 	t->th.Destroy();
 #endif
 
-	if (!t->root)
+	if (t->root)
 	{
-		free(t);
-		return;
+		if (t->level == 0)
+			FreePatch((Patch*)t->root);
+		else
+			DeleteTerrain((Node*)t->root, t->level);
 	}
 
-	if (t->level == 0)
+	if (t->grid)
 	{
-		Patch* p = (Patch*)t->root;
-		free(p);
-		free(t);
-		return;
+		for (int i = 0; i < t->grid_w * t->grid_h; i++)
+		{
+			GridPage* page = t->grid[i];
+			if (!page)
+				continue;
+			for (int j = 0; j < (1 << (2 * (GRID_SHIFT - SLAB_SHIFT))); j++)
+			{
+				if (page->slab[j])
+					free(page->slab[j]);
+			}
+			free(page);
+		}
+		free(t->grid);
 	}
 
-	int lev = t->level;
-	int xy = 0;
-	Node* n = (Node*)t->root;
-	free(t);
+	while (t->node_chunk)
+	{
+		NodeChunk* c = t->node_chunk;
+		t->node_chunk = c->next;
+		free(c);
+	}
 
-	DeleteTerrain(n, lev);
+	free(t);
 
 	/*
 
@@ -442,41 +748,31 @@ struct Tap3x3
 				SetDiag(x, y, my_abs(c0) > my_abs(c1));
 			}
 		}
+
+		for (int i = 0; i < 9; i++)
+		{
+			if (p[i / 3][i % 3])
+				DropMips(p[i / 3][i % 3]);
+		}
 	}
 
 	Patch* p[3][3];
 };
 
-Patch* GetTerrainPatch(Terrain* t, int x, int y)
+static inline Patch* GridGet(Terrain* t, int x, int y)
 {
-	if (!t->root)
-		return 0;
-
-	x += t->x;
-	y += t->y;
-
-	int range = 1 << t->level;
-	if (x < 0 || y < 0 || x >= range || y >= range)
+	int kx = x + t->grid_x, ky = y + t->grid_y;
+	unsigned px = (unsigned)(kx >> GRID_SHIFT), py = (unsigned)(ky >> GRID_SHIFT);
+	if (px >= (unsigned)t->grid_w || py >= (unsigned)t->grid_h)
 		return 0;
 
-	if (t->level == 0)
-		return (Patch*)t->root;
-
-	int lev = t->level;
-
-	Node* n = (Node*)t->root;
-	while (n)
-	{
-		lev--;
-		int i = ((x >> lev) & 1) | (((y >> lev) & 1) << 1);
-
-		if (lev)
-			n = (Node*)n->quad[i];
-		else
-			return (Patch*)n->quad[i];
-	}
+	GridPage* page = t->grid[py * t->grid_w + px];
+	return page ? page->patch[((ky & GRID_MASK) << GRID_SHIFT) + (kx & GRID_MASK)] : 0;
+}
 
-	return 0;
+Patch* GetTerrainPatch(Terrain* t, int x, int y)
+{
+	return GridGet(t, x, y);
 }
 
 void GetTerrainPatch(Terrain* t, Patch* p, int* x, int* y)
@@ -538,10 +834,20 @@ static void UpdateNodes(Patch* p)
 
 bool DelTerrainPatch(Terrain* t, int x, int y)
 {
-	Patch* p = GetTerrainPatch(t, x, y);
+	if (t->lazy)
+		PinTerrainChunk(t, x, y);
+
+	Patch* p = GridGet(t, x, y);
 	if (!p)
 		return false;
 
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(t, p, x, y);
+#endif
+
+	GridSet(t, x, y, 0);
+	DropMips(p);
+
 	int flags = p->flags;
 	Node* n = p->parent;
 
@@ -554,7 +860,7 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 		UpdateTerrainHeightMap(l);
 	}
 #endif
-	free(p);
+	FreePatch(p);
 
 	t->patches--;
 
@@ -585,7 +891,7 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 		{
 			q = n;
 			n = n->parent;
-			free((Node*)q);
+			FreeNode(t, (Node*)q);
 			t->nodes--;
 		}
 		else
@@ -623,7 +929,7 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 
 		t->root = n->quad[j];
 		t->root->parent = 0;
-		free(n);
+		FreeNode(t, n);
 		t->nodes--;
 
 		if (t->level)
@@ -634,14 +940,14 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 
 	Patch* np[8] =
 	{
-		flags & 0x01 ? GetTerrainPatch(t, x - 1, y - 1) : 0,
-		flags & 0x02 ? GetTerrainPatch(t, x, y - 1) : 0,
-		flags & 0x04 ? GetTerrainPatch(t, x + 1, y - 1) : 0,
-		flags & 0x08 ? GetTerrainPatch(t, x + 1, y) : 0,
-		flags & 0x10 ? GetTerrainPatch(t, x + 1, y + 1) : 0,
-		flags & 0x20 ? GetTerrainPatch(t, x, y + 1) : 0,
-		flags & 0x40 ? GetTerrainPatch(t, x - 1, y + 1) : 0,
-		flags & 0x80 ? GetTerrainPatch(t, x - 1, y) : 0,
+		flags & 0x01 ? GridGet(t, x - 1, y - 1) : 0,
+		flags & 0x02 ? GridGet(t, x, y - 1) : 0,
+		flags & 0x04 ? GridGet(t, x + 1, y - 1) : 0,
+		flags & 0x08 ? GridGet(t, x + 1, y) : 0,
+		flags & 0x10 ? GridGet(t, x + 1, y + 1) : 0,
+		flags & 0x20 ? GridGet(t, x, y + 1) : 0,
+		flags & 0x40 ? GridGet(t, x - 1, y + 1) : 0,
+		flags & 0x80 ? GridGet(t, x - 1, y) : 0,
 	};
 
 	for (int i = 0; i < 8; i++)
@@ -658,13 +964,16 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 
 Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 {
+	if (t->lazy)
+		PinTerrainChunk(t, x, y);
+
 	if (!t->root)
 	{
 		t->x = -x;
 		t->y = -y;
 		t->level = 0;
 
-		Patch* p = (Patch*)malloc(sizeof(Patch));
+		Patch* p = AllocPatch(t, x, y);
 		p->parent = 0;
 		p->lo = z;
 		p->hi = z;
@@ -672,6 +981,10 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 #ifdef DARK_TERRAIN
 		p->dark = 0;
+		p->dark_lo = z;
+		p->dark_hi = z;
+		memset(p->horizon, 0, sizeof(p->horizon));
+		dark_edits_all++;
 #endif
 
 		for (int y = 0; y <= HEIGHT_CELLS; y++)
@@ -689,6 +1002,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 		t->root = p;
 		t->patches = 1;
+		GridSet(t, x, y, p);
 
 #ifdef TEXHEAP
 		TexData data[2] =
@@ -712,7 +1026,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (x < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * y < range)
@@ -758,7 +1072,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (y < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * x < range)
@@ -804,7 +1118,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (x >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * y > range)
@@ -844,7 +1158,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (y >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * x > range)
@@ -902,7 +1216,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 		{
 			if (!(Node*)n->quad[i])
 			{
-				Node* c = (Node*)malloc(sizeof(Node));
+				Node* c = AllocNode(t);
 				t->nodes++;
 
 				c->parent = n;
@@ -920,15 +1234,19 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 				return (Patch*)n->quad[i];
 			}
 
-			Patch* p = (Patch*)malloc(sizeof(Patch));
+			Patch* p = AllocPatch(t, x - t->x, y - t->y);
 			t->patches++;
 
 			n->quad[i] = p;
 			p->parent = n;
 			p->flags = 0;
+			GridSet(t, x - t->x, y - t->y, p);
 
 #ifdef DARK_TERRAIN
 			p->dark = 0;
+			p->dark_lo = 0xffff;
+			p->dark_hi = 0x0000;
+			memset(p->horizon, 0, sizeof(p->horizon));
 #endif
 
 			p->diag = 0;
@@ -937,14 +1255,14 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 			Patch* np[8] =
 			{
-				GetTerrainPatch(t, nx - 1, ny - 1),
-				GetTerrainPatch(t, nx, ny - 1),
-				GetTerrainPatch(t, nx + 1, ny - 1),
-				GetTerrainPatch(t, nx + 1, ny),
-				GetTerrainPatch(t, nx + 1, ny + 1),
-				GetTerrainPatch(t, nx, ny + 1),
-				GetTerrainPatch(t, nx - 1, ny + 1),
-				GetTerrainPatch(t, nx - 1, ny),
+				GridGet(t, nx - 1, ny - 1),
+				GridGet(t, nx, ny - 1),
+				GridGet(t, nx + 1, ny - 1),
+				GridGet(t, nx + 1, ny),
+				GridGet(t, nx + 1, ny + 1),
+				GridGet(t, nx, ny + 1),
+				GridGet(t, nx - 1, ny + 1),
+				GridGet(t, nx - 1, ny),
 			};
 
 			for (int i = 0; i < 8; i++)
@@ -1103,6 +1421,10 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 				}
 			}
 
+#ifdef DARK_TERRAIN
+			MarkDarkDirty(p);
+#endif
+
 			/*
 			for (int y = 0; y < VISUAL_CELLS; y++)
 				for (int x = 0; x < VISUAL_CELLS; x++)
@@ -1240,14 +1562,14 @@ Patch* CalcTerrainGhost(Terrain* t, int x, int y, int z, uint16_t ghost[4 * HEIG
 
 	Patch* np[8] =
 	{
-		GetTerrainPatch(t, nx - 1, ny - 1),
-		GetTerrainPatch(t, nx, ny - 1),
-		GetTerrainPatch(t, nx + 1, ny - 1),
-		GetTerrainPatch(t, nx + 1, ny),
-		GetTerrainPatch(t, nx + 1, ny + 1),
-		GetTerrainPatch(t, nx, ny + 1),
-		GetTerrainPatch(t, nx - 1, ny + 1),
-		GetTerrainPatch(t, nx - 1, ny),
+		GridGet(t, nx - 1, ny - 1),
+		GridGet(t, nx, ny - 1),
+		GridGet(t, nx + 1, ny - 1),
+		GridGet(t, nx + 1, ny),
+		GridGet(t, nx + 1, ny + 1),
+		GridGet(t, nx, ny + 1),
+		GridGet(t, nx - 1, ny + 1),
+		GridGet(t, nx - 1, ny),
 	};
 
 	int flags = 0;
@@ -1373,6 +1695,10 @@ void GetTerrainLimits(Patch* p, uint16_t* lo, uint16_t* hi)
 
 void UpdateTerrainHeightMap(Patch* p)
 {
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(p); // old range
+#endif
+
 	p->lo = 0xffff;
 	p->hi = 0x0000;
 
@@ -1385,6 +1711,10 @@ void UpdateTerrainHeightMap(Patch* p)
 		}
 	}
 
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(p); // new range
+#endif
+
 	Tap3x3 tap(p);
 	tap.Update();
 
@@ -1398,6 +1728,8 @@ void UpdateTerrainHeightMap(Patch* p)
 
 void UpdateTerrainVisualMap(Patch* p)
 {
+	DropMips(p);
+
 #ifdef TEXHEAP
 	TexData data = { GL_RED_INTEGER, GL_UNSIGNED_SHORT, p->visual };
 	p->ta->Update(1, 1, &data); // ONLY VISUAL !!!
@@ -1431,6 +1763,10 @@ uint16_t GetTerrainDiag(Patch* p)
 void SetTerrainDiag(Patch* p, uint16_t diag)
 {
 	p->diag = diag;
+	DropMips(p);
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(p);
+#endif
 }
 
 #ifdef DARK_TERRAIN
@@ -1442,6 +1778,7 @@ uint64_t GetTerrainDark(Patch* p)
 void SetTerrainDark(Patch* p, uint64_t dark)
 {
 	p->dark = dark;
+	DropMips(p);
 }
 #endif
 
@@ -1528,105 +1865,474 @@ void QueryTerrainSample(QuadItem* q, int x, int y, int range, void(*cb)(Patch* p
 }
 
 #ifdef DARK_TERRAIN
-void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor)
+struct DarkBake
 {
-	struct Updater
+	struct Job
 	{
-		static void cb(Patch* p, int u, int v, double coords[3], void* cookie)
-		{
-			Updater* updater = (Updater*)cookie;
+		Patch* p;
+		int x, y;
+	};
 
-			double hit[3] = { coords[0], coords[1], coords[2] };
-			Patch* q = HitTerrain(updater->t, coords, updater->lightdir, hit, 0);
+	bool editor;
+	Terrain* t;
+	World* w;
+	double lightdir[3];
 
-			uint64_t mask = ((uint64_t)1) << (u + VISUAL_CELLS * v);
+	int jobs;
+	Job job[1]; // [t->patches]
+};
 
-			if (q)
-			{
-				if (/*q != p || */ hit[2] > coords[2] + HEIGHT_SCALE/4)
-				{
-					p->dark |= mask;
-					return;
-				}
-			}
+// edited caster volumes (x,y in visual cells, z in height units)
+// and direction towards the light (z > 0) to find receivers they can shade
+struct DarkDirty
+{
+	double up[3];
+	int boxes;
+	double(*box)[6];
+};
+
+// collects (if dd) and clears edited height ranges of all patches
+static void GatherDarkDirty(DarkDirty* dd, QuadItem* q, int x, int y, int range)
+{
+	if (range > VISUAL_CELLS)
+	{
+		range >>= 1;
+		Node* n = (Node*)q;
+		if (n->quad[0])
+			GatherDarkDirty(dd, n->quad[0], x, y, range);
+		if (n->quad[1])
+			GatherDarkDirty(dd, n->quad[1], x + range, y, range);
+		if (n->quad[2])
+			GatherDarkDirty(dd, n->quad[2], x, y + range, range);
+		if (n->quad[3])
+			GatherDarkDirty(dd, n->quad[3], x + range, y + range, range);
+		return;
+	}
 
-			Inst* i = HitWorld(updater->w, coords, updater->lightdir, hit, 0, false, updater->editor);
+	Patch* p = (Patch*)q;
+	if (p->dark_lo > p->dark_hi)
+		return;
 
-			if (i)
-			{
-				if (hit[2] > coords[2])
-				{
-					p->dark |= mask;
-					return;
-				}
-			}
+	if (dd)
+	{
+		double* b = dd->box[dd->boxes++];
+		b[0] = x;
+		b[1] = x + VISUAL_CELLS;
+		b[2] = y;
+		b[3] = y + VISUAL_CELLS;
+		b[4] = p->dark_lo;
+		b[5] = p->dark_hi;
+	}
 
-			p->dark &= ~mask;
-		}
+	p->dark_lo = 0xffff;
+	p->dark_hi = 0x0000;
+}
 
-		bool editor;
-		Terrain* t;
-		World* w;
-		double lightdir[3];
-	};
+// conservative: rays leaving receiver box r towards the light are swept
+// over the height span of every edited box, their xy extent is tested
+static bool DarkAffected(const DarkDirty* dd, const double r[6])
+{
+	for (int i = 0; i < dd->boxes; i++)
+	{
+		const double* v = dd->box[i];
 
-	Updater updater = { editor, t, w, {-lightpos[0], -lightpos[1], -lightpos[2] * HEIGHT_SCALE} };
+		double s1 = (v[5] - r[4]) / dd->up[2];
+		if (s1 < 0)
+			continue;
+		double s0 = (v[4] - r[5]) / dd->up[2];
+		if (s0 < 0)
+			s0 = 0;
 
-//	double n = 1.0 / sqrt(lightpos[0]* lightpos[0]+ lightpos[1]* lightpos[1]+ lightpos[2]* lightpos[2]);
-//	updater.lightdir[0] *= n;
-//	updater.lightdir[1] *= n;
-//	updater.lightdir[2] *= n;
+		double x0 = dd->up[0] * s0, x1 = dd->up[0] * s1;
+		if (x0 > x1)
+		{
+			double s = x0; x0 = x1; x1 = s;
+		}
+		if (r[0] + x0 > v[1] || r[1] + x1 < v[0])
+			continue;
 
-	if (t->root)
-		QueryTerrainSample(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, Updater::cb, &updater);
+		double y0 = dd->up[1] * s0, y1 = dd->up[1] * s1;
+		if (y0 > y1)
+		{
+			double s = y0; y0 = y1; y1 = s;
+		}
+		if (r[2] + y0 > v[3] || r[3] + y1 < v[2])
+			continue;
+
+		return true;
+	}
+
+	return false;
 }
-#endif
 
-static inline /*__forceinline*/ void QueryTerrain(QuadItem* q, int x, int y, int range, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+#define HORIZON_SECTORS 8 // 4 bits each, sector 0 is centered on +x, CCW
+#define HORIZON_LEVELS 15 // elevation steps over 90 deg
+#define HORIZON_REACH 64 // visual cells, see horizon_step[]
+
+// horizons of receiver box r can only be raised or lowered by edited boxes within reach above it
+static bool HorizonAffected(const DarkDirty* dd, const double r[6])
 {
-	if (range == VISUAL_CELLS)
+	for (int i = 0; i < dd->boxes; i++)
 	{
-		cb((Patch*)q, x, y, view_flags & ~q->flags, cookie);
+		const double* v = dd->box[i];
+		if (v[5] > r[4] &&
+			v[0] < r[1] + HORIZON_REACH && v[1] > r[0] - HORIZON_REACH &&
+			v[2] < r[3] + HORIZON_REACH && v[3] > r[2] - HORIZON_REACH)
+			return true;
 	}
-	else
+	return false;
+}
+
+static void GatherDarkJobs(DarkBake* db, int cap, const DarkDirty* dd, QuadItem* q, int x, int y, int range)
+{
+	if (dd)
 	{
-		Node* n = (Node*)q;
+		double r[6] = { (double)x, (double)(x + range), (double)y, (double)(y + range), (double)q->lo, (double)q->hi };
+		if (!DarkAffected(dd, r) && !HorizonAffected(dd, r))
+			return;
+	}
 
+	if (range > VISUAL_CELLS)
+	{
 		range >>= 1;
-
+		Node* n = (Node*)q;
 		if (n->quad[0])
-			QueryTerrain(n->quad[0], x, y, range, view_flags, cb, cookie);
+			GatherDarkJobs(db, cap, dd, n->quad[0], x, y, range);
 		if (n->quad[1])
-			QueryTerrain(n->quad[1], x + range, y, range, view_flags, cb, cookie);
+			GatherDarkJobs(db, cap, dd, n->quad[1], x + range, y, range);
 		if (n->quad[2])
-			QueryTerrain(n->quad[2], x, y + range, range, view_flags, cb, cookie);
+			GatherDarkJobs(db, cap, dd, n->quad[2], x, y + range, range);
 		if (n->quad[3])
-			QueryTerrain(n->quad[3], x + range, y + range, range, view_flags, cb, cookie);
+			GatherDarkJobs(db, cap, dd, n->quad[3], x + range, y + range, range);
+	}
+	else
+	if (db->jobs < cap)
+	{
+		DarkBake::Job* j = db->job + db->jobs++;
+		j->p = (Patch*)q;
+		j->x = x;
+		j->y = y;
 	}
 }
 
-static void inline /*__forceinline*/ QueryTerrain(QuadItem* q, int x, int y, int range, int planes, double* plane[], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+static DarkBake* AllocDarkBake(Terrain* t, World* w, const float lightpos[3], bool editor, int cap)
 {
-	int hi = q->hi;
-	int lo = q->lo;
-	int fl = view_flags & ~q->flags;
+	DarkBake* db = (DarkBake*)malloc(sizeof(DarkBake) + sizeof(DarkBake::Job) * cap);
 
-	if (fl)
-		lo = 0;
+	db->editor = editor;
+	db->t = t;
+	db->w = w;
+	db->lightdir[0] = -lightpos[0];
+	db->lightdir[1] = -lightpos[1];
+	db->lightdir[2] = -lightpos[2] * HEIGHT_SCALE;
+	db->jobs = 0;
 
-	int c[4] = { x, y, lo, 1 }; // 0,0,0
+	return db;
+}
 
-	for (int i = 0; i < planes; i++)
-	{
-		int neg_pos[2] = { 0,0 };
+DarkBake* CreateDarkBake(Terrain* t, World* w, float lightpos[3], bool editor, bool dirty_only, bool loaded_only)
+{
+	if (!loaded_only)
+		LoadTerrainChunks(t);
 
-		neg_pos[PositiveProduct(plane[i], c)] ++;
+	t->dark_light[0] = lightpos[0];
+	t->dark_light[1] = lightpos[1];
+	t->dark_light[2] = lightpos[2];
+	t->dark_baked = true;
+	t->dark_editor = editor;
+	t->dark_world = w;
 
-		c[0] += range; // 1,0,0
-		neg_pos[PositiveProduct(plane[i], c)] ++;
+	int cap = t->root ? t->patches : 0;
+	DarkBake* db = AllocDarkBake(t, w, lightpos, editor, cap);
 
-		c[1] += range; // 1,1,0
-		neg_pos[PositiveProduct(plane[i], c)] ++;
+//	double n = 1.0 / sqrt(lightpos[0]* lightpos[0]+ lightpos[1]* lightpos[1]+ lightpos[2]* lightpos[2]);
+//	db->lightdir[0] *= n;
+//	db->lightdir[1] *= n;
+//	db->lightdir[2] *= n;
+
+	// take edits since last bake, full bake simply drops them
+	DarkDirty dd;
+	dd.up[0] = lightpos[0];
+	dd.up[1] = lightpos[1];
+	dd.up[2] = lightpos[2] * HEIGHT_SCALE;
+	dd.boxes = 0;
+	dd.box = dirty_only ? (double(*)[6])malloc(sizeof(double[6]) * (cap + 2)) : 0;
+
+	if (t->root)
+		GatherDarkDirty(dirty_only ? &dd : 0, t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level);
+
+	if (dirty_only && t->dark_dirty[0] <= t->dark_dirty[1])
+		memcpy(dd.box[dd.boxes++], t->dark_dirty, sizeof(double[6]));
+	t->dark_dirty[0] = 1;
+	t->dark_dirty[1] = 0;
+	t->dark_edits = dark_edits_all;
+
+	double wb[6];
+	if (TakeWorldDirty(w, wb) && dirty_only)
+		memcpy(dd.box[dd.boxes++], wb, sizeof(double[6]));
+
+	db->jobs = 0;
+	if (t->root && (!dirty_only || dd.boxes))
+	{
+		// light at or below horizon can't be swept, rebake everything
+		bool cull = dirty_only && dd.up[2] > 0;
+		GatherDarkJobs(db, cap, cull ? &dd : 0, t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level);
+	}
+
+	if (dd.box)
+		free(dd.box);
+
+	return db;
+}
+
+void DeleteDarkBake(DarkBake* db)
+{
+	// workers wrote dark bits directly
+	for (int j = 0; j < db->jobs; j++)
+		DropMips(db->job[j].p);
+	free(db);
+}
+
+bool GetTerrainDarkDirty(Terrain* t, World* w)
+{
+	return t->dark_edits != dark_edits_all || GetWorldDirty(w);
+}
+
+int GetDarkBakeJobs(DarkBake* db)
+{
+	return db->jobs;
+}
+
+// distances of horizon samples in visual cells, denser close to the receiver
+static const float horizon_step[] = { 1.5f, 3, 5, 8, 12, 18, 27, 40, HORIZON_REACH };
+
+// max tangent of terrain elevation seen from c (visual cells, height units) in direction dx,dy
+// with the same bias as ray casting in BakeTerrainDark()
+static float HorizonTan(Terrain* t, const double c[3], float dx, float dy)
+{
+	float tan = 0;
+	Patch* p = 0;
+	int px = 0, py = 0;
+
+	float z = (float)c[2] + HEIGHT_SCALE / 4;
+	float top = t->root->hi - z; // nothing further can be higher
+
+	for (int i = 0; i < (int)(sizeof(horizon_step) / sizeof(float)); i++)
+	{
+		float s = horizon_step[i];
+		if (top <= tan * s * HEIGHT_SCALE)
+			break;
+
+		float x = (float)c[0] + dx * s;
+		float y = (float)c[1] + dy * s;
+		int qx = (int)floorf(x / VISUAL_CELLS);
+		int qy = (int)floorf(y / VISUAL_CELLS);
+
+		if (!p || qx != px || qy != py)
+		{
+			p = GridGet(t, qx, qy);
+			px = qx;
+			py = qy;
+		}
+
+		if (!p || p->hi - z <= tan * s * HEIGHT_SCALE)
+			continue;
+
+		double h = HitTerrain(p, (x - qx * VISUAL_CELLS) / VISUAL_CELLS, (y - qy * VISUAL_CELLS) / VISUAL_CELLS);
+
+		float k = (float)(h - z) / (s * HEIGHT_SCALE);
+		tan = k > tan ? k : tan;
+	}
+
+	return tan;
+}
+
+// sectors are sampled at their centers, lights are snapped to nearest one too
+static uint32_t HorizonBits(Terrain* t, const double c[3])
+{
+	static const float r = (float)M_SQRT1_2;
+	static const float dir[HORIZON_SECTORS][2] = { {1,0}, {r,r}, {0,1}, {-r,r}, {-1,0}, {-r,-r}, {0,-1}, {r,-r} };
+
+	// tangents of (i + 0.5) * 90 / HORIZON_LEVELS deg, where level rounds up to i + 1
+	static const float rise[HORIZON_LEVELS] =
+	{
+		0.05241f, 0.15838f, 0.26795f, 0.38386f, 0.50953f, 0.64941f, 0.80978f, 1.00000f,
+		1.23490f, 1.53986f, 1.96261f, 2.60509f, 3.73205f, 6.31375f, 19.08114f
+	};
+
+	uint32_t bits = 0;
+	for (int s = 0; s < HORIZON_SECTORS; s++)
+	{
+		float k = HorizonTan(t, c, dir[s][0], dir[s][1]);
+
+		int lev = 0;
+		while (lev < HORIZON_LEVELS && k >= rise[lev])
+			lev++;
+		bits |= lev << (4 * s);
+	}
+
+	return bits;
+}
+
+uint32_t GetTerrainHorizonLight(const float lightpos[3])
+{
+	double a = atan2(lightpos[1], lightpos[0]);
+	int s = (int)floor(a * HORIZON_SECTORS / (2 * M_PI) + 0.5);
+	s = (s + HORIZON_SECTORS) % HORIZON_SECTORS;
+
+	// cells are dark if their horizon level is above the light one, -1 if light is below horizon
+	double e = atan2(lightpos[2], sqrt(lightpos[0] * lightpos[0] + lightpos[1] * lightpos[1]));
+	int lev = e > 0 ? (int)floor(e * HORIZON_LEVELS / (M_PI / 2)) : -1;
+	lev = lev < HORIZON_LEVELS ? lev : HORIZON_LEVELS;
+
+	return (s << 8) | (lev + 1);
+}
+
+uint64_t GetTerrainHorizonDark(Patch* p, uint32_t light)
+{
+	int shift = 4 * (light >> 8);
+	int lev = (int)(light & 0xFF) - 1;
+
+	// each height cell covers 2x2 visual cells
+	uint64_t dark = 0;
+	for (int c = 0; c < HEIGHT_CELLS * HEIGHT_CELLS; c++)
+	{
+		if ((int)((p->horizon[c] >> shift) & 0xF) > lev)
+			dark |= ((uint64_t)0x0303) << (2 * (c % HEIGHT_CELLS) + 2 * VISUAL_CELLS * (c / HEIGHT_CELLS));
+	}
+	return dark;
+}
+
+bool GetTerrainDarkLight(Terrain* t, float lightpos[3])
+{
+	if (!t->dark_baked)
+		return false;
+	lightpos[0] = t->dark_light[0];
+	lightpos[1] = t->dark_light[1];
+	lightpos[2] = t->dark_light[2];
+	return true;
+}
+
+static void DarkSample(Patch* p, int u, int v, double coords[3], void* cookie)
+{
+	double(*sample)[3] = (double(*)[3])cookie;
+	double* s = sample[u + VISUAL_CELLS * v];
+	s[0] = coords[0];
+	s[1] = coords[1];
+	s[2] = coords[2];
+}
+
+void BakeTerrainDark(DarkBake* db, int from, int to)
+{
+	// patch samples are traced against terrain in packets, all share light dir
+	double sample[VISUAL_CELLS * VISUAL_CELLS][3];
+	double dir[TERRAIN_PACKET][3];
+	for (int i = 0; i < TERRAIN_PACKET; i++)
+	{
+		dir[i][0] = db->lightdir[0];
+		dir[i][1] = db->lightdir[1];
+		dir[i][2] = db->lightdir[2];
+	}
+
+	for (int j = from; j < to; j++)
+	{
+		Patch* p = db->job[j].p;
+		QueryTerrainSample(p, db->job[j].x, db->job[j].y, DarkSample, sample);
+
+		uint64_t dark = 0;
+		for (int s = 0; s < VISUAL_CELLS * VISUAL_CELLS; s += TERRAIN_PACKET)
+		{
+			double hit[TERRAIN_PACKET][3];
+			Patch* q[TERRAIN_PACKET];
+			HitTerrainPacket(db->t, TERRAIN_PACKET, sample + s, dir, hit, q);
+
+			for (int i = 0; i < TERRAIN_PACKET; i++)
+			{
+				double* coords = sample[s + i];
+				uint64_t mask = ((uint64_t)1) << (s + i);
+
+				if (q[i] && hit[i][2] > coords[2] + HEIGHT_SCALE / 4)
+				{
+					dark |= mask;
+					continue;
+				}
+
+				Inst* inst = HitWorld(db->w, coords, db->lightdir, hit[i], 0, false, db->editor);
+				if (inst && hit[i][2] > coords[2])
+					dark |= mask;
+			}
+		}
+
+		p->dark = dark;
+
+		// horizons are taken at height cell centers
+		for (int v = 0; v < HEIGHT_CELLS; v++)
+		{
+			for (int u = 0; u < HEIGHT_CELLS; u++)
+			{
+				double c[3] =
+				{
+					db->job[j].x + (u + 0.5) * VISUAL_CELLS / HEIGHT_CELLS,
+					db->job[j].y + (v + 0.5) * VISUAL_CELLS / HEIGHT_CELLS,
+					HitTerrain(p, (u + 0.5) / HEIGHT_CELLS, (v + 0.5) / HEIGHT_CELLS)
+				};
+				p->horizon[u + v * HEIGHT_CELLS] = HorizonBits(db->t, c);
+			}
+		}
+	}
+}
+
+void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor)
+{
+	DarkBake* db = CreateDarkBake(t, w, lightpos, editor);
+	BakeTerrainDark(db, 0, db->jobs);
+	DeleteDarkBake(db);
+}
+#endif
+
+static inline /*__forceinline*/ void QueryTerrain(QuadItem* q, int x, int y, int range, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	if (range == VISUAL_CELLS)
+	{
+		cb((Patch*)q, x, y, view_flags & ~q->flags, cookie);
+	}
+	else
+	{
+		Node* n = (Node*)q;
+
+		range >>= 1;
+
+		if (n->quad[0])
+			QueryTerrain(n->quad[0], x, y, range, view_flags, cb, cookie);
+		if (n->quad[1])
+			QueryTerrain(n->quad[1], x + range, y, range, view_flags, cb, cookie);
+		if (n->quad[2])
+			QueryTerrain(n->quad[2], x, y + range, range, view_flags, cb, cookie);
+		if (n->quad[3])
+			QueryTerrain(n->quad[3], x + range, y + range, range, view_flags, cb, cookie);
+	}
+}
+
+// false if node box is fully outside of any plane, planes it is fully inside of are
+// moved past the end of plane[] and dropped from planes (shared by plain and LOD queries)
+static inline bool CullTerrain(const QuadItem* q, int x, int y, int range, int fl, int* planes, double* plane[])
+{
+	int hi = q->hi;
+	int lo = fl ? 0 : q->lo;
+
+	int c[4] = { x, y, lo, 1 }; // 0,0,0
+
+	for (int i = 0; i < *planes; i++)
+	{
+		int neg_pos[2] = { 0,0 };
+
+		neg_pos[PositiveProduct(plane[i], c)] ++;
+
+		c[0] += range; // 1,0,0
+		neg_pos[PositiveProduct(plane[i], c)] ++;
+
+		c[1] += range; // 1,1,0
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
 		c[0] -= range; // 0,1,0
 		neg_pos[PositiveProduct(plane[i], c)] ++;
@@ -1646,21 +2352,30 @@ static void inline /*__forceinline*/ QueryTerrain(QuadItem* q, int x, int y, int
 		c[2] = lo; // 0,0,0
 
 		if (neg_pos[0] == 8)
-			return;
+			return false;
 
 		if (neg_pos[1] == 8)
 		{
-			planes--;
-			if (i < planes)
+			(*planes)--;
+			if (i < *planes)
 			{
 				double* swap = plane[i];
-				plane[i] = plane[planes];
-				plane[planes] = swap;
+				plane[i] = plane[*planes];
+				plane[*planes] = swap;
 			}
 			i--;
 		}
 	}
 
+	return true;
+}
+
+static void inline /*__forceinline*/ QueryTerrain(QuadItem* q, int x, int y, int range, int planes, double* plane[], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	int fl = view_flags & ~q->flags;
+	if (!CullTerrain(q, x, y, range, fl, &planes, plane))
+		return;
+
 	if (range == VISUAL_CELLS)
 	{
 		cb((Patch*)q, x, y, fl, cookie);
@@ -1710,8 +2425,200 @@ void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, voi
 	}
 }
 
+// most frequent of 4 visuals, first one wins ties
+static inline uint16_t DominantVisual(const uint16_t v[4])
+{
+	int best = 0, cnt = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		int c = 0;
+		for (int j = i; j < 4; j++)
+			c += v[j] == v[i];
+		if (c > cnt)
+		{
+			best = i;
+			cnt = c;
+		}
+	}
+	return v[best];
+}
 
-void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+// coarse patch of a node covering range visual cells, made of its children (patches or their mips)
+// heights are point sampled so corners match finer neighbors, each visual cell and dark bit
+// comes from 2x2 child cells, NULL if node isn't full (holes can't be represented)
+static Patch* GetNodeMip(Node* n, int range)
+{
+	if (n->mip)
+		return n->mip;
+
+	Patch* src[4];
+	for (int i = 0; i < 4; i++)
+	{
+		if (!n->quad[i])
+			return 0;
+		src[i] = range == 2 * VISUAL_CELLS ? (Patch*)n->quad[i] : GetNodeMip((Node*)n->quad[i], range >> 1);
+		if (!src[i])
+			return 0;
+	}
+
+	Patch* m = (Patch*)malloc(sizeof(Patch));
+	m->parent = n;
+	m->lo = n->lo;
+	m->hi = n->hi;
+	m->flags = n->flags;
+	m->diag = 0;
+	m->slot = 0;
+
+	for (int y = 0; y <= HEIGHT_CELLS; y++)
+	{
+		int qy = y > HEIGHT_CELLS / 2;
+		int sy = 2 * y - qy * HEIGHT_CELLS;
+		for (int x = 0; x <= HEIGHT_CELLS; x++)
+		{
+			int qx = x > HEIGHT_CELLS / 2;
+			int sx = 2 * x - qx * HEIGHT_CELLS;
+			m->height[y][x] = src[qx + 2 * qy]->height[sy][sx];
+		}
+	}
+
+	for (int y = 0; y < HEIGHT_CELLS; y++)
+	{
+		for (int x = 0; x < HEIGHT_CELLS; x++)
+		{
+			Patch* s = src[(x >= HEIGHT_CELLS / 2) + 2 * (y >= HEIGHT_CELLS / 2)];
+			int sx = 2 * x % HEIGHT_CELLS, sy = 2 * y % HEIGHT_CELLS;
+			int b = sx + sy * HEIGHT_CELLS;
+			if (s->diag & (1 << b))
+				m->diag |= 1 << (x + y * HEIGHT_CELLS);
+
+#ifdef DARK_TERRAIN
+			// highest horizon of 2x2 in every sector
+			const uint32_t hz[4] = { s->horizon[b], s->horizon[b + 1], s->horizon[b + HEIGHT_CELLS], s->horizon[b + HEIGHT_CELLS + 1] };
+			uint32_t h = 0;
+			for (int k = 0; k < 32; k += 4)
+			{
+				uint32_t l = 0;
+				for (int i = 0; i < 4; i++)
+					l = ((hz[i] >> k) & 0xF) > l ? ((hz[i] >> k) & 0xF) : l;
+				h |= l << k;
+			}
+			m->horizon[x + y * HEIGHT_CELLS] = h;
+#endif
+		}
+	}
+
+#ifdef DARK_TERRAIN
+	m->dark = 0;
+	m->dark_lo = 0xffff;
+	m->dark_hi = 0x0000;
+#endif
+
+	for (int y = 0; y < VISUAL_CELLS; y++)
+	{
+		for (int x = 0; x < VISUAL_CELLS; x++)
+		{
+			Patch* s = src[(x >= VISUAL_CELLS / 2) + 2 * (y >= VISUAL_CELLS / 2)];
+			int sx = 2 * x % VISUAL_CELLS, sy = 2 * y % VISUAL_CELLS;
+			uint16_t v[4] = { s->visual[sy][sx], s->visual[sy][sx + 1], s->visual[sy + 1][sx], s->visual[sy + 1][sx + 1] };
+			m->visual[y][x] = DominantVisual(v);
+
+#ifdef DARK_TERRAIN
+			int b = sx + sy * VISUAL_CELLS;
+			int d = (int)((s->dark >> b) & 1) + (int)((s->dark >> (b + 1)) & 1) +
+				(int)((s->dark >> (b + VISUAL_CELLS)) & 1) + (int)((s->dark >> (b + VISUAL_CELLS + 1)) & 1);
+			if (d >= 2)
+				m->dark |= ((uint64_t)1) << (x + y * VISUAL_CELLS);
+#endif
+		}
+	}
+
+#ifdef TEXHEAP
+	m->ta = 0;
+#endif
+
+	n->mip = m;
+	return m;
+}
+
+static void QueryTerrain(QuadItem* q, int x, int y, int range, int planes, double* plane[], int view_flags, const QueryTerrainLOD* cb, void* cookie)
+{
+	int fl = view_flags & ~q->flags;
+	if (!CullTerrain(q, x, y, range, fl, &planes, plane))
+		return;
+
+	if (range == VISUAL_CELLS)
+	{
+		cb->patch_cb((Patch*)q, x, y, range, fl, cookie);
+		return;
+	}
+
+	Node* n = (Node*)q;
+
+	if (cb->lod_cb(x, y, range, cookie))
+	{
+		Patch* m = GetNodeMip(n, range);
+		if (m)
+		{
+			cb->patch_cb(m, x, y, range, fl, cookie);
+			return;
+		}
+	}
+
+	range >>= 1;
+
+	if (n->quad[0])
+		QueryTerrain(n->quad[0], x, y, range, planes, plane, view_flags, cb, cookie);
+	if (n->quad[1])
+		QueryTerrain(n->quad[1], x + range, y, range, planes, plane, view_flags, cb, cookie);
+	if (n->quad[2])
+		QueryTerrain(n->quad[2], x, y + range, range, planes, plane, view_flags, cb, cookie);
+	if (n->quad[3])
+		QueryTerrain(n->quad[3], x + range, y + range, range, planes, plane, view_flags, cb, cookie);
+}
+
+void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, const QueryTerrainLOD* cb, void* cookie)
+{
+	if (!t || !t->root)
+		return;
+
+	double* pp[6] = { 0 };
+	for (int i = 0; i < planes && i < 6; i++)
+		pp[i] = plane[i];
+
+	QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, planes > 0 ? planes : 0, pp, view_flags & 0xAA, cb, cookie);
+}
+
+// children first, so nodes with holes still get mips below them
+static void BuildNodeMips(QuadItem* q, int range)
+{
+	if (range == VISUAL_CELLS)
+		return;
+
+	Node* n = (Node*)q;
+	for (int i = 0; i < 4; i++)
+	{
+		if (n->quad[i])
+			BuildNodeMips(n->quad[i], range >> 1);
+	}
+
+	GetNodeMip(n, range);
+}
+
+void PrepareTerrainQueries(Terrain* t, bool loaded_only)
+{
+	if (!t)
+		return;
+
+	if (!loaded_only)
+		LoadTerrainChunks(t);
+
+	if (t->root)
+		BuildNodeMips(t->root, VISUAL_CELLS << t->level);
+}
+
+
+// 0 if square doesn't touch the circle, 4 if it is fully inside
+static inline int CircleHit(int x, int y, int range, const double xyr[3])
 {
 	int hit = 0;
 
@@ -1743,10 +2650,17 @@ void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int
 		{
 			hit = 1;
 		}
-		else
-			return;
 	}
 
+	return hit;
+}
+
+void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	int hit = CircleHit(x, y, range, xyr);
+	if (!hit)
+		return;
+
 	if (range == VISUAL_CELLS)
 	{
 		cb((Patch*)q, x, y, view_flags & ~q->flags, cookie);
@@ -1783,23 +2697,37 @@ void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int
 
 void QueryTerrain(Terrain* t, double x, double y, double r, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
 {
-	if (!t || !t->root)
+	if (!t || r <= 0)
 		return;
 
-	if (r <= 0)
+	double xyr[3] = { x,y,r };
+
+	if (!t->root)
 		return;
 
-	double xyr[3] = { x,y,r };
+	// small circles (painting, brushes) look patches up directly
+	int x0 = (int)floor((x - r) / VISUAL_CELLS), x1 = (int)floor((x + r) / VISUAL_CELLS);
+	int y0 = (int)floor((y - r) / VISUAL_CELLS), y1 = (int)floor((y + r) / VISUAL_CELLS);
+	if ((x1 - x0 + 1) * (y1 - y0 + 1) <= 16)
+	{
+		for (int py = y0; py <= y1; py++)
+		{
+			for (int px = x0; px <= x1; px++)
+			{
+				Patch* p = GridGet(t, px, py);
+				if (p && CircleHit(px * VISUAL_CELLS, py * VISUAL_CELLS, VISUAL_CELLS, xyr))
+					cb(p, px * VISUAL_CELLS, py * VISUAL_CELLS, view_flags & 0xAA & ~p->flags, cookie);
+			}
+		}
+		return;
+	}
 
 	QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, xyr, view_flags & 0xAA, cb, cookie);
 }
 
 
-int triangle_intersections = 0; 
-int hit_patch_tests = 0;
 bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[3], bool positive_only)
 {
-	hit_patch_tests ++;
 	static const double sxy = (double)VISUAL_CELLS / (double)HEIGHT_CELLS;
 	bool hit = false;
 
@@ -1822,7 +2750,6 @@ bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[
 
 			if (rot & 1)
 			{
-				triangle_intersections++;
 				if (RayIntersectsTriangle(ray, v[2], v[0], v[1], ret, positive_only))
 				{
 					hit |= 1;
@@ -1835,7 +2762,6 @@ bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[
 					}
 				}
 
-				triangle_intersections++;
 				if (RayIntersectsTriangle(ray, v[2], v[1], v[3], ret, positive_only))
 				{
 					hit |= 1;
@@ -1850,7 +2776,6 @@ bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[
 			}
 			else
 			{
-				triangle_intersections++;
 				if (RayIntersectsTriangle(ray, v[0], v[3], v[2], ret, positive_only))
 				{
 					hit |= 1;
@@ -1863,7 +2788,6 @@ bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[
 					}
 				}
 
-				triangle_intersections++;
 				if (RayIntersectsTriangle(ray, v[0], v[1], v[3], ret, positive_only))
 				{
 					hit |= 1;
@@ -2433,12 +3357,208 @@ Patch* HitTerrain(Terrain* t, double p[3], double v[3], double ret[3], double nr
 		HitTerrain7
 	};
 
-	hit_patch_tests = 0;
-	triangle_intersections = 0;
 	Patch* patch = func_vect[sign_case](t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, ray, ret, nrm, positive_only);
 	return patch;
 }
 
+// packet tracing: all lanes go down the tree together, lanes missing a node
+// (slab test, also behind nearest hit so far) are masked out of its subtree
+// lanes are plain loops so compiler can vectorize them, no intrinsics
+struct RayPacket
+{
+	double p[3][TERRAIN_PACKET]; // origins
+	double v[3][TERRAIN_PACKET]; // directions
+	double iv[3][TERRAIN_PACKET]; // reciprocal directions
+	double lo[TERRAIN_PACKET]; // 0 if positive_only
+	double t[TERRAIN_PACKET]; // nearest hit so far
+	double ret[3][TERRAIN_PACKET];
+	Patch* hit[TERRAIN_PACKET];
+	int flip; // near to far child order
+};
+
+static inline int HitPacketBox(const RayPacket* rp, int mask, double x0, double y0, double z0, double x1, double y1, double z1)
+{
+	int m = 0;
+	for (int i = 0; i < TERRAIN_PACKET; i++)
+	{
+		double ax = (x0 - rp->p[0][i]) * rp->iv[0][i], bx = (x1 - rp->p[0][i]) * rp->iv[0][i];
+		double ay = (y0 - rp->p[1][i]) * rp->iv[1][i], by = (y1 - rp->p[1][i]) * rp->iv[1][i];
+		double az = (z0 - rp->p[2][i]) * rp->iv[2][i], bz = (z1 - rp->p[2][i]) * rp->iv[2][i];
+
+		double n = rp->lo[i], f = rp->t[i];
+		n = ax < bx ? (ax > n ? ax : n) : (bx > n ? bx : n);
+		f = ax < bx ? (bx < f ? bx : f) : (ax < f ? ax : f);
+		n = ay < by ? (ay > n ? ay : n) : (by > n ? by : n);
+		f = ay < by ? (by < f ? by : f) : (ay < f ? ay : f);
+		n = az < bz ? (az > n ? az : n) : (bz > n ? bz : n);
+		f = az < bz ? (bz < f ? bz : f) : (az < f ? az : f);
+
+		m |= (n <= f) << i;
+	}
+	return m & mask;
+}
+
+// same math as RayIntersectsTriangle() per lane
+static inline int HitPacketTriangle(RayPacket* rp, int mask, const double v0[3], const double v1[3], const double v2[3])
+{
+	const double EPSILON = 0.0000001;
+
+	double e1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+	double e2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+
+	int m = 0;
+	for (int i = 0; i < TERRAIN_PACKET; i++)
+	{
+		double h[3] =
+		{
+			rp->v[1][i] * e2[2] - rp->v[2][i] * e2[1],
+			rp->v[2][i] * e2[0] - rp->v[0][i] * e2[2],
+			rp->v[0][i] * e2[1] - rp->v[1][i] * e2[0]
+		};
+
+		double a = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+		double f = 1.0 / a;
+
+		double s[3] = { rp->p[0][i] - v0[0], rp->p[1][i] - v0[1], rp->p[2][i] - v0[2] };
+		double u = f * (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]);
+
+		double q[3] =
+		{
+			s[1] * e1[2] - s[2] * e1[1],
+			s[2] * e1[0] - s[0] * e1[2],
+			s[0] * e1[1] - s[1] * e1[0]
+		};
+
+		double v = f * (rp->v[0][i] * q[0] + rp->v[1][i] * q[1] + rp->v[2][i] * q[2]);
+		double t = f * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+
+		bool in = (mask >> i) & 1 &&
+			!(a > -EPSILON && a < EPSILON) &&
+			u >= 0.0 && u <= 1.0 && v >= 0.0 && u + v <= 1.0 &&
+			t >= rp->lo[i] && t <= rp->t[i];
+
+		rp->t[i] = in ? t : rp->t[i];
+		rp->ret[0][i] = in ? rp->p[0][i] + rp->v[0][i] * t : rp->ret[0][i];
+		rp->ret[1][i] = in ? rp->p[1][i] + rp->v[1][i] * t : rp->ret[1][i];
+		rp->ret[2][i] = in ? rp->p[2][i] + rp->v[2][i] * t : rp->ret[2][i];
+
+		m |= in << i;
+	}
+	return m;
+}
+
+static void HitPacketPatch(RayPacket* rp, int mask, Patch* p, int x, int y)
+{
+	static const double sxy = (double)VISUAL_CELLS / (double)HEIGHT_CELLS;
+	int hit = 0;
+	int rot = p->diag;
+
+	for (int hy = 0; hy < HEIGHT_CELLS; hy++)
+	{
+		for (int hx = 0; hx < HEIGHT_CELLS; hx++)
+		{
+			double x0 = x + hx * sxy, x1 = x0 + sxy;
+			double y0 = y + hy * sxy, y1 = y0 + sxy;
+
+			double v[4][3] =
+			{
+				{x0,y0,(double)p->height[hy][hx]},
+				{x1,y0,(double)p->height[hy][hx+1]},
+				{x0,y1,(double)p->height[hy+1][hx]},
+				{x1,y1,(double)p->height[hy+1][hx+1]},
+			};
+
+			if (rot & 1)
+			{
+				hit |= HitPacketTriangle(rp, mask, v[2], v[0], v[1]);
+				hit |= HitPacketTriangle(rp, mask, v[2], v[1], v[3]);
+			}
+			else
+			{
+				hit |= HitPacketTriangle(rp, mask, v[0], v[3], v[2]);
+				hit |= HitPacketTriangle(rp, mask, v[0], v[1], v[3]);
+			}
+
+			rot >>= 1;
+		}
+	}
+
+	for (int i = 0; i < TERRAIN_PACKET; i++)
+	{
+		if (hit & (1 << i))
+			rp->hit[i] = p;
+	}
+}
+
+static void HitPacketTree(RayPacket* rp, int mask, QuadItem* q, int x, int y, int range)
+{
+	mask = HitPacketBox(rp, mask, x, y, q->lo, x + range, y + range, q->hi);
+	if (!mask)
+		return;
+
+	if (range == VISUAL_CELLS)
+	{
+		HitPacketPatch(rp, mask, (Patch*)q, x, y);
+		return;
+	}
+
+	range >>= 1;
+	Node* n = (Node*)q;
+	for (int c = 0; c < 4; c++)
+	{
+		int i = c ^ rp->flip;
+		if (n->quad[i])
+			HitPacketTree(rp, mask, n->quad[i], x + (i & 1) * range, y + (i >> 1) * range, range);
+	}
+}
+
+int HitTerrainPacket(Terrain* t, int rays, double p[][3], double v[][3], double ret[][3], Patch* hit[], bool positive_only)
+{
+	if (rays > TERRAIN_PACKET)
+		rays = TERRAIN_PACKET;
+
+	for (int i = 0; i < rays; i++)
+		hit[i] = 0;
+
+	if (!t || !t->root || rays <= 0)
+		return 0;
+
+	RayPacket rp;
+	for (int i = 0; i < TERRAIN_PACKET; i++)
+	{
+		int r = i < rays ? i : 0; // pad with first ray, masked out
+		for (int a = 0; a < 3; a++)
+		{
+			rp.p[a][i] = p[r][a];
+			rp.v[a][i] = v[r][a];
+			rp.iv[a][i] = v[r][a] ? 1.0 / v[r][a] : DBL_MAX;
+			rp.ret[a][i] = 0;
+		}
+		rp.lo[i] = positive_only ? 0 : -DBL_MAX;
+		rp.t[i] = FLT_MAX;
+		rp.hit[i] = 0;
+	}
+
+	// minimal t first, lane 0 decides for all
+	rp.flip = (v[0][0] < 0 ? 1 : 0) | (v[0][1] < 0 ? 2 : 0);
+
+	HitPacketTree(&rp, (1 << rays) - 1, t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level);
+
+	int mask = 0;
+	for (int i = 0; i < rays; i++)
+	{
+		hit[i] = rp.hit[i];
+		if (hit[i])
+		{
+			ret[i][0] = rp.ret[0][i];
+			ret[i][1] = rp.ret[1][i];
+			ret[i][2] = rp.ret[2][i];
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
 size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 {
 	int x, y;
@@ -2449,6 +3569,13 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 	if (py)
 		*py = y;
 
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(t, p, x, y);
+#endif
+
+	GridSet(t, x, y, 0);
+	DropMips(p);
+
 	int flags = p->flags;
 	Node* n = p->parent;
 
@@ -2485,7 +3612,7 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 		{
 			q = n;
 			n = n->parent;
-			free((Node*)q);
+			FreeNode(t, (Node*)q);
 			t->nodes--;
 		}
 		else
@@ -2523,7 +3650,7 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 
 		t->root = n->quad[j];
 		t->root->parent = 0;
-		free(n);
+		FreeNode(t, n);
 		t->nodes--;
 
 		if (t->level)
@@ -2534,14 +3661,14 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 
 	Patch* np[8] =
 	{
-		flags & 0x01 ? GetTerrainPatch(t, x - 1, y - 1) : 0,
-		flags & 0x02 ? GetTerrainPatch(t, x, y - 1) : 0,
-		flags & 0x04 ? GetTerrainPatch(t, x + 1, y - 1) : 0,
-		flags & 0x08 ? GetTerrainPatch(t, x + 1, y) : 0,
-		flags & 0x10 ? GetTerrainPatch(t, x + 1, y + 1) : 0,
-		flags & 0x20 ? GetTerrainPatch(t, x, y + 1) : 0,
-		flags & 0x40 ? GetTerrainPatch(t, x - 1, y + 1) : 0,
-		flags & 0x80 ? GetTerrainPatch(t, x - 1, y) : 0,
+		flags & 0x01 ? GridGet(t, x - 1, y - 1) : 0,
+		flags & 0x02 ? GridGet(t, x, y - 1) : 0,
+		flags & 0x04 ? GridGet(t, x + 1, y - 1) : 0,
+		flags & 0x08 ? GridGet(t, x + 1, y) : 0,
+		flags & 0x10 ? GridGet(t, x + 1, y + 1) : 0,
+		flags & 0x20 ? GridGet(t, x, y + 1) : 0,
+		flags & 0x40 ? GridGet(t, x - 1, y + 1) : 0,
+		flags & 0x80 ? GridGet(t, x - 1, y) : 0,
 	};
 
 	for (int i = 0; i < 8; i++)
@@ -2558,6 +3685,10 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 
 size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 {
+#ifdef DARK_TERRAIN
+	MarkDarkDirty(p);
+#endif
+
 	if (!t->root)
 	{
 		t->x = -x;
@@ -2568,6 +3699,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 		t->root = p;
 		t->patches = 1;
+		GridSet(t, x, y, p);
 
 		return sizeof(Patch);
 	}
@@ -2581,7 +3713,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (x < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * y < range)
@@ -2627,7 +3759,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (y < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * x < range)
@@ -2673,7 +3805,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (x >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * y > range)
@@ -2713,7 +3845,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (y >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = AllocNode(t);
 		t->nodes++;
 
 		if (2 * x > range)
@@ -2771,7 +3903,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 		{
 			if (!(Node*)n->quad[i])
 			{
-				Node* c = (Node*)malloc(sizeof(Node));
+				Node* c = AllocNode(t);
 				t->nodes++;
 
 				c->parent = n;
@@ -2793,6 +3925,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 			n->quad[i] = p;
 			p->parent = n;
+			GridSet(t, x - t->x, y - t->y, p);
 
 			UpdateNodes(p);
 
@@ -2818,7 +3951,7 @@ size_t TerrainDispose(Patch* p)
 	}
 #endif
 
-	free(p);
+	FreePatch(p);
 
 	return sizeof(Patch);
 }
@@ -2841,32 +3974,506 @@ struct FilePatch
 	uint16_t diag; // 2
 };
 
-void SaveTree(FILE* f, int x, int y, int lev, const QuadItem* item)
+// chunked format, told from old one (flat array of FilePatch) by header_size
+// header is followed by chunk directory and then by chunk payloads
+#define TERRAIN_FILE_VERSION 1
+#define CHUNK_SHIFT 4 // 16x16 patches per file chunk
+#define CHUNK_MASK ((1 << CHUNK_SHIFT) - 1)
+
+struct FileChunkHeader
+{
+	uint32_t file_sign;
+	uint32_t header_size; // old loaders reject this format by it
+	uint32_t num_patches;
+	uint32_t version;
+	uint32_t num_chunks;
+	uint32_t chunk_shift;
+	uint64_t data_size; // directory + payloads, terrain section ends right after
+};
+
+enum FILE_CHUNK_ENCODING
+{
+	FILE_CHUNK_RAW = 0, // array of FilePatch
+	FILE_CHUNK_PACKED = 1, // see EncodeChunk()
+};
+
+struct FileChunk
+{
+	int32_t x, y; // worldspace patch coords >> CHUNK_SHIFT
+	uint16_t lo, hi; // height range of its patches, lets queries cull it unloaded
+	uint16_t patches;
+	uint16_t encoding;
+	uint32_t size; // payload bytes
+	uint32_t reserved;
+	uint64_t offset; // payload from directory start
+};
+
+#define PATCH_HEIGHTS ((HEIGHT_CELLS + 1) * (HEIGHT_CELLS + 1))
+#define PATCH_VISUALS (VISUAL_CELLS * VISUAL_CELLS)
+#define PACKED_CHUNK_BOUND(n) ((n) * (1 + 3 + 3 * PATCH_HEIGHTS + 6 * PATCH_VISUALS))
+
+static inline uint8_t* PutVarint(uint8_t* dst, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*dst++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*dst++ = (uint8_t)v;
+	return dst;
+}
+
+// NULL if truncated
+static inline const uint8_t* GetVarint(const uint8_t* src, const uint8_t* end, uint32_t* v)
+{
+	uint32_t r = 0;
+	for (int s = 0; s < 32 && src < end; s += 7)
+	{
+		uint8_t b = *src++;
+		r |= (uint32_t)(b & 0x7F) << s;
+		if (!(b & 0x80))
+		{
+			*v = r;
+			return src;
+		}
+	}
+	return 0;
+}
+
+// packed chunk payload, all patches of chunk go through each stream in turn:
+// - patch positions in chunk, byte per patch (y << CHUNK_SHIFT | x)
+// - diags as varints
+// - heights as zigzag varint deltas from previous height (smooth slopes take a byte)
+// - visuals as varint pairs (run - 1, value) (large areas share material)
+static uint32_t EncodeChunk(const FilePatch* pch, int n, uint8_t* dst)
+{
+	uint8_t* d = dst;
+
+	for (int i = 0; i < n; i++)
+		*d++ = (uint8_t)(((pch[i].y & CHUNK_MASK) << CHUNK_SHIFT) | (pch[i].x & CHUNK_MASK));
+
+	for (int i = 0; i < n; i++)
+		d = PutVarint(d, pch[i].diag);
+
+	int prev = 0;
+	for (int i = 0; i < n; i++)
+	{
+		const uint16_t* h = pch[i].height[0];
+		for (int j = 0; j < PATCH_HEIGHTS; j++)
+		{
+			int delta = h[j] - prev;
+			prev = h[j];
+			d = PutVarint(d, (uint32_t)(delta * 2) ^ (uint32_t)(delta >> 31));
+		}
+	}
+
+	int total = n * PATCH_VISUALS;
+	for (int k = 0; k < total; )
+	{
+		uint16_t v = pch[k / PATCH_VISUALS].visual[0][k % PATCH_VISUALS];
+		int run = 1;
+		while (k + run < total && pch[(k + run) / PATCH_VISUALS].visual[0][(k + run) % PATCH_VISUALS] == v)
+			run++;
+
+		d = PutVarint(d, run - 1);
+		d = PutVarint(d, v);
+		k += run;
+	}
+
+	return (uint32_t)(d - dst);
+}
+
+// false if payload is broken
+static bool DecodeChunk(const uint8_t* src, uint32_t size, int n, int x0, int y0, FilePatch* pch)
+{
+	const uint8_t* end = src + size;
+	if (size < (uint32_t)n)
+		return false;
+
+	for (int i = 0; i < n; i++)
+	{
+		pch[i].x = x0 + (src[i] & CHUNK_MASK);
+		pch[i].y = y0 + (src[i] >> CHUNK_SHIFT);
+	}
+	src += n;
+
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t v;
+		if (!(src = GetVarint(src, end, &v)))
+			return false;
+		pch[i].diag = (uint16_t)v;
+	}
+
+	// prefix sum of deltas
+	int acc = 0;
+	for (int i = 0; i < n; i++)
+	{
+		uint16_t* h = pch[i].height[0];
+		for (int j = 0; j < PATCH_HEIGHTS; j++)
+		{
+			uint32_t z;
+			if (!(src = GetVarint(src, end, &z)))
+				return false;
+			acc += (int)(z >> 1) ^ -(int)(z & 1);
+			h[j] = (uint16_t)acc;
+		}
+	}
+
+	int total = n * PATCH_VISUALS;
+	for (int k = 0; k < total; )
+	{
+		uint32_t run, v;
+		if (!(src = GetVarint(src, end, &run)) || !(src = GetVarint(src, end, &v)) || run >= (uint32_t)(total - k))
+			return false;
+
+		for (uint32_t r = 0; r <= run; r++, k++)
+			pch[k / PATCH_VISUALS].visual[0][k % PATCH_VISUALS] = (uint16_t)v;
+	}
+
+	return src == end;
+}
+
+struct LazyChunk
+{
+	FileChunk fc;
+	bool loaded;
+	bool pinned; // patches added / deleted, never evicted
+	uint32_t stamp; // clock of last touch
+};
+
+struct TerrainFile
+{
+	void* map; // whole file if mmap'ed
+	size_t map_size;
+	uint8_t* buf; // or terrain section read to memory
+	const uint8_t* data; // directory start
+
+	int chunks;
+	LazyChunk* chunk; // sorted by y then x
+	int pending; // chunks not loaded
+
+	int budget; // max patches loaded, 0 -> no limit
+	uint32_t clock; // ticks on every touch
+	bool busy; // loading or evicting, pinning is off
+};
+
+static void DeleteTerrainFile(TerrainFile* tf)
+{
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	if (tf->map)
+		munmap(tf->map, tf->map_size);
+#endif
+
+	if (tf->buf)
+		free(tf->buf);
+	if (tf->chunk)
+		free(tf->chunk);
+	free(tf);
+}
+
+// nothing left to load or to reload after eviction, file is not needed anymore
+static void SettleTerrainFile(Terrain* t)
+{
+	if (!t->lazy->pending && !t->lazy->budget)
+	{
+		DeleteTerrainFile(t->lazy);
+		t->lazy = 0;
+	}
+}
+
+static int CmpChunk(const void* a, const void* b)
+{
+	const FileChunk* ca = &((const LazyChunk*)a)->fc;
+	const FileChunk* cb = &((const LazyChunk*)b)->fc;
+	if (ca->y != cb->y)
+		return ca->y < cb->y ? -1 : 1;
+	if (ca->x != cb->x)
+		return ca->x < cb->x ? -1 : 1;
+	return 0;
+}
+
+static LazyChunk* FindChunk(TerrainFile* tf, int x, int y)
+{
+	int a = 0, b = tf->chunks;
+	while (a < b)
+	{
+		int m = (a + b) / 2;
+		const FileChunk* fc = &tf->chunk[m].fc;
+		if (fc->y < y || fc->y == y && fc->x < x)
+			a = m + 1;
+		else
+			b = m;
+	}
+
+	if (a < tf->chunks && tf->chunk[a].fc.x == x && tf->chunk[a].fc.y == y)
+		return tf->chunk + a;
+	return 0;
+}
+
+static void EvictChunk(Terrain* t, LazyChunk* c)
+{
+	int x0 = c->fc.x * (1 << CHUNK_SHIFT);
+	int y0 = c->fc.y * (1 << CHUNK_SHIFT);
+
+#ifdef DARK_TERRAIN
+	// not an edit, neighbors keep shadows it casts (as if it was still there)
+	double dark_dirty[6];
+	memcpy(dark_dirty, t->dark_dirty, sizeof(dark_dirty));
+#endif
+
+	for (int y = 0; y <= CHUNK_MASK; y++)
+	{
+		for (int x = 0; x <= CHUNK_MASK; x++)
+		{
+			if (GridGet(t, x0 + x, y0 + y))
+				DelTerrainPatch(t, x0 + x, y0 + y);
+		}
+	}
+
+#ifdef DARK_TERRAIN
+	memcpy(t->dark_dirty, dark_dirty, sizeof(dark_dirty));
+#endif
+
+	TrimSlabs(t, x0, y0, x0 + CHUNK_MASK, y0 + CHUNK_MASK);
+
+	c->loaded = false;
+	t->lazy->pending++;
+}
+
+// least recently touched first, never ones touched by current TouchTerrain()
+static void EvictChunks(Terrain* t, int need)
+{
+	TerrainFile* tf = t->lazy;
+	while (t->patches + need > tf->budget)
+	{
+		LazyChunk* lru = 0;
+		for (int i = 0; i < tf->chunks; i++)
+		{
+			LazyChunk* c = tf->chunk + i;
+			if (c->loaded && !c->pinned && c->stamp != tf->clock &&
+				(!lru || tf->clock - c->stamp > tf->clock - lru->stamp))
+			{
+				lru = c;
+			}
+		}
+
+		if (!lru)
+			break; // all in use, go over budget
+
+		EvictChunk(t, lru);
+	}
+}
+
+static void LoadChunk(Terrain* t, LazyChunk* c)
+{
+	TerrainFile* tf = t->lazy;
+
+	c->loaded = true;
+	tf->pending--;
+
+	int x0 = c->fc.x * (1 << CHUNK_SHIFT);
+	int y0 = c->fc.y * (1 << CHUNK_SHIFT);
+	const uint8_t* src = tf->data + c->fc.offset;
+
+	int patches = c->fc.patches;
+	FilePatch* arr = (FilePatch*)malloc(sizeof(FilePatch) * (patches + 1));
+	if (c->fc.encoding == FILE_CHUNK_RAW)
+		memcpy(arr, src, sizeof(FilePatch) * patches);
+	else
+	if (!DecodeChunk(src, c->fc.size, patches, x0, y0, arr))
+		patches = 0; // broken, leave it empty
+
+	for (int i = 0; i < patches; i++)
+	{
+		const FilePatch& pch = arr[i];
+
+		int x = pch.x - x0, y = pch.y - y0;
+		if (x < 0 || y < 0 || x > CHUNK_MASK || y > CHUNK_MASK || GridGet(t, pch.x, pch.y))
+			continue;
+
+		// adding / updating recalcs diags along borders of neighbors,
+		// keep their loaded ones so result doesn't depend on touch order
+		Patch* np[9];
+		uint16_t nd[9];
+		for (int n = 0; n < 9; n++)
+		{
+			np[n] = GridGet(t, pch.x + n % 3 - 1, pch.y + n / 3 - 1);
+			nd[n] = np[n] ? np[n]->diag : 0;
+		}
+
+		Patch* p = AddTerrainPatch(t, pch.x, pch.y, 0);
+
+		memcpy(p->visual, pch.visual, sizeof(uint16_t)*VISUAL_CELLS*VISUAL_CELLS);
+		memcpy(p->height, pch.height, sizeof(uint16_t)*(HEIGHT_CELLS + 1)*(HEIGHT_CELLS + 1));
+
+		UpdateTerrainVisualMap(p);
+		UpdateTerrainHeightMap(p);
+
+		p->diag = pch.diag;
+		for (int n = 0; n < 9; n++)
+		{
+			if (np[n])
+				np[n]->diag = nd[n];
+		}
+
+#ifdef DARK_TERRAIN
+		// comes in as edited over its own height range, so next dirty_only bake
+		// shades it together with loaded neighbors it casts shadows on
+		p->dark_lo = p->lo;
+		p->dark_hi = p->hi;
+#endif
+	}
+
+	free(arr);
+}
+
+static void PinTerrainChunk(Terrain* t, int x, int y)
+{
+	TerrainFile* tf = t->lazy;
+	if (tf->busy)
+		return;
+
+	LazyChunk* c = FindChunk(tf, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+	if (!c)
+		return;
+
+	tf->busy = true;
+	c->stamp = tf->clock;
+	c->pinned = true;
+	if (!c->loaded)
+		LoadChunk(t, c);
+	tf->busy = false;
+
+	SettleTerrainFile(t);
+}
+
+// chunk square in visual cells grown by a patch, so patches at its border
+// get neighbor flags and diags along edges from adjacent chunks
+static inline int ChunkSquare(const FileChunk* fc, int* x, int* y)
+{
+	*x = fc->x * (VISUAL_CELLS << CHUNK_SHIFT) - VISUAL_CELLS;
+	*y = fc->y * (VISUAL_CELLS << CHUNK_SHIFT) - VISUAL_CELLS;
+	return (VISUAL_CELLS << CHUNK_SHIFT) + 2 * VISUAL_CELLS;
+}
+
+bool TouchTerrain(Terrain* t, const double xyr[3])
+{
+	if (!t || !t->lazy)
+		return false;
+
+	TerrainFile* tf = t->lazy;
+	tf->busy = true;
+	tf->clock++;
+
+	bool paged = false;
+	for (int i = 0; i < tf->chunks; i++)
+	{
+		LazyChunk* c = tf->chunk + i;
+
+		int x, y;
+		int range = ChunkSquare(&c->fc, &x, &y);
+		if (!CircleHit(x, y, range, xyr))
+			continue;
+
+		c->stamp = tf->clock;
+		if (!c->loaded)
+		{
+			LoadChunk(t, c);
+			paged = true;
+		}
+	}
+
+	if (tf->budget)
+	{
+		int pending = tf->pending;
+		EvictChunks(t, 0);
+		if (tf->pending != pending)
+			paged = true;
+	}
+
+	tf->busy = false;
+	SettleTerrainFile(t);
+	return paged;
+}
+
+void LoadTerrainChunks(Terrain* t)
+{
+	if (!t || !t->lazy)
+		return;
+
+	TerrainFile* tf = t->lazy;
+	tf->budget = 0; // everything stays
+	tf->busy = true;
+	for (int i = 0; i < tf->chunks; i++)
+	{
+		if (!tf->chunk[i].loaded)
+			LoadChunk(t, tf->chunk + i);
+	}
+	tf->busy = false;
+
+	SettleTerrainFile(t);
+}
+
+void SetTerrainBudget(Terrain* t, int patches)
+{
+	if (!t || !t->lazy)
+		return; // all in memory, nothing to reload from
+
+	t->lazy->budget = patches > 0 ? patches : 0;
+	SettleTerrainFile(t);
+}
+
+struct SavePatch
+{
+	int x, y;
+	const Patch* p;
+};
+
+static void GatherTree(SavePatch* list, int* n, int x, int y, int lev, const QuadItem* item)
 {
 	if (!lev)
 	{
-		const Patch* p = (const Patch*)item;
-		fwrite(&x,1,sizeof(int32_t),f);
-		fwrite(&y,1,sizeof(int32_t),f);
-		fwrite(p->visual,VISUAL_CELLS*VISUAL_CELLS,sizeof(uint16_t),f);
-		fwrite(p->height,(HEIGHT_CELLS+1)*(HEIGHT_CELLS+1),sizeof(uint16_t),f);
-		fwrite(&p->diag,1,sizeof(int16_t),f);
+		SavePatch* sp = list + *n;
+		sp->x = x;
+		sp->y = y;
+		sp->p = (const Patch*)item;
+		(*n)++;
 		return;
 	}
 
-	const Node* n = (const Node*)item;
+	const Node* nd = (const Node*)item;
 	lev--;
 
 	int r = 1<<lev;
 
-	if (n->quad[0])
-		SaveTree(f,x,y,lev,n->quad[0]);
-	if (n->quad[1])
-		SaveTree(f,x+r,y,lev,n->quad[1]);
-	if (n->quad[2])
-		SaveTree(f,x,y+r,lev,n->quad[2]);
-	if (n->quad[3])
-		SaveTree(f,x+r,y+r,lev,n->quad[3]);
+	if (nd->quad[0])
+		GatherTree(list,n,x,y,lev,nd->quad[0]);
+	if (nd->quad[1])
+		GatherTree(list,n,x+r,y,lev,nd->quad[1]);
+	if (nd->quad[2])
+		GatherTree(list,n,x,y+r,lev,nd->quad[2]);
+	if (nd->quad[3])
+		GatherTree(list,n,x+r,y+r,lev,nd->quad[3]);
+}
+
+// chunks by y then x, patches inside of them too (tree order changes as it grows
+// so it would make saves of the same terrain differ)
+static int CmpSavePatch(const void* a, const void* b)
+{
+	const SavePatch* pa = (const SavePatch*)a;
+	const SavePatch* pb = (const SavePatch*)b;
+	int ay = pa->y >> CHUNK_SHIFT, by = pb->y >> CHUNK_SHIFT;
+	if (ay != by)
+		return ay < by ? -1 : 1;
+	int ax = pa->x >> CHUNK_SHIFT, bx = pb->x >> CHUNK_SHIFT;
+	if (ax != bx)
+		return ax < bx ? -1 : 1;
+	if (pa->y != pb->y)
+		return pa->y < pb->y ? -1 : 1;
+	if (pa->x != pb->x)
+		return pa->x < pb->x ? -1 : 1;
+	return 0;
 }
 
 bool SaveTerrain(const Terrain* t, FILE* f)
@@ -2874,23 +4481,167 @@ bool SaveTerrain(const Terrain* t, FILE* f)
 	if (!t || !f)
 		return false;
 
-	FileHeader hdr =
+	// chunks are written from memory
+	LoadTerrainChunks((Terrain*)t);
+
+	int n = 0;
+	SavePatch* list = (SavePatch*)malloc(sizeof(SavePatch) * (t->patches + 1));
+	if (t->root)
+		GatherTree(list, &n, -t->x, -t->y, t->level, t->root);
+
+	qsort(list, n, sizeof(SavePatch), CmpSavePatch);
+
+	int chunks = 0;
+	FileChunk* dir = (FileChunk*)malloc(sizeof(FileChunk) * (n + 1));
+	uint8_t* data = (uint8_t*)malloc(PACKED_CHUNK_BOUND(n) + 1);
+	FilePatch* arr = (FilePatch*)malloc(sizeof(FilePatch) << (2 * CHUNK_SHIFT));
+	uint32_t size = 0;
+
+	for (int i = 0; i < n; )
+	{
+		FileChunk* fc = dir + chunks++;
+		fc->x = list[i].x >> CHUNK_SHIFT;
+		fc->y = list[i].y >> CHUNK_SHIFT;
+		fc->lo = 0xffff;
+		fc->hi = 0x0000;
+		fc->patches = 0;
+		fc->encoding = FILE_CHUNK_PACKED;
+		fc->reserved = 0;
+
+		for (; i < n && (list[i].x >> CHUNK_SHIFT) == fc->x && (list[i].y >> CHUNK_SHIFT) == fc->y; i++)
+		{
+			const Patch* p = list[i].p;
+			FilePatch* pch = arr + fc->patches++;
+			pch->x = list[i].x;
+			pch->y = list[i].y;
+			memcpy(pch->visual,p->visual,sizeof(uint16_t)*VISUAL_CELLS*VISUAL_CELLS);
+			memcpy(pch->height,p->height,sizeof(uint16_t)*(HEIGHT_CELLS+1)*(HEIGHT_CELLS+1));
+			pch->diag = p->diag;
+
+			fc->lo = p->lo < fc->lo ? p->lo : fc->lo;
+			fc->hi = p->hi > fc->hi ? p->hi : fc->hi;
+		}
+
+		fc->offset = size; // relative to payloads for now
+		fc->size = EncodeChunk(arr, fc->patches, data + size);
+		size += fc->size;
+	}
+
+	uint64_t offset = chunks * sizeof(FileChunk);
+	for (int i = 0; i < chunks; i++)
+		dir[i].offset += offset;
+	offset += size;
+
+	FileChunkHeader hdr =
 	{
 		*(uint32_t*)"AS3D",
-		(uint32_t)sizeof(FileHeader),
+		(uint32_t)sizeof(FileChunkHeader),
 		(uint32_t)t->patches,
-		(uint32_t)0
+		(uint32_t)TERRAIN_FILE_VERSION,
+		(uint32_t)chunks,
+		(uint32_t)CHUNK_SHIFT,
+		offset
 	};
 
-	fwrite(&hdr,1,sizeof(FileHeader),f);
+	fwrite(&hdr,1,sizeof(FileChunkHeader),f);
+	fwrite(dir,sizeof(FileChunk),chunks,f);
+	fwrite(data,1,size,f);
 
-	if (t->root)
-		SaveTree(f, -t->x, -t->y, t->level,t->root);
+	free(arr);
+	free(data);
+	free(dir);
+	free(list);
 
 	return true;
 }
 
-Terrain* LoadTerrain(FILE* f)
+static Terrain* LoadChunkedTerrain(FILE* f, const FileHeader* head, bool lazy)
+{
+	FileChunkHeader hdr;
+	memcpy(&hdr, head, sizeof(FileHeader));
+	size_t rest = sizeof(FileChunkHeader) - sizeof(FileHeader);
+	if (fread((uint8_t*)&hdr + sizeof(FileHeader), 1, rest, f) != rest)
+		return 0;
+
+	uint64_t dir_size = (uint64_t)hdr.num_chunks * sizeof(FileChunk);
+	if (hdr.version != TERRAIN_FILE_VERSION || hdr.chunk_shift != CHUNK_SHIFT || hdr.data_size < dir_size)
+		return 0;
+
+	TerrainFile* tf = (TerrainFile*)malloc(sizeof(TerrainFile));
+	tf->map = 0;
+	tf->map_size = 0;
+	tf->buf = 0;
+	tf->data = 0;
+	tf->chunks = 0;
+	tf->chunk = 0;
+	tf->pending = 0;
+	tf->budget = 0;
+	tf->clock = 0;
+	tf->busy = false;
+
+	long base = ftell(f);
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	struct stat st;
+	if (lazy && base >= 0 && fstat(fileno(f), &st) == 0 && (uint64_t)st.st_size >= base + hdr.data_size)
+	{
+		// whole file, offset must be page aligned
+		void* map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED)
+		{
+			tf->map = map;
+			tf->map_size = (size_t)st.st_size;
+			tf->data = (const uint8_t*)map + base;
+			fseek(f, base + (long)hdr.data_size, SEEK_SET);
+		}
+	}
+#endif
+
+	if (!tf->map)
+	{
+		// eager or not mappable, lazy loading still decodes chunks on demand
+		tf->buf = (uint8_t*)malloc(hdr.data_size ? (size_t)hdr.data_size : 1);
+		tf->data = tf->buf;
+		if (fread(tf->buf, 1, (size_t)hdr.data_size, f) != hdr.data_size)
+		{
+			DeleteTerrainFile(tf);
+			return 0;
+		}
+	}
+
+	tf->chunks = hdr.num_chunks;
+	tf->chunk = (LazyChunk*)calloc(tf->chunks + 1, sizeof(LazyChunk));
+	tf->pending = tf->chunks;
+
+	for (int i = 0; i < tf->chunks; i++)
+	{
+		FileChunk* fc = &tf->chunk[i].fc;
+		memcpy(fc, tf->data + i * sizeof(FileChunk), sizeof(FileChunk));
+
+		if (fc->encoding != FILE_CHUNK_RAW && fc->encoding != FILE_CHUNK_PACKED ||
+			fc->patches > (1 << (2 * CHUNK_SHIFT)) ||
+			fc->encoding == FILE_CHUNK_RAW && fc->size != fc->patches * sizeof(FilePatch) ||
+			fc->offset < dir_size || fc->offset + fc->size > hdr.data_size)
+		{
+			DeleteTerrainFile(tf);
+			return 0;
+		}
+	}
+
+	qsort(tf->chunk, tf->chunks, sizeof(LazyChunk), CmpChunk);
+
+	Terrain* t = CreateTerrain();
+	t->lazy = tf;
+
+	if (!lazy)
+		LoadTerrainChunks(t);
+	else
+		SettleTerrainFile(t);
+
+	return t;
+}
+
+Terrain* LoadTerrain(FILE* f, bool lazy)
 {
 	if (!f)
 		return 0;
@@ -2901,6 +4652,13 @@ Terrain* LoadTerrain(FILE* f)
 		return 0;
 	}
 
+	if (hdr.file_sign == *(uint32_t*)"AS3D" &&
+		hdr.header_size == sizeof(FileChunkHeader))
+	{
+		return LoadChunkedTerrain(f, &hdr, lazy);
+	}
+
+	// old format, loaded at once
 	if (hdr.file_sign != *(uint32_t*)"AS3D" ||
 		hdr.header_size != sizeof(FileHeader))
 	{
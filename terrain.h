@@ -21,8 +21,28 @@ void DeleteTerrain(Terrain* t);
 void GetTerrainBase(Terrain* t, int b[2]);
 void SetTerrainBase(Terrain* t, const int b[2]);
 
+// writes chunked format, old flat format is still loadable
 bool SaveTerrain(const Terrain* t, FILE* f);
-Terrain* LoadTerrain(FILE* f);
+
+// lazy==true materializes chunks only as TouchTerrain() pages them in, file is mmap'ed
+// where possible so it must not be rewritten in place meanwhile (old format loads at once)
+// queries skip chunks not in memory, adding or deleting a patch loads its chunk
+Terrain* LoadTerrain(FILE* f, bool lazy = false);
+
+// materializes all chunks left and lets the file go
+void LoadTerrainChunks(Terrain* t);
+
+// materializes chunks with their square within circle xyr (center x,y, radius in
+// visual cells), evicts least recently touched ones over budget, returns true if
+// anything changed, must not run during queries, any patches it evicted are gone
+// chunks come in marked as edited so next dirty_only CreateDarkBake() shades them
+// and loaded neighbors they cast shadows on, evicted ones leave shadows as they were
+bool TouchTerrain(Terrain* t, const double xyr[3]);
+
+// max patches kept materialized (0 = no limit), enforced by next TouchTerrain(),
+// evicted chunks are reloaded when touched again, edits made to them are lost
+// so it's for read-only use, chunks with patches added or deleted are kept
+void SetTerrainBudget(Terrain* t, int patches);
 
 struct Patch;
 
@@ -77,11 +97,61 @@ uint16_t GetTerrainHi(Patch* p, uint16_t* lo = 0);
 uint64_t GetTerrainDark(Patch* p);
 void SetTerrainDark(Patch* p, uint64_t dark);
 void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor);
+
+// same as above but split into per-patch jobs, BakeTerrainDark() can be called
+// from many threads at once on disjoint job ranges (terrain and world must not change meanwhile)
+// dirty_only limits jobs to patches whose shadows could be changed by edits made since
+// last bake: height maps, diags, patch add/del/attach/detach and non-volatile insts
+// loaded_only leaves lazy terrain chunks alone (so SetTerrainBudget() holds), chunks
+// paged in later need dirty_only bake after TouchTerrain(), see there
+struct DarkBake;
+DarkBake* CreateDarkBake(Terrain* t, World* w, float lightpos[3], bool editor, bool dirty_only = false, bool loaded_only = false);
+void DeleteDarkBake(DarkBake* db);
+int GetDarkBakeJobs(DarkBake* db);
+void BakeTerrainDark(DarkBake* db, int from, int to);
+
+// true if there were edits since last bake, cheap enough to poll every frame
+// (may be true for edits of other terrains, dirty_only bake will have no jobs then)
+bool GetTerrainDarkDirty(Terrain* t, World* w);
+
+// light of last bake, false if there was none
+bool GetTerrainDarkLight(Terrain* t, float lightpos[3]);
+
+// bake also leaves a horizon per height cell (highest terrain elevation in 8 azimuth sectors)
+// so terrain self shadowing for any other light is a lookup, world shadows are not included
+uint32_t GetTerrainHorizonLight(const float lightpos[3]); // packs lightpos for lookups below
+uint64_t GetTerrainHorizonDark(Patch* p, uint32_t light); // same layout as GetTerrainDark()
 #endif
 
 void QueryTerrain(Terrain* t, double x, double y, double r, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie);
 void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, void (*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie);
+
+// same as above but lod_cb can stop descent at any node (range > VISUAL_CELLS), then its
+// coarse patch (same layout, spread over range x range visual cells) goes to patch_cb instead
+// of its children, patches come with range == VISUAL_CELLS, coarse ones are built on demand
+// and kept until something under them changes, nodes with holes are always descended
+struct QueryTerrainLOD
+{
+	bool (*lod_cb)(int x, int y, int range, void* cookie);
+	void (*patch_cb)(Patch* p, int x, int y, int range, int view_flags, void* cookie);
+};
+void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, const QueryTerrainLOD* cb, void* cookie);
 Patch* HitTerrain(Terrain* t, double p[3], double v[3], double ret[4], double nrm[3]=0, bool positive_only = false);
 
+// queries & hits above (and GetTerrainPatch) are read only on terrain except for
+// coarse LOD patches (lazy chunks are never loaded by them, see TouchTerrain()),
+// once those are built by PrepareTerrainQueries() any number of queries can run at
+// once from many threads until terrain is modified (patches added, deleted, updated
+// or paged in / out by TouchTerrain()), it costs about a third of patches memory for
+// mips that far views would build anyway
+// loaded_only builds them just for chunks in memory (so SetTerrainBudget() holds),
+// call it again after TouchTerrain() pages anything before querying from many threads
+void PrepareTerrainQueries(Terrain* t, bool loaded_only = false);
+
+// traces up to TERRAIN_PACKET rays together, pays off for coherent rays (shadow baking)
+// per ray results as HitTerrain() gives, returns bit mask of rays that hit
+#define TERRAIN_PACKET 4
+int HitTerrainPacket(Terrain* t, int rays, double p[][3], double v[][3], double ret[][3], Patch* hit[], bool positive_only = false);
+
 double HitTerrain(Patch* p, double u, double v); // u,v must be normalized
 
@@ -9,6 +9,17 @@
 #include <assert.h>
 #include <float.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "sprite.h"
 #include "world.h"
 #include "matrix.h"
@@ -109,7 +120,25 @@ struct Mesh
 
     MeshInst* share_list;
 
+	// read only soa copy of faces & lines used at runtime (queries, hits, physics, rendering)
+	// rebuilt by Update(), face i uses verts bake_abc[3*i+0..2], verts are in list order
+	// lines follow faces, their 3rd index repeats 2nd one (visual has line bit set)
+	void* bake; // single allocation holding all arrays below
+	size_t bake_map; // if not 0 bake points into mmap'ed cache file of this size
+	float* bake_xyz; // 3 per vert
+	int* bake_abc; // 3 per face / line
+	uint32_t* bake_visual; // 1 per face / line
+	uint8_t* bake_rgba; // 4 per vert
+
     bool Update(const char* path);
+	bool ParsePLY(const char* path);
+	void Bake();
+	void SetBake(void* block);
+	void Clear();
+
+	// binary cache of baked arrays next to source file
+	bool LoadCache(const char* path, const struct stat* st, uint64_t hash);
+	void SaveCache(const char* path, const struct stat* st, uint64_t hash);
 };
 
 struct BSP
@@ -148,6 +177,43 @@ struct BSP_Leaf : BSP
    Inst* tail;
 };
 
+// sprite & item insts move every frame, they never enter static bsp
+// instead they are kept in loose grid cells (leaves) keyed by bbox center
+// cell bbox only grows while cell is occupied, empty cells are freed
+#define DYN_CELL_SIZE 32
+#define DYN_HASH_SIZE 1024
+
+struct BSP_Cell : BSP_Leaf
+{
+	int x, y;
+	BSP_Cell* hash_next;
+
+	// in world
+	BSP_Cell* next;
+	BSP_Cell* prev;
+};
+
+// built tree compiled into one array of 4 wide nodes (depth first)
+// for queries and hits, pointer tree stays for editing
+// any change to the tree drops it until next rebuild
+#define FLAT_DEPTH 64
+#define FLAT_STACK (3 * FLAT_DEPTH + 4)
+
+struct FlatNode
+{
+	float box[6][4]; // x0,x1,y0,y1,z0,z1 of 4 lanes
+	int child[4]; // node index if count==0, else first item, -1 if lane is empty
+	int count[4];
+};
+
+struct FlatBSP
+{
+	int nodes, node_cap;
+	FlatNode* node;
+	int items, item_cap;
+	struct Inst** item;
+};
+
 struct Inst : BSP
 {
 	enum INST_TYPE
@@ -178,30 +244,29 @@ struct MeshInst : Inst
 	void UpdateBox()
 	{
 		float w[4];
-		Vert* v = mesh->head_vert;
+		const float* v = mesh->bake_xyz;
 
-		if (v)
+		for (int i = 0; i < mesh->verts; i++, v += 3)
 		{
-			Product(tm, v->xyzw, w);
-			bbox[0] = w[0];
-			bbox[1] = w[0];
-			bbox[2] = w[1];
-			bbox[3] = w[1];
-			bbox[4] = w[2];
-			bbox[5] = w[2];
-			v = v->next;
-		}
+			float xyzw[4] = { v[0], v[1], v[2], 1 };
+			Product(tm, xyzw, w);
+			if (!i)
+			{
+				bbox[0] = w[0];
+				bbox[1] = w[0];
+				bbox[2] = w[1];
+				bbox[3] = w[1];
+				bbox[4] = w[2];
+				bbox[5] = w[2];
+				continue;
+			}
 
-		while (v)
-		{
-			Product(tm, v->xyzw, w);
 			bbox[0] = fminf(bbox[0], w[0]);
 			bbox[1] = fmaxf(bbox[1], w[0]);
 			bbox[2] = fminf(bbox[2], w[1]);
 			bbox[3] = fmaxf(bbox[3], w[1]);
 			bbox[4] = fminf(bbox[4], w[2]);
 			bbox[5] = fmaxf(bbox[5], w[2]);
-			v = v->next;
 		}
 	}
 
@@ -212,22 +277,30 @@ struct MeshInst : Inst
 
 		bool flag = false;
 
-		Face* f = flags & INST_FLAGS::INST_VISIBLE ? mesh->head_face : 0;
-		while (f)
+		int faces = flags & INST_FLAGS::INST_VISIBLE ? mesh->faces : 0;
+		const int* abc = mesh->bake_abc;
+		const float* xyz = mesh->bake_xyz;
+		const uint8_t* rgba = mesh->bake_rgba;
+
+		for (int f = 0; f < faces; f++, abc += 3)
 		{
 			if (solid_only)
 			{
-				if ((f->abc[0]->rgba[3] | f->abc[1]->rgba[3] | f->abc[2]->rgba[3]) & 0x80)
-				{
-					f = f->next;
+				if ((rgba[4 * abc[0] + 3] | rgba[4 * abc[1] + 3] | rgba[4 * abc[2] + 3]) & 0x80)
 					continue;
-				}
 			}
 
+			const float* p0 = xyz + 3 * abc[0];
+			const float* p1 = xyz + 3 * abc[1];
+			const float* p2 = xyz + 3 * abc[2];
+			float xyzw0[4] = { p0[0], p0[1], p0[2], 1 };
+			float xyzw1[4] = { p1[0], p1[1], p1[2], 1 };
+			float xyzw2[4] = { p2[0], p2[1], p2[2], 1 };
+
 			double v0[4], v1[4], v2[4];
-			Product(tm, f->abc[0]->xyzw, v0);
-			Product(tm, f->abc[1]->xyzw, v1);
-			Product(tm, f->abc[2]->xyzw, v2);
+			Product(tm, xyzw0, v0);
+			Product(tm, xyzw1, v1);
+			Product(tm, xyzw2, v2);
 
 			if (RayIntersectsTriangle(ray, v0, v1, v2, ret, positive_only))
 			{
@@ -240,8 +313,6 @@ struct MeshInst : Inst
 
 				flag = true;
 			}
-
-			f = f->next;
 		}
 
 		return flag;
@@ -404,9 +475,9 @@ void PurgeItemInstCache()
 	item_inst_cache = 0;
 }
 
-int bsp_tests=0;
-int bsp_insts=0;
-int bsp_nodes=0;
+// paging mesh insts from chunked file, see LoadWorld()
+struct WorldFile;
+static void DeleteWorldFile(WorldFile* wf);
 
 struct World
 {
@@ -447,6 +518,13 @@ struct World
         m->head_line = 0;
         m->tail_line = 0;
 
+		m->bake = 0;
+		m->bake_map = 0;
+		m->bake_xyz = 0;
+		m->bake_abc = 0;
+		m->bake_visual = 0;
+		m->bake_rgba = 0;
+
         memset(m->bbox,0,sizeof(float[6]));
 
         meshes++;
@@ -464,29 +542,7 @@ struct World
         while (m->share_list)
             DelInst(m->share_list);
 
-        Face* f = m->head_face;
-        while (f)
-        {
-            Face* n = f->next;
-            free(f);
-            f=n;
-        }
-
-        Line* l = m->head_line;
-        while (l)
-        {
-            Line* n = l->next;
-            free(l);
-            l=n;
-        }        
-
-        Vert* v = m->head_vert;
-        while (v)
-        {
-            Vert* n = v->next;
-            free(v);
-            v=n;
-        }
+        m->Clear();
 
         if (m->name)
             free(m->name);
@@ -539,20 +595,13 @@ struct World
 
 		i->type = BSP::BSP_TYPE_INST;
 		i->flags = flags;
-		i->bsp_parent = 0;
-
-		i->next = 0;
-		i->prev = tail_inst;
-		if (tail_inst)
-			tail_inst->next = i;
-		else
-			head_inst = i;
-		tail_inst = i;
+		CellInsert(i);
 
 		// if (item->purpose == Item::WORLD)
 		if (flags & INST_FLAGS::INST_VOLATILE)
 			temp_insts++;
 
+		Dirty(i);
 		insts++;
 
 		return i;
@@ -590,19 +639,12 @@ struct World
 
 		i->type = BSP::BSP_TYPE_INST;
 		i->flags = flags;
-		i->bsp_parent = 0;
-
-		i->next = 0;
-		i->prev = tail_inst;
-		if (tail_inst)
-			tail_inst->next = i;
-		else
-			head_inst = i;
-		tail_inst = i;
+		CellInsert(i);
 
 		if (flags & INST_FLAGS::INST_VOLATILE)
 			temp_insts++;
 
+		Dirty(i);
 		insts++;
 		return i;
 	}
@@ -661,7 +703,8 @@ struct World
 
 		if (flags & INST_FLAGS::INST_VOLATILE)
 			temp_insts++;
-        
+
+        Dirty(i);
         insts++;
         return i;
     }
@@ -670,6 +713,7 @@ struct World
 	{
 		if (!i)
 			return false;
+		Dirty(i);
 		if (i->inst_type == Inst::INST_TYPE::MESH)
 			return DelInst((MeshInst*)i);
 		if (i->inst_type == Inst::INST_TYPE::SPRITE)
@@ -684,6 +728,9 @@ struct World
         if (!i || !i->mesh || i->mesh->world != this)
             return false;
 
+		if (i->bsp_parent || i == root)
+			DropFlat();
+
         if (i->mesh)
         {
             MeshInst** s = &i->mesh->share_list;
@@ -829,10 +876,7 @@ struct World
 					leaf->tail = i->prev;
 
 				if (leaf->head == 0)
-				{
-					// do ancestors cleanup
-					// ...
-				}
+					CellFree((BSP_Cell*)leaf);
 			}
 			else
 				if (i->bsp_parent->type == BSP::BSP_TYPE_NODE_SHARE)
@@ -938,10 +982,7 @@ struct World
 					leaf->tail = i->prev;
 
 				if (leaf->head == 0)
-				{
-					// do ancestors cleanup
-					// ...
-				}
+					CellFree((BSP_Cell*)leaf);
 			}
 			else
 			if (i->bsp_parent->type == BSP::BSP_TYPE_NODE_SHARE)
@@ -1025,6 +1066,183 @@ struct World
     // now we want to form a tree of Insts
     BSP* root;
 
+	// loose grid of sprite & item insts (see BSP_Cell)
+	int cells;
+	BSP_Cell* head_cell;
+	BSP_Cell* cell_hash[DYN_HASH_SIZE];
+	float cell_pad; // max xy half extent of insts ever inserted
+	float cell_z[2]; // z range of insts ever inserted
+
+	static bool IsDynamic(Inst* i)
+	{
+		return i->inst_type == Inst::INST_TYPE::SPRITE || i->inst_type == Inst::INST_TYPE::ITEM;
+	}
+
+	static void GetCellXY(Inst* i, int* x, int* y)
+	{
+		*x = (int)floorf((i->bbox[0] + i->bbox[1]) * (0.5f / DYN_CELL_SIZE));
+		*y = (int)floorf((i->bbox[2] + i->bbox[3]) * (0.5f / DYN_CELL_SIZE));
+	}
+
+	static int CellHash(int x, int y)
+	{
+		return (int)(((unsigned)x * 73856093u ^ (unsigned)y * 19349663u) % DYN_HASH_SIZE);
+	}
+
+	BSP_Cell* FindCell(int x, int y)
+	{
+		BSP_Cell* c = cell_hash[CellHash(x, y)];
+		while (c && (c->x != x || c->y != y))
+			c = c->hash_next;
+		return c;
+	}
+
+	// i must be out of any list, its bbox up to date
+	void CellInsert(Inst* i)
+	{
+		int x, y;
+		GetCellXY(i, &x, &y);
+
+		BSP_Cell* c = FindCell(x, y);
+		if (!c)
+		{
+			int h = CellHash(x, y);
+
+			c = (BSP_Cell*)malloc(sizeof(BSP_Cell));
+			c->type = BSP::BSP_TYPE_LEAF;
+			c->bsp_parent = 0;
+			c->x = x;
+			c->y = y;
+			c->head = 0;
+			c->tail = 0;
+
+			c->hash_next = cell_hash[h];
+			cell_hash[h] = c;
+
+			if (!head_cell)
+			{
+				cell_pad = 0;
+				cell_z[0] = i->bbox[4];
+				cell_z[1] = i->bbox[5];
+			}
+
+			c->prev = 0;
+			c->next = head_cell;
+			if (head_cell)
+				head_cell->prev = c;
+			head_cell = c;
+			cells++;
+		}
+
+		cell_pad = fmaxf(cell_pad, 0.5f * fmaxf(i->bbox[1] - i->bbox[0], i->bbox[3] - i->bbox[2]));
+		cell_z[0] = fminf(cell_z[0], i->bbox[4]);
+		cell_z[1] = fmaxf(cell_z[1], i->bbox[5]);
+
+		if (c->head)
+		{
+			for (int a = 0; a < 6; a += 2)
+			{
+				c->bbox[a] = fminf(c->bbox[a], i->bbox[a]);
+				c->bbox[a + 1] = fmaxf(c->bbox[a + 1], i->bbox[a + 1]);
+			}
+		}
+		else
+		{
+			for (int a = 0; a < 6; a++)
+				c->bbox[a] = i->bbox[a];
+		}
+
+		i->bsp_parent = c;
+		i->prev = 0;
+		i->next = c->head;
+		if (c->head)
+			c->head->prev = i;
+		else
+			c->tail = i;
+		c->head = i;
+	}
+
+	// c must be empty already
+	void CellFree(BSP_Cell* c)
+	{
+		BSP_Cell** h = cell_hash + CellHash(c->x, c->y);
+		while (*h != c)
+			h = &(*h)->hash_next;
+		*h = c->hash_next;
+
+		if (c->prev)
+			c->prev->next = c->next;
+		else
+			head_cell = c->next;
+		if (c->next)
+			c->next->prev = c->prev;
+
+		cells--;
+		free(c);
+	}
+
+	// i is in the grid and its bbox has just changed, O(1)
+	void CellMove(Inst* i)
+	{
+		BSP_Cell* c = (BSP_Cell*)i->bsp_parent;
+
+		int x, y;
+		GetCellXY(i, &x, &y);
+
+		if (c->x == x && c->y == y)
+		{
+			for (int a = 0; a < 6; a += 2)
+			{
+				c->bbox[a] = fminf(c->bbox[a], i->bbox[a]);
+				c->bbox[a + 1] = fmaxf(c->bbox[a + 1], i->bbox[a + 1]);
+			}
+			cell_pad = fmaxf(cell_pad, 0.5f * fmaxf(i->bbox[1] - i->bbox[0], i->bbox[3] - i->bbox[2]));
+			cell_z[0] = fminf(cell_z[0], i->bbox[4]);
+			cell_z[1] = fmaxf(cell_z[1], i->bbox[5]);
+			return;
+		}
+
+		if (i->prev)
+			i->prev->next = i->next;
+		else
+			c->head = i->next;
+		if (i->next)
+			i->next->prev = i->prev;
+		else
+			c->tail = i->prev;
+
+		if (!c->head)
+			CellFree(c);
+
+		CellInsert(i);
+	}
+
+	// bbox of non-volatile insts added / removed since last TakeWorldDirty()
+	// empty if dirty[0] > dirty[1]
+	double dirty[6];
+
+	void Dirty(Inst* i)
+	{
+		if (i->flags & INST_FLAGS::INST_VOLATILE)
+			return;
+		DirtyBox(i->bbox);
+	}
+
+	void DirtyBox(const float bbox[6])
+	{
+		if (dirty[0] > dirty[1])
+		{
+			for (int a = 0; a < 6; a++)
+				dirty[a] = bbox[a];
+			return;
+		}
+		for (int a = 0; a < 6; a += 2)
+		{
+			dirty[a] = fmin(dirty[a], bbox[a]);
+			dirty[a + 1] = fmax(dirty[a + 1], bbox[a + 1]);
+		}
+	}
+
     void DeleteBSP(BSP* bsp)
     {
         if (bsp->type == BSP::BSP_TYPE_NODE)
@@ -1121,343 +1339,279 @@ struct World
     struct BSP_Item
     {
         Inst* inst;
-        float area;
+        float c[3]; // doubled bbox center
     };
 
-    BSP* SplitBSP(BSP_Item* arr, int num)
+	// xy faces are weighted by HEIGHT_SCALE (z is in height units)
+	static float BoxArea(const float b[6])
+	{
+		return
+			(b[1] - b[0]) * (b[3] - b[2]) * HEIGHT_SCALE +
+			(b[3] - b[2]) * (b[5] - b[4]) +
+			(b[5] - b[4]) * (b[1] - b[0]);
+	}
+
+	static void BoxGrow(float b[6], const float a[6])
+	{
+		b[0] = fminf(b[0], a[0]);
+		b[1] = fmaxf(b[1], a[1]);
+		b[2] = fminf(b[2], a[2]);
+		b[3] = fmaxf(b[3], a[3]);
+		b[4] = fminf(b[4], a[4]);
+		b[5] = fmaxf(b[5], a[5]);
+	}
+
+    static BSP* MakeLeaf(BSP_Item* arr, int num)
     {
-        assert(num>0);
+        BSP_Leaf* leaf = (BSP_Leaf*)malloc(sizeof(BSP_Leaf));
+        leaf->bsp_parent = 0;
+        leaf->type = BSP::BSP_TYPE_LEAF;
+
+        leaf->bbox[0] = arr[0].inst->bbox[0];
+        leaf->bbox[1] = arr[0].inst->bbox[1];
+        leaf->bbox[2] = arr[0].inst->bbox[2];
+        leaf->bbox[3] = arr[0].inst->bbox[3];
+        leaf->bbox[4] = arr[0].inst->bbox[4];
+        leaf->bbox[5] = arr[0].inst->bbox[5];
         
-        if (num == 1)
-        {
-            Inst* inst = arr[0].inst;
-            inst->bsp_parent = 0;
-            inst->prev = 0;
-            inst->next = 0;
-            return inst;
-        }
+        leaf->head = arr[0].inst;
+        leaf->tail = arr[num-1].inst;
+        
+        arr[0].inst->prev = 0;
+        arr[num-1].inst->next = 0;
 
-        struct CentroidSorter
+        arr[0].inst->bsp_parent = leaf;
+        if (num>1)
         {
-            static int sortX(const void* a, const void* b)
-            {
-                Inst* ia = ((BSP_Item*)a)->inst;
-                Inst* ib = ((BSP_Item*)b)->inst;
-
-                float diff = (ia->bbox[0]+ia->bbox[1])-(ib->bbox[0]+ib->bbox[1]);
-                if (diff<0)
-                    return -1;
-                if (diff>0)
-                    return +1;
-                return 0;
-            }
-            static int sortY(const void* a, const void* b)
-            {
-                Inst* ia = ((BSP_Item*)a)->inst;
-                Inst* ib = ((BSP_Item*)b)->inst;
-
-                float diff = (ia->bbox[2]+ia->bbox[3])-(ib->bbox[2]+ib->bbox[3]);
-                if (diff<0)
-                    return -1;
-                if (diff>0)
-                    return +1;
-                return 0;
-            }
-            static int sortZ(const void* a, const void* b)
-            {
-                Inst* ia = ((BSP_Item*)a)->inst;
-                Inst* ib = ((BSP_Item*)b)->inst;
-
-                float diff = (ia->bbox[4]+ia->bbox[5])-(ib->bbox[4]+ib->bbox[5]);
-                if (diff<0)
-                    return -1;
-                if (diff>0)
-                    return +1;
-                return 0;
-            }
-        };
+            arr[0].inst->next = arr[1].inst;
+            arr[num-1].inst->prev = arr[num-2].inst;
+            arr[num-1].inst->bsp_parent = leaf;
+
+            leaf->bbox[0] = fminf( leaf->bbox[0], arr[num-1].inst->bbox[0]);
+            leaf->bbox[1] = fmaxf( leaf->bbox[1], arr[num-1].inst->bbox[1]);
+            leaf->bbox[2] = fminf( leaf->bbox[2], arr[num-1].inst->bbox[2]);
+            leaf->bbox[3] = fmaxf( leaf->bbox[3], arr[num-1].inst->bbox[3]);
+            leaf->bbox[4] = fminf( leaf->bbox[4], arr[num-1].inst->bbox[4]);
+            leaf->bbox[5] = fmaxf( leaf->bbox[5], arr[num-1].inst->bbox[5]);                
+        }
 
-        static int (*sort[3])(const void* a, const void* b) = 
+        for (int i=1; i<num-1; i++)
         {
-            CentroidSorter::sortX,
-            CentroidSorter::sortY,
-            CentroidSorter::sortZ
-        };
+            leaf->bbox[0] = fminf( leaf->bbox[0], arr[i].inst->bbox[0]);
+            leaf->bbox[1] = fmaxf( leaf->bbox[1], arr[i].inst->bbox[1]);
+            leaf->bbox[2] = fminf( leaf->bbox[2], arr[i].inst->bbox[2]);
+            leaf->bbox[3] = fmaxf( leaf->bbox[3], arr[i].inst->bbox[3]);
+            leaf->bbox[4] = fminf( leaf->bbox[4], arr[i].inst->bbox[4]);
+            leaf->bbox[5] = fmaxf( leaf->bbox[5], arr[i].inst->bbox[5]);  
+                            
+            arr[i].inst->bsp_parent = leaf;
+            arr[i].inst->prev = arr[i-1].inst;
+            arr[i].inst->next = arr[i+1].inst;
+        }
 
-        float best_cost = -1;
-        int best_axis = -1;
-        int best_item = -1;
+        assert(leaf->head);
+        assert(leaf->tail);
+        assert(num==1 && leaf->head == leaf->tail || num!=1 && leaf->head != leaf->tail);
+        assert(leaf->head->prev == 0);
+        assert(leaf->tail->next == 0);
 
-        // actualy it could be better to splin only in x and y (axis<2)
-        for (int axis=0; axis<3; axis++)
+        Inst* i = leaf->head;
+        int c = 0;
+        while (i)
         {
-            qsort(arr, num, sizeof(BSP_Item), sort[axis]);
-
-            float lo_bbox[6] =
-            {
-                arr[0].inst->bbox[0],
-                arr[0].inst->bbox[1],
-                arr[0].inst->bbox[2],
-                arr[0].inst->bbox[3],
-                arr[0].inst->bbox[4],
-                arr[0].inst->bbox[5]
-            };
-
-            for (int i=0; i<num; i++)
-            {
-                lo_bbox[0] = fminf( lo_bbox[0], arr[i].inst->bbox[0]);
-                lo_bbox[1] = fmaxf( lo_bbox[1], arr[i].inst->bbox[1]);
-                lo_bbox[2] = fminf( lo_bbox[2], arr[i].inst->bbox[2]);
-                lo_bbox[3] = fmaxf( lo_bbox[3], arr[i].inst->bbox[3]);
-                lo_bbox[4] = fminf( lo_bbox[4], arr[i].inst->bbox[4]);
-                lo_bbox[5] = fmaxf( lo_bbox[5], arr[i].inst->bbox[5]);
-
-                arr[i].area = 
-                    (lo_bbox[1]-lo_bbox[0]) * (lo_bbox[3]-lo_bbox[2]) * HEIGHT_SCALE +
-                    (lo_bbox[3]-lo_bbox[2]) * (lo_bbox[5]-lo_bbox[4]) +
-                    (lo_bbox[5]-lo_bbox[4]) * (lo_bbox[1]-lo_bbox[0]);                
-            }
-
-            float hi_bbox[6] =
-            {
-                arr[num-1].inst->bbox[0],
-                arr[num-1].inst->bbox[1],
-                arr[num-1].inst->bbox[2],
-                arr[num-1].inst->bbox[3],
-                arr[num-1].inst->bbox[4],
-                arr[num-1].inst->bbox[5]
-            };
-
-            for (int i=num-1; i>0; i--)
-            {
-                hi_bbox[0] = fminf( hi_bbox[0], arr[i].inst->bbox[0]);
-                hi_bbox[1] = fmaxf( hi_bbox[1], arr[i].inst->bbox[1]);
-                hi_bbox[2] = fminf( hi_bbox[2], arr[i].inst->bbox[2]);
-                hi_bbox[3] = fmaxf( hi_bbox[3], arr[i].inst->bbox[3]);
-                hi_bbox[4] = fminf( hi_bbox[4], arr[i].inst->bbox[4]);
-                hi_bbox[5] = fmaxf( hi_bbox[5], arr[i].inst->bbox[5]);
-
-                float area = 
-                    (hi_bbox[1]-hi_bbox[0]) * (hi_bbox[3]-hi_bbox[2]) * HEIGHT_SCALE +
-                    (hi_bbox[3]-hi_bbox[2]) * (hi_bbox[5]-hi_bbox[4]) +
-                    (hi_bbox[5]-hi_bbox[4]) * (hi_bbox[1]-hi_bbox[0]);
-
-                // cost of {0..i-1}, {i..num-1}
-                float cost = arr[i-1].area * i + area * (num-i);
-                if (cost < best_cost || best_cost < 0)
-                {
-                    best_cost = cost;
-                    best_item = i;
-                    best_axis = axis;
-                }
-            }
+            c++;
+            i=i->next;
+            if (i)
+                assert(i->prev->next == i);
         }
 
-        if (best_axis != -1)
+        assert(c==num);
+
+        i = leaf->tail;
+        c = 0;
+        while (i)
         {
-            if (best_cost + arr[num-1].area * 2 > arr[num-1].area * num)
-                best_axis = -1;
+            c++;
+            i=i->prev;
+            if (i)
+                assert(i->next->prev == i);
         }
 
-        if (best_axis == -1)
-        {
-            // fill final list of instances
-
-            BSP_Leaf* leaf = (BSP_Leaf*)malloc(sizeof(BSP_Leaf));
-            leaf->bsp_parent = 0;
-            leaf->type = BSP::BSP_TYPE_LEAF;
-
-            leaf->bbox[0] = arr[0].inst->bbox[0];
-            leaf->bbox[1] = arr[0].inst->bbox[1];
-            leaf->bbox[2] = arr[0].inst->bbox[2];
-            leaf->bbox[3] = arr[0].inst->bbox[3];
-            leaf->bbox[4] = arr[0].inst->bbox[4];
-            leaf->bbox[5] = arr[0].inst->bbox[5];
-            
-            leaf->head = arr[0].inst;
-            leaf->tail = arr[num-1].inst;
-            
-            arr[0].inst->prev = 0;
-            arr[num-1].inst->next = 0;
-
-            arr[0].inst->bsp_parent = leaf;
-            if (num>1)
-            {
-                arr[0].inst->next = arr[1].inst;
-                arr[num-1].inst->prev = arr[num-2].inst;
-                arr[num-1].inst->bsp_parent = leaf;
-
-                leaf->bbox[0] = fminf( leaf->bbox[0], arr[num-1].inst->bbox[0]);
-                leaf->bbox[1] = fmaxf( leaf->bbox[1], arr[num-1].inst->bbox[1]);
-                leaf->bbox[2] = fminf( leaf->bbox[2], arr[num-1].inst->bbox[2]);
-                leaf->bbox[3] = fmaxf( leaf->bbox[3], arr[num-1].inst->bbox[3]);
-                leaf->bbox[4] = fminf( leaf->bbox[4], arr[num-1].inst->bbox[4]);
-                leaf->bbox[5] = fmaxf( leaf->bbox[5], arr[num-1].inst->bbox[5]);                
-            }
+        assert(c==num);
 
-            for (int i=1; i<num-1; i++)
-            {
-                leaf->bbox[0] = fminf( leaf->bbox[0], arr[i].inst->bbox[0]);
-                leaf->bbox[1] = fmaxf( leaf->bbox[1], arr[i].inst->bbox[1]);
-                leaf->bbox[2] = fminf( leaf->bbox[2], arr[i].inst->bbox[2]);
-                leaf->bbox[3] = fmaxf( leaf->bbox[3], arr[i].inst->bbox[3]);
-                leaf->bbox[4] = fminf( leaf->bbox[4], arr[i].inst->bbox[4]);
-                leaf->bbox[5] = fmaxf( leaf->bbox[5], arr[i].inst->bbox[5]);  
-                                
-                arr[i].inst->bsp_parent = leaf;
-                arr[i].inst->prev = arr[i-1].inst;
-                arr[i].inst->next = arr[i+1].inst;
-            }
+        return leaf;
+    }
 
-            assert(leaf->head);
-            assert(leaf->tail);
-            assert(num==1 && leaf->head == leaf->tail || num!=1 && leaf->head != leaf->tail);
-            assert(leaf->head->prev == 0);
-            assert(leaf->tail->next == 0);
+	static BSP_Node* MakeNode(const float bbox[6])
+	{
+		// BSP_Node* node = (BSP_Node*)malloc(sizeof(BSP_Node));
+		BSP_Node* node = (BSP_Node*)malloc(sizeof(BSP_NodeShare)); // make it easily changable!
+
+		node->bsp_parent = 0;
+		node->type = BSP::BSP_TYPE_NODE;
+		node->bsp_child[0] = 0;
+		node->bsp_child[1] = 0;
+		for (int a = 0; a < 6; a++)
+			node->bbox[a] = bbox[a];
+		return node;
+	}
 
-            Inst* i = leaf->head;
-            int c = 0;
-            while (i)
-            {
-                c++;
-                i=i->next;
-                if (i)
-                    assert(i->prev->next == i);
-            }
+	#define BSP_BINS 16
 
-            assert(c==num);
+	// binned SAH, centroids are counted into bins along each axis (no sorting)
+	// and cost is evaluated at bin boundaries only, best one partitions arr in place
+	// returns number of items on the left or 0 if keeping them all in a leaf is cheaper
+	// bbox receives bounds of all items
+	static int BinSplit(BSP_Item* arr, int num, float bbox[6])
+	{
+		float cmin[3], cmax[3];
+		for (int a = 0; a < 6; a++)
+			bbox[a] = arr[0].inst->bbox[a];
+		for (int a = 0; a < 3; a++)
+			cmin[a] = cmax[a] = arr[0].c[a];
 
-            i = leaf->tail;
-            c = 0;
-            while (i)
-            {
-                c++;
-                i=i->prev;
-                if (i)
-                    assert(i->next->prev == i);
-            }
+		for (int i = 1; i < num; i++)
+		{
+			BoxGrow(bbox, arr[i].inst->bbox);
+			for (int a = 0; a < 3; a++)
+			{
+				cmin[a] = fminf(cmin[a], arr[i].c[a]);
+				cmax[a] = fmaxf(cmax[a], arr[i].c[a]);
+			}
+		}
 
-            assert(c==num);
+		float total = BoxArea(bbox);
+		float best_cost = -1;
+		int best_axis = -1;
+		int best_bin = 0;
+		float scale[3];
 
-            return leaf;
-        }
-        else
-        {
-            int axis = best_axis;
-            qsort(arr, num, sizeof(BSP_Item), sort[axis]);
+		// actualy it could be better to split only in x and y (axis<2)
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float extent = cmax[axis] - cmin[axis];
+			if (extent <= 0)
+				continue;
+			scale[axis] = BSP_BINS * 0.9999f / extent;
 
-            // BSP_Node* node = (BSP_Node*)malloc(sizeof(BSP_Node));
-			BSP_Node* node = (BSP_Node*)malloc(sizeof(BSP_NodeShare)); // make it easily changable!
+			int bin_num[BSP_BINS] = { 0 };
+			float bin_box[BSP_BINS][6];
+
+			for (int i = 0; i < num; i++)
+			{
+				int b = (int)((arr[i].c[axis] - cmin[axis]) * scale[axis]);
+				b = b < BSP_BINS ? b : BSP_BINS - 1;
+				if (bin_num[b]++)
+					BoxGrow(bin_box[b], arr[i].inst->bbox);
+				else
+					memcpy(bin_box[b], arr[i].inst->bbox, sizeof(float[6]));
+			}
 
-            node->bsp_parent = 0;
-            node->type = BSP::BSP_TYPE_NODE;
+			// hi_area[b] / hi_num[b] describe bins b..BSP_BINS-1
+			float hi_area[BSP_BINS];
+			int hi_num[BSP_BINS];
+			float box[6];
+			int n = 0;
+			for (int b = BSP_BINS - 1; b > 0; b--)
+			{
+				if (bin_num[b])
+				{
+					if (n)
+						BoxGrow(box, bin_box[b]);
+					else
+						memcpy(box, bin_box[b], sizeof(float[6]));
+					n += bin_num[b];
+				}
+				hi_area[b] = n ? BoxArea(box) : 0;
+				hi_num[b] = n;
+			}
 
-            node->bsp_child[0] = SplitBSP(arr + 0, best_item);
-            node->bsp_child[0]->bsp_parent = node;
+			n = 0;
+			for (int b = 0; b < BSP_BINS - 1; b++)
+			{
+				if (bin_num[b])
+				{
+					if (n)
+						BoxGrow(box, bin_box[b]);
+					else
+						memcpy(box, bin_box[b], sizeof(float[6]));
+					n += bin_num[b];
+				}
 
-            node->bsp_child[1] = SplitBSP(arr + best_item, num - best_item);
-            node->bsp_child[1]->bsp_parent = node;
+				if (!n || !hi_num[b + 1])
+					continue;
 
-            node->bbox[0] = fminf( node->bsp_child[0]->bbox[0], node->bsp_child[1]->bbox[0]);
-            node->bbox[1] = fmaxf( node->bsp_child[0]->bbox[1], node->bsp_child[1]->bbox[1]);
-            node->bbox[2] = fminf( node->bsp_child[0]->bbox[2], node->bsp_child[1]->bbox[2]);
-            node->bbox[3] = fmaxf( node->bsp_child[0]->bbox[3], node->bsp_child[1]->bbox[3]);
-            node->bbox[4] = fminf( node->bsp_child[0]->bbox[4], node->bsp_child[1]->bbox[4]);
-            node->bbox[5] = fmaxf( node->bsp_child[0]->bbox[5], node->bsp_child[1]->bbox[5]);               
+				// cost of {0..b}, {b+1..BSP_BINS-1}
+				float cost = BoxArea(box) * n + hi_area[b + 1] * hi_num[b + 1];
+				if (cost < best_cost || best_cost < 0)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b + 1;
+				}
+			}
+		}
 
-            return node;
-        }
-    }
+		if (best_axis == -1 || best_cost + total * 2 > total * num)
+			return 0;
 
-	void Rebuild(bool boxes)
-	{
-		if (root)
+		int i = 0, j = num - 1;
+		while (i <= j)
 		{
-			DeleteBSP(root);
-			root = 0;
+			int b = (int)((arr[i].c[best_axis] - cmin[best_axis]) * scale[best_axis]);
+			b = b < BSP_BINS ? b : BSP_BINS - 1;
+			if (b < best_bin)
+				i++;
+			else
+			{
+				BSP_Item swap = arr[i];
+				arr[i] = arr[j];
+				arr[j--] = swap;
+			}
 		}
 
-        if (!insts)
-            return;
-
-        // MAY BE SLOW: 1/2 * num^3
-        /*
-        int num = 0;
+		return i;
+	}
 
-        BSP** arr = (BSP**)malloc(sizeof(BSP*) * insts);
+    static BSP* SplitBSP(BSP_Item* arr, int num)
+    {
+        assert(num>0);
         
-        for (Inst* inst = head_inst; inst; inst=inst->next)
+        if (num == 1)
         {
-            if (inst->flags & INST_USE_TREE)
-                arr[num++] = inst;
+            Inst* inst = arr[0].inst;
+            inst->bsp_parent = 0;
+            inst->prev = 0;
+            inst->next = 0;
+            return inst;
         }
 
-        while (num>1)
-        {
-            int a = 0;
-            int b = 1;
-            float e = -1;
-
-            for (int u=0; u<num-1; u++)
-            {
-                for (int v=u+1; v<num; v++)
-                {
-                    float bbox[6] =
-                    {
-                        fminf( arr[u]->bbox[0] , arr[v]->bbox[0] ),
-                        fmaxf( arr[u]->bbox[1] , arr[v]->bbox[1] ),
-                        fminf( arr[u]->bbox[2] , arr[v]->bbox[2] ),
-                        fmaxf( arr[u]->bbox[3] , arr[v]->bbox[3] ),
-                        fminf( arr[u]->bbox[4] , arr[v]->bbox[4] ),
-                        fmaxf( arr[u]->bbox[5] , arr[v]->bbox[5] )
-                    };
-
-                    float vol = (bbox[1]-bbox[0]) * (bbox[3]-bbox[2]) * (bbox[5]-bbox[4]);
-                    
-                    float u_vol = (arr[u]->bbox[1]-arr[u]->bbox[0]) * (arr[u]->bbox[3]-arr[u]->bbox[2]) * (arr[u]->bbox[5]-arr[u]->bbox[4]);
-                    float v_vol = (arr[v]->bbox[1]-arr[v]->bbox[0]) * (arr[v]->bbox[3]-arr[v]->bbox[2]) * (arr[v]->bbox[5]-arr[v]->bbox[4]);
-                    
-                    vol -= u_vol + v_vol; // minimize volumne expansion
-
-                    // minimize volume difference between children
-                    if (u_vol > v_vol)
-                        vol += u_vol-v_vol;
-                    else
-                        vol += v_vol-u_vol;
-
-                    if (vol < e || e<0)
-                    {
-                        a = u;
-                        b = v;
-                        e = vol;
-                    }
-                }
-            }
-
-            BSP_Node* node = (BSP_Node*)malloc(sizeof(BSP_Node));
+		float bbox[6];
+		int left = BinSplit(arr, num, bbox);
+		if (!left)
+			return MakeLeaf(arr, num); // fill final list of instances
 
-            node->bsp_parent = 0;
-            node->type = BSP::BSP_TYPE_NODE;
+		BSP_Node* node = MakeNode(bbox);
 
-            node->bsp_child[0] = arr[a];
-            node->bsp_child[1] = arr[b];
+		node->bsp_child[0] = SplitBSP(arr + 0, left);
+		node->bsp_child[0]->bsp_parent = node;
 
-            node->bbox[0] = fminf( arr[a]->bbox[0] , arr[b]->bbox[0] );
-            node->bbox[1] = fmaxf( arr[a]->bbox[1] , arr[b]->bbox[1] );
-            node->bbox[2] = fminf( arr[a]->bbox[2] , arr[b]->bbox[2] );
-            node->bbox[3] = fmaxf( arr[a]->bbox[3] , arr[b]->bbox[3] );
-            node->bbox[4] = fminf( arr[a]->bbox[4] , arr[b]->bbox[4] );
-            node->bbox[5] = fmaxf( arr[a]->bbox[5] , arr[b]->bbox[5] );
+		node->bsp_child[1] = SplitBSP(arr + left, num - left);
+		node->bsp_child[1]->bsp_parent = node;
 
-            num--;
-            if (b!=num)
-                arr[b] = arr[num];
+		return node;
+    }
 
-            arr[a] = node;
-        }
-        root = arr[0];
-        free(arr);
-        */
+	// kills bsp, moves detached sprites & items back to grid
+	// and extracts tree insts from flat list into arr (must fit all insts)
+	int TakeTreeInsts(BSP_Item* arr, bool boxes)
+	{
+		DropFlat();
+		if (root)
+		{
+			DeleteBSP(root);
+			root = 0;
+		}
 
         // LET'S TRY:
         // https://graphics.stanford.edu/~boulos/papers/togbvh.pdf
@@ -1468,8 +1622,6 @@ struct World
         // object can be referenced by both leaf siblings -> use NodeShare in place of Node !!! 
         // ... need only to ensure that union of both leaf bboxes fully encapsulates that object
 
-        BSP_Item* arr = (BSP_Item*)malloc(sizeof(BSP_Item) * insts);
-
         int count = 0;
         for (Inst* inst = head_inst; inst; )
         {
@@ -1481,13 +1633,28 @@ struct World
 			}
 
             Inst* next = inst->next;
+            if (IsDynamic(inst))
+            {
+                // detached ones go back to the grid
+                if (inst->prev)
+                    inst->prev->next = inst->next;
+                else
+                    head_inst = inst->next;
+                if (inst->next)
+                    inst->next->prev = inst->prev;
+                else
+                    tail_inst = inst->prev;
+
+                CellInsert(inst);
+            }
+            else
             if (inst->flags & INST_USE_TREE)
             {
-				if (count==insts)
-				{
-					int defect=0;
-				}
-                arr[count++].inst = inst;
+                BSP_Item* item = arr + count++;
+                item->inst = inst;
+                item->c[0] = inst->bbox[0] + inst->bbox[1];
+                item->c[1] = inst->bbox[2] + inst->bbox[3];
+                item->c[2] = inst->bbox[4] + inst->bbox[5];
 
                 // extract!
                 if (inst->prev)
@@ -1502,1680 +1669,1019 @@ struct World
             inst = next;
         }
 
-        if (count)
-        {
-            // split recursively!
-            root = SplitBSP(arr, count);
+		return count;
+	}
 
-            if (!root)
-            {
-                // if failed we need to put them back
-                for (int i=0; i<count; i++)
-                {
-                    Inst* inst = arr[i].inst;
-                    inst->bsp_parent = 0;
-                    inst->prev = tail_inst;
-                    inst->next = 0;
-                    if (tail_inst)
-                        tail_inst->next = inst;
-                    else
-                        head_inst = inst;
-                    tail_inst = inst;                        
-                }
-            }
+	void Rebuild(bool boxes)
+	{
+		WorldBuild* wb = CreateWorldBuild(this, boxes);
+		BuildWorldJobs(wb, 0, GetWorldBuildJobs(wb));
+		DeleteWorldBuild(wb);
+	}
 
-            free(arr);
-        }
-    }
+	static bool HitInst(Inst* inst, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too, const WorldQuery* wq)
+	{
+		if (inst == wq->skip)
+			return false;
+
+		if (editor && (inst->flags & INST_VOLATILE) || 
+			!editor && !(inst->flags & INST_VOLATILE))
+			return false;
 
-	static Inst* HitWorld0(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+		if (inst->inst_type == Inst::INST_TYPE::MESH)
+			return ((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only);
+		if (inst->inst_type == Inst::INST_TYPE::SPRITE)
+			return sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only);
+		if (inst->inst_type == Inst::INST_TYPE::ITEM)
+			return sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only);
+		return false;
+	}
+
+	// plucker line vs box, in each of 3 axis projections box corners
+	// must not be all on one side of the line
+	static bool RayBox(const double ray[10], const float b[6])
 	{
-		if (!q)
-			return 0;
+		// xz: ray[1] + ray[5] * x - ray[3] * z
+		if (ray[1] + ray[5] * b[ray[5] >= 0 ? 0 : 1] - ray[3] * b[ray[3] >= 0 ? 5 : 4] > 0 ||
+			ray[1] + ray[5] * b[ray[5] >= 0 ? 1 : 0] - ray[3] * b[ray[3] >= 0 ? 4 : 5] < 0)
+			return false;
 
-        const float x[2] = {q->bbox[0],q->bbox[1]};
-		const float y[2] = {q->bbox[2],q->bbox[3]};
-		const float z[2] = {q->bbox[4],q->bbox[5]};
+		// yz: ray[5] * y - ray[0] - ray[4] * z
+		if (ray[5] * b[ray[5] >= 0 ? 2 : 3] - ray[0] - ray[4] * b[ray[4] >= 0 ? 5 : 4] > 0 ||
+			ray[5] * b[ray[5] >= 0 ? 3 : 2] - ray[0] - ray[4] * b[ray[4] >= 0 ? 4 : 5] < 0)
+			return false;
 
-		if (positive_only)
-		{
-			// do not recurse if all 8 corners projected onto ray are negative
-		}
+		// xy: ray[2] - ray[4] * x + ray[3] * y
+		if (ray[2] - ray[4] * b[ray[4] >= 0 ? 1 : 0] + ray[3] * b[ray[3] >= 0 ? 2 : 3] > 0 ||
+			ray[2] - ray[4] * b[ray[4] >= 0 ? 0 : 1] + ray[3] * b[ray[3] >= 0 ? 3 : 2] < 0)
+			return false;
+
+		return true;
+	}
 
-		if (ray[1] - z[0] * ray[3] + ray[5] * x[1] > 0 ||
-			ray[5] * y[1] - ray[0] - z[0] * ray[4] > 0 ||
-			ray[2] - ray[4] * x[0] + ray[3] * y[1] > 0 ||
-			z[1] * ray[3] - ray[5] * x[0] - ray[1] > 0 ||
-			ray[0] + z[1] * ray[4] - ray[5] * y[0] > 0 ||
-			ray[4] * x[1] - ray[3] * y[0] - ray[2] > 0)
+	// pointer tree (grid cells, or tree being edited since last rebuild)
+	static Inst* HitBSP(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too, const WorldQuery* wq)
+	{
+		if (!q || !RayBox(ray, q->bbox))
 			return 0;
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
+		Inst* i = 0;
+		Inst* j = 0;
+
+		switch (q->type)
 		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+			case BSP::BSP_TYPE_INST:
+				return HitInst((Inst*)q, ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq) ? (Inst*)q : 0;
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
+			case BSP::BSP_TYPE_NODE:
+			case BSP::BSP_TYPE_NODE_SHARE:
 			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				BSP_Node* n = (BSP_Node*)q;
+				i = HitBSP(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq);
+				j = HitBSP(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq);
+				i = j ? j : i;
+				if (q->type == BSP::BSP_TYPE_NODE)
+					return i;
+				j = ((BSP_NodeShare*)q)->head;
+				break;
 			}
-			return 0;
+
+			case BSP::BSP_TYPE_LEAF:
+				j = ((BSP_Leaf*)q)->head;
+				break;
 		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld0(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld0(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
 
-            Inst* i = HitWorld0(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld0(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+		while (j)
+		{
+			if (HitInst(j, ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq))
+				i = j;
+			j = j->next;
+		}
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+		return i;
+	}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+	// compiled tree
+	FlatBSP* flat;
 
-                j=j->next;
-            }
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)q;
+	WorldFile* lazy; // chunks not paged in yet, NULL if all are
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+	void DropFlat()
+	{
+		if (flat)
+		{
+			free(flat->node);
+			free(flat->item);
+			free(flat);
+			flat = 0;
+		}
+	}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+	struct FlatLane
+	{
+		BSP* bsp; // node to be compiled or 0 if lane holds inst list
+		Inst* head;
+		float bbox[6];
+	};
 
-                j=j->next;
-            }
-            return i;
-        }
-        
-		return 0;
+	static void SetLane(FlatLane* l, BSP* b)
+	{
+		memcpy(l->bbox, b->bbox, sizeof(float[6]));
+		l->bsp = 0;
+		l->head = 0;
+		if (b->type == BSP::BSP_TYPE_NODE || b->type == BSP::BSP_TYPE_NODE_SHARE)
+			l->bsp = b;
+		else
+		if (b->type == BSP::BSP_TYPE_LEAF)
+			l->head = ((BSP_Leaf*)b)->head;
+		else
+			l->head = (Inst*)b; // direct child has no siblings
 	}
 
-	static Inst* HitWorld1(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+	// children of node (and its shared list) as lanes, returns count (up to 3)
+	static int GetLanes(BSP* b, FlatLane* lane)
 	{
-		if (!q)
-			return 0;
-
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
+		BSP_Node* n = (BSP_Node*)b;
+		int lanes = 0;
+		for (int c = 0; c < 2; c++)
+		{
+			if (n->bsp_child[c])
+				SetLane(lane + lanes++, n->bsp_child[c]);
+		}
 
-		if (positive_only)
+		if (b->type == BSP::BSP_TYPE_NODE_SHARE && ((BSP_NodeShare*)b)->head)
 		{
-			// do not recurse if all 8 corners projected onto ray are negative
+			FlatLane* l = lane + lanes++;
+			l->bsp = 0;
+			l->head = ((BSP_NodeShare*)b)->head;
+			memcpy(l->bbox, l->head->bbox, sizeof(float[6]));
+			for (Inst* i = l->head->next; i; i = i->next)
+				BoxGrow(l->bbox, i->bbox);
 		}
 
-		if (ray[5] * y[1] - ray[0] - z[0] * ray[4] > 0 ||
-			z[0] * ray[3] - ray[5] * x[0] - ray[1] > 0 ||
-			ray[2] - ray[4] * x[0] + ray[3] * y[0] > 0 ||
-			ray[0] + z[1] * ray[4] - ray[5] * y[0] > 0 ||
-			ray[1] - z[1] * ray[3] + ray[5] * x[1] > 0 ||
-			ray[4] * x[1] - ray[3] * y[1] - ray[2] > 0)
-			return 0;
+		return lanes;
+	}
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
-		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+	// collapses binary levels into 4 wide nodes in depth first order
+	// returns node index or -1 if tree is too deep for traversal stack
+	static int FlattenNode(FlatBSP* f, FlatLane* lane, int lanes, int depth)
+	{
+		if (depth > FLAT_DEPTH)
+			return -1;
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
+		// open biggest nodes while their children fit
+		while (1)
+		{
+			int best = -1;
+			float best_area = -1;
+			for (int k = 0; k < lanes; k++)
 			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
+				if (!lane[k].bsp)
+					continue;
+				BSP_Node* n = (BSP_Node*)lane[k].bsp;
+				int open = (n->bsp_child[0] != 0) + (n->bsp_child[1] != 0) +
+					(n->type == BSP::BSP_TYPE_NODE_SHARE && ((BSP_NodeShare*)n)->head != 0);
+				float area = BoxArea(lane[k].bbox);
+				if (lanes - 1 + open <= 4 && area > best_area)
+				{
+					best = k;
+					best_area = area;
+				}
 			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
+
+			if (best < 0)
+				break;
+
+			// opened in place, lanes keep depth first order of the tree
+			FlatLane sub[3];
+			int subs = GetLanes(lane[best].bsp, sub);
+			memmove(lane + best + subs, lane + best + 1, sizeof(FlatLane) * (lanes - best - 1));
+			memcpy(lane + best, sub, sizeof(FlatLane) * subs);
+			lanes += subs - 1;
+		}
+
+		if (f->nodes == f->node_cap)
+		{
+			f->node_cap = 2 * f->node_cap + 16;
+			f->node = (FlatNode*)realloc(f->node, sizeof(FlatNode) * f->node_cap);
+		}
+
+		int idx = f->nodes++;
+		for (int k = 0; k < 4; k++)
+		{
+			FlatNode* n = f->node + idx;
+			n->child[k] = -1;
+			n->count[k] = 0;
+			for (int a = 0; a < 6; a++)
+				n->box[a][k] = k < lanes ? lane[k].bbox[a] : (a & 1 ? -FLT_MAX : FLT_MAX);
+		}
+
+		for (int k = 0; k < lanes; k++)
+		{
+			int child = -1, count = 0;
+			if (lane[k].bsp)
 			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				FlatLane sub[4];
+				int subs = GetLanes(lane[k].bsp, sub);
+				child = FlattenNode(f, sub, subs, depth + 1);
+				if (child < 0)
+					return -1;
 			}
 			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
 			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				child = f->items;
+				for (Inst* i = lane[k].head; i; i = i->next)
+				{
+					if (f->items == f->item_cap)
+					{
+						f->item_cap = 2 * f->item_cap + 16;
+						f->item = (Inst**)realloc(f->item, sizeof(Inst*) * f->item_cap);
+					}
+					f->item[f->items++] = i;
+				}
+				count = f->items - child;
+				if (!count)
+					child = -1;
 			}
-			return 0;
-		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld1(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld1(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
 
-            Inst* i = HitWorld1(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld1(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+			f->node[idx].child[k] = child;
+			f->node[idx].count[k] = count;
+		}
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+		return idx;
+	}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+	void Flatten()
+	{
+		DropFlat();
+		if (!root)
+			return;
+
+		flat = (FlatBSP*)malloc(sizeof(FlatBSP));
+		flat->nodes = 0;
+		flat->node_cap = 0;
+		flat->node = 0;
+		flat->items = 0;
+		flat->item_cap = 0;
+		flat->item = 0;
+
+		FlatLane lane[4];
+		int lanes = 1;
+		if (root->type == BSP::BSP_TYPE_NODE || root->type == BSP::BSP_TYPE_NODE_SHARE)
+			lanes = GetLanes(root, lane);
+		else
+			SetLane(lane, root);
 
-				j = j->next;
-            }
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)q;
+		// too deep, stay with pointer tree
+		if (FlattenNode(flat, lane, lanes, 0) < 0)
+			DropFlat();
+	}
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
+	Inst* HitFlat(double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too, const WorldQuery* wq)
+	{
+		// box corners minimizing/maximizing each projection (see RayBox)
+		const int xz_lo[2] = { ray[5] >= 0 ? 0 : 1, ray[3] >= 0 ? 5 : 4 };
+		const int xz_hi[2] = { xz_lo[0] ^ 1, xz_lo[1] ^ 1 };
+		const int yz_lo[2] = { ray[5] >= 0 ? 2 : 3, ray[4] >= 0 ? 5 : 4 };
+		const int yz_hi[2] = { yz_lo[0] ^ 1, yz_lo[1] ^ 1 };
+		const int xy_lo[2] = { ray[4] >= 0 ? 1 : 0, ray[3] >= 0 ? 2 : 3 };
+		const int xy_hi[2] = { xy_lo[0] ^ 1, xy_lo[1] ^ 1 };
+
+		// node index or ~(4 * node + lane) of inst list, lanes are pushed backwards
+		// so they're visited in tree order and equal hits resolve as in pointer tree
+		Inst* hit = 0;
+		int stack[FLAT_STACK];
+		int sp = 0;
+		stack[sp++] = 0;
+
+		while (sp)
+		{
+			int idx = stack[--sp];
+			if (idx < 0)
+			{
+				const FlatNode* n = flat->node + (~idx >> 2);
+				int k = ~idx & 3;
+				Inst** item = flat->item + n->child[k];
+				for (int i = 0; i < n->count[k]; i++)
 				{
-					j=j->next;
-					continue;
+					if (RayBox(ray, item[i]->bbox) && HitInst(item[i], ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq))
+						hit = item[i];
 				}
+				continue;
+			}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+			const FlatNode* n = flat->node + idx;
 
-                j=j->next;
-            }
-            return i;
-        }
+			// all 4 lanes at once
+			bool in[4];
+			for (int k = 0; k < 4; k++)
+			{
+				in[k] =
+					ray[1] + ray[5] * n->box[xz_lo[0]][k] - ray[3] * n->box[xz_lo[1]][k] <= 0 &&
+					ray[1] + ray[5] * n->box[xz_hi[0]][k] - ray[3] * n->box[xz_hi[1]][k] >= 0 &&
+					ray[5] * n->box[yz_lo[0]][k] - ray[0] - ray[4] * n->box[yz_lo[1]][k] <= 0 &&
+					ray[5] * n->box[yz_hi[0]][k] - ray[0] - ray[4] * n->box[yz_hi[1]][k] >= 0 &&
+					ray[2] - ray[4] * n->box[xy_lo[0]][k] + ray[3] * n->box[xy_lo[1]][k] <= 0 &&
+					ray[2] - ray[4] * n->box[xy_hi[0]][k] + ray[3] * n->box[xy_hi[1]][k] >= 0;
+			}
 
-		return 0;
+			for (int k = 3; k >= 0; k--)
+			{
+				if (in[k] && n->child[k] >= 0)
+					stack[sp++] = n->count[k] ? ~(4 * idx + k) : n->child[k];
+			}
+		}
+
+		return hit;
 	}
 
-	static Inst* HitWorld2(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-	{
-		if (!q)
-			return 0;
 
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
+    // RAY HIT using plucker
+    Inst* HitWorld(double p[3], double v[3], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too, const WorldQuery* wq)
+    {
+		if (!root && !(sprites_too && head_cell))
+			return 0;
 
+		/*
+		double max_z = 0;
 		if (positive_only)
 		{
-			// do not recurse if all 8 corners projected onto ray are negative
+			max_z = p[2];
+			p[0] += v[0];
+			p[1] += v[1];
+			p[2] += v[2];
 		}
+		*/
 
-		if (ray[0] + z[0] * ray[4] - ray[5] * y[0] > 0 ||
-			ray[1] - z[0] * ray[3] + ray[5] * x[1] > 0 ||
-			ray[2] + ray[3] * y[1] - ray[4] * x[1] > 0 ||
-			ray[5] * y[1] - ray[0] - z[1] * ray[4] > 0 ||
-			z[1] * ray[3] - ray[5] * x[0] - ray[1] > 0 ||
-			ray[4] * x[0] - ray[3] * y[0] - ray[2] > 0)
-			return 0;
+		// p should be projected to the BOTTOM plane!
+		double ray[] =
+		{
+			p[1] * v[2] - p[2] * v[1],
+			p[2] * v[0] - p[0] * v[2],
+			p[0] * v[1] - p[1] * v[0],
+			v[0], v[1], v[2],
+			p[0], p[1], p[2], // used by triangle-ray intersection
+			FLT_MAX
+		};
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
+		/*
+		if (!positive_only)
 		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+			// otherwie ret must be preinitialized
+			ret[0] = p[0];
+			ret[1] = p[1];
+			ret[2] = p[2];
+		}
+		*/
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
+		Inst* inst = flat ? HitFlat(ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq) :
+			HitBSP(root, ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq);
+
+		// grid has sprites & items only
+		if (sprites_too && head_cell)
+		{
+			// clip ray to z range of the grid, if its xy shadow
+			// covers fewer cells than are alive walk just these
+			double range[4];
+			bool walk = false;
+			if (v[2] != 0)
 			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
+				double t0 = (cell_z[0] - p[2]) / v[2];
+				double t1 = (cell_z[1] - p[2]) / v[2];
+				double a[2] = { p[0] + v[0] * t0, p[1] + v[1] * t0 };
+				double b[2] = { p[0] + v[0] * t1, p[1] + v[1] * t1 };
+				range[0] = floor((fmin(a[0], b[0]) - cell_pad) / DYN_CELL_SIZE);
+				range[1] = floor((fmax(a[0], b[0]) + cell_pad) / DYN_CELL_SIZE);
+				range[2] = floor((fmin(a[1], b[1]) - cell_pad) / DYN_CELL_SIZE);
+				range[3] = floor((fmax(a[1], b[1]) + cell_pad) / DYN_CELL_SIZE);
+				walk = (range[1] - range[0] + 1) * (range[3] - range[2] + 1) <= cells;
 			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
+
+			if (walk)
 			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				for (int y = (int)range[2]; y <= (int)range[3]; y++)
+				{
+					for (int x = (int)range[0]; x <= (int)range[1]; x++)
+					{
+						BSP_Cell* c = FindCell(x, y);
+						if (!c)
+							continue;
+						Inst* i = HitBSP(c, ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq);
+						if (i)
+							inst = i;
+					}
+				}
 			}
 			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
 			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				for (BSP_Cell* c = head_cell; c; c = c->next)
+				{
+					Inst* i = HitBSP(c, ray, ret, nrm, positive_only, editor, solid_only, sprites_too, wq);
+					if (i)
+						inst = i;
+				}
 			}
-			return 0;
 		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld2(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld2(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
 
-            Inst* i = HitWorld2(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld2(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+		return inst;
+    }
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+    static void QueryBSP(int level, BSP* bsp, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
+    {
+        // temporarily don't check planes
+        cb(level, bsp->bbox,cookie);
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+        if (bsp->type == BSP::BSP_TYPE_NODE)
+        {
+            BSP_Node* n = (BSP_Node*)bsp;
 
-				j = j->next;
-			}
-            return i;
+            if (n->bsp_child[0])
+                QueryBSP(level+1, n->bsp_child[0], planes, plane, cb, cookie);
+            if (n->bsp_child[1])
+                QueryBSP(level+1, n->bsp_child[1], planes, plane, cb, cookie);
         }
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
+        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
         {
-            BSP_Leaf* l = (BSP_Leaf*)q;
+            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
-
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+            if (s->bsp_child[0])
+                QueryBSP(level+1, s->bsp_child[0], planes, plane, cb, cookie);
+            if (s->bsp_child[1])
+                QueryBSP(level+1, s->bsp_child[1], planes, plane, cb, cookie);
 
-				j = j->next;
+            Inst* i = s->head;
+            while (i)
+            {
+                QueryBSP(level+1, i, planes, plane, cb, cookie);
+                i=i->next;
             }
-            return i;
         }
-
-		return 0;
-	}
-
-	static Inst* HitWorld3(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-	{
-		if (!q)
-			return 0;
-
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
-
-		if (positive_only)
-		{
-			// do not recurse if all 8 corners projected onto ray are negative
-		}
-
-		if (z[0] * ray[3] - ray[5] * x[0] - ray[1] > 0 ||
-			ray[0] + z[0] * ray[4] - ray[5] * y[0] > 0 ||
-			ray[2] - ray[4] * x[1] + ray[3] * y[0] > 0 ||
-			ray[1] - z[1] * ray[3] + ray[5] * x[1] > 0 ||
-			ray[5] * y[1] - ray[0] - z[1] * ray[4] > 0 ||
-			ray[4] * x[0] - ray[3] * y[1] - ray[2] > 0)
-			return 0;
-
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
-		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
-
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-
-			return 0;
-		}
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
+        if (bsp->type == BSP::BSP_TYPE_LEAF)
         {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld3(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld3(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
+            BSP_Leaf* l = (BSP_Leaf*)bsp;
+
+            Inst* i = l->head;
+            while (i)
+            {
+                QueryBSP(level+1, i, planes, plane, cb, cookie);
+                i=i->next;
+            }
         }
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
         {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
+            assert(bsp->type == BSP::BSP_TYPE_INST);
+        }
+        
+    }
 
-            Inst* i = HitWorld3(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld3(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+    // MESHES IN HULL
 
-            j = s->head;
-            while (j)
+    // recursive no clipping
+    static void Query(BSP* bsp, QueryWorldCB* cb, void* cookie, WorldQuery* wq)
+    {
+        if (bsp->type == BSP::BSP_TYPE_LEAF)
+        {
+            wq->nodes++;
+            Inst* i = ((BSP_Leaf*)bsp)->head;
+            while (i)
             {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
-
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-
-				j = j->next;
+                Query(i,cb,cookie,wq);
+                i=i->next;
             }
-            return i;
         }
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
+        if (bsp->type == BSP::BSP_TYPE_INST)
         {
-            BSP_Leaf* l = (BSP_Leaf*)q;
-
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
-
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-
-				j = j->next;
-            }
-            return i;
+            wq->insts++;
+			QueryInst((Inst*)bsp, cb, cookie, wq);
         }
-
-		return 0;
-	}
-
-	static Inst* HitWorld4(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-	{
-		if (!q)
-			return 0;
-
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
-
-		if (positive_only)
-		{
-			// do not recurse if all 8 corners projected onto ray are negative
-		}
-
-		if (ray[0] + z[1] * ray[4] - ray[5] * y[1] > 0 ||
-			-ray[1] + z[1] * ray[3] - ray[5] * x[1] > 0 ||
-			-ray[2] + ray[4] * x[1] - ray[3] * y[0] > 0 ||
-			-ray[0] - z[0] * ray[4] + ray[5] * y[0] > 0 ||
-			ray[1] - z[0] * ray[3] + ray[5] * x[0] > 0 ||
-			ray[2] - ray[4] * x[0] + ray[3] * y[1] > 0)
-			return 0;
-
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
-		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
-
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-
-			return 0;
-		}
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
+        if (bsp->type == BSP::BSP_TYPE_NODE)
         {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld4(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld4(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
+            wq->nodes++;
+            BSP_Node* n = (BSP_Node*)bsp;
+            if (n->bsp_child[0])
+                Query(n->bsp_child[0],cb,cookie,wq);
+            if (n->bsp_child[1])
+                Query(n->bsp_child[1],cb,cookie,wq);
         }
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
+        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
         {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
-
-            Inst* i = HitWorld4(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld4(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-
-            j = s->head;
-            while (j)
+            wq->nodes++;
+            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
+            if (s->bsp_child[0])
+                Query(s->bsp_child[0],cb,cookie,wq);
+            if (s->bsp_child[1])
+                Query(s->bsp_child[1],cb,cookie,wq);
+            Inst* i = s->head;
+            while (i)
             {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
-
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-
-				j = j->next;
-            }
-            return i;
+                Query(i,cb,cookie,wq);
+                i=i->next;
+            }                
         }
         else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
         {
-            BSP_Leaf* l = (BSP_Leaf*)q;
-
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+            assert(0);
+        }
+        
+    }
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+    // recursive
+    static void Query(BSP* bsp, int planes, double* plane[], QueryWorldCB* cb, void* cookie, WorldQuery* wq)
+    {
+        float c[4] = { bsp->bbox[0], bsp->bbox[2], bsp->bbox[4], 1 }; // 0,0,0
 
-				j = j->next;
-            }
-            return i;
-        }
+        wq->tests++;
 
-		return 0;
-	}
+        for (int i = 0; i < planes; i++)
+        {
+            int neg_pos[2] = { 0,0 };
 
-	static Inst* HitWorld5(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-	{
-		if (!q)
-			return 0;
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
+            c[0] = bsp->bbox[1]; // 1,0,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-		if (positive_only)
-		{
-			// do not recurse if all 8 corners projected onto ray are negative
-		}
+            c[1] = bsp->bbox[3]; // 1,1,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-		if (ray[1] - z[1] * ray[3] + ray[5] * x[0] > 0 ||
-			ray[0] + z[1] * ray[4] - ray[5] * y[1] > 0 ||
-			-ray[2] + ray[4] * x[1] - ray[3] * y[1] > 0 ||
-			-ray[1] + z[0] * ray[3] - ray[5] * x[1] > 0 ||
-			-ray[0] - z[0] * ray[4] + ray[5] * y[0] > 0 ||
-			ray[2] - ray[4] * x[0] + ray[3] * y[0] > 0)
-			return 0;
+            c[0] = bsp->bbox[0]; // 0,1,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
-		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+            c[2] = bsp->bbox[5]; // 0,1,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
+            c[0] = bsp->bbox[1]; // 1,1,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-			return 0;
-		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld5(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld5(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
+            c[1] = bsp->bbox[2]; // 1,0,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-            Inst* i = HitWorld5(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld5(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+            c[0] = bsp->bbox[0]; // 0,0,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+            c[2] = bsp->bbox[4]; // 0,0,0
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+            if (neg_pos[0] == 8)
+                return;
 
-				j = j->next;
+            if (neg_pos[1] == 8)
+            {
+                planes--;
+                if (i < planes)
+                {
+                    double* swap = plane[i];
+                    plane[i] = plane[planes];
+                    plane[planes] = swap;
+                }
+                i--;
             }
-            return i;
         }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)q;
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+        if (bsp->type == BSP::BSP_TYPE_INST)
+        {
+            wq->insts++;
+			QueryInst((Inst*)bsp, cb, cookie, wq);
+		}
+        else
+        if (bsp->type == BSP::BSP_TYPE_NODE)        
+        {
+            wq->nodes++;
+            BSP_Node* n = (BSP_Node*)bsp;
+            if (planes)
+            {
+                if (n->bsp_child[0])
+                    Query(n->bsp_child[0],planes,plane,cb,cookie,wq);
+                if (n->bsp_child[1])
+                    Query(n->bsp_child[1],planes,plane,cb,cookie,wq);
+            }
+            else
+            {
+                if (n->bsp_child[0])
+                    Query(n->bsp_child[0],cb,cookie,wq);
+                if (n->bsp_child[1])
+                    Query(n->bsp_child[1],cb,cookie,wq);
+            }
+        }
+        else
+        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
+        {
+            wq->nodes++;
+            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
+            if (planes)
+            {
+                if (s->bsp_child[0])
+                    Query(s->bsp_child[0],planes,plane,cb,cookie,wq);
+                if (s->bsp_child[1])
+                    Query(s->bsp_child[1],planes,plane,cb,cookie,wq);
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+                Inst* i = s->head;
+                while (i)
+                {
+                    Query(i,planes,plane,cb,cookie,wq);
+                    i=i->next;
+                }                
+            }
+            else
+            {
+                if (s->bsp_child[0])
+                    Query(s->bsp_child[0],cb,cookie,wq);
+                if (s->bsp_child[1])
+                    Query(s->bsp_child[1],cb,cookie,wq);
 
-				j = j->next;
+                Inst* i = s->head;
+                while (i)
+                {
+                    Query(i,cb,cookie,wq);
+                    i=i->next;
+                }                
+            }
+        }        
+        else
+        if (bsp->type == BSP::BSP_TYPE_LEAF)
+        {
+            wq->nodes++;
+            BSP_Leaf* l = (BSP_Leaf*)bsp;
+            if (planes)
+            {
+                Inst* i = l->head;
+                while (i)
+                {
+                    Query(i,planes,plane,cb,cookie,wq);
+                    i=i->next;
+                }                
             }
-            return i;
+            else
+            {
+                Inst* i = l->head;
+                while (i)
+                {
+                    Query(i,cb,cookie,wq);
+                    i=i->next;
+                }                
+            }
+        }        
+        else
+        {
+            assert(0);
         }
+    }
 
-		return 0;
-	}
-
-	static Inst* HitWorld6(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+	static void QueryInst(Inst* i, QueryWorldCB* cb, void* cookie, const WorldQuery* wq)
 	{
-		if (!q)
-			return 0;
+		if (i == wq->skip)
+			return;
 
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
+		if (i->inst_type == Inst::INST_TYPE::MESH)
+			cb->mesh_cb(((MeshInst*)i)->mesh, ((MeshInst*)i)->tm, cookie);
+		else
+		if (i->inst_type == Inst::INST_TYPE::SPRITE)
+		{
+			SpriteInst* si = (SpriteInst*)i;
+			if (i->flags & INST_FLAGS::INST_VISIBLE)
+				cb->sprite_cb(si,si->sprite, si->pos, si->yaw, si->anim, si->frame, si->reps, cookie);
+		}
+		else
+		if (i->inst_type == Inst::INST_TYPE::ITEM)
+		{
+			ItemInst* si = (ItemInst*)i;
+			cb->sprite_cb(si, si->item->proto->sprite_3d, si->pos, si->yaw, -1, si->item->purpose, (int*)si->item, cookie);
+		}
+	}
 
-		if (positive_only)
+	// compiled tree, iterative, planes still intersecting are carried as bit mask
+	void QueryFlat(int planes, double plane[][4], QueryWorldCB* cb, void* cookie, WorldQuery* wq)
+	{
+		// per plane indices of box corner farthest along its normal (p-vertex)
+		int hi[6][3];
+		for (int p = 0; p < planes; p++)
 		{
-			// do not recurse if all 8 corners projected onto ray are negative
+			for (int a = 0; a < 3; a++)
+				hi[p][a] = 2 * a + (plane[p][a] > 0 ? 1 : 0);
 		}
 
-		if (-ray[1] + z[1] * ray[3] - ray[5] * x[1] > 0 ||
-			-ray[0] - z[1] * ray[4] + ray[5] * y[0] > 0 ||
-			-ray[2] + ray[4] * x[0] - ray[3] * y[0] > 0 ||
-			ray[1] - z[0] * ray[3] + ray[5] * x[0] > 0 ||
-			ray[0] + z[0] * ray[4] - ray[5] * y[1] > 0 ||
-			ray[2] - ray[4] * x[1] + ray[3] * y[1] > 0)
-			return 0;
+		// node index or ~(4 * node + lane) of inst list, lanes are pushed backwards
+		// so callbacks come in tree order (as from pointer tree, renderer depends on it)
+		int stack[FLAT_STACK];
+		int mask[FLAT_STACK];
+		int sp = 0;
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
-		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+		stack[sp] = 0;
+		mask[sp++] = (1 << planes) - 1;
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
+		while (sp)
+		{
+			sp--;
+			int idx = stack[sp];
+			if (idx < 0)
 			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
-			}
-
-			return 0;
-		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld6(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld6(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
+				const FlatNode* n = flat->node + (~idx >> 2);
+				int k = ~idx & 3;
+				Inst** item = flat->item + n->child[k];
+				for (int i = 0; i < n->count[k]; i++)
+				{
+					int m = mask[sp];
+					bool in = true;
+					const float* b = item[i]->bbox;
 
-            Inst* i = HitWorld6(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld6(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+					wq->tests++;
+					for (int p = 0; in && m; p++, m >>= 1)
+					{
+						if (m & 1)
+							in = plane[p][0] * b[hi[p][0]] + plane[p][1] * b[hi[p][1]] + plane[p][2] * b[hi[p][2]] + plane[p][3] > 0;
+					}
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
+					if (in)
+					{
+						wq->insts++;
+						QueryInst(item[i], cb, cookie, wq);
+					}
 				}
+				continue;
+			}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+			const FlatNode* n = flat->node + idx;
+			int lane_mask[4] = { mask[sp], mask[sp], mask[sp], mask[sp] };
+			bool out[4] = { false, false, false, false };
 
-				j = j->next;
-            }
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)q;
+			wq->nodes++;
+			wq->tests += 4;
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
+			for (int p = 0; p < planes; p++)
+			{
+				if (!(mask[sp] & (1 << p)))
 					continue;
-				}
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
+				const double* pl = plane[p];
+				const float* x0 = n->box[hi[p][0]];
+				const float* y0 = n->box[hi[p][1]];
+				const float* z0 = n->box[hi[p][2]];
+				const float* x1 = n->box[hi[p][0] ^ 1];
+				const float* y1 = n->box[hi[p][1] ^ 1];
+				const float* z1 = n->box[hi[p][2] ^ 1];
+
+				// all 4 lanes at once
+				for (int k = 0; k < 4; k++)
 				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
+					double d_hi = pl[0] * x0[k] + pl[1] * y0[k] + pl[2] * z0[k] + pl[3];
+					double d_lo = pl[0] * x1[k] + pl[1] * y1[k] + pl[2] * z1[k] + pl[3];
+					out[k] |= d_hi <= 0;
+					lane_mask[k] &= d_lo > 0 ? ~(1 << p) : ~0;
 				}
+			}
 
-				j = j->next;
-            }
-            return i;
-        }
+			for (int k = 3; k >= 0; k--)
+			{
+				if (out[k] || n->child[k] < 0)
+					continue;
 
-		return 0;
+				stack[sp] = n->count[k] ? ~(4 * idx + k) : n->child[k];
+				mask[sp++] = lane_mask[k];
+			}
+		}
 	}
 
-	static Inst* HitWorld7(BSP* q, double ray[10], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-	{
-		if (!q)
-			return 0;
-
-		const float x[2] = { q->bbox[0],q->bbox[1] };
-		const float y[2] = { q->bbox[2],q->bbox[3] };
-		const float z[2] = { q->bbox[4],q->bbox[5] };
+    // main
+    void Query(int planes, double plane[][4], QueryWorldCB* cb, void* cookie, WorldQuery* wq)
+    {
+        wq->tests=0;
+        wq->insts=0;
+        wq->nodes=0;
 
-		if (positive_only)
-		{
-			// do not recurse if all 8 corners projected onto ray are negative
-		}
+        // static first
+		if (flat)
+			QueryFlat(planes, plane, cb, cookie, wq);
+		else
+        if (root)
+        {
+			if (planes > 0)
+			{
+				//double* pp[4] = { plane[0],plane[1],plane[2],plane[3] };
+				double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
 
-		if (-ray[0] - z[1] * ray[4] + ray[5] * y[0] > 0 ||
-			ray[1] - z[1] * ray[3] + ray[5] * x[0] > 0 ||
-			-ray[2] + ray[4] * x[0] - ray[3] * y[1] > 0 ||
-			ray[0] + z[0] * ray[4] - ray[5] * y[1] > 0 ||
-			-ray[1] + z[0] * ray[3] - ray[5] * x[1] > 0 ||
-			ray[2] - ray[4] * x[1] + ray[3] * y[0] > 0)
-			return 0;
+				Query(root, planes, pp, cb, cookie, wq);
+			}
+			else
+			{
+				Query(root, cb, cookie, wq);
+			}
+        }
 
-		if (q->type == BSP::TYPE::BSP_TYPE_INST)
+		// dynamic after
+		Inst* i = head_inst;
+		if (planes > 0)
 		{
-			Inst* inst = (Inst*)q;
-			if (editor && (inst->flags & INST_VOLATILE) || 
-				!editor && !(inst->flags & INST_VOLATILE))
-				return 0;
+			// double* pp[4] = { plane[0],plane[1],plane[2],plane[3] };
+			double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
 
-			if (inst->inst_type == Inst::INST_TYPE::MESH)
-			{
-				if (((MeshInst*)inst)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-					return inst;
-				else
-					return 0;
-			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::SPRITE)
+			while (i)
 			{
-				if (sprites_too && ((SpriteInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				Query(i, planes, pp, cb, cookie, wq);
+				i = i->next;
 			}
-			else
-			if (inst->inst_type == Inst::INST_TYPE::ITEM)
+
+			for (BSP_Cell* c = head_cell; c; c = c->next)
+				Query(c, planes, pp, cb, cookie, wq);
+		}
+		else
+		{
+			while (i)
 			{
-				if (sprites_too && ((ItemInst*)inst)->Hit(ray, ret, positive_only))
-					return inst;
-				else
-					return 0;
+				Query(i, cb, cookie, wq);
+				i = i->next;
 			}
 
-			return 0;
+			for (BSP_Cell* c = head_cell; c; c = c->next)
+				Query(c, cb, cookie, wq);
 		}
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)q;
-            Inst* i = HitWorld7(n->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld7(n->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)q;
+	}
+};
 
-            Inst* i = HitWorld7(s->bsp_child[0], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            Inst* j = HitWorld7(s->bsp_child[1], ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-            i = j ? j : i;
+struct WorldBuild
+{
+	World* w;
+	World::BSP_Item* arr;
 
-            j = s->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+	struct Job
+	{
+		World::BSP_Item* arr;
+		int num;
+		BSP_Node* parent; // 0 if job builds root
+		int child;
+	};
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+	int jobs;
+	Job* job;
+};
 
-				j = j->next;
-            }
-            return i;
-        }
-        else
-        if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)q;
+// top levels are split right away, subtrees of at most job_size items become jobs
+static BSP* SplitWorldBuild(WorldBuild* wb, World::BSP_Item* arr, int num, int job_size, BSP_Node* parent, int child)
+{
+	if (num <= job_size)
+	{
+		WorldBuild::Job* j = wb->job + wb->jobs++;
+		j->arr = arr;
+		j->num = num;
+		j->parent = parent;
+		j->child = child;
+		return 0;
+	}
 
-            Inst* i = 0;
-            Inst* j = l->head;
-            while (j)
-            {
-				if (editor && (j->flags & INST_VOLATILE) || 
-					!editor && !(j->flags & INST_VOLATILE))
-				{
-					j=j->next;
-					continue;
-				}
+	float bbox[6];
+	int left = World::BinSplit(arr, num, bbox);
+	if (!left)
+		return World::MakeLeaf(arr, num);
 
-				if (j->inst_type == Inst::INST_TYPE::MESH)
-				{
-					if (((MeshInst*)j)->HitFace(ray, ret, nrm, positive_only, editor, solid_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::SPRITE && sprites_too)
-				{
-					if (((SpriteInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
-				else
-				if (j->inst_type == Inst::INST_TYPE::ITEM && sprites_too)
-				{
-					if (((ItemInst*)j)->Hit(ray, ret, positive_only))
-						i = j;
-				}
+	BSP_Node* node = World::MakeNode(bbox);
+	node->bsp_child[0] = SplitWorldBuild(wb, arr, left, job_size, node, 0);
+	node->bsp_child[1] = SplitWorldBuild(wb, arr + left, num - left, job_size, node, 1);
+	for (int c = 0; c < 2; c++)
+	{
+		if (node->bsp_child[c])
+			node->bsp_child[c]->bsp_parent = node;
+	}
+	return node;
+}
 
-				j = j->next;
-            }
-            return i;
-        }
+WorldBuild* CreateWorldBuild(World* w, bool boxes)
+{
+	WorldBuild* wb = (WorldBuild*)malloc(sizeof(WorldBuild));
+	wb->w = w;
+	wb->jobs = 0;
+	wb->arr = (World::BSP_Item*)malloc(sizeof(World::BSP_Item) * (w->insts + 1));
 
-		return 0;
+	int count = w->TakeTreeInsts(wb->arr, boxes);
+
+	wb->job = (WorldBuild::Job*)malloc(sizeof(WorldBuild::Job) * (count + 1));
+	if (count)
+	{
+		// ~64 jobs on big worlds, few on small ones
+		int job_size = count / 64 > 64 ? count / 64 : 64;
+		w->root = SplitWorldBuild(wb, wb->arr, count, job_size, 0, 0);
 	}
 
+	return wb;
+}
 
-    // RAY HIT using plucker
-    Inst* HitWorld(double p[3], double v[3], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
-    {
-		if (!root)
-			return 0;
-
-		/*
-		double max_z = 0;
-		if (positive_only)
-		{
-			max_z = p[2];
-			p[0] += v[0];
-			p[1] += v[1];
-			p[2] += v[2];
-		}
-		*/
-
-		// p should be projected to the BOTTOM plane!
-		double ray[] =
-		{
-			p[1] * v[2] - p[2] * v[1],
-			p[2] * v[0] - p[0] * v[2],
-			p[0] * v[1] - p[1] * v[0],
-			v[0], v[1], v[2],
-			p[0], p[1], p[2], // used by triangle-ray intersection
-			FLT_MAX
-		};
-
-		int sign_case = 0;
-
-		if (v[0] >= 0)
-			sign_case |= 1;
-		if (v[1] >= 0)
-			sign_case |= 2;
-		if (v[2] >= 0)
-			sign_case |= 4;
-
-		// assert((sign_case & 4) == 0); // watching from the bottom? -> raytraced reflections?
+void DeleteWorldBuild(WorldBuild* wb)
+{
+	wb->w->Flatten();
+	free(wb->arr);
+	free(wb->job);
+	free(wb);
+}
 
-		static Inst* (*const func_vect[])(BSP* q, double ray[10], double ret[3], double nrm[3], bool, bool, bool, bool) =
-		{
-			HitWorld0,
-			HitWorld1,
-			HitWorld2,
-			HitWorld3,
-
-			HitWorld4,
-			HitWorld5,
-			HitWorld6,
-			HitWorld7,
-		};
+int GetWorldBuildJobs(WorldBuild* wb)
+{
+	return wb->jobs;
+}
 
-		/*
-		if (!positive_only)
+void BuildWorldJobs(WorldBuild* wb, int from, int to)
+{
+	for (int j = from; j < to; j++)
+	{
+		WorldBuild::Job* job = wb->job + j;
+		BSP* b = World::SplitBSP(job->arr, job->num);
+		if (job->parent)
 		{
-			// otherwie ret must be preinitialized
-			ret[0] = p[0];
-			ret[1] = p[1];
-			ret[2] = p[2];
+			job->parent->bsp_child[job->child] = b;
+			b->bsp_parent = job->parent;
 		}
-		*/
+		else
+			wb->w->root = b;
+	}
+}
 
-		Inst* inst = func_vect[sign_case](root, ray, ret, nrm, positive_only, editor, solid_only, sprites_too);
-		return inst;
-    }
+Item* delete_item_list = 0;
+SpriteInst* delete_sprite_list = 0;
 
-    static void QueryBSP(int level, BSP* bsp, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
+static void DeleteItemInsts(BSP* bsp, bool all) 
+{
+    if (bsp->type == BSP::BSP_TYPE_LEAF)
     {
-        // temporarily don't check planes
-        cb(level, bsp->bbox,cookie);
-
-        if (bsp->type == BSP::BSP_TYPE_NODE)
-        {
-            BSP_Node* n = (BSP_Node*)bsp;
-
-            if (n->bsp_child[0])
-                QueryBSP(level+1, n->bsp_child[0], planes, plane, cb, cookie);
-            if (n->bsp_child[1])
-                QueryBSP(level+1, n->bsp_child[1], planes, plane, cb, cookie);
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
-        {
-            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
-
-            if (s->bsp_child[0])
-                QueryBSP(level+1, s->bsp_child[0], planes, plane, cb, cookie);
-            if (s->bsp_child[1])
-                QueryBSP(level+1, s->bsp_child[1], planes, plane, cb, cookie);
-
-            Inst* i = s->head;
-            while (i)
-            {
-                QueryBSP(level+1, i, planes, plane, cb, cookie);
-                i=i->next;
-            }
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_LEAF)
-        {
-            BSP_Leaf* l = (BSP_Leaf*)bsp;
-
-            Inst* i = l->head;
-            while (i)
-            {
-                QueryBSP(level+1, i, planes, plane, cb, cookie);
-                i=i->next;
-            }
-        }
-        else
+        Inst* i = ((BSP_Leaf*)bsp)->head;
+        while (i)
         {
-            assert(bsp->type == BSP::BSP_TYPE_INST);
+			if (i->inst_type == Inst::INST_TYPE::ITEM)
+			{
+				Item* item = ((ItemInst*)i)->item;
+				if (all || item->purpose == Item::WORLD)
+				{
+					item->proto = (ItemProto*)delete_item_list;
+					delete_item_list = item;
+				}
+			}
+            i=i->next;
         }
-        
     }
-
-    // MESHES IN HULL
-
-    // recursive no clipping
-    static void Query(BSP* bsp, QueryWorldCB* cb, void* cookie)
+    else
+    if (bsp->type == BSP::BSP_TYPE_INST)
     {
-        if (bsp->type == BSP::BSP_TYPE_LEAF)
-        {
-            bsp_nodes++;
-            Inst* i = ((BSP_Leaf*)bsp)->head;
-            while (i)
-            {
-                Query(i,cb,cookie);
-                i=i->next;
-            }
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_INST)
-        {
-            bsp_insts++;
-            Inst* i = (Inst*)bsp;
-			if (i->inst_type == Inst::INST_TYPE::MESH)
-				cb->mesh_cb(((MeshInst*)i)->mesh, ((MeshInst*)i)->tm, cookie);
-			else
-			if (i->inst_type == Inst::INST_TYPE::SPRITE)
+        Inst* i = (Inst*)bsp;
+		if (i->inst_type == Inst::INST_TYPE::ITEM)
+		{
+			Item* item = ((ItemInst*)i)->item;
+			if (all || item->purpose == Item::WORLD)
 			{
-				SpriteInst* si = (SpriteInst*)i;
-				if (i->flags & INST_FLAGS::INST_VISIBLE)
-					cb->sprite_cb(si, si->sprite, si->pos, si->yaw, si->anim, si->frame, si->reps, cookie);
+				item->proto = (ItemProto*)delete_item_list;
+				delete_item_list = item;
 			}
-			else
+		}
+	}
+    else
+    if (bsp->type == BSP::BSP_TYPE_NODE)
+    {
+        BSP_Node* n = (BSP_Node*)bsp;
+        if (n->bsp_child[0])
+			DeleteItemInsts(n->bsp_child[0],all);
+        if (n->bsp_child[1])
+			DeleteItemInsts(n->bsp_child[1],all);
+    }
+    else
+    if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
+    {
+        BSP_NodeShare* s = (BSP_NodeShare*)bsp;
+        if (s->bsp_child[0])
+			DeleteItemInsts(s->bsp_child[0],all);
+        if (s->bsp_child[1])
+			DeleteItemInsts(s->bsp_child[1],all);
+        Inst* i = s->head;
+        while (i)
+        {
 			if (i->inst_type == Inst::INST_TYPE::ITEM)
 			{
-				ItemInst* si = (ItemInst*)i;
-				cb->sprite_cb(si, si->item->proto->sprite_3d, si->pos, si->yaw, -1, si->item->purpose, (int*)si->item, cookie);
+				Item* item = ((ItemInst*)i)->item;
+				if (all || item->purpose == Item::WORLD)
+				{
+					item->proto = (ItemProto*)delete_item_list;
+					delete_item_list = item;
+				}
 			}
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_NODE)
-        {
-            bsp_nodes++;
-            BSP_Node* n = (BSP_Node*)bsp;
-            if (n->bsp_child[0])
-                Query(n->bsp_child[0],cb,cookie);
-            if (n->bsp_child[1])
-                Query(n->bsp_child[1],cb,cookie);
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
-        {
-            bsp_nodes++;
-            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
-            if (s->bsp_child[0])
-                Query(s->bsp_child[0],cb,cookie);
-            if (s->bsp_child[1])
-                Query(s->bsp_child[1],cb,cookie);
-            Inst* i = s->head;
-            while (i)
-            {
-                Query(i,cb,cookie);
-                i=i->next;
-            }                
-        }
-        else
-        {
-            assert(0);
-        }
-        
+			i=i->next;
+        }                
     }
-
-    // recursive
-    static void Query(BSP* bsp, int planes, double* plane[], QueryWorldCB* cb, void* cookie)
+    else
     {
-        float c[4] = { bsp->bbox[0], bsp->bbox[2], bsp->bbox[4], 1 }; // 0,0,0
-
-        bsp_tests++;
-
-        for (int i = 0; i < planes; i++)
-        {
-            int neg_pos[2] = { 0,0 };
-
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[0] = bsp->bbox[1]; // 1,0,0
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[1] = bsp->bbox[3]; // 1,1,0
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[0] = bsp->bbox[0]; // 0,1,0
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[2] = bsp->bbox[5]; // 0,1,1
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[0] = bsp->bbox[1]; // 1,1,1
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[1] = bsp->bbox[2]; // 1,0,1
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[0] = bsp->bbox[0]; // 0,0,1
-            neg_pos[PositiveProduct(plane[i], c)] ++;
-
-            c[2] = bsp->bbox[4]; // 0,0,0
-
-            if (neg_pos[0] == 8)
-                return;
-
-            if (neg_pos[1] == 8)
-            {
-                planes--;
-                if (i < planes)
-                {
-                    double* swap = plane[i];
-                    plane[i] = plane[planes];
-                    plane[planes] = swap;
-                }
-                i--;
-            }
-        }
+        assert(0);
+    }
+}
 
-        if (bsp->type == BSP::BSP_TYPE_INST)
+static void DeleteSpriteInsts(BSP* bsp) 
+{
+    if (bsp->type == BSP::BSP_TYPE_LEAF)
+    {
+        Inst* i = ((BSP_Leaf*)bsp)->head;
+        while (i)
         {
-            bsp_insts++;
-            Inst* i = (Inst*)bsp;
-			if (i->inst_type == Inst::INST_TYPE::MESH)
-				cb->mesh_cb(((MeshInst*)i)->mesh, ((MeshInst*)i)->tm, cookie);
-			else
 			if (i->inst_type == Inst::INST_TYPE::SPRITE)
 			{
 				SpriteInst* si = (SpriteInst*)i;
-				if (i->flags & INST_FLAGS::INST_VISIBLE)
-					cb->sprite_cb(si,si->sprite, si->pos, si->yaw, si->anim, si->frame, si->reps, cookie);
-			}
-			else
-			if (i->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				ItemInst* si = (ItemInst*)i;
-				cb->sprite_cb(si, si->item->proto->sprite_3d, si->pos, si->yaw, -1, si->item->purpose, (int*)si->item, cookie);
-			}
-		}
-        else
-        if (bsp->type == BSP::BSP_TYPE_NODE)        
-        {
-            bsp_nodes++;
-            BSP_Node* n = (BSP_Node*)bsp;
-            if (planes)
-            {
-                if (n->bsp_child[0])
-                    Query(n->bsp_child[0],planes,plane,cb,cookie);
-                if (n->bsp_child[1])
-                    Query(n->bsp_child[1],planes,plane,cb,cookie);
-            }
-            else
-            {
-                if (n->bsp_child[0])
-                    Query(n->bsp_child[0],cb,cookie);
-                if (n->bsp_child[1])
-                    Query(n->bsp_child[1],cb,cookie);
-            }
-        }
-        else
-        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
-        {
-            bsp_nodes++;
-            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
-            if (planes)
-            {
-                if (s->bsp_child[0])
-                    Query(s->bsp_child[0],planes,plane,cb,cookie);
-                if (s->bsp_child[1])
-                    Query(s->bsp_child[1],planes,plane,cb,cookie);
-
-                Inst* i = s->head;
-                while (i)
-                {
-                    Query(i,planes,plane,cb,cookie);
-                    i=i->next;
-                }                
-            }
-            else
-            {
-                if (s->bsp_child[0])
-                    Query(s->bsp_child[0],cb,cookie);
-                if (s->bsp_child[1])
-                    Query(s->bsp_child[1],cb,cookie);
-
-                Inst* i = s->head;
-                while (i)
-                {
-                    Query(i,cb,cookie);
-                    i=i->next;
-                }                
-            }
-        }        
-        else
-        if (bsp->type == BSP::BSP_TYPE_LEAF)
-        {
-            bsp_nodes++;
-            BSP_Leaf* l = (BSP_Leaf*)bsp;
-            if (planes)
-            {
-                Inst* i = l->head;
-                while (i)
-                {
-                    Query(i,planes,plane,cb,cookie);
-                    i=i->next;
-                }                
-            }
-            else
-            {
-                Inst* i = l->head;
-                while (i)
-                {
-                    Query(i,cb,cookie);
-                    i=i->next;
-                }                
-            }
-        }        
-        else
-        {
-            assert(0);
-        }
-    }
-
-    // main
-    void Query(int planes, double plane[][4], QueryWorldCB* cb, void* cookie)
-    {
-        bsp_tests=0;
-        bsp_insts=0;
-        bsp_nodes=0;
-
-        // static first
-        if (root)
-        {
-			if (planes > 0)
-			{
-				//double* pp[4] = { plane[0],plane[1],plane[2],plane[3] };
-				double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
-
-				Query(root, planes, pp, cb, cookie);
-			}
-			else
-			{
-				Query(root, cb, cookie);
-			}
-        }
-
-		// dynamic after
-		Inst* i = head_inst;
-		if (planes > 0)
-		{
-			// double* pp[4] = { plane[0],plane[1],plane[2],plane[3] };
-			double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
-
-			while (i)
-			{
-				Query(i, planes, pp, cb, cookie);
-				i = i->next;
-			}
-		}
-		else
-		{
-			while (i)
-			{
-				Query(i, cb, cookie);
-				i = i->next;
-			}
-		}
-	}
-};
-
-Item* delete_item_list = 0;
-SpriteInst* delete_sprite_list = 0;
-
-static void DeleteItemInsts(BSP* bsp, bool all) 
-{
-    if (bsp->type == BSP::BSP_TYPE_LEAF)
-    {
-        Inst* i = ((BSP_Leaf*)bsp)->head;
-        while (i)
-        {
-			if (i->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				Item* item = ((ItemInst*)i)->item;
-				if (all || item->purpose == Item::WORLD)
-				{
-					item->proto = (ItemProto*)delete_item_list;
-					delete_item_list = item;
-				}
-			}
-            i=i->next;
-        }
-    }
-    else
-    if (bsp->type == BSP::BSP_TYPE_INST)
-    {
-        Inst* i = (Inst*)bsp;
-		if (i->inst_type == Inst::INST_TYPE::ITEM)
-		{
-			Item* item = ((ItemInst*)i)->item;
-			if (all || item->purpose == Item::WORLD)
-			{
-				item->proto = (ItemProto*)delete_item_list;
-				delete_item_list = item;
-			}
-		}
-	}
-    else
-    if (bsp->type == BSP::BSP_TYPE_NODE)
-    {
-        BSP_Node* n = (BSP_Node*)bsp;
-        if (n->bsp_child[0])
-			DeleteItemInsts(n->bsp_child[0],all);
-        if (n->bsp_child[1])
-			DeleteItemInsts(n->bsp_child[1],all);
-    }
-    else
-    if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
-    {
-        BSP_NodeShare* s = (BSP_NodeShare*)bsp;
-        if (s->bsp_child[0])
-			DeleteItemInsts(s->bsp_child[0],all);
-        if (s->bsp_child[1])
-			DeleteItemInsts(s->bsp_child[1],all);
-        Inst* i = s->head;
-        while (i)
-        {
-			if (i->inst_type == Inst::INST_TYPE::ITEM)
-			{
-				Item* item = ((ItemInst*)i)->item;
-				if (all || item->purpose == Item::WORLD)
-				{
-					item->proto = (ItemProto*)delete_item_list;
-					delete_item_list = item;
-				}
-			}
-			i=i->next;
-        }                
-    }
-    else
-    {
-        assert(0);
-    }
-}
-
-static void DeleteSpriteInsts(BSP* bsp) 
-{
-    if (bsp->type == BSP::BSP_TYPE_LEAF)
-    {
-        Inst* i = ((BSP_Leaf*)bsp)->head;
-        while (i)
-        {
-			if (i->inst_type == Inst::INST_TYPE::SPRITE)
-			{
-				SpriteInst* si = (SpriteInst*)i;
-				si->sprite = (Sprite*)delete_sprite_list;
-				delete_sprite_list = si;
+				si->sprite = (Sprite*)delete_sprite_list;
+				delete_sprite_list = si;
 			}
             i=i->next;
         }
@@ -3330,6 +2836,9 @@ void ResetItemInsts(World* w)
 
 		if (w->root)
 			DeleteItemInsts(w->root, false); // prepares list only
+
+		for (BSP_Cell* c = w->head_cell; c; c = c->next)
+			DeleteItemInsts(c, false);
 	}
 
 	Item* item = delete_item_list;
@@ -3342,1198 +2851,2068 @@ void ResetItemInsts(World* w)
 
 	if (w->root)
 		CloneItemInsts(w,w->root); // clones immediately
+
+	// clones land in the cell of their origin, at its head
+	for (BSP_Cell* c = w->head_cell; c; c = c->next)
+		CloneItemInsts(w, c);
 	RebuildWorld(w);
 }
 
-bool Mesh::Update(const char* path)
-{
-	if (strstr(path,".akm"))
-	{
-		int bio = 1;
-	}
-    FILE* f = fopen(path,"rt");
-	if (!f)
-		return false;
+// baked arrays follow the header exactly as they are laid in memory
+// cache is valid only for source file of same size and content hash
+// (mtime can't tell edits made within the same second)
+#define MESH_CACHE_VERSION 2
+
+struct MeshCacheHeader
+{
+	char magic[4]; // "AKMC"
+	uint32_t version;
+	uint64_t src_size;
+	uint64_t src_hash; // FNV-1a of whole source file
+	int32_t verts, faces, lines, pad;
+	float bbox[6];
+};
+
+static bool HashMeshFile(const char* path, uint64_t* hash)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	uint64_t h = 14695981039346656037ull;
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		for (size_t i = 0; i < n; i++)
+			h = (h ^ buf[i]) * 1099511628211ull;
+	}
+
+	bool ok = !ferror(f);
+	fclose(f);
+	*hash = h;
+	return ok;
+}
+
+bool Mesh::Update(const char* path)
+{
+	Clear();
+
+	struct stat st;
+	uint64_t hash;
+	bool cache = stat(path, &st) == 0 && HashMeshFile(path, &hash);
+	if (cache && LoadCache(path, &st, hash))
+		return true;
+
+	bool ok = ParsePLY(path);
+	Bake();
+
+	if (ok && cache)
+		SaveCache(path, &st, hash);
+	return ok;
+}
+
+void Mesh::Clear()
+{
+	Face* f = head_face;
+	while (f)
+	{
+		Face* n = f->next;
+		free(f);
+		f = n;
+	}
+
+	Line* l = head_line;
+	while (l)
+	{
+		Line* n = l->next;
+		free(l);
+		l = n;
+	}
+
+	Vert* v = head_vert;
+	while (v)
+	{
+		Vert* n = v->next;
+		free(v);
+		v = n;
+	}
+
+	faces = 0;
+	head_face = 0;
+	tail_face = 0;
+	lines = 0;
+	head_line = 0;
+	tail_line = 0;
+	verts = 0;
+	head_vert = 0;
+	tail_vert = 0;
+
+	if (bake_map)
+	{
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+		munmap((MeshCacheHeader*)bake - 1, bake_map);
+#endif
+	}
+	else
+	if (bake)
+		free(bake);
+
+	bake = 0;
+	bake_map = 0;
+	SetBake(0);
+}
+
+static size_t BakeSize(int verts, int prims)
+{
+	return sizeof(float[3]) * verts + sizeof(int[3]) * prims + sizeof(uint32_t) * prims + sizeof(uint8_t[4]) * verts;
+}
+
+void Mesh::SetBake(void* block)
+{
+	// biggest alignment first
+	int prims = faces + lines;
+	bake_xyz = (float*)block;
+	bake_abc = (int*)(bake_xyz + 3 * verts);
+	bake_visual = (uint32_t*)(bake_abc + 3 * prims);
+	bake_rgba = (uint8_t*)(bake_visual + prims);
+}
+
+void Mesh::Bake()
+{
+	bake = malloc(BakeSize(verts, faces + lines));
+	SetBake(bake);
+
+	int n = 0;
+	for (Vert* v = head_vert; v; v = v->next, n++)
+	{
+		v->vert_id = n;
+		bake_xyz[3 * n + 0] = v->xyzw[0];
+		bake_xyz[3 * n + 1] = v->xyzw[1];
+		bake_xyz[3 * n + 2] = v->xyzw[2];
+		memcpy(bake_rgba + 4 * n, v->rgba, 4);
+	}
+
+	n = 0;
+	for (Face* f = head_face; f; f = f->next, n++)
+	{
+		bake_abc[3 * n + 0] = f->abc[0]->vert_id;
+		bake_abc[3 * n + 1] = f->abc[1]->vert_id;
+		bake_abc[3 * n + 2] = f->abc[2]->vert_id;
+		bake_visual[n] = f->visual;
+	}
+
+	for (Line* l = head_line; l; l = l->next, n++)
+	{
+		bake_abc[3 * n + 0] = l->ab[0]->vert_id;
+		bake_abc[3 * n + 1] = l->ab[1]->vert_id;
+		bake_abc[3 * n + 2] = l->ab[1]->vert_id;
+		bake_visual[n] = l->visual;
+	}
+}
+
+bool Mesh::LoadCache(const char* path, const struct stat* st, uint64_t hash)
+{
+	char* cache_path = (char*)malloc(strlen(path) + 7);
+	sprintf(cache_path, "%s.cache", path);
+	FILE* f = fopen(cache_path, "rb");
+	free(cache_path);
+	if (!f)
+		return false;
+
+	MeshCacheHeader hdr;
+	if (fread(&hdr, sizeof(MeshCacheHeader), 1, f) != 1 ||
+		memcmp(hdr.magic, "AKMC", 4) || hdr.version != MESH_CACHE_VERSION ||
+		hdr.src_size != (uint64_t)st->st_size || hdr.src_hash != hash ||
+		hdr.verts < 0 || hdr.faces < 0 || hdr.lines < 0)
+	{
+		fclose(f);
+		return false;
+	}
+
+	size_t size = BakeSize(hdr.verts, hdr.faces + hdr.lines);
+	void* block = 0;
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	struct stat cst;
+	if (fstat(fileno(f), &cst) == 0 && (uint64_t)cst.st_size == sizeof(MeshCacheHeader) + size)
+	{
+		// header size keeps arrays aligned
+		void* map = mmap(0, sizeof(MeshCacheHeader) + size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED)
+		{
+			bake_map = sizeof(MeshCacheHeader) + size;
+			block = (MeshCacheHeader*)map + 1;
+		}
+	}
+#endif
+
+	if (!block)
+	{
+		block = malloc(size);
+		if (fread(block, 1, size, f) != size)
+		{
+			free(block);
+			fclose(f);
+			return false;
+		}
+	}
+
+	fclose(f);
+
+	bake = block;
+	verts = hdr.verts;
+	faces = hdr.faces;
+	lines = hdr.lines;
+	memcpy(bbox, hdr.bbox, sizeof(float[6]));
+	SetBake(bake);
+
+	// don't trust indices
+	for (int i = 0; i < 3 * (faces + lines); i++)
+	{
+		if (bake_abc[i] < 0 || bake_abc[i] >= verts)
+		{
+			Clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Mesh::SaveCache(const char* path, const struct stat* st, uint64_t hash)
+{
+	MeshCacheHeader hdr;
+	memset(&hdr, 0, sizeof(MeshCacheHeader));
+	memcpy(hdr.magic, "AKMC", 4);
+	hdr.version = MESH_CACHE_VERSION;
+	hdr.src_size = (uint64_t)st->st_size;
+	hdr.src_hash = hash;
+	hdr.verts = verts;
+	hdr.faces = faces;
+	hdr.lines = lines;
+	memcpy(hdr.bbox, bbox, sizeof(float[6]));
+
+	// write aside then replace, others may have old one mapped
+	// temp is unique per process and mesh, game & server may bake same file at once
+	#ifdef _WIN32
+	int pid = _getpid();
+	#else
+	int pid = getpid();
+	#endif
+
+	char* cache_path = (char*)malloc(2 * strlen(path) + 64);
+	char* temp_path = cache_path + strlen(path) + 7;
+	sprintf(cache_path, "%s.cache", path);
+	sprintf(temp_path, "%s.cache~%d.%p", path, pid, (void*)this);
+
+	FILE* f = fopen(temp_path, "wb");
+	if (f)
+	{
+		size_t size = BakeSize(verts, faces + lines);
+		bool ok = fwrite(&hdr, sizeof(MeshCacheHeader), 1, f) == 1 && fwrite(bake, 1, size, f) == size;
+		ok = fclose(f) == 0 && ok;
+
+		// rename doesn't replace on windows
+		if (ok && rename(temp_path, cache_path) != 0)
+		{
+			remove(cache_path);
+			ok = rename(temp_path, cache_path) == 0;
+		}
+
+		if (!ok)
+			remove(temp_path);
+	}
+
+	free(cache_path);
+}
+
+bool Mesh::ParsePLY(const char* path)
+{
+	if (strstr(path,".akm"))
+	{
+		int bio = 1;
+	}
+    FILE* f = fopen(path,"rt");
+	if (!f)
+		return false;
+
+	int plannar = 0x7 | 0x8;
+
+	char buf[1024];
+	char tail_str[1024];
+
+	int num_verts = -1;
+	int num_faces = -1;
+	int element = 0;
+
+	bool face_props = false;
+	int vert_props = 0;
+
+	// file header
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+
+		if (strcmp(buf, "ply"))
+		{
+			fclose(f);
+			return false;
+		}
+		else
+			break;
+	}
+
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+		if (strcmp(buf, "format ascii 1.0"))
+		{
+			fclose(f);
+			return false;
+		}
+		else
+			break;
+	}
+
+	// mesh header
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
+			continue;
+
+		if (strncmp(buf, "element vertex ",15) == 0)
+		{
+			if (num_verts >= 0)
+			{
+				fclose(f);
+				return false;
+			}
+
+			if (sscanf(buf+15, "%d", &num_verts) != 1 || num_verts < 0)
+			{
+				fclose(f);
+				return false;
+			}
+
+			element = 'V';
+
+			continue;
+		}
+
+		if (strncmp(buf, "element face ",13) == 0)
+		{
+			if (num_faces >= 0)
+			{
+				fclose(f);
+				return false;
+			}
+
+			if (sscanf(buf+13, "%d", &num_faces) != 1 || num_faces < 0)
+			{
+				fclose(f);
+				return false;
+			}
+
+			element = 'F';
+
+			continue;
+		}
+
+		if (strncmp(buf, "property ", 9) == 0)
+		{
+			if (element == 'F')
+			{
+				if (strcmp(buf + 9, "list uchar uint vertex_indices") != 0)
+				{
+					fclose(f);
+					return false;
+				}
+
+				face_props = true;
+				continue;
+			}
+			else
+			if (element == 'V')
+			{
+				static const char* match[] = 
+				{
+					"property float x",
+					"property float y",
+					"property float z",
+					"property uchar red",
+					"property uchar green",
+					"property uchar blue",
+					"property uchar alpha",
+					0
+				};
+
+				if (!match[vert_props] || strcmp(buf,match[vert_props]) != 0)
+				{
+					fclose(f);
+					return false;
+				}
+
+				vert_props++;
+				continue;
+			}
+			else
+			{
+				fclose(f);
+				return false;
+			}
+		}
+
+		if (strcmp(buf, "end_header") == 0)
+		{
+			if (num_faces <= 0 || num_verts <= 0 || !face_props || vert_props != 3 && vert_props != 7)
+			{
+				fclose(f);
+				return false;
+			}
+			break;
+		}
+		else
+		{
+			fclose(f);
+			return false;
+		}
+	}
+
+	Vert** index = (Vert**)malloc(sizeof(Vert*)*num_verts);
+
+	// verts
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
+			continue;
+
+		float x=0, y=0, z=0;
+		int r=255, g=255, b=255, a=255;
+		if (vert_props == 3)
+		{
+			if (sscanf(buf, "%f %f %f %s", &x, &y, &z, tail_str) != 3)
+			{
+				free(index);
+				fclose(f);
+				return false;
+			}
+		}
+		else
+		{
+			if (sscanf(buf, "%f %f %f %d %d %d %d %s", &x, &y, &z, &r, &g, &b, &a, tail_str) != 7)
+			{
+				free(index);
+				fclose(f);
+				return false;
+			}
+		}
+
+		Vert* v = (Vert*)malloc(sizeof(Vert));
+		index[verts] = v;
+
+		v->xyzw[0] = x;
+		v->xyzw[1] = y;
+		v->xyzw[2] = z;
+		v->xyzw[3] = 1;
+		v->rgba[0] = r;
+		v->rgba[1] = g;
+		v->rgba[2] = b;
+		v->rgba[3] = a;
+
+		if (verts && plannar)
+		{
+			if (plannar & 1)
+			{
+				if (v->xyzw[0] != head_vert->xyzw[0])
+					plannar &= ~1;
+			}
+			if (plannar & 2)
+			{
+				if (v->xyzw[1] != head_vert->xyzw[1])
+					plannar &= ~2;
+			}
+			if (plannar & 4)
+			{
+				if (v->xyzw[2] != head_vert->xyzw[2])
+					plannar &= ~4;
+			}
+			if (plannar & 8)
+			{
+				if (v->rgba[0] != head_vert->rgba[0] ||
+					v->rgba[1] != head_vert->rgba[1] ||
+					v->rgba[2] != head_vert->rgba[2])
+				{
+					plannar &= ~8;
+				}
+			}
+		}
+
+		v->mesh = this;
+		v->face_list = 0;
+		v->line_list = 0;
+		v->next = 0;
+		v->prev = tail_vert;
+		if (tail_vert)
+			tail_vert->next = v;
+		else
+			head_vert = v;
+		tail_vert = v;
+
+		if (!verts)
+		{
+			bbox[0] = v->xyzw[0];
+			bbox[1] = v->xyzw[0];
+			bbox[2] = v->xyzw[1];
+			bbox[3] = v->xyzw[1];
+			bbox[4] = v->xyzw[2];
+			bbox[5] = v->xyzw[2];
+		}
+		else
+		{
+			bbox[0] = fminf(bbox[0], v->xyzw[0]);
+			bbox[1] = fmaxf(bbox[1], v->xyzw[0]);
+			bbox[2] = fminf(bbox[2], v->xyzw[1]);
+			bbox[3] = fmaxf(bbox[3], v->xyzw[1]);
+			bbox[4] = fminf(bbox[4], v->xyzw[2]);
+			bbox[5] = fmaxf(bbox[5], v->xyzw[2]);
+		}
+
+		v->sel = false;
+
+		verts++;
+
+		if (verts == num_verts)
+			break;
+	}
+
+	// faces
+    int polys=0;
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len] == ' ' || buf[len] == '\r' || buf[len] == '\n' || buf[len] == '\t' || buf[len] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
+			continue;
+
+        int vv[4];
+		int n;
+
+		if (sscanf(buf, "%d %d %d %d %d %s", &n, vv+0,  vv+1,  vv+2,  vv+3, tail_str) < 3 || 
+			n != 2 && n != 3 && n != 4 && n != -3 && n != -4)
+		{
+ 			free(index);
+			fclose(f);
+			return false;
+		}
+
+		// FREESTYLE
+		bool freestyle = false;
+		if (n<0)
+		{
+			freestyle = true;
+			n=-n;
+		}
+
+		if (n>2)
+		{
+			for (int v1=0; v1<n; v1++)
+			{
+				if (vv[v1]<0 || vv[v1]>=num_verts)
+				{
+					free(index);
+					fclose(f);
+					return false;            
+				}  
+
+				if (v1==n-1)
+					break;
+
+				for (int v2=v1+1; v2<n; v2++)
+				{
+					if (vv[v1]==vv[v2])
+					{
+						free(index);
+						fclose(f);
+						return false;            
+					}            
+				}
+			}
+		
+			////////////////
+			for (int t=0; t<n-2; t++)
+			{
+				Face* f = (Face*)malloc(sizeof(Face));
+
+				int abc[3] = { vv[0],vv[t+1],vv[t+2] };
+
+				f->visual = freestyle ? (1<<30) : 0; // highest bit is line, next is freestyle
+				f->mesh = this;
+				f->freestyle = freestyle;
+
+				f->next = 0;
+				f->prev = tail_face;
+				if (tail_face)
+					tail_face->next = f;
+				else
+					head_face = f;
+				tail_face = f;
+
+				for (int i = 0; i < 3; i++)
+				{
+					f->abc[i] = index[abc[i]];
+					f->share_next[i] = f->abc[i]->face_list;
+					f->abc[i]->face_list = f;
+				}
+
+				faces++;
+			}
+		}
+		else
+		if (n==2)
+		{
+			if (vv[0]<0 || vv[0]>=num_verts || 
+				vv[1]<0 || vv[1]>=num_verts ||
+				vv[0] == vv[1])
+			{
+				free(index);
+				fclose(f);
+				return false;            
+			}  
+
+			Line* l = (Line*)malloc(sizeof(Line));
+			l->ab[0] = index[vv[0]];
+			l->ab[1] = index[vv[1]];
+
+			l->visual = freestyle ? (3<<30) : (2<<30); // highest bit is line, next is freestyle
+			l->mesh = this;
+
+			l->next = 0;
+			l->prev = tail_line;
+			if (tail_line)
+				tail_line->next = l;
+			else
+				head_line = l;
+			tail_line = l;
+
+			lines++;
+		}
+		
+        polys++;
+        if (polys == num_faces)
+			break;
+	}
+
+	free(index);
+
+	// tail
+	while (fgets(buf, 1024, f))
+	{
+		int len = (int)strlen(buf);
+		while (len && (buf[len] == ' ' || buf[len] == '\r' || buf[len] == '\n' || buf[len] == '\t' || buf[len] == '\v'))
+			len--;
+		if (!len)
+			continue;
+		buf[len] = 0;
+
+		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
+			continue;
+
+		fclose(f);
+		return false;
+	}
+
+#if 0
+	// OLD .obj parser
+	
+	// first pass - scan all verts
+	while (fgets(buf,1024,f))
+    {
+        // note: on every char check for # or \n or \r or 0 -> end of line
+
+        char* p = buf;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (*p=='#' || *p=='\r' || *p=='\n' || *p=='\0')
+            continue;
+
+        if (p[0] != 'v' || p[1] != ' ')
+            continue;
+
+        p += 2;
+
+		float xyzw[4];
+		float rgb[4];
+
+		// expect 6-7 floats 
+		// xyz rgb
+		// xyzw rgb
+		int coords = sscanf(p, "%f %f %f %f %f %f %f", xyzw + 0, xyzw + 1, xyzw + 2, xyzw + 3, rgb+0, rgb+1, rgb+2);
+		if (coords < 2)
+			continue;
+
+		if (coords < 3)
+		{
+			xyzw[2] = 0.0f;
+			xyzw[3] = 1.0f;
+			rgb[0] = rgb[1] = rgb[2] = 1.0f;
+		}
+		else
+		if (coords < 4)
+		{
+			xyzw[3] = 1.0f;
+			rgb[0] = rgb[1] = rgb[2] = 1.0f;
+		}
+		else
+		if (coords < 6)
+			rgb[0] = rgb[1] = rgb[2] = 1.0f;
+		else
+		if (coords < 7)
+		{
+			rgb[2] = rgb[1];
+			rgb[1] = rgb[0];
+			rgb[0] = xyzw[3];
+			xyzw[3] = 1.0f;
+		}
+
+        Vert* v = (Vert*)malloc(sizeof(Vert));
+        v->xyzw[0] = xyzw[0];
+        v->xyzw[1] = xyzw[1];
+        v->xyzw[2] = xyzw[2];
+        v->xyzw[3] = xyzw[3];
+		v->rgb[0] = rgb[0];
+		v->rgb[1] = rgb[1];
+		v->rgb[2] = rgb[2];
+
+        if (m->verts && plannar)
+        {
+            if (plannar&1)
+            {
+                if (v->xyzw[0] != m->head_vert->xyzw[0])
+                    plannar &= ~1;
+            }
+            if (plannar&2)
+            {
+                if (v->xyzw[1] != m->head_vert->xyzw[1])
+                    plannar &= ~2;
+            }
+            if (plannar&4)
+            {
+                if (v->xyzw[2] != m->head_vert->xyzw[2])
+                    plannar &= ~4;
+            }
+			if (plannar & 8)
+			{
+				if (v->rgb[0] != m->head_vert->rgb[0] ||
+					v->rgb[1] != m->head_vert->rgb[1] ||
+					v->rgb[2] != m->head_vert->rgb[2])
+				{
+					plannar &= ~8;
+				}
+			}
+        }
+
+        v->mesh = m;
+        v->face_list = 0;
+        v->line_list = 0;
+        v->next = 0;
+        v->prev = m->tail_vert;
+        if (m->tail_vert)
+            m->tail_vert->next = v;
+        else
+            m->head_vert = v;
+        m->tail_vert = v;
+
+        if (!m->verts)
+        {
+            m->bbox[0] = v->xyzw[0];
+            m->bbox[1] = v->xyzw[0];
+            m->bbox[2] = v->xyzw[1];
+            m->bbox[3] = v->xyzw[1];
+            m->bbox[4] = v->xyzw[2];
+            m->bbox[5] = v->xyzw[2];
+        }
+        else
+        {
+            m->bbox[0] = fminf( m->bbox[0] , v->xyzw[0] );
+            m->bbox[1] = fmaxf( m->bbox[1] , v->xyzw[0] );
+            m->bbox[2] = fminf( m->bbox[2] , v->xyzw[1] );
+            m->bbox[3] = fmaxf( m->bbox[3] , v->xyzw[1] );
+            m->bbox[4] = fminf( m->bbox[4] , v->xyzw[2] );
+            m->bbox[5] = fmaxf( m->bbox[5] , v->xyzw[2] );
+        }
+
+        v->sel = false;
+        m->verts++;
+    }
+
+    if (m->verts)
+    {
+        Vert** index = (Vert**)malloc(sizeof(Vert*)*m->verts);
+        Vert* v = m->head_vert;
+        for (int i=0; i<m->verts; i++)
+        {
+            index[i] = v;
+            v = v->next;
+        }
+
+        fseek(f,0,SEEK_SET);
+
+        int verts = 0;
+
+        while (fgets(buf,1024,f))
+        {
+            char* p = buf;
+            while (*p == ' ' || *p == '\t')
+                p++;
+
+            if (*p=='#' || *p=='\r' || *p=='\n' || *p=='\0')
+                continue;
+
+            if (p[1] != ' ')
+                continue;
+
+            int cmd = p[0];
+            if (cmd == 'f' || cmd == 'l')
+            {
+                p += 2;
+
+                // we assume it is 'f' is fan 'l" is linestrip
 
-	int plannar = 0x7 | 0x8;
+                int num = 0;
+                int abc[3];
+                char* end;
 
-	char buf[1024];
-	char tail_str[1024];
+                while (abc[num]=(int)strtol(p,&end,0))
+                {
+                    if (abc[num] > 0)
+                        abc[num] -= 1;
+                    else
+                        abc[num] += verts;
 
-	int num_verts = -1;
-	int num_faces = -1;
-	int element = 0;
+                    if (abc[num] >= 0 && abc[num] < m->verts)
+                    {
+                        if (cmd == 'f')
+                        {
+                            if (num<2)
+                                num++;
+                            else
+                            {
+                                // add face
+                                Face* f = (Face*)malloc(sizeof(Face));
 
-	bool face_props = false;
-	int vert_props = 0;
+                                f->visual = 0;
+                                f->mesh = m;
 
-	// file header
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+                                f->next = 0;
+                                f->prev = m->tail_face;
+                                if (m->tail_face)
+                                    m->tail_face->next = f;
+                                else
+                                    m->head_face = f;
+                                m->tail_face = f;
 
+                                for (int i=0; i<3; i++)
+                                {
+                                    f->abc[i] = index[abc[i]];
+                                    f->share_next[i] = f->abc[i]->face_list;
+                                    f->abc[i]->face_list = f;
+                                }
 
-		if (strcmp(buf, "ply"))
-		{
-			fclose(f);
-			return false;
-		}
-		else
-			break;
-	}
+                                m->faces++;
 
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+                                abc[1] = abc[2];
+                            }
+                        }
+                        else
+                        if (cmd == 'l')
+                        {
+                            if (num<1)
+                                num++;
+                            else
+                            {
+                                // add line
+                                Line* l = (Line*)malloc(sizeof(Line));
 
-		if (strcmp(buf, "format ascii 1.0"))
-		{
-			fclose(f);
-			return false;
-		}
-		else
-			break;
-	}
+                                l->visual = 0;
+                                l->mesh = m;
 
-	// mesh header
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+                                l->next = 0;
+                                l->prev = m->tail_line;
+                                if (m->tail_line)
+                                    m->tail_line->next = l;
+                                else
+                                    m->head_line = l;
+                                m->tail_line = l;
 
-		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
-			continue;
+                                for (int i=0; i<2; i++)
+                                {
+                                    l->ab[i] = index[abc[i]];
+                                    l->share_next[i] = l->ab[i]->line_list;
+                                    l->ab[i]->line_list = l;
+                                }
 
-		if (strncmp(buf, "element vertex ",15) == 0)
-		{
-			if (num_verts >= 0)
-			{
-				fclose(f);
-				return false;
-			}
+                                m->lines++;
 
-			if (sscanf(buf+15, "%d", &num_verts) != 1 || num_verts < 0)
-			{
-				fclose(f);
-				return false;
-			}
+                                abc[0] = abc[1];
+                            }
+                        }
+                        
+                    }
 
-			element = 'V';
+                    p = end;
 
-			continue;
-		}
+                    // looking for space,digit
+                    while (*p!='#' && *p!='\r' && *p!='\n' && *p!='\0')
+                    {
+                        if ((p[0]==' ' || p[0]=='\t') && (p[1]=='-' || p[1]=='+' || p[1]>='0' && p[1]<='9'))
+                        {
+                            end = 0;
+                            break;
+                        }
+                        p++;
+                    }
 
-		if (strncmp(buf, "element face ",13) == 0)
-		{
-			if (num_faces >= 0)
-			{
-				fclose(f);
-				return false;
-			}
+                    if (end)
+                        break;
 
-			if (sscanf(buf+13, "%d", &num_faces) != 1 || num_faces < 0)
-			{
-				fclose(f);
-				return false;
-			}
+                    p++;
+                }
+            }
+            else
+            if (cmd == 'v')
+            {
+                p += 2;
+                // expect 2-4 floats, ignore 4th if present
+                float xyzw[4];
+                int coords = sscanf(p,"%f %f %f %f", xyzw+0, xyzw+1, xyzw+2, xyzw+3);
+                if (coords<2)
+                    continue;
 
-			element = 'F';
+                // needed for relative indices
+                verts++;
+            }
+        }
 
-			continue;
-		}
+        free(index);
+    }
+	#endif // OLD .obj parser
 
-		if (strncmp(buf, "property ", 9) == 0)
-		{
-			if (element == 'F')
-			{
-				if (strcmp(buf + 9, "list uchar uint vertex_indices") != 0)
-				{
-					fclose(f);
-					return false;
-				}
+    fclose(f);
+    return true;
+}
 
-				face_props = true;
-				continue;
-			}
-			else
-			if (element == 'V')
-			{
-				static const char* match[] = 
-				{
-					"property float x",
-					"property float y",
-					"property float z",
-					"property uchar red",
-					"property uchar green",
-					"property uchar blue",
-					"property uchar alpha",
-					0
-				};
+Mesh* World::LoadMesh(const char* path, const char* name)
+{
+    Mesh* m = AddMesh(name ? name : path);
 
-				if (!match[vert_props] || strcmp(buf,match[vert_props]) != 0)
-				{
-					fclose(f);
-					return false;
-				}
+    if (!m->Update(path))
+    {
+        DeleteMesh(m);
+        return 0;
+    }
 
-				vert_props++;
-				continue;
-			}
-			else
-			{
-				fclose(f);
-				return false;
-			}
-		}
+    return m;
+}
+
+World* CreateWorld()
+{
+    World* w = (World*)malloc(sizeof(World));
+
+    w->meshes = 0;
+    w->head_mesh = 0;
+    w->tail_mesh = 0;
+    w->insts = 0;
+	w->temp_insts = 0;
+    w->head_inst = 0;
+    w->tail_inst = 0;
+    w->editable = 0;
+    w->root = 0;
+	w->flat = 0;
+	w->lazy = 0;
+	w->cells = 0;
+	w->head_cell = 0;
+	memset(w->cell_hash, 0, sizeof(w->cell_hash));
+	w->dirty[0] = 1;
+	w->dirty[1] = 0;
 
-		if (strcmp(buf, "end_header") == 0)
-		{
-			if (num_faces <= 0 || num_verts <= 0 || !face_props || vert_props != 3 && vert_props != 7)
-			{
-				fclose(f);
-				return false;
-			}
-			break;
-		}
-		else
-		{
-			fclose(f);
-			return false;
-		}
-	}
+    return w;
+}
 
-	Vert** index = (Vert**)malloc(sizeof(Vert*)*num_verts);
+void DeleteWorld(World* w)
+{
+    if (!w)
+        return;
 
-	// verts
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == '\t' || buf[len - 1] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+    // killing bsp brings all instances to world list
 
-		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
-			continue;
+	w->DropFlat();
 
-		float x=0, y=0, z=0;
-		int r=255, g=255, b=255, a=255;
-		if (vert_props == 3)
+	delete_item_list = 0;
+	delete_sprite_list = 0;
+
+	// flat first
+	Inst* i = w->head_inst;
+	while (i)
+	{
+		if (i->inst_type == Inst::INST_TYPE::ITEM)
 		{
-			if (sscanf(buf, "%f %f %f %s", &x, &y, &z, tail_str) != 3)
+			Item* item = ((ItemInst*)i)->item;
+			if (/*all || */item->purpose == Item::WORLD)
 			{
-				free(index);
-				fclose(f);
-				return false;
+				item->proto = (ItemProto*)delete_item_list;
+				delete_item_list = item;
 			}
 		}
 		else
+		if (i->inst_type == Inst::INST_TYPE::SPRITE)
 		{
-			if (sscanf(buf, "%f %f %f %d %d %d %d %s", &x, &y, &z, &r, &g, &b, &a, tail_str) != 7)
-			{
-				free(index);
-				fclose(f);
-				return false;
-			}
+			SpriteInst* si = (SpriteInst*)i;
+			si->sprite = (Sprite*)delete_sprite_list;
+			delete_sprite_list = si;
 		}
 
-		Vert* v = (Vert*)malloc(sizeof(Vert));
-		index[verts] = v;
+		i = i->next;
+	}
 
-		v->xyzw[0] = x;
-		v->xyzw[1] = y;
-		v->xyzw[2] = z;
-		v->xyzw[3] = 1;
-		v->rgba[0] = r;
-		v->rgba[1] = g;
-		v->rgba[2] = b;
-		v->rgba[3] = a;
+	if (w->root)
+	{
+		DeleteItemInsts(w->root, true); // prepares list only
+	}
 
-		if (verts && plannar)
-		{
-			if (plannar & 1)
-			{
-				if (v->xyzw[0] != head_vert->xyzw[0])
-					plannar &= ~1;
-			}
-			if (plannar & 2)
-			{
-				if (v->xyzw[1] != head_vert->xyzw[1])
-					plannar &= ~2;
-			}
-			if (plannar & 4)
-			{
-				if (v->xyzw[2] != head_vert->xyzw[2])
-					plannar &= ~4;
-			}
-			if (plannar & 8)
-			{
-				if (v->rgba[0] != head_vert->rgba[0] ||
-					v->rgba[1] != head_vert->rgba[1] ||
-					v->rgba[2] != head_vert->rgba[2])
-				{
-					plannar &= ~8;
-				}
-			}
-		}
+	for (BSP_Cell* c = w->head_cell; c; c = c->next)
+		DeleteItemInsts(c, true);
 
-		v->mesh = this;
-		v->face_list = 0;
-		v->line_list = 0;
-		v->next = 0;
-		v->prev = tail_vert;
-		if (tail_vert)
-			tail_vert->next = v;
-		else
-			head_vert = v;
-		tail_vert = v;
+	Item* item = delete_item_list;
+	while (item)
+	{
+		Item* n = (Item*)item->proto;
+		DestroyItem(item); // destroys inst too!!!
+		item = n;
+	}
 
-		if (!verts)
-		{
-			bbox[0] = v->xyzw[0];
-			bbox[1] = v->xyzw[0];
-			bbox[2] = v->xyzw[1];
-			bbox[3] = v->xyzw[1];
-			bbox[4] = v->xyzw[2];
-			bbox[5] = v->xyzw[2];
-		}
-		else
-		{
-			bbox[0] = fminf(bbox[0], v->xyzw[0]);
-			bbox[1] = fmaxf(bbox[1], v->xyzw[0]);
-			bbox[2] = fminf(bbox[2], v->xyzw[1]);
-			bbox[3] = fmaxf(bbox[3], v->xyzw[1]);
-			bbox[4] = fminf(bbox[4], v->xyzw[2]);
-			bbox[5] = fmaxf(bbox[5], v->xyzw[2]);
-		}
+	////////////////////////////////////////////////
+	// sprite insts
 
-		v->sel = false;
+	if (w->root)
+		DeleteSpriteInsts(w->root);
 
-		verts++;
+	for (BSP_Cell* c = w->head_cell; c; c = c->next)
+		DeleteSpriteInsts(c);
 
-		if (verts == num_verts)
-			break;
+	SpriteInst* si = delete_sprite_list;
+	while (si)
+	{
+		SpriteInst* n = (SpriteInst*)si->sprite;
+		DeleteInst(si);
+		si = n;
 	}
 
-	// faces
-    int polys=0;
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len] == ' ' || buf[len] == '\r' || buf[len] == '\n' || buf[len] == '\t' || buf[len] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+	if (w->root)
+		w->DeleteBSP(w->root);
 
-		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
-			continue;
+	w->root = 0;
 
-        int vv[4];
-		int n;
+    // killing all meshes should kill all insts as well
+    while (w->meshes)
+        w->DelMesh(w->head_mesh);
 
-		if (sscanf(buf, "%d %d %d %d %d %s", &n, vv+0,  vv+1,  vv+2,  vv+3, tail_str) < 3 || 
-			n != 2 && n != 3 && n != 4 && n != -3 && n != -4)
-		{
- 			free(index);
-			fclose(f);
-			return false;
-		}
+	if (w->lazy)
+		DeleteWorldFile(w->lazy);
 
-		// FREESTYLE
-		bool freestyle = false;
-		if (n<0)
-		{
-			freestyle = true;
-			n=-n;
-		}
+	free(w);
+}
 
-		if (n>2)
-		{
-			for (int v1=0; v1<n; v1++)
-			{
-				if (vv[v1]<0 || vv[v1]>=num_verts)
-				{
-					free(index);
-					fclose(f);
-					return false;            
-				}  
+Mesh* LoadMesh(World* w, const char* path, const char* name)
+{
+    if (!w)
+        return 0;
+    return w->LoadMesh(path, name);
+}
 
-				if (v1==n-1)
-					break;
+bool UpdateMesh(Mesh* m, const char* path)
+{
+    return m->Update(path);
+}
 
-				for (int v2=v1+1; v2<n; v2++)
-				{
-					if (vv[v1]==vv[v2])
-					{
-						free(index);
-						fclose(f);
-						return false;            
-					}            
-				}
-			}
-		
-			////////////////
-			for (int t=0; t<n-2; t++)
-			{
-				Face* f = (Face*)malloc(sizeof(Face));
+void DeleteMesh(Mesh* m)
+{
+    if (!m)
+        return;
+    m->world->DelMesh(m);
+}
 
-				int abc[3] = { vv[0],vv[t+1],vv[t+2] };
+Inst* CreateInst(Mesh* m, int flags, const double tm[16], const char* name, int story_id)
+{
+    if (!m)
+        return 0;
+    return m->world->AddInst(m,flags,tm,name,story_id);
+}
 
-				f->visual = freestyle ? (1<<30) : 0; // highest bit is line, next is freestyle
-				f->mesh = this;
-				f->freestyle = freestyle;
+Inst* CreateInst(World* w, Sprite* s, int flags, float pos[3], float yaw, int anim, int frame, int reps[4], const char* name, int story_id)
+{
+	if (!s)
+		return 0;
+	return w->AddInst(s, flags, pos, yaw, anim, frame, reps, name, story_id);
+}
+
+Inst* CreateInst(World* w, Item* item, int flags, float pos[3], float yaw, int story_id)
+{
+	if (!item)
+		return 0;
+	return w->AddInst(item, flags, pos, yaw, story_id);
+}
 
-				f->next = 0;
-				f->prev = tail_face;
-				if (tail_face)
-					tail_face->next = f;
-				else
-					head_face = f;
-				tail_face = f;
+void DeleteInst(Inst* i)
+{
+    if (!i)
+        return;
+	if (i->inst_type == Inst::INST_TYPE::MESH)
+		((MeshInst*)i)->mesh->world->DelInst(i);
+	else
+	if (i->inst_type == Inst::INST_TYPE::SPRITE)
+		((SpriteInst*)i)->w->DelInst(i);
+	else
+	if (i->inst_type == Inst::INST_TYPE::ITEM)
+		((ItemInst*)i)->w->DelInst(i);
+}
 
-				for (int i = 0; i < 3; i++)
-				{
-					f->abc[i] = index[abc[i]];
-					f->share_next[i] = f->abc[i]->face_list;
-					f->abc[i]->face_list = f;
-				}
+bool TakeWorldDirty(World* w, double bbox[6])
+{
+	if (!w || w->dirty[0] > w->dirty[1])
+		return false;
+	memcpy(bbox, w->dirty, sizeof(double[6]));
+	w->dirty[0] = 1;
+	w->dirty[1] = 0;
+	return true;
+}
 
-				faces++;
-			}
-		}
-		else
-		if (n==2)
-		{
-			if (vv[0]<0 || vv[0]>=num_verts || 
-				vv[1]<0 || vv[1]>=num_verts ||
-				vv[0] == vv[1])
-			{
-				free(index);
-				fclose(f);
-				return false;            
-			}  
+bool GetWorldDirty(World* w)
+{
+	return w && w->dirty[0] <= w->dirty[1];
+}
 
-			Line* l = (Line*)malloc(sizeof(Line));
-			l->ab[0] = index[vv[0]];
-			l->ab[1] = index[vv[1]];
+void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void* cookie, WorldQuery* wq)
+{
+    if (!w)
+        return;
+    WorldQuery tmp = { 0 };
+    w->Query(planes,plane,cb,cookie,wq ? wq : &tmp);
+}
 
-			l->visual = freestyle ? (3<<30) : (2<<30); // highest bit is line, next is freestyle
-			l->mesh = this;
+void QueryWorldBSP(World* w, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
+{
+    if (!w || !w->root)
+        return;
+    World::QueryBSP(1, w->root,planes,plane,cb,cookie);
+}
 
-			l->next = 0;
-			l->prev = tail_line;
-			if (tail_line)
-				tail_line->next = l;
-			else
-				head_line = l;
-			tail_line = l;
 
-			lines++;
-		}
-		
-        polys++;
-        if (polys == num_faces)
-			break;
-	}
+Mesh* GetFirstMesh(World* w)
+{
+    if (!w)
+        return 0;
+    return w->head_mesh;
+}
 
-	free(index);
+Mesh* GetLastMesh(World* w)
+{
+    if (!w)
+        return 0;
+    return w->tail_mesh;
+}
 
-	// tail
-	while (fgets(buf, 1024, f))
-	{
-		int len = (int)strlen(buf);
-		while (len && (buf[len] == ' ' || buf[len] == '\r' || buf[len] == '\n' || buf[len] == '\t' || buf[len] == '\v'))
-			len--;
-		if (!len)
-			continue;
-		buf[len] = 0;
+Mesh* GetPrevMesh(Mesh* m)
+{
+    if (!m)
+        return 0;
+    return m->prev;
+}
 
-		if (strncmp(buf, "comment", 7) == 0 && (buf[7] == 0 || buf[7] == ' ' || buf[7] == '\t' || buf[7] == '\r' || buf[7] == '\n'))
-			continue;
+Mesh* GetNextMesh(Mesh* m)
+{
+    if (!m)
+        return 0;
+    return m->next;
+}
 
-		fclose(f);
-		return false;
-	}
+World* GetMeshWorld(Mesh* m)
+{
+	return m->world;
+}
 
-#if 0
-	// OLD .obj parser
-	
-	// first pass - scan all verts
-	while (fgets(buf,1024,f))
+int GetMeshName(Mesh* m, char* buf, int size)
+{
+    if (!m)
     {
-        // note: on every char check for # or \n or \r or 0 -> end of line
+        if (buf && size>0)
+            *buf=0;
+        return 0;
+    }
 
-        char* p = buf;
-        while (*p == ' ' || *p == '\t')
-            p++;
+    int len = (int)strlen(m->name);
 
-        if (*p=='#' || *p=='\r' || *p=='\n' || *p=='\0')
-            continue;
+    if (buf && size>0)
+        strncpy(buf,m->name,size);
 
-        if (p[0] != 'v' || p[1] != ' ')
-            continue;
+    return len+1;
+}
 
-        p += 2;
+void GetMeshBBox(Mesh* m, float bbox[6])
+{
+    if (!m || !bbox)
+        return;
 
-		float xyzw[4];
-		float rgb[4];
+    bbox[0] = m->bbox[0];
+    bbox[1] = m->bbox[1];
+    bbox[2] = m->bbox[2];
+    bbox[3] = m->bbox[3];
+    bbox[4] = m->bbox[4];
+    bbox[5] = m->bbox[5];
+}
 
-		// expect 6-7 floats 
-		// xyz rgb
-		// xyzw rgb
-		int coords = sscanf(p, "%f %f %f %f %f %f %f", xyzw + 0, xyzw + 1, xyzw + 2, xyzw + 3, rgb+0, rgb+1, rgb+2);
-		if (coords < 2)
-			continue;
+void QueryMesh(Mesh* m, void (*cb)(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie), void* cookie)
+{
+    if (!m || !cb)
+        return;
 
-		if (coords < 3)
-		{
-			xyzw[2] = 0.0f;
-			xyzw[3] = 1.0f;
-			rgb[0] = rgb[1] = rgb[2] = 1.0f;
-		}
-		else
-		if (coords < 4)
-		{
-			xyzw[3] = 1.0f;
-			rgb[0] = rgb[1] = rgb[2] = 1.0f;
-		}
-		else
-		if (coords < 6)
-			rgb[0] = rgb[1] = rgb[2] = 1.0f;
-		else
-		if (coords < 7)
+    float coords[9];
+	uint8_t colors[12];
+
+	const int* abc = m->bake_abc;
+	for (int f = 0; f < m->faces + m->lines; f++, abc += 3)
+	{
+		for (int i = 0; i < 3; i++)
 		{
-			rgb[2] = rgb[1];
-			rgb[1] = rgb[0];
-			rgb[0] = xyzw[3];
-			xyzw[3] = 1.0f;
+			memcpy(coords + 3 * i, m->bake_xyz + 3 * abc[i], sizeof(float[3]));
+			memcpy(colors + 4 * i, m->bake_rgba + 4 * abc[i], 4);
 		}
 
-        Vert* v = (Vert*)malloc(sizeof(Vert));
-        v->xyzw[0] = xyzw[0];
-        v->xyzw[1] = xyzw[1];
-        v->xyzw[2] = xyzw[2];
-        v->xyzw[3] = xyzw[3];
-		v->rgb[0] = rgb[0];
-		v->rgb[1] = rgb[1];
-		v->rgb[2] = rgb[2];
+        cb(coords, colors, m->bake_visual[f], cookie);
+	}
+}
 
-        if (m->verts && plannar)
-        {
-            if (plannar&1)
-            {
-                if (v->xyzw[0] != m->head_vert->xyzw[0])
-                    plannar &= ~1;
-            }
-            if (plannar&2)
-            {
-                if (v->xyzw[1] != m->head_vert->xyzw[1])
-                    plannar &= ~2;
-            }
-            if (plannar&4)
-            {
-                if (v->xyzw[2] != m->head_vert->xyzw[2])
-                    plannar &= ~4;
-            }
-			if (plannar & 8)
-			{
-				if (v->rgb[0] != m->head_vert->rgb[0] ||
-					v->rgb[1] != m->head_vert->rgb[1] ||
-					v->rgb[2] != m->head_vert->rgb[2])
-				{
-					plannar &= ~8;
-				}
-			}
-        }
+void QueryMesh(Mesh* m, void (*cb)(int verts, const float* xyz, const uint8_t* rgba, int faces, const int* abc, const uint32_t* visual, void* cookie), void* cookie)
+{
+    if (!m || !cb)
+        return;
+
+	cb(m->verts, m->bake_xyz, m->bake_rgba, m->faces + m->lines, m->bake_abc, m->bake_visual, cookie);
+}
+
+void* GetMeshCookie(Mesh* m)
+{
+    if (!m)
+        return 0;
+    return m->cookie;
+}
+
+void  SetMeshCookie(Mesh* m, void* cookie)
+{
+    if (m)
+        m->cookie = cookie;
+}
+
+void RebuildWorld(World* w, bool boxes)
+{
+    if (w)
+        w->Rebuild(boxes);
+}
 
-        v->mesh = m;
-        v->face_list = 0;
-        v->line_list = 0;
-        v->next = 0;
-        v->prev = m->tail_vert;
-        if (m->tail_vert)
-            m->tail_vert->next = v;
-        else
-            m->head_vert = v;
-        m->tail_vert = v;
 
-        if (!m->verts)
-        {
-            m->bbox[0] = v->xyzw[0];
-            m->bbox[1] = v->xyzw[0];
-            m->bbox[2] = v->xyzw[1];
-            m->bbox[3] = v->xyzw[1];
-            m->bbox[4] = v->xyzw[2];
-            m->bbox[5] = v->xyzw[2];
-        }
-        else
-        {
-            m->bbox[0] = fminf( m->bbox[0] , v->xyzw[0] );
-            m->bbox[1] = fmaxf( m->bbox[1] , v->xyzw[0] );
-            m->bbox[2] = fminf( m->bbox[2] , v->xyzw[1] );
-            m->bbox[3] = fmaxf( m->bbox[3] , v->xyzw[1] );
-            m->bbox[4] = fminf( m->bbox[4] , v->xyzw[2] );
-            m->bbox[5] = fmaxf( m->bbox[5] , v->xyzw[2] );
-        }
 
-        v->sel = false;
-        m->verts++;
-    }
+// file or memory, chunk payloads are built and parsed in memory
+struct WorldStream
+{
+	FILE* f;
 
-    if (m->verts)
-    {
-        Vert** index = (Vert**)malloc(sizeof(Vert*)*m->verts);
-        Vert* v = m->head_vert;
-        for (int i=0; i<m->verts; i++)
-        {
-            index[i] = v;
-            v = v->next;
-        }
+	uint8_t* buf; // written, grows
+	size_t size, cap;
 
-        fseek(f,0,SEEK_SET);
+	const uint8_t* ptr; // read
+	const uint8_t* end;
 
-        int verts = 0;
+	void Write(const void* src, size_t n)
+	{
+		if (f)
+		{
+			fwrite(src, 1, n, f);
+			return;
+		}
 
-        while (fgets(buf,1024,f))
-        {
-            char* p = buf;
-            while (*p == ' ' || *p == '\t')
-                p++;
+		if (size + n > cap)
+		{
+			cap = 2 * cap > size + n ? 2 * cap : size + n + 4096;
+			buf = (uint8_t*)realloc(buf, cap);
+		}
 
-            if (*p=='#' || *p=='\r' || *p=='\n' || *p=='\0')
-                continue;
+		memcpy(buf + size, src, n);
+		size += n;
+	}
 
-            if (p[1] != ' ')
-                continue;
+	bool Read(void* dst, size_t n)
+	{
+		if (f)
+			return fread(dst, 1, n, f) == n;
 
-            int cmd = p[0];
-            if (cmd == 'f' || cmd == 'l')
-            {
-                p += 2;
+		if (n > (size_t)(end - ptr))
+			return false;
 
-                // we assume it is 'f' is fan 'l" is linestrip
+		memcpy(dst, ptr, n);
+		ptr += n;
+		return true;
+	}
+};
 
-                int num = 0;
-                int abc[3];
-                char* end;
+static void SaveInst(Inst* inst, WorldStream* s)
+{
+	if (inst->flags & INST_FLAGS::INST_VOLATILE)
+		return;
 
-                while (abc[num]=(int)strtol(p,&end,0))
-                {
-                    if (abc[num] > 0)
-                        abc[num] -= 1;
-                    else
-                        abc[num] += verts;
+	if (inst->inst_type == Inst::INST_TYPE::MESH)
+	{
+		MeshInst* i = (MeshInst*)inst;
 
-                    if (abc[num] >= 0 && abc[num] < m->verts)
-                    {
-                        if (cmd == 'f')
-                        {
-                            if (num<2)
-                                num++;
-                            else
-                            {
-                                // add face
-                                Face* f = (Face*)malloc(sizeof(Face));
+		int mesh_id_len = i->mesh && i->mesh->name ? (int)strlen(i->mesh->name) : 0;
 
-                                f->visual = 0;
-                                f->mesh = m;
+		s->Write(&mesh_id_len, 4);
+		if (mesh_id_len)
+			s->Write(i->mesh->name, mesh_id_len);
 
-                                f->next = 0;
-                                f->prev = m->tail_face;
-                                if (m->tail_face)
-                                    m->tail_face->next = f;
-                                else
-                                    m->head_face = f;
-                                m->tail_face = f;
+		int inst_name_len = i->name ? (int)strlen(i->name) : 0;
 
-                                for (int i=0; i<3; i++)
-                                {
-                                    f->abc[i] = index[abc[i]];
-                                    f->share_next[i] = f->abc[i]->face_list;
-                                    f->abc[i]->face_list = f;
-                                }
+		s->Write(&inst_name_len, 4);
+		if (inst_name_len)
+			s->Write(i->name, inst_name_len);
 
-                                m->faces++;
+		s->Write(i->tm, 16 * 8);
+		s->Write(&i->flags, 4);
+		s->Write(&i->story_id, 4);
+	}
+	else
+	if (inst->inst_type == Inst::INST_TYPE::SPRITE)
+	{
+		SpriteInst* i = (SpriteInst*)inst;
 
-                                abc[1] = abc[2];
-                            }
-                        }
-                        else
-                        if (cmd == 'l')
-                        {
-                            if (num<1)
-                                num++;
-                            else
-                            {
-                                // add line
-                                Line* l = (Line*)malloc(sizeof(Line));
+		int mesh_id_len = -1; // identify sprite
+		s->Write(&mesh_id_len, 4);
 
-                                l->visual = 0;
-                                l->mesh = m;
+		// sprite id ???
+		// ...
 
-                                l->next = 0;
-                                l->prev = m->tail_line;
-                                if (m->tail_line)
-                                    m->tail_line->next = l;
-                                else
-                                    m->head_line = l;
-                                m->tail_line = l;
+		int inst_name_len = i->sprite->name ? (int)strlen(i->sprite->name) : 0;
 
-                                for (int i=0; i<2; i++)
-                                {
-                                    l->ab[i] = index[abc[i]];
-                                    l->share_next[i] = l->ab[i]->line_list;
-                                    l->ab[i]->line_list = l;
-                                }
+		s->Write(&inst_name_len, 4);
+		if (inst_name_len)
+			s->Write(i->sprite->name, inst_name_len);
+
+		s->Write(i->pos, sizeof(float[3]));
+		s->Write(&i->yaw, sizeof(float));
+		s->Write(&i->anim, sizeof(int));
+		s->Write(&i->frame, sizeof(int));
+		s->Write(&i->reps, sizeof(int[4]));
+		s->Write(&i->flags, 4);
+		s->Write(&i->story_id, 4);
+	}
+	else
+	if (inst->inst_type == Inst::INST_TYPE::ITEM)
+	{
+		// SAVE ONLY EDITOR INSTANCES !!!
+		ItemInst* i = (ItemInst*)inst;
 
-                                m->lines++;
+		// checked by inst flags
+		// if (i->item->purpose == Item::EDIT)
 
-                                abc[0] = abc[1];
-                            }
-                        }
-                        
-                    }
+		{
+			int mesh_id_len = -2; // identify item
+			s->Write(&mesh_id_len, 4);
 
-                    p = end;
+			// sprite id ???
+			// ...
 
-                    // looking for space,digit
-                    while (*p!='#' && *p!='\r' && *p!='\n' && *p!='\0')
-                    {
-                        if ((p[0]==' ' || p[0]=='\t') && (p[1]=='-' || p[1]=='+' || p[1]>='0' && p[1]<='9'))
-                        {
-                            end = 0;
-                            break;
-                        }
-                        p++;
-                    }
+			int item_proto_index = (int)(i->item->proto - item_proto_lib);
 
-                    if (end)
-                        break;
+			s->Write(&item_proto_index, 4);
 
-                    p++;
-                }
-            }
-            else
-            if (cmd == 'v')
-            {
-                p += 2;
-                // expect 2-4 floats, ignore 4th if present
-                float xyzw[4];
-                int coords = sscanf(p,"%f %f %f %f", xyzw+0, xyzw+1, xyzw+2, xyzw+3);
-                if (coords<2)
-                    continue;
+			s->Write(&i->item->count, sizeof(int));
 
-                // needed for relative indices
-                verts++;
-            }
-        }
+			s->Write(i->pos, sizeof(float[3]));
+			s->Write(&i->yaw, sizeof(float));
 
-        free(index);
+			s->Write(&i->flags, 4);
+			s->Write(&i->story_id, 4);
+		}
+	}
+}
+
+static void GatherInst(Inst* i, Inst** list, int* n)
+{
+	if (!(i->flags & INST_FLAGS::INST_VOLATILE))
+		list[(*n)++] = i;
+}
+
+static void GatherInsts(BSP* bsp, Inst** list, int* n)
+{
+    if (bsp->type == BSP::BSP_TYPE_LEAF)
+    {
+        Inst* i = ((BSP_Leaf*)bsp)->head;
+        while (i)
+        {
+            GatherInst(i,list,n);
+            i=i->next;
+        }
     }
-	#endif // OLD .obj parser
+    else
+    if (bsp->type == BSP::BSP_TYPE_INST)
+    {
+        Inst* i = (Inst*)bsp;
+        GatherInst(i,list,n);
+    }
+    else
+    if (bsp->type == BSP::BSP_TYPE_NODE)
+    {
+        BSP_Node* node = (BSP_Node*)bsp;
+        if (node->bsp_child[0])
+            GatherInsts(node->bsp_child[0],list,n);
+        if (node->bsp_child[1])
+            GatherInsts(node->bsp_child[1],list,n);
+    }
+    else
+    if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
+    {
+        BSP_NodeShare* s = (BSP_NodeShare*)bsp;
+        if (s->bsp_child[0])
+            GatherInsts(s->bsp_child[0],list,n);
+        if (s->bsp_child[1])
+            GatherInsts(s->bsp_child[1],list,n);
+        Inst* i = s->head;
+        while (i)
+        {
+            GatherInst(i,list,n);
+            i=i->next;
+        }
+    }
+    else
+    {
+        assert(0);
+    }
+}
+
+// chunked section (version -2), header is followed by loose insts (sprites & items,
+// few and owned by game logic, they are loaded at once), then by chunk directory and
+// chunk payloads, mesh insts are grouped into chunks by xy cell of their pivot
+#define WORLD_CHUNK_SHIFT 7 // 128x128 world units per chunk (16x16 terrain patches)
+
+struct WorldFileHeader
+{
+	uint32_t header_size;
+	uint32_t loose_insts;
+	uint32_t num_chunks;
+	uint32_t chunk_shift;
+	uint64_t data_size; // directory + payloads, world section ends right after
+};
+
+struct WorldFileChunk
+{
+	int32_t x, y; // worldspace pivot >> WORLD_CHUNK_SHIFT
+	float bbox[6]; // of its insts when saved, touching tests it
+	uint32_t insts;
+	uint32_t size; // payload bytes, SaveInst() records
+	uint64_t offset; // payload from directory start
+};
+
+struct WorldChunk
+{
+	WorldFileChunk fc;
+	bool loaded;
+	uint32_t stamp; // clock of last touch
+
+	int insts;
+	MeshInst** inst; // paged in, deleted on eviction
+};
+
+struct WorldFile
+{
+	void* map; // whole file if mmap'ed
+	size_t map_size;
+	uint8_t* buf; // or chunk data read to memory
+	const uint8_t* data; // directory start
+
+	int chunks;
+	WorldChunk* chunk;
+	int pending; // chunks not paged in
 
-    fclose(f);
-    return true;
-}
+	int budget; // max insts paged in, 0 -> no limit
+	int paged; // insts paged in now
+	uint32_t clock; // ticks on every touch
 
-Mesh* World::LoadMesh(const char* path, const char* name)
+	bool editor;
+	char* mesh_dir; // 0 -> meshes are caller's business
+};
+
+static void DeleteWorldFile(WorldFile* wf)
 {
-    Mesh* m = AddMesh(name ? name : path);
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	if (wf->map)
+		munmap(wf->map, wf->map_size);
+#endif
 
-    if (!m->Update(path))
-    {
-        DeleteMesh(m);
-        return 0;
-    }
+	for (int i = 0; i < wf->chunks; i++)
+	{
+		if (wf->chunk[i].inst)
+			free(wf->chunk[i].inst);
+	}
 
-    return m;
+	if (wf->buf)
+		free(wf->buf);
+	if (wf->chunk)
+		free(wf->chunk);
+	if (wf->mesh_dir)
+		free(wf->mesh_dir);
+	free(wf);
 }
 
-World* CreateWorld()
+// nothing left to page in or to reload after eviction, file is not needed anymore
+static void SettleWorldFile(World* w)
 {
-    World* w = (World*)malloc(sizeof(World));
+	if (!w->lazy->pending && !w->lazy->budget)
+	{
+		DeleteWorldFile(w->lazy);
+		w->lazy = 0;
+	}
+}
 
-    w->meshes = 0;
-    w->head_mesh = 0;
-    w->tail_mesh = 0;
-    w->insts = 0;
-	w->temp_insts = 0;
-    w->head_inst = 0;
-    w->tail_inst = 0;
-    w->editable = 0;
-    w->root = 0;
+struct SaveChunkInst
+{
+	int x, y;
+	int order; // save order inside of chunk
+	MeshInst* inst;
+};
 
-    return w;
+static int CmpSaveChunkInst(const void* a, const void* b)
+{
+	const SaveChunkInst* ia = (const SaveChunkInst*)a;
+	const SaveChunkInst* ib = (const SaveChunkInst*)b;
+	if (ia->y != ib->y)
+		return ia->y < ib->y ? -1 : 1;
+	if (ia->x != ib->x)
+		return ia->x < ib->x ? -1 : 1;
+	return ia->order - ib->order;
 }
 
-void DeleteWorld(World* w)
+void SaveWorld(World* w, FILE* f)
 {
-    if (!w)
-        return;
+	int format_version = -2;
 
-    // killing bsp brings all instances to world list
+	/*
+		VERSION: -1
+		- adds format_version (before num_of_instances which must be >= 0 and version must be < 0)
+		- adds per instance: Inst::story_id
 
+		VERSION: -2
+		- adds WorldFileHeader after num_of_instances
+		- mesh instances go to chunks (see WorldFileChunk) after loose ones
+	*/
 
-	delete_item_list = 0;
-	delete_sprite_list = 0;
+	// chunks are written from memory
+	LoadWorldChunks(w);
 
-	// flat first
-	Inst* i = w->head_inst;
-	while (i)
+	// non bsp first, then bsp ones and grid ones
+	int n = 0;
+	Inst** list = (Inst**)malloc(sizeof(Inst*) * (w->insts + 1));
+
+	for (Inst* i = w->head_inst; i; i = i->next)
+		GatherInst(i, list, &n);
+
+	if (w->root)
+		GatherInsts(w->root, list, &n);
+
+	for (BSP_Cell* c = w->head_cell; c; c = c->next)
+		GatherInsts(c, list, &n);
+
+	int loose = 0, meshes = 0;
+	SaveChunkInst* arr = (SaveChunkInst*)malloc(sizeof(SaveChunkInst) * (n + 1));
+	for (int i = 0; i < n; i++)
 	{
-		if (i->inst_type == Inst::INST_TYPE::ITEM)
-		{
-			Item* item = ((ItemInst*)i)->item;
-			if (/*all || */item->purpose == Item::WORLD)
-			{
-				item->proto = (ItemProto*)delete_item_list;
-				delete_item_list = item;
-			}
-		}
-		else
-		if (i->inst_type == Inst::INST_TYPE::SPRITE)
+		if (list[i]->inst_type != Inst::INST_TYPE::MESH)
 		{
-			SpriteInst* si = (SpriteInst*)i;
-			si->sprite = (Sprite*)delete_sprite_list;
-			delete_sprite_list = si;
+			list[loose++] = list[i];
+			continue;
 		}
 
-		i = i->next;
+		MeshInst* mi = (MeshInst*)list[i];
+		SaveChunkInst* sci = arr + meshes;
+		sci->x = (int)floor(mi->tm[12]) >> WORLD_CHUNK_SHIFT;
+		sci->y = (int)floor(mi->tm[13]) >> WORLD_CHUNK_SHIFT;
+		sci->order = meshes++;
+		sci->inst = mi;
 	}
 
-	if (w->root)
-	{
-		DeleteItemInsts(w->root, true); // prepares list only
-	}
+	qsort(arr, meshes, sizeof(SaveChunkInst), CmpSaveChunkInst);
 
-	Item* item = delete_item_list;
-	while (item)
+	int chunks = 0;
+	WorldFileChunk* dir = (WorldFileChunk*)malloc(sizeof(WorldFileChunk) * (meshes + 1));
+	WorldStream data = { 0 };
+
+	for (int i = 0; i < meshes; )
 	{
-		Item* n = (Item*)item->proto;
-		DestroyItem(item); // destroys inst too!!!
-		item = n;
-	}
+		WorldFileChunk* fc = dir + chunks++;
+		fc->x = arr[i].x;
+		fc->y = arr[i].y;
+		fc->insts = 0;
+		fc->offset = data.size; // relative to payloads for now
 
-	////////////////////////////////////////////////
-	// sprite insts
+		for (; i < meshes && arr[i].x == fc->x && arr[i].y == fc->y; i++)
+		{
+			MeshInst* mi = arr[i].inst;
 
-	if (w->root)
-		DeleteSpriteInsts(w->root);
+			// pivot only if mesh isn't loaded (inst has no box)
+			float bbox[6] = { (float)mi->tm[12], (float)mi->tm[12], (float)mi->tm[13], (float)mi->tm[13], (float)mi->tm[14], (float)mi->tm[14] };
+			if (mi->mesh->verts)
+				memcpy(bbox, mi->bbox, sizeof(float[6]));
 
-	SpriteInst* si = delete_sprite_list;
-	while (si)
-	{
-		SpriteInst* n = (SpriteInst*)si->sprite;
-		DeleteInst(si);
-		si = n;
+			for (int a = 0; a < 6; a += 2)
+			{
+				fc->bbox[a] = fc->insts ? fminf(fc->bbox[a], bbox[a]) : bbox[a];
+				fc->bbox[a + 1] = fc->insts ? fmaxf(fc->bbox[a + 1], bbox[a + 1]) : bbox[a + 1];
+			}
+
+			fc->insts++;
+			SaveInst(mi, &data);
+		}
+
+		fc->size = (uint32_t)(data.size - fc->offset);
 	}
 
-	if (w->root)
-		w->DeleteBSP(w->root);
+	uint64_t offset = chunks * sizeof(WorldFileChunk);
+	for (int i = 0; i < chunks; i++)
+		dir[i].offset += offset;
+	offset += data.size;
 
-	w->root = 0;
+	WorldFileHeader hdr =
+	{
+		(uint32_t)sizeof(WorldFileHeader),
+		(uint32_t)loose,
+		(uint32_t)chunks,
+		(uint32_t)WORLD_CHUNK_SHIFT,
+		offset
+	};
 
-    // killing all meshes should kill all insts as well
-    while (w->meshes)
-        w->DelMesh(w->head_mesh);
+	fwrite(&format_version, 1, 4, f);
 
-	free(w);
-}
+	int num_of_instances = n;
+	fwrite(&num_of_instances,1,4,f);
 
-Mesh* LoadMesh(World* w, const char* path, const char* name)
-{
-    if (!w)
-        return 0;
-    return w->LoadMesh(path, name);
-}
+	fwrite(&hdr, 1, sizeof(WorldFileHeader), f);
 
-bool UpdateMesh(Mesh* m, const char* path)
-{
-    return m->Update(path);
-}
+	WorldStream ws = { f };
+	for (int i = 0; i < loose; i++)
+		SaveInst(list[i], &ws);
 
-void DeleteMesh(Mesh* m)
-{
-    if (!m)
-        return;
-    m->world->DelMesh(m);
-}
+	fwrite(dir, sizeof(WorldFileChunk), chunks, f);
+	if (data.size)
+		fwrite(data.buf, 1, data.size, f);
 
-Inst* CreateInst(Mesh* m, int flags, const double tm[16], const char* name, int story_id)
-{
-    if (!m)
-        return 0;
-    return m->world->AddInst(m,flags,tm,name,story_id);
+	if (data.buf)
+		free(data.buf);
+	free(dir);
+	free(arr);
+	free(list);
 }
 
-Inst* CreateInst(World* w, Sprite* s, int flags, float pos[3], float yaw, int anim, int frame, int reps[4], const char* name, int story_id)
+// one SaveInst() record, false if broken
+static bool LoadInst(World* w, WorldStream* s, int format_version, bool editor, Inst** inst)
 {
-	if (!s)
-		return 0;
-	return w->AddInst(s, flags, pos, yaw, anim, frame, reps, name, story_id);
-}
+	*inst = 0;
 
-Inst* CreateInst(World* w, Item* item, int flags, float pos[3], float yaw, int story_id)
-{
-	if (!item)
-		return 0;
-	return w->AddInst(item, flags, pos, yaw, story_id);
-}
+	int mesh_id_len = 0;
+	if (!s->Read(&mesh_id_len, 4))
+		return false;
 
-void DeleteInst(Inst* i)
-{
-    if (!i)
-        return;
-	if (i->inst_type == Inst::INST_TYPE::MESH)
-		((MeshInst*)i)->mesh->world->DelInst(i);
-	else
-	if (i->inst_type == Inst::INST_TYPE::SPRITE)
-		((SpriteInst*)i)->w->DelInst(i);
-	else
-	if (i->inst_type == Inst::INST_TYPE::ITEM)
-		((ItemInst*)i)->w->DelInst(i);
-}
+	if (mesh_id_len >= 0)
+	{
+		char mesh_id[256] = "";
+		if (mesh_id_len > 255)
+			return false;
+		if (mesh_id_len)
+		{
+			if (!s->Read(mesh_id, mesh_id_len))
+				return false;
+		}
+		mesh_id[mesh_id_len] = 0;
 
-void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void* cookie)
-{
-    if (!w)
-        return;
-    w->Query(planes,plane,cb,cookie);
-}
+		if (mesh_id_len>=4 && strcmp(mesh_id+mesh_id_len-4,".ply")==0)
+			strcpy(mesh_id+mesh_id_len-4,".akm");
 
-void QueryWorldBSP(World* w, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
-{
-    if (!w || !w->root)
-        return;
-    World::QueryBSP(1, w->root,planes,plane,cb,cookie);
-}
+		int inst_name_len = 0;
+		if (!s->Read(&inst_name_len, 4))
+			return false;
 
+		char inst_name[256] = "";
+		if (inst_name_len < 0 || inst_name_len > 255)
+			return false;
+		if (inst_name_len)
+		{
+			if (!s->Read(inst_name, inst_name_len))
+				return false;
+		}
+		inst_name[inst_name_len] = 0;
 
-Mesh* GetFirstMesh(World* w)
-{
-    if (!w)
-        return 0;
-    return w->head_mesh;
-}
+		double tm[16] = { 0 };
+		if (!s->Read(tm, 16 * 8))
+			return false;
 
-Mesh* GetLastMesh(World* w)
-{
-    if (!w)
-        return 0;
-    return w->tail_mesh;
-}
+		int flags = 0;
+		if (!s->Read(&flags, 4))
+			return false;
 
-Mesh* GetPrevMesh(Mesh* m)
-{
-    if (!m)
-        return 0;
-    return m->prev;
-}
+		int story_id = -1;
+		if (format_version > 0)
+		{
+			if (!s->Read(&story_id, 4))
+				return false;
+		}
 
-Mesh* GetNextMesh(Mesh* m)
-{
-    if (!m)
-        return 0;
-    return m->next;
-}
+		/*
+		if (strstr(mesh_id,"untitled"))
+		{
+			strcpy(mesh_id,"tree-3.akm");
+		}
+		*/
 
-World* GetMeshWorld(Mesh* m)
-{
-	return m->world;
-}
 
-int GetMeshName(Mesh* m, char* buf, int size)
-{
-    if (!m)
-    {
-        if (buf && size>0)
-            *buf=0;
-        return 0;
-    }
+		// mesh id lookup
+		Mesh* m = w->head_mesh;
+		while (m && strcmp(m->name, mesh_id))
+			m = m->next;
 
-    int len = (int)strlen(m->name);
+		if (!m)
+			m = w->AddMesh(mesh_id);
 
-    if (buf && size>0)
-        strncpy(buf,m->name,size);
+		if (!editor)
+			flags |= INST_FLAGS::INST_VOLATILE;
 
-    return len+1;
-}
+		*inst = CreateInst(m, flags, tm, inst_name, story_id);
+	}
+	else
+	if (mesh_id_len == -1)
+	{
+		int inst_name_len = 0;
+		if (!s->Read(&inst_name_len, 4))
+			return false;
 
-void GetMeshBBox(Mesh* m, float bbox[6])
-{
-    if (!m || !bbox)
-        return;
+		char inst_name[256] = "";
+		if (inst_name_len < 0 || inst_name_len > 255)
+			return false;
+		if (inst_name_len)
+			if (!s->Read(inst_name, inst_name_len))
+				return false;
+		inst_name[inst_name_len] = 0;
+
+		float pos[3];
+		float yaw;
+		int anim;
+		int frame;
+		int reps[4];
+		int flags;
+
+		if (!s->Read(pos, sizeof(float[3])) ||
+			!s->Read(&yaw, sizeof(float)) ||
+			!s->Read(&anim, sizeof(int)) ||
+			!s->Read(&frame, sizeof(int)) ||
+			!s->Read(reps, sizeof(int[4])) ||
+			!s->Read(&flags, 4))
+		{
+			return false;
+		}
+
+		if (!editor)
+			flags |= INST_FLAGS::INST_VOLATILE;
+
+		int story_id = -1;
+		if (format_version > 0)
+		{
+			if (!s->Read(&story_id, 4))
+				return false;
+		}
+
+		Sprite* spr = GetFirstSprite();
+		while (spr)
+		{
+			if (strcmp(inst_name, spr->name) == 0)
+			{
+				*inst = CreateInst(w, spr, flags, pos, yaw, anim, frame, reps, 0, story_id);
+				break;
+			}
+
+			spr = spr->next;
+		}
+	}
+	else
+	if (mesh_id_len == -2)
+	{
+		int item_proto_index = -1;
+		int count = 0;
+
+		float pos[3] = { 0,0,0 };
+		float yaw = 0;
+
+		int flags;
+
+		if (!s->Read(&item_proto_index, 4) ||
+			!s->Read(&count, sizeof(int)) ||
+			!s->Read(pos, sizeof(float[3])) ||
+			!s->Read(&yaw, sizeof(float)) ||
+			!s->Read(&flags, 4))
+		{
+			return false;
+		}
 
-    bbox[0] = m->bbox[0];
-    bbox[1] = m->bbox[1];
-    bbox[2] = m->bbox[2];
-    bbox[3] = m->bbox[3];
-    bbox[4] = m->bbox[4];
-    bbox[5] = m->bbox[5];
-}
+		int story_id = -1;
+		if (format_version > 0)
+		{
+			if (!s->Read(&story_id, 4))
+				return false;
+		}
 
-void QueryMesh(Mesh* m, void (*cb)(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie), void* cookie)
-{
-    if (!m || !cb)
-        return;
+		Item* item = CreateItem();
 
-    float coords[9];
-	uint8_t colors[12];
+		if (!editor)
+			flags |= INST_FLAGS::INST_VOLATILE;
 
-    Face* f = m->head_face;
-    while (f)
-    {
-        coords[0] = f->abc[0]->xyzw[0];
-        coords[1] = f->abc[0]->xyzw[1];
-        coords[2] = f->abc[0]->xyzw[2];
-		colors[0] = f->abc[0]->rgba[0];
-		colors[1] = f->abc[0]->rgba[1];
-		colors[2] = f->abc[0]->rgba[2];
-		colors[3] = f->abc[0]->rgba[3];
-
-        coords[3] = f->abc[1]->xyzw[0];
-        coords[4] = f->abc[1]->xyzw[1];
-        coords[5] = f->abc[1]->xyzw[2];
-		colors[4] = f->abc[1]->rgba[0];
-		colors[5] = f->abc[1]->rgba[1];
-		colors[6] = f->abc[1]->rgba[2];
-		colors[7] = f->abc[1]->rgba[3];
-
-        coords[6] = f->abc[2]->xyzw[0];
-        coords[7] = f->abc[2]->xyzw[1];
-        coords[8] = f->abc[2]->xyzw[2];
-		colors[8] = f->abc[2]->rgba[0];
-		colors[9] = f->abc[2]->rgba[1];
-		colors[10] = f->abc[2]->rgba[2];
-		colors[11] = f->abc[2]->rgba[3];
-
-        cb(coords, colors, f->visual, cookie);
-
-        f=f->next;
-    }
+		item->count = count;
+		item->proto = item_proto_lib + item_proto_index;
+		item->purpose = editor ? Item::EDIT : Item::WORLD;
+		item->inst = CreateInst(w, item, flags, pos, yaw, story_id);
+		*inst = item->inst;
 
-    Line* l = m->head_line;
-    while (l)
-    {	
-        coords[0] = l->ab[0]->xyzw[0];
-        coords[1] = l->ab[0]->xyzw[1];
-        coords[2] = l->ab[0]->xyzw[2];
-		colors[0] = l->ab[0]->rgba[0];
-		colors[1] = l->ab[0]->rgba[1];
-		colors[2] = l->ab[0]->rgba[2];
-		colors[3] = l->ab[0]->rgba[3];
-
-        coords[3] = l->ab[1]->xyzw[0];
-        coords[4] = l->ab[1]->xyzw[1];
-        coords[5] = l->ab[1]->xyzw[2];
-		colors[4] = l->ab[1]->rgba[0];
-		colors[5] = l->ab[1]->rgba[1];
-		colors[6] = l->ab[1]->rgba[2];
-		colors[7] = l->ab[1]->rgba[3];		
-
-        cb(coords, colors, l->visual, cookie);
-
-        l=l->next;		
+		if (editor)
+		{
+			// create clone for players
+			Item* clone = CreateItem(); // (Item*)malloc(sizeof(Item));
+			memcpy(clone, item, sizeof(Item));
+			clone->purpose = Item::WORLD;
+			clone->inst = CreateInst(w, clone, flags | INST_FLAGS::INST_VOLATILE, pos, yaw, story_id);
+		}
 	}
-}
-
-void* GetMeshCookie(Mesh* m)
-{
-    if (!m)
-        return 0;
-    return m->cookie;
-}
 
-void  SetMeshCookie(Mesh* m, void* cookie)
-{
-    if (m)
-        m->cookie = cookie;
+	return true;
 }
 
-void RebuildWorld(World* w, bool boxes)
+static void PageInChunk(World* w, WorldChunk* c)
 {
-    if (w)
-        w->Rebuild(boxes);
-}
+	WorldFile* wf = w->lazy;
 
+	c->loaded = true;
+	wf->pending--;
 
+	WorldStream s = { 0 };
+	s.ptr = wf->data + c->fc.offset;
+	s.end = s.ptr + c->fc.size;
 
-static void SaveInst(Inst* inst, FILE* f)
-{
-	if (inst->flags & INST_FLAGS::INST_VOLATILE)
-		return;
+	c->insts = 0;
+	c->inst = (MeshInst**)malloc(sizeof(MeshInst*) * (c->fc.insts + 1));
 
-	if (inst->inst_type == Inst::INST_TYPE::MESH)
+	for (uint32_t i = 0; i < c->fc.insts; i++)
 	{
-		MeshInst* i = (MeshInst*)inst;
+		Inst* inst;
+		if (!LoadInst(w, &s, 2, wf->editor, &inst))
+			break; // broken, keep what we've got
 
-		int mesh_id_len = i->mesh && i->mesh->name ? (int)strlen(i->mesh->name) : 0;
+		if (!inst || inst->inst_type != Inst::INST_TYPE::MESH)
+			continue;
 
-		fwrite(&mesh_id_len, 1, 4, f);
-		if (mesh_id_len)
-			fwrite(i->mesh->name, 1, mesh_id_len, f);
+		MeshInst* mi = (MeshInst*)inst;
+		if (wf->mesh_dir)
+		{
+			// first user since mesh was created or dropped
+			if (!mi->mesh->bake)
+			{
+				char path[4096];
+				snprintf(path, sizeof(path), "%s%s", wf->mesh_dir, mi->mesh->name);
+				mi->mesh->Update(path);
+			}
 
-		int inst_name_len = i->name ? (int)strlen(i->name) : 0;
+			mi->UpdateBox();
 
-		fwrite(&inst_name_len, 1, 4, f);
-		if (inst_name_len)
-			fwrite(i->name, 1, inst_name_len, f);
+			// casts shadows on terrain even if volatile (game), next dirty_only bake takes it
+			w->DirtyBox(mi->bbox);
+		}
 
-		fwrite(i->tm, 1, 16 * 8, f);
-		fwrite(&i->flags, 1, 4, f);
-		fwrite(&i->story_id, 1, 4, f);
+		c->inst[c->insts++] = mi;
 	}
-	else
-	if (inst->inst_type == Inst::INST_TYPE::SPRITE)
-	{
-		SpriteInst* i = (SpriteInst*)inst;
 
-		int mesh_id_len = -1; // identify sprite
-		fwrite(&mesh_id_len, 1, 4, f);
+	wf->paged += c->insts;
+}
 
-		// sprite id ???
-		// ...
+static void PageOutChunk(World* w, WorldChunk* c)
+{
+	WorldFile* wf = w->lazy;
 
-		int inst_name_len = i->sprite->name ? (int)strlen(i->sprite->name) : 0;
+	// not an edit, terrain keeps shadows they cast (as if they were still there)
+	double dirty[6];
+	memcpy(dirty, w->dirty, sizeof(dirty));
 
-		fwrite(&inst_name_len, 1, 4, f);
-		if (inst_name_len)
-			fwrite(i->sprite->name, 1, inst_name_len, f);
-
-		fwrite(i->pos, 1, sizeof(float[3]), f);
-		fwrite(&i->yaw, 1, sizeof(float), f);
-		fwrite(&i->anim, 1, sizeof(int), f);
-		fwrite(&i->frame, 1, sizeof(int), f);
-		fwrite(&i->reps, 1, sizeof(int[4]), f);
-		fwrite(&i->flags, 1, 4, f);
-		fwrite(&i->story_id, 1, 4, f);
-	}
-	else
-	if (inst->inst_type == Inst::INST_TYPE::ITEM)
+	for (int i = 0; i < c->insts; i++)
 	{
-		// SAVE ONLY EDITOR INSTANCES !!!
-		ItemInst* i = (ItemInst*)inst;
+		Mesh* m = c->inst[i]->mesh;
+		w->DelInst(c->inst[i]);
 
-		// checked by inst flags
-		// if (i->item->purpose == Item::EDIT)
-
-		{
-			int mesh_id_len = -2; // identify item
-			fwrite(&mesh_id_len, 1, 4, f);
+		// last user gone, reloaded when paged in again
+		if (wf->mesh_dir && !m->share_list)
+			m->Clear();
+	}
 
-			// sprite id ???
-			// ...
+	memcpy(w->dirty, dirty, sizeof(dirty));
 
-			int item_proto_index = (int)(i->item->proto - item_proto_lib);
+	wf->paged -= c->insts;
 
-			fwrite(&item_proto_index, 1, 4, f);
+	free(c->inst);
+	c->inst = 0;
+	c->insts = 0;
 
-			fwrite(&i->item->count, 1, sizeof(int), f);
+	c->loaded = false;
+	wf->pending++;
+}
 
-			fwrite(i->pos, 1, sizeof(float[3]), f);
-			fwrite(&i->yaw, 1, sizeof(float), f);
+// least recently touched first, never ones touched by current call
+static bool EvictWorldChunks(World* w)
+{
+	WorldFile* wf = w->lazy;
+	bool evicted = false;
 
-			fwrite(&i->flags, 1, 4, f);
-			fwrite(&i->story_id, 1, 4, f);
+	while (wf->paged > wf->budget)
+	{
+		WorldChunk* lru = 0;
+		for (int i = 0; i < wf->chunks; i++)
+		{
+			WorldChunk* c = wf->chunk + i;
+			if (c->loaded && c->stamp != wf->clock &&
+				(!lru || wf->clock - c->stamp > wf->clock - lru->stamp))
+			{
+				lru = c;
+			}
 		}
+
+		if (!lru)
+			break; // all in use, go over budget
+
+		PageOutChunk(w, lru);
+		evicted = true;
 	}
-}
 
-static void SaveQueryBSP(BSP* bsp, FILE* f) 
-{
-    if (bsp->type == BSP::BSP_TYPE_LEAF)
-    {
-        Inst* i = ((BSP_Leaf*)bsp)->head;
-        while (i)
-        {
-            SaveInst(i,f);
-            i=i->next;
-        }
-    }
-    else
-    if (bsp->type == BSP::BSP_TYPE_INST)
-    {
-        Inst* i = (Inst*)bsp;
-        SaveInst(i,f);
-    }
-    else
-    if (bsp->type == BSP::BSP_TYPE_NODE)
-    {
-        bsp_nodes++;
-        BSP_Node* n = (BSP_Node*)bsp;
-        if (n->bsp_child[0])
-            SaveQueryBSP(n->bsp_child[0],f);
-        if (n->bsp_child[1])
-            SaveQueryBSP(n->bsp_child[1],f);
-    }
-    else
-    if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
-    {
-        bsp_nodes++;
-        BSP_NodeShare* s = (BSP_NodeShare*)bsp;
-        if (s->bsp_child[0])
-            SaveQueryBSP(s->bsp_child[0],f);
-        if (s->bsp_child[1])
-            SaveQueryBSP(s->bsp_child[1],f);
-        Inst* i = s->head;
-        while (i)
-        {
-            SaveInst(i,f);
-            i=i->next;
-        }                
-    }
-    else
-    {
-        assert(0);
-    }
+	return evicted;
 }
 
-void SaveWorld(World* w, FILE* f)
+// reads directory, leaves stream at the end of world section
+static bool LoadWorldFile(World* w, FILE* f, const WorldFileHeader* hdr, bool editor, const char* mesh_dir)
 {
-	int format_version = -1;
+	uint64_t dir_size = (uint64_t)hdr->num_chunks * sizeof(WorldFileChunk);
+	if (hdr->data_size < dir_size)
+		return false;
 
-	/*
-		VERSION: -1 
-		- adds format_version (before num_of_instances which must be >= 0 and version must be < 0) 
-		- adds per instance: Inst::story_id
-	*/
-	fwrite(&format_version, 1, 4, f);
+	WorldFile* wf = (WorldFile*)malloc(sizeof(WorldFile));
+	wf->map = 0;
+	wf->map_size = 0;
+	wf->buf = 0;
+	wf->data = 0;
+	wf->chunks = 0;
+	wf->chunk = 0;
+	wf->pending = 0;
+	wf->budget = 0;
+	wf->paged = 0;
+	wf->clock = 0;
+	wf->editor = editor;
+	wf->mesh_dir = mesh_dir ? strdup(mesh_dir) : 0;
+
+	w->lazy = wf; // DeleteWorld() frees it if we fail
+
+	long base = ftell(f);
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	struct stat st;
+	if (mesh_dir && base >= 0 && fstat(fileno(f), &st) == 0 && (uint64_t)st.st_size >= base + hdr->data_size)
+	{
+		// whole file, offset must be page aligned
+		void* map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED)
+		{
+			wf->map = map;
+			wf->map_size = (size_t)st.st_size;
+			wf->data = (const uint8_t*)map + base;
+			fseek(f, base + (long)hdr->data_size, SEEK_SET);
+		}
+	}
+#endif
+
+	if (!wf->map)
+	{
+		// eager or not mappable, paging still parses chunks on demand
+		wf->buf = (uint8_t*)malloc(hdr->data_size ? (size_t)hdr->data_size : 1);
+		wf->data = wf->buf;
+		if (fread(wf->buf, 1, (size_t)hdr->data_size, f) != hdr->data_size)
+			return false;
+	}
 
-    int num_of_instances = w->insts - w->temp_insts;
-    fwrite(&num_of_instances,1,4,f);
+	wf->chunks = hdr->num_chunks;
+	wf->chunk = (WorldChunk*)calloc(wf->chunks + 1, sizeof(WorldChunk));
+	wf->pending = wf->chunks;
 
-    // non bsp first
-    Inst* i = w->head_inst;
-    while (i)
-    {
-        SaveInst(i,f);
-        i=i->next;
-    }
+	for (int i = 0; i < wf->chunks; i++)
+	{
+		WorldFileChunk* fc = &wf->chunk[i].fc;
+		memcpy(fc, wf->data + i * sizeof(WorldFileChunk), sizeof(WorldFileChunk));
 
-    // then bsp ones
-	if (w->root)
-		SaveQueryBSP(w->root,f);
+		if (fc->offset < dir_size || fc->offset + fc->size > hdr->data_size)
+			return false;
+	}
+
+	if (!mesh_dir)
+	{
+		// at once, caller loads meshes and rebuilds
+		for (int i = 0; i < wf->chunks; i++)
+			PageInChunk(w, wf->chunk + i);
+	}
+
+	SettleWorldFile(w);
+	return true;
 }
 
-World* LoadWorld(FILE* f, bool editor)
+World* LoadWorld(FILE* f, bool editor, const char* mesh_dir)
 {
-    // load instances, 
+    // load instances,
     // create empty meshes if mesh-id is used for the first time
     // all subsequent instances should point to that mesh (share!)
 
@@ -4560,212 +4939,117 @@ World* LoadWorld(FILE* f, bool editor)
 			return 0;
 		}
 	}
-    
-    for (int i=0; i<num_of_instances; i++)
-    {
-        int mesh_id_len = 0;
-        if (1!=fread(&mesh_id_len, 4,1, f))
-        {
-            DeleteWorld(w);
-            return 0;
-        }
-
-		if (mesh_id_len >= 0)
-		{
-			char mesh_id[256] = "";
-			if (mesh_id_len)
-			{
-				if (1 != fread(mesh_id, mesh_id_len, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			}
-			mesh_id[mesh_id_len] = 0;
-
-			if (mesh_id_len>=4 && strcmp(mesh_id+mesh_id_len-4,".ply")==0)
-				strcpy(mesh_id+mesh_id_len-4,".akm");
-
-			int inst_name_len = 0;
-			if (1 != fread(&inst_name_len, 4, 1, f))
-			{
-				DeleteWorld(w);
-				return 0;
-			}
-
-			char inst_name[256] = "";
-			if (inst_name_len)
-			{
-				if (1 != fread(inst_name, inst_name_len, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			}
-			inst_name[inst_name_len] = 0;
 
-			double tm[16] = { 0 };
-			if (1 != fread(tm, 16 * 8, 1, f))
-			{
-				DeleteWorld(w);
-				return 0;
-			}
+	// older formats have all insts loose
+	WorldFileHeader hdr = { 0 };
+	hdr.loose_insts = num_of_instances;
 
-			int flags = 0;
-			if (1 != fread(&flags, 4, 1, f))
-			{
-				DeleteWorld(w);
-				return 0;
-			}
+	if (format_version >= 2)
+	{
+		if (format_version > 2 || 1 != fread(&hdr, sizeof(WorldFileHeader), 1, f) ||
+			hdr.header_size != sizeof(WorldFileHeader) || hdr.chunk_shift != WORLD_CHUNK_SHIFT)
+		{
+			DeleteWorld(w);
+			return 0;
+		}
+	}
 
-			int story_id = -1;
-			if (format_version > 0)
-			{
-				if (1 != fread(&story_id, 4, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			}
+	WorldStream ws = { f };
 
-			/*
-			if (strstr(mesh_id,"untitled"))
-			{
-				strcpy(mesh_id,"tree-3.akm");
-			}
-			*/
+    for (int i=0; i<(int)hdr.loose_insts; i++)
+    {
+		Inst* inst;
+		if (!LoadInst(w, &ws, format_version, editor, &inst))
+		{
+			DeleteWorld(w);
+			return 0;
+		}
+    }
 
+	if (format_version >= 2 && !LoadWorldFile(w, f, &hdr, editor, mesh_dir))
+	{
+		DeleteWorld(w);
+		return 0;
+	}
 
-			// mesh id lookup
-			Mesh* m = w->head_mesh;
-			while (m && strcmp(m->name, mesh_id))
-				m = m->next;
+    return w;
+}
 
-			if (!m)
-				m = w->AddMesh(mesh_id);
+void LoadWorldChunks(World* w)
+{
+	if (!w || !w->lazy)
+		return;
 
-			if (!editor)
-				flags |= INST_FLAGS::INST_VOLATILE;
+	WorldFile* wf = w->lazy;
+	wf->budget = 0; // everything stays
 
-			Inst* inst = CreateInst(m, flags, tm, inst_name, story_id);
-		}
-		else
-		if (mesh_id_len == -1)
+	bool paged = false;
+	for (int i = 0; i < wf->chunks; i++)
+	{
+		if (!wf->chunk[i].loaded)
 		{
-			int inst_name_len = 0;
-			if (1 != fread(&inst_name_len, 4, 1, f))
-			{
-				DeleteWorld(w);
-				return 0;
-			}
-
-			char inst_name[256] = "";
-			if (inst_name_len)
-				if (1 != fread(inst_name, inst_name_len, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			inst_name[inst_name_len] = 0;
-
-			float pos[3];
-			float yaw;
-			int anim;
-			int frame;
-			int reps[4];
-			int flags;
-
-			int r;
-			r = fread(pos, 1, sizeof(float[3]), f);
-			r = fread(&yaw, 1, sizeof(float), f);
-			r = fread(&anim, 1, sizeof(int), f);
-			r = fread(&frame, 1, sizeof(int), f);
-			r = fread(reps, 1, sizeof(int[4]), f);
-			r = fread(&flags, 1, 4, f);
-
-			if (!editor)
-				flags |= INST_FLAGS::INST_VOLATILE;
-
-			int story_id = -1;
-			if (format_version > 0)
-			{
-				if (1 != fread(&story_id, 4, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			}
-
-			Sprite* s = GetFirstSprite();
-			while (s)
-			{
-				if (strcmp(inst_name, s->name) == 0)
-				{
-					CreateInst(w, s, flags, pos, yaw, anim, frame, reps, 0, story_id);
-					break;
-				}
-
-				s = s->next;
-			}
+			PageInChunk(w, wf->chunk + i);
+			paged = true;
 		}
-		else
-		if (mesh_id_len == -2)
-		{
-			int r;
+	}
 
-			int item_proto_index = -1;
-			r = fread(&item_proto_index, 1, 4, f);
+	if (paged)
+		w->Rebuild(false);
 
-			int count = 0;
-			r = fread(&count, 1, sizeof(int), f);
+	SettleWorldFile(w);
+}
 
-			float pos[3] = { 0,0,0 };
-			float yaw = 0;
+bool TouchWorld(World* w, const double xyr[3])
+{
+	if (!w || !w->lazy)
+		return false;
 
-			r = fread(pos, 1, sizeof(float[3]), f);
-			r = fread(&yaw, 1, sizeof(float), f);
+	WorldFile* wf = w->lazy;
+	wf->clock++;
 
-			int flags;
-			r = fread(&flags, 1, 4, f);
+	bool paged = false;
+	for (int i = 0; i < wf->chunks; i++)
+	{
+		WorldChunk* c = wf->chunk + i;
 
-			int story_id = -1;
-			if (format_version > 0)
-			{
-				if (1 != fread(&story_id, 4, 1, f))
-				{
-					DeleteWorld(w);
-					return 0;
-				}
-			}
+		// circle vs chunk box, xy only
+		double dx = fmax(fmax(c->fc.bbox[0] - xyr[0], xyr[0] - c->fc.bbox[1]), 0.0);
+		double dy = fmax(fmax(c->fc.bbox[2] - xyr[1], xyr[1] - c->fc.bbox[3]), 0.0);
+		if (dx * dx + dy * dy > xyr[2] * xyr[2])
+			continue;
 
-			Item* item = CreateItem();
+		c->stamp = wf->clock;
+		if (!c->loaded)
+		{
+			PageInChunk(w, c);
+			paged = true;
+		}
+	}
 
-			if (!editor)
-				flags |= INST_FLAGS::INST_VOLATILE;
+	if (wf->budget && EvictWorldChunks(w))
+		paged = true;
 
-			item->count = count;
-			item->proto = item_proto_lib + item_proto_index;
-			item->purpose = editor ? Item::EDIT : Item::WORLD;
-			item->inst = CreateInst(w, item, flags, pos, yaw, story_id);
+	if (paged)
+		w->Rebuild(false);
 
-			if (editor)
-			{
-				// create clone for players
-				Item* clone = CreateItem(); // (Item*)malloc(sizeof(Item));
-				memcpy(clone, item, sizeof(Item));
-				clone->purpose = Item::WORLD;
-				clone->inst = CreateInst(w, clone, flags | INST_FLAGS::INST_VOLATILE, pos, yaw, story_id);
-			}
-		}
-    }
+	SettleWorldFile(w);
+	return paged;
+}
 
-    return w;
+void SetWorldBudget(World* w, int insts)
+{
+	if (!w || !w->lazy)
+		return; // all in memory, nothing to reload from
+
+	w->lazy->budget = insts > 0 ? insts : 0;
+	SettleWorldFile(w);
 }
 
 
-Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3], bool positive_only, bool editor, bool solid_only, bool sprites_too, const WorldQuery* wq)
 {
-    return w->HitWorld(p,v,ret,nrm, positive_only, editor, solid_only, sprites_too);
+    WorldQuery tmp = { 0 };
+    return w->HitWorld(p,v,ret,nrm, positive_only, editor, solid_only, sprites_too, wq ? wq : &tmp);
 }
 
 Mesh* GetInstMesh(Inst* i)
@@ -5028,6 +5312,9 @@ bool DetachInst(World* w, Inst* inst)
 	if (!inst->bsp_parent && inst != w->root)
 		return false; // already out
 
+	if (!World::IsDynamic(inst))
+		w->DropFlat();
+
 	if (inst == w->root)
 	{
 		w->root = 0;
@@ -5074,6 +5361,9 @@ bool DetachInst(World* w, Inst* inst)
 				inst->next->prev = inst->prev;
 			else
 				l->tail = inst->prev;
+
+			if (!l->head && World::IsDynamic(inst))
+				w->CellFree((BSP_Cell*)l);
 			break;
 		}
 
@@ -5087,6 +5377,7 @@ bool DetachInst(World* w, Inst* inst)
 		w->head_inst->prev = inst;
 	else
 		w->tail_inst = inst;
+	w->head_inst = inst;
 	inst->bsp_parent = 0;
 
 	return true;
@@ -5126,13 +5417,38 @@ bool AttachInst(World* w, Inst* inst)
 			break;
 	}
 
+	if (World::IsDynamic(inst))
+	{
+		if (inst->bsp_parent)
+		{
+			w->CellMove(inst);
+			return false; // already in
+		}
+
+		if (inst->prev)
+			inst->prev->next = inst->next;
+		else
+			w->head_inst = inst->next;
+		if (inst->next)
+			inst->next->prev = inst->prev;
+		else
+			w->tail_inst = inst->prev;
+
+		w->CellInsert(inst);
+		return true;
+	}
+
 	if (inst->bsp_parent || inst == w->root)
 		return false; // already in
 
 	if (!w->root)
 		return false; // no place to insert
 
-	return w->root->InsertInst(w,inst);
+	if (!w->root->InsertInst(w,inst))
+		return false;
+
+	w->DropFlat();
+	return true;
 }
 
 void ShowInst(Inst* i)
@@ -5151,11 +5467,7 @@ void UpdateSpriteInst(World* world, Inst* i, Sprite* sprite, const float pos[3],
 		return;
 	assert(i->inst_type == Inst::INST_TYPE::SPRITE);
 
-	// instead of detach/ attach it could be more intelligent:
-	// start from current parrent, if bbox ok try its children
-	// if not retry with parent's parent ...
-
-	DetachInst(world, i);
+	// sprites live in the grid, AttachInst just moves it to the new cell
 
 	SpriteInst* si = (SpriteInst*)i;
 	si->sprite = sprite;
@@ -5190,6 +5502,7 @@ void SoftInstAdd(Inst* i)
 	// it is in flat list now
 
 	AttachInst(w, i);
+	w->Dirty(i);
 
 	// if there was place it is in bsp otherwise in flat list
 	w->insts++;
@@ -5201,6 +5514,7 @@ void SoftInstDel(Inst* i)
 
 	// it is in bsp or flat
 
+	w->Dirty(i);
 	DetachInst(w, i);
 
 	// it is in flat list now.
@@ -11,9 +11,21 @@ World* CreateWorld();
 void DeleteWorld(World* w);
 void RebuildWorld(World* w, bool boxes = false);
 
+// same as above but split into subtree jobs, BuildWorldJobs() can be called
+// from many threads at once on disjoint job ranges (world must not change meanwhile)
+// all jobs must be built before DeleteWorldBuild(), insts of unbuilt ones are lost
+// DeleteWorldBuild() compiles finished tree into flat layout used by queries & hits
+struct WorldBuild;
+WorldBuild* CreateWorldBuild(World* w, bool boxes);
+void DeleteWorldBuild(WorldBuild* wb);
+int GetWorldBuildJobs(WorldBuild* wb);
+void BuildWorldJobs(WorldBuild* wb, int from, int to);
+
 Mesh* LoadMesh(World* w, const char* path, const char* name = 0);
 void DeleteMesh(Mesh* m);
 
+// touches given mesh only, distinct meshes can be updated from many threads at once
+// (inst bboxes are refreshed later by RebuildWorld(w,true))
 bool UpdateMesh(Mesh* m, const char* path);
 
 Mesh* GetFirstMesh(World* w);
@@ -31,6 +43,11 @@ void GetMeshBBox(Mesh* m, float bbox[6]);
 int GetMeshFaces(Mesh* m);
 void QueryMesh(Mesh* m, void (*cb)(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie), void* cookie);
 
+// batched, whole mesh in one call, face i uses verts abc[3*i+0..2]
+// vert j is xyz[3*j+0..2] colored rgba[4*j+0..3], arrays are read only
+// lines come last as faces with line bit (1<<31) in visual, 3rd index repeats 2nd
+void QueryMesh(Mesh* m, void (*cb)(int verts, const float* xyz, const uint8_t* rgba, int faces, const int* abc, const uint32_t* visual, void* cookie), void* cookie);
+
 Inst* CreateInst(World* w, Item* item, int flags, float pos[3], float yaw, int story_id);
 Inst* CreateInst(World* w, Sprite* s, int flags, float pos[3], float yaw, int anim, int frame, int reps[4], const char* name, int story_id);
 Inst* CreateInst(Mesh* m, int flags, const double tm[16], const char* name, int story_id);
@@ -56,6 +73,12 @@ int AnimateSpriteInst(Inst* i, uint64_t stamp);
 void ShowInst(Inst* i);
 void HideInst(Inst* i);
 
+// bbox of non-volatile insts created / deleted (undo/redo too) and of any mesh insts
+// TouchWorld() paged in since last call (ones it evicts don't count)
+// returns false if there were none, resets tracking
+bool TakeWorldDirty(World* w, double bbox[6]);
+bool GetWorldDirty(World* w); // same as above but doesn't take it
+
 enum INST_FLAGS
 {
     INST_VISIBLE = 0x1,
@@ -72,23 +95,52 @@ struct QueryWorldCB
 	void(*sprite_cb)(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie);
 };
 
-void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void* cookie);
+// per call state of QueryWorld() & HitWorld(), each thread passes its own (or 0)
+// both only read the world so any number of them can run at once on the same world,
+// as long as nothing modifies it meanwhile (insts created, deleted, updated, shown,
+// hidden, attached or rebuilt), callbacks run on the calling thread
+struct WorldQuery
+{
+	Inst* skip; // treated as if hidden, instead of HideInst() / ShowInst() around the call
+	int tests, insts, nodes; // stats of last QueryWorld()
+};
+
+void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void* cookie, WorldQuery* wq = 0);
 void QueryWorldBSP(World* w, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie);
 
 
 // if editor==true -> ignore volatile instances
-Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3], bool positive_only = false, bool editor = false, bool solid_only = false, bool sprites_too = true);
+Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3], bool positive_only = false, bool editor = false, bool solid_only = false, bool sprites_too = true, const WorldQuery* wq = 0);
 
+// writes chunked format (mesh insts grouped by xy into chunks with directory),
+// older formats are still loadable
 void SaveWorld(World* w, FILE* f);
 
 // editor==true  clones items for test-players
 // editor==false changes items purpose directly for player(s)
-World* LoadWorld(FILE* f, bool editor); 
+// mesh_dir!=0 keeps mesh insts of chunked file in it till TouchWorld() pages them in,
+// meshes they use are loaded from mesh_dir + name (so it ends with '/') on first use,
+// file is mmap'ed where possible so it must not be rewritten in place meanwhile
+// (older formats load at once, mesh_dir==0 leaves loading meshes to caller as before)
+World* LoadWorld(FILE* f, bool editor, const char* mesh_dir = 0);
+
+// pages in all chunks left (and rebuilds) and lets the file go
+void LoadWorldChunks(World* w);
+
+// pages in chunks with xy of their box within circle xyr (center x,y, radius),
+// evicts least recently touched ones over budget and rebuilds if anything changed
+// returns true if so, must not run during queries, any insts it evicted are gone
+bool TouchWorld(World* w, const double xyr[3]);
+
+// max mesh insts kept paged in (0 = no limit), enforced by next TouchWorld(),
+// evicted insts are deleted and meshes left with no insts drop their geometry,
+// edits made to them are lost so it's for read-only use
+void SetWorldBudget(World* w, int insts);
 
 void PurgeItemInstCache();
 void ResetItemInsts(World* w);
 
-bool AttachInst(World* w, Inst* i); // tries to move from flat list to bsp
+bool AttachInst(World* w, Inst* i); // tries to move from flat list to bsp (sprites & items to grid)
 
 // undo/redo only!!!
 void SoftInstAdd(Inst* i);